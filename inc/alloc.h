@@ -0,0 +1,76 @@
+/**
+ * Counts memory allocations made through SDL.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#pragma once
+
+#include <SDL.h>
+
+/* Subsystem that allocations are attributed to. Allocations made by the thread
+ * that called alloc_track_init() are attributed to the tag set with
+ * alloc_track_set_tag(); all other threads are counted together. */
+enum alloc_tag_e {
+	ALLOC_TAG_MAIN = 0,
+	ALLOC_TAG_EVENTS,
+	ALLOC_TAG_RUN,
+	ALLOC_TAG_UPLOAD,
+	ALLOC_TAG_PRESENT,
+	ALLOC_TAG_THREADS,
+
+	ALLOC_TAG_MAX
+};
+
+struct alloc_stats_s
+{
+	/* Calls to malloc, calloc and realloc, and calls to free. */
+	Uint64 allocs;
+	Uint64 frees;
+	Uint64 tag_allocs[ALLOC_TAG_MAX];
+
+	/* Bytes currently allocated, and the most that were allocated at
+	 * once. */
+	size_t cur_bytes;
+	size_t peak_bytes;
+};
+
+/**
+ * Replaces the memory functions used by SDL with functions that count each
+ * allocation. This must be called before SDL allocates any memory, which
+ * means before any other SDL function is called.
+ *
+ * \return	0 on success, else negative.
+ */
+int alloc_track_init(void);
+
+/**
+ * Returns SDL_TRUE if allocations are being counted.
+ */
+SDL_bool alloc_track_enabled(void);
+
+/**
+ * Sets the tag that allocations made by the main thread are attributed to.
+ *
+ * \param tag	New tag.
+ * \return	Previous tag.
+ */
+enum alloc_tag_e alloc_track_set_tag(enum alloc_tag_e tag);
+
+/**
+ * Copies the current allocation statistics.
+ */
+void alloc_track_get(struct alloc_stats_s *stats);
+
+/**
+ * Logs the allocation statistics.
+ */
+void alloc_track_report(void);
@@ -0,0 +1,83 @@
+/**
+ * Cache of compressed core states for seeking within a replay.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#pragma once
+
+#include <SDL.h>
+
+typedef struct ckpt_ctx_s ckpt_ctx;
+
+/**
+ * Creates an empty checkpoint cache. If the checkpoints exceed the memory
+ * limit, every other checkpoint is dropped and the interval is doubled.
+ *
+ * \param interval	Number of frames between checkpoints.
+ * \param max_bytes	Memory limit of the compressed checkpoints.
+ * \return		Checkpoint cache, or NULL on error with error in
+ *			SDL_GetError().
+ */
+ckpt_ctx *ckpt_init(Uint32 interval, size_t max_bytes);
+
+/**
+ * Checks whether a checkpoint should be added at a frame. Checkpoints are
+ * added in order, so a frame at or before the latest checkpoint is never due.
+ */
+SDL_bool ckpt_due(const ckpt_ctx *ctx, Uint64 frame);
+
+/**
+ * Stores a checkpoint. The state is copied and compressed on a worker thread
+ * if the thread pool is running. The checkpoint is added once compressed,
+ * which is waited for when the next checkpoint is added or when the
+ * checkpoints are searched. Must not be called from multiple threads.
+ *
+ * \param ctx		Checkpoint cache.
+ * \param frame		Frame that the state was saved at.
+ * \param state		Serialised state of the core.
+ * \param len		Length of the state in bytes.
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError() if this or the previous checkpoint could
+ *			not be added.
+ */
+int ckpt_add(ckpt_ctx *ctx, Uint64 frame, const void *state, size_t len);
+
+/**
+ * Finds the latest checkpoint at or before a frame.
+ *
+ * \param ctx		Checkpoint cache.
+ * \param frame		Frame to seek to.
+ * \param at		Receives the frame of the checkpoint.
+ * \return		0 on success, or negative if there is no checkpoint at
+ *			or before the frame.
+ */
+int ckpt_find(ckpt_ctx *ctx, Uint64 frame, Uint64 *at);
+
+/**
+ * Decompresses the latest checkpoint at or before a frame.
+ *
+ * \param ctx		Checkpoint cache.
+ * \param frame		Frame to seek to.
+ * \param at		Receives the frame of the checkpoint.
+ * \param state		Buffer to receive the state of the core.
+ * \param len		Length of the buffer, which receives the length of
+ *			the state.
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError().
+ */
+int ckpt_load(ckpt_ctx *ctx, Uint64 frame, Uint64 *at, void *state,
+	      size_t *len);
+
+/**
+ * Frees the checkpoint cache. Safe to call with NULL.
+ */
+void ckpt_exit(ckpt_ctx *ctx);
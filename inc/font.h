@@ -39,6 +39,22 @@
  */
 typedef struct font_ctx_s font_ctx;
 
+/**
+ * Method used to draw strings.
+ */
+typedef enum {
+	/* One draw call per character. */
+	FONT_BATCH_NONE = 0,
+
+	/* Strings are rendered to a cached texture on first use, and drawn
+	 * with a single draw call afterwards. Requires render targets. */
+	FONT_BATCH_CACHE,
+
+	/* All characters of a string are drawn with a single call to
+	 * SDL_RenderGeometry(). Requires SDL 2.0.18. */
+	FONT_BATCH_GEOMETRY
+} font_batch_e;
+
 /**
  * Initialises font context with given renderer. Must be called first.
  * The given renderer must remain valid until after FontExit() is called.
@@ -48,6 +64,17 @@ typedef struct font_ctx_s font_ctx;
  */
 font_ctx *FontStartup(SDL_Renderer *renderer);
 
+/**
+ * Selects the method used to draw strings. FontStartup() selects the fastest
+ * method supported by the renderer, so this is only required for testing.
+ *
+ * \param ctx	Font library context.
+ * \param batch	Method to use.
+ * \return	0 on success, or negative if the method is not supported by the
+ *		renderer. Use SDL_GetError().
+ */
+int FontSetBatching(font_ctx *ctx, font_batch_e batch);
+
 /**
  * Prints a string to the SDL2 renderer.
  * Use SDL_SetRenderDrawColor() to change the text colour.
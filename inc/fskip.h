@@ -0,0 +1,103 @@
+/**
+ * Decides which frames to skip when the host is unable to keep up.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#pragma once
+
+#include <SDL.h>
+
+/* Number of recent frames that the cost of a frame is predicted from. */
+#define FSKIP_WINDOW	64
+
+/* Ring of recent frame costs, also kept in sorted order so that percentiles
+ * are available without sorting on each frame. */
+struct fskip_window_s
+{
+	Uint32 ring[FSKIP_WINDOW];
+	Uint32 sorted[FSKIP_WINDOW];
+	Uint8 pos;
+	Uint8 n;
+};
+
+struct fskip_ctx_s
+{
+	Uint32 target_us;
+
+	/* Maximum number of consecutive frames that may be skipped. */
+	Uint8 limit;
+
+	/* Time taken to process frames that were drawn, and frames that were
+	 * skipped, in microseconds. */
+	struct fskip_window_s drawn;
+	struct fskip_window_s skipped;
+
+	/* Fraction of frames to skip, and the credit accumulated towards the
+	 * next skipped frame, as 16.16 fixed point. */
+	Uint32 ratio;
+	Uint32 credit;
+
+	/* Number of consecutive frames that a lower ratio was sufficient. */
+	Uint16 calm;
+
+	/* Number of frames skipped since the last drawn frame. */
+	Uint8 run;
+	SDL_bool skipping;
+};
+
+/**
+ * Initialises the frameskip controller.
+ *
+ * \param fs		Frameskip context.
+ * \param fps		Frame rate of the core.
+ * \param limit		Maximum number of consecutive frames to skip.
+ */
+void fskip_init(struct fskip_ctx_s *fs, double fps, Uint8 limit);
+
+/**
+ * Decides whether the next frame should be skipped. Frames are only skipped
+ * whilst emulation is behind, and only as often as the predicted cost of each
+ * frame requires to maintain full speed.
+ *
+ * \param fs		Frameskip context.
+ * \param behind	Whether emulation is running behind real time.
+ * \return		SDL_TRUE if the video of the next frame should not be
+ *			drawn.
+ */
+SDL_bool fskip_next(struct fskip_ctx_s *fs, SDL_bool behind);
+
+/**
+ * Records the time taken to process the frame, excluding time spent waiting,
+ * and updates the fraction of frames to skip.
+ *
+ * \param fs		Frameskip context.
+ * \param work_us	Time taken to process the frame in microseconds.
+ */
+void fskip_update(struct fskip_ctx_s *fs, Uint32 work_us);
+
+/**
+ * Loads the frame costs learned from a previous session with the same core,
+ * so that the correct number of frames are skipped from the start.
+ *
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError().
+ */
+int fskip_profile_load(struct fskip_ctx_s *fs, const char *filename);
+
+/**
+ * Saves the learned frame costs. Nothing is saved if too few frames were
+ * processed.
+ *
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError().
+ */
+int fskip_profile_save(const struct fskip_ctx_s *fs, const char *filename);
@@ -16,15 +16,21 @@
 
 #include <SDL.h>
 
+#include <ckpt.h>
 #include <font.h>
+#include <fskip.h>
 #include <gl.h>
 #include <input.h>
+#include <latency.h>
 #include <libretro.h>
+#include <perf.h>
+#include <pmu.h>
 #include <retro-extensions.h>
 #include <rec.h>
 #include <tai.h>
 #include <timer.h>
 #include <ui.h>
+#include <verify.h>
 
 #define REL_VERSION_MAJOR 0
 #define REL_VERSION_MINOR 1
@@ -35,8 +41,57 @@ struct settings_s
 	unsigned fullscreen : 1;
 	unsigned benchmark : 1;
 	unsigned start_core : 1;
+
+	/* Sample processor counters during the benchmark. */
+	unsigned counters : 1;
+
+	/* Delay the start of each frame after VSYNC to reduce latency. */
+	unsigned frame_delay : 1;
 	Uint32 benchmark_dur;
 	Uint8 frameskip_limit;
+
+	/* Length of parallel encoded recording segments in seconds, or zero
+	 * to encode recordings with a single encoder. */
+	Uint8 rec_segment_sec;
+
+	/* Memory used for the instant replay in MiB, or zero to disable. */
+	Uint16 replay_mib;
+
+	/* Number of input latency trials to perform before exiting, or zero
+	 * to disable. */
+	Uint16 latency_trials;
+
+	/* Frame timings are saved when a frame is late by more than this many
+	 * milliseconds, or never if zero. */
+	Uint16 stutter_ms;
+
+	/* If set, the tool assisted input file being played is rendered to
+	 * this file as fast as possible, without displaying it. */
+	char *render_filename;
+
+	/* If either is set, the tool assisted input file being played is
+	 * verified as fast as possible, without displaying it. The hashes of
+	 * each frame are written to verify_trace, and compared against
+	 * verify_golden. */
+	char *verify_trace;
+	char *verify_golden;
+
+	/* Also hash the serialised state of the core after each frame. */
+	unsigned verify_state : 1;
+
+	/* If seek is set, playback of the tool assisted input file starts at
+	 * seek_frame. */
+	unsigned seek : 1;
+	Uint64 seek_frame;
+
+	/* Set when rendering or verifying, in which case nothing is displayed
+	 * and the core runs as fast as possible. */
+	unsigned offline : 1;
+
+	/* If set, recordings are captured as raw video and audio. The prefix
+	 * may be NULL, in which case a file name is generated. */
+	unsigned rec_raw : 1;
+	char *rec_raw_prefix;
 	char *core_filename;
 	char *content_filename;
 };
@@ -128,6 +183,10 @@ struct core_ctx_s
 	char *content_filename;
 	char *sram_filename;
 
+	/* Directory of the executable, given to the core as the system and save
+	 * directory. Obtained on first use. */
+	char *base_path;
+
 	/* Libretro core environment status. */
 	struct
 	{
@@ -144,6 +203,14 @@ struct core_ctx_s
 				unsigned video_disabled : 1;
 				unsigned valid_frame : 1;
 				unsigned support_no_game : 1;
+
+				/* Hash each frame given by the core into
+				 * frame_hash. */
+				unsigned hash_frames : 1;
+
+				/* Hash the audio given by the core into
+				 * audio_hash. */
+				unsigned hash_audio : 1;
 			} bits;
 			Uint16 all;
 		} status;
@@ -153,6 +220,13 @@ struct core_ctx_s
 		Uint32 frames;
 		SDL_RendererFlip flip;
 
+		/* Hash of the last frame uploaded, if hash_frames is set. */
+		Uint32 frame_hash;
+
+		/* Hash of the audio given since it was last reset to
+		 * UTIL_HASH_INIT, if hash_audio is set. */
+		Uint32 audio_hash;
+
 		struct retro_audio_callback audio_cb;
 		retro_frame_time_callback_t ftcb;
 		retro_usec_t ftref;
@@ -160,9 +234,16 @@ struct core_ctx_s
 
 	struct timer_ctx_s tim;
 	struct input_ctx_s inp;
+	struct perf_ctx_s perf;
+
+	/* Raw video and audio capture. */
+	rec_raw_ctx *raw;
 
 #if ENABLE_VIDEO_RECORDING == 1
 	rec_ctx *vid;
+
+	/* Continuous recording held in memory, saved on request. */
+	rec_ctx *replay;
 #endif
 };
 
@@ -185,7 +266,10 @@ struct haiyajan_ctx_s
 
 	/* User interface context. */
 	ui *ui;
-	ui_overlay_ctx *ui_overlay;
+	ui_overlay_ctx ui_overlay;
+
+	/* Timeouts that are expired by the main loop. */
+	struct timer_wheel_s timers;
 
 	/* Font */
 	font_ctx *font;
@@ -193,6 +277,34 @@ struct haiyajan_ctx_s
 	/* Tool assist context. */
 	tai *tai;
 
+	/* Processor counters sampled during the benchmark, or NULL. */
+	pmu_ctx *pmu;
+
+	/* Frameskip controller, and the file that the frame costs learned for
+	 * the loaded core are kept in, or NULL. */
+	struct fskip_ctx_s fskip;
+	char *fskip_profile;
+
+	/* Delay after VSYNC, used if frame_delay is set. */
+	struct timer_delay_s frame_delay;
+
+	/* Input latency test, or NULL. */
+	latency_ctx *latency;
+
+	/* Replay verification, or NULL. */
+	verify_ctx *verify;
+
+	/* Checkpoints of the replay being played, used to seek within it, or
+	 * NULL. */
+	ckpt_ctx *ckpt;
+
+	/* Buffer that the state of the core is serialised to. */
+	void *state_buf;
+	size_t state_buf_len;
+
 	unsigned quit : 1;
+
+	/* Show the performance HUD. */
+	unsigned show_perf : 1;
 };
 
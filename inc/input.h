@@ -52,7 +52,10 @@ typedef enum {
 	INPUT_EVENT_TOGGLE_INFO = 0,
 	INPUT_EVENT_TOGGLE_FULLSCREEN,
 	INPUT_EVENT_TAKE_SCREENSHOT,
-	INPUT_EVENT_RECORD_VIDEO_TOGGLE
+	INPUT_EVENT_RECORD_VIDEO_TOGGLE,
+	INPUT_EVENT_SAVE_REPLAY,
+	INPUT_EVENT_SEEK_BACK,
+	INPUT_EVENT_SEEK_FORWARD
 } input_cmd_event_codes_e;
 
 /* Libretro joypad input as an enum for improved type tracking. */
@@ -175,10 +178,33 @@ struct input_device {
 	} type;
 };
 
+/* State of a port as seen by the core for a single frame. */
+struct input_snap_s
+{
+	/* Joypad buttons, with bit n set if RETRO_DEVICE_ID_JOYPAD n is
+	 * pressed. */
+	Uint16 btns;
+
+	/* Analogue sticks indexed by RETRO_DEVICE_INDEX_ANALOG_* and
+	 * RETRO_DEVICE_ID_ANALOG_*. */
+	Sint16 stick[2][2];
+
+	/* Analogue value of each joypad button. */
+	Sint16 btn_analog[16];
+};
+
 struct input_ctx_s
 {
 	Uint32 input_cmd_event;
 	input_device_s player[MAX_PLAYERS];
+
+	/* Only written by input_poll(), so that the core sees the same input
+	 * throughout a frame. */
+	struct input_snap_s snap[MAX_PLAYERS];
+
+	/* Set whilst the snapshot is provided by tool assisted input, in which
+	 * case input_poll() leaves it unchanged. */
+	SDL_bool held;
 };
 
 /**
@@ -212,7 +238,26 @@ void input_add_controller(struct input_ctx_s *ctx, unsigned port,
 void input_handle_event(struct input_ctx_s *const in_ctx, const SDL_Event *ev);
 
 /**
- * Obtain input.
+ * Sets the state of a key on the keyboard, in the same way that a key event
+ * handled by input_handle_event() does, without the event queue.
+ *
+ * \param in_ctx	Input struct context.
+ * \param sc		Scancode of the key.
+ * \param state		SDL_PRESSED or SDL_RELEASED.
+ */
+void input_set_key(struct input_ctx_s *in_ctx, SDL_Scancode sc, Uint8 state);
+
+/**
+ * Samples the state of every port into the input snapshot. Game controllers
+ * are updated first, so that their state is as recent as possible. This is
+ * expected to be called by the core once per frame, prior to reading input.
+ *
+ * \param in_ctx	Input struct context.
+ */
+void input_poll(struct input_ctx_s *in_ctx);
+
+/**
+ * Obtain input from the snapshot taken by the last call to input_poll().
  *
  * \param in_ctx	Input struct context.
  * \param port		Port the controller is attached to.
@@ -0,0 +1,73 @@
+/**
+ * Measures the time from input to the presentation of its response.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#pragma once
+
+#include <SDL.h>
+
+/* The key pressed in each trial. Mapped to the B button by default. */
+#define LATENCY_KEY	SDL_SCANCODE_Z
+
+typedef struct latency_ctx_s latency_ctx;
+
+struct latency_stats_s
+{
+	/* Number of trials that were measured, and that timed out without a
+	 * response. */
+	unsigned measured;
+	unsigned missed;
+
+	/* Latency in microseconds. */
+	Uint32 min_us, mean_us, p50_us, p90_us, p99_us, max_us;
+};
+
+/**
+ * Prepares a latency test. In each trial, a key press is injected at a random
+ * point within a frame, and the time until a frame with different contents is
+ * presented is measured. The screen of the core must only change in response
+ * to the key press.
+ *
+ * \param trials	Number of trials to perform.
+ * \param fps		Frame rate of the core.
+ * \return		Latency test context, or NULL on error with error in
+ *			SDL_GetError().
+ */
+latency_ctx *latency_init(unsigned trials, double fps);
+
+/**
+ * Must be called after each frame is presented.
+ *
+ * \param ctx		Latency test context.
+ * \param hash		Hash of the presented frame.
+ * \return		SDL_TRUE once all trials are complete.
+ */
+SDL_bool latency_presented(latency_ctx *ctx, Uint32 hash);
+
+/**
+ * Calculates the distribution of the latencies measured so far.
+ *
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError().
+ */
+int latency_get_stats(latency_ctx *ctx, struct latency_stats_s *st);
+
+/**
+ * Logs the distribution of the latencies measured so far.
+ */
+void latency_report(latency_ctx *ctx);
+
+/**
+ * Cancels a pending key press and frees the context. Safe to call with NULL.
+ */
+void latency_exit(latency_ctx *ctx);
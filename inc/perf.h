@@ -0,0 +1,174 @@
+/**
+ * Measures the time spent in each phase of a frame.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#pragma once
+
+#include <SDL.h>
+#include <font.h>
+
+/* Number of frame times kept for the frame time graph. */
+#define PERF_HISTORY	128
+
+/* Number of frames kept by the flight recorder; just over ten seconds at 100
+ * frames per second. Must be a power of two. */
+#define PERF_FLIGHT_FRAMES	1024
+
+/* Maximum length of a line formatted by perf_flight_line(). */
+#define PERF_FLIGHT_LINE_MAX	128
+
+enum perf_phase_e {
+	/* Processing SDL events and input. */
+	PERF_PHASE_EVENTS = 0,
+
+	/* Executing retro_run(), including the time spent in callbacks. */
+	PERF_PHASE_RUN,
+
+	/* Uploading the frame from the core to the texture. */
+	PERF_PHASE_UPLOAD,
+
+	/* Presenting the frame, including waiting for VSYNC. */
+	PERF_PHASE_PRESENT,
+
+	PERF_PHASE_MAX
+};
+
+enum perf_flag_e {
+	PERF_FLAG_SKIPPED = (1 << 0),
+	PERF_FLAG_DUPLICATE = (1 << 1)
+};
+
+/* Timings of a single frame kept by the flight recorder. */
+struct perf_flight_s
+{
+	Uint32 frame;
+	Uint32 frame_us;
+	Uint32 phase_us[PERF_PHASE_MAX];
+	Uint32 audio_queued;
+	Uint32 allocs;
+	Uint16 events;
+	Uint8 flags;
+};
+
+struct perf_ctx_s
+{
+	Uint64 freq;
+	Uint64 frame_beg;
+	Uint64 phase_beg[PERF_PHASE_MAX];
+
+	/* Time in microseconds spent in each phase during the current frame,
+	 * and the moving average over previous frames. */
+	Uint32 phase_us[PERF_PHASE_MAX];
+	Uint32 phase_avg_us[PERF_PHASE_MAX];
+
+	/* Ring of previous frame times in microseconds. */
+	Uint32 frame_us[PERF_HISTORY];
+	Uint8 frame_pos;
+
+	Uint32 frames_skipped;
+	Uint32 frames_dup;
+
+	/* Allocations made by the main thread up to the start of the current
+	 * frame, counted when allocation tracking is enabled. */
+	Uint64 allocs_prev;
+
+	/* Set during the current frame. */
+	Uint32 audio_queued;
+	Uint16 events;
+	Uint8 flags;
+
+	/* Ring of the timings of recent frames, which is saved to a file when a
+	 * frame overruns the target frame time by more than stutter_us. Saving
+	 * is disabled if stutter_us is zero. */
+	struct perf_flight_s flight[PERF_FLIGHT_FRAMES];
+	Uint32 frames;
+	Uint32 target_us;
+	Uint32 stutter_us;
+	Uint32 stutter_cooldown;
+};
+
+/**
+ * Initialises the performance context.
+ */
+void perf_init(struct perf_ctx_s *p);
+
+/**
+ * Marks the start of a new frame, and stores the timings of the previous
+ * frame. If the previous frame overran the target frame time by more than
+ * stutter_us, the flight recorder is saved.
+ */
+void perf_frame_begin(struct perf_ctx_s *p);
+
+/**
+ * Sets whether the current frame was skipped or duplicated.
+ */
+void perf_frame_status(struct perf_ctx_s *p, SDL_bool skipped, SDL_bool dup);
+
+/**
+ * Marks the beginning and the end of a phase. A phase may be executed more
+ * than once per frame, in which case the time is accumulated.
+ */
+void perf_phase_begin(struct perf_ctx_s *p, enum perf_phase_e phase);
+void perf_phase_end(struct perf_ctx_s *p, enum perf_phase_e phase);
+
+/**
+ * Returns the number of frames held by the flight recorder.
+ */
+unsigned perf_flight_len(const struct perf_ctx_s *p);
+
+/**
+ * Returns a frame held by the flight recorder, where 0 is the oldest frame.
+ */
+const struct perf_flight_s *perf_flight_get(const struct perf_ctx_s *p,
+					    unsigned i);
+
+/**
+ * Formats the timings of a frame as a line of text. This function is
+ * async-signal-safe, so that it may be used to save the flight recorder after
+ * a crash.
+ *
+ * \param f		Frame timings.
+ * \param line		Output buffer of at least PERF_FLIGHT_LINE_MAX bytes.
+ *			The line is not NULL terminated.
+ * \return		Length of the line.
+ */
+size_t perf_flight_line(const struct perf_flight_s *f, char *line);
+
+/* Header describing the columns written by perf_flight_line(). */
+#define PERF_FLIGHT_HEADER						\
+	"# frame frame_us events_us run_us upload_us present_us "	\
+	"audio_bytes allocs events flags\n"
+
+/**
+ * Saves the flight recorder to a text file on a worker thread.
+ *
+ * \param p		Performance context.
+ * \param filename	File to write to.
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError().
+ */
+int perf_flight_save(const struct perf_ctx_s *p, const char *filename);
+
+/**
+ * Draws the performance HUD in the top left corner of the renderer.
+ *
+ * \param p		Performance context.
+ * \param rend		Renderer to draw to.
+ * \param font		Font context.
+ * \param audio_ms	Audio queued for playback in milliseconds, or negative
+ *			if audio is not being played.
+ * \param enc_backlog	Video frames waiting to be encoded, or negative if not
+ *			recording.
+ */
+void perf_hud_render(const struct perf_ctx_s *p, SDL_Renderer *rend,
+		     font_ctx *font, int audio_ms, int enc_backlog);
@@ -0,0 +1,50 @@
+/**
+ * Samples processor event counters.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#pragma once
+
+#include <SDL.h>
+
+typedef struct pmu_ctx_s pmu_ctx;
+
+/**
+ * Opens counters for instructions, cycles, cache misses, branch misses and
+ * page faults on the calling thread. If the hardware counters are unavailable,
+ * such as within a virtual machine, software counters are used instead. The
+ * counters are opened as a group, and are scaled if the group is multiplexed
+ * with other events. Only supported on Linux.
+ *
+ * \return	Counter context, or NULL on error with error in SDL_GetError().
+ */
+pmu_ctx *pmu_init(void);
+
+/**
+ * Marks the beginning and the end of a sampled span. The difference in each
+ * counter over the span is stored as one sample. The span is skipped if the
+ * counters could not be read, or were not scheduled during the span. Must be
+ * called from the thread that called pmu_init().
+ */
+void pmu_begin(pmu_ctx *ctx);
+void pmu_end(pmu_ctx *ctx);
+
+/**
+ * Logs the average, median, 90th and 99th percentile of each counter per
+ * span.
+ */
+void pmu_report(pmu_ctx *ctx);
+
+/**
+ * Closes the counters and frees the context. Safe to call with NULL.
+ */
+void pmu_exit(pmu_ctx *ctx);
@@ -0,0 +1,58 @@
+/**
+ * Worker thread pool for background jobs.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#pragma once
+
+#include <SDL.h>
+
+/* Job priority. Jobs of a higher priority are always started before jobs of a
+ * lower priority. */
+enum pool_prio_e {
+	POOL_PRIO_HIGH = 0,
+	POOL_PRIO_NORMAL,
+	POOL_PRIO_LOW,
+
+	POOL_PRIO_MAX
+};
+
+typedef void (*pool_job_fn)(void *param);
+
+/**
+ * Starts the worker threads. The worker threads run at a low priority.
+ *
+ * \param workers	Number of worker threads, or 0 to select a number based
+ *			upon the number of CPUs available.
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError().
+ */
+int pool_init(unsigned workers);
+
+/**
+ * Queues a job to be executed on a worker thread. This function does not
+ * allocate and does not block.
+ *
+ * \param fn		Function to execute.
+ * \param param		Parameter passed to the function.
+ * \param prio		Priority of the job.
+ * \return		0 on success, or negative if the pool is not running or
+ *			the queue is full. The job is not executed on failure.
+ */
+int pool_submit(pool_job_fn fn, void *param, enum pool_prio_e prio);
+
+/**
+ * Executes all queued jobs and stops the worker threads. This function blocks
+ * until all jobs have finished. It is safe to call this function if
+ * pool_init() failed.
+ */
+void pool_exit(void);
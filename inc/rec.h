@@ -24,7 +24,9 @@ typedef struct rec_s rec_ctx;
  * this format. This includes the latest ffmpeg.
  * Audio is encoded with Wavpack. This is primarily due to supporting any input
  * sample rate.
- * These files are not merged into a container format.
+ * Both streams are interleaved into a single Matroska file. Video frames are
+ * timestamped by the emulated frame number, so that skipped and duplicated
+ * frames keep the video in sync with the audio.
  *
  * Software encoding is used for both audio and video. This will consume
  * significant CPU time.
@@ -36,20 +38,41 @@ typedef struct rec_s rec_ctx;
  * \param height	Height of video.
  * \param fps		Frames per second.
  * \param sample_rate	Sample rate of audio.
+ * \param segment_sec	If non-zero, the video is split into segments of
+ *			the given number of seconds which are encoded in
+ *			parallel by multiple encoders. This improves
+ *			throughput on systems with many processors, but
+ *			disables rec_speedup() and rec_relax().
+ * \param replay_bytes	If non-zero, the recording is kept in memory instead
+ *			of being written to fileout, which may be NULL. The
+ *			oldest GOPs are dropped to keep the recording within
+ *			the given number of bytes. Use rec_replay_save() to
+ *			write the replay to a file.
+ * \param realtime	If SDL_FALSE, the caller is blocked until the encoders
+ *			are able to accept more input, instead of audio
+ *			samples and video frames being dropped. This function
+ *			also waits for the video encoder to initialise.
  * \return		Valid context used for recording, or NULL on error.
  */
 rec_ctx *rec_init(const char *fileout, int width, int height, double fps,
-		      Sint32 sample_rate);
+		      Sint32 sample_rate, Uint8 segment_sec, size_t replay_bytes,
+		      SDL_bool realtime);
 
 /**
  * Encode given surface as a new frame of video.
  * This may take too long too complete. Use rec_speedup() and rec_relax() to
  * control the time taken to encode frames.
+ * The surface is free'd by the encoder.
+ *
+ * \param surf		Surface containing the frame in RGB24 format.
+ * \param frame	Frame number that the surface was generated on.
  */
-void rec_enc_video(rec_ctx *ctx, SDL_Surface *surf);
+void rec_enc_video(rec_ctx *ctx, SDL_Surface *surf, Uint32 frame);
 
 /**
- * Encode a given number of audio frames.
+ * Queue a given number of stereo audio frames for encoding.
+ * The samples are copied to a ring buffer and encoded on a separate thread.
+ * Samples are dropped if the encoder is unable to keep up.
  */
 void rec_enc_audio(rec_ctx *ctx, const Sint16 *data, uint32_t frames);
 
@@ -60,14 +83,24 @@ void rec_enc_audio(rec_ctx *ctx, const Sint16 *data, uint32_t frames);
 void rec_end(rec_ctx **ctxp);
 
 /**
- * Returns the current output file size of the video file, or -1 on error.
+ * Returns the current output file size of the recording, or -1 on error.
  */
-Sint64 rec_video_size(rec_ctx *ctx);
+Sint64 rec_size(rec_ctx *ctx);
 
 /**
- * Returns the current output file size of the audio file, or -1 on error.
+ * Returns the number of video frames waiting to be encoded, or -1 on error.
  */
-Sint64 rec_audio_size(rec_ctx *ctx);
+int rec_backlog(rec_ctx *ctx);
+
+/**
+ * Save the replay held in memory to a file. The file is written on a separate
+ * thread, and the replay is emptied.
+ *
+ * \param ctx		Context initialised with a replay size.
+ * \param fileout	Output file name.
+ * \return		0 on success, or -1 on error.
+ */
+int rec_replay_save(rec_ctx *ctx, const char *fileout);
 
 /**
  * Set the quality of the video.
@@ -86,7 +119,55 @@ void rec_speedup(rec_ctx *ctx);
 void rec_relax(rec_ctx *ctx);
 #endif /* ENABLE_VIDEO_RECORDING */
 
+typedef struct rec_raw_s rec_raw_ctx;
+
+/**
+ * Initialise raw capture context. This is available even when Haiyajan is
+ * built without encoders.
+ * Video is written uncompressed to "prefix.y4m" in YUV4MPEG2 format, and audio
+ * is written to "prefix.wav" as 16-bit stereo PCM. The output files may be
+ * named pipes to an external encoder.
+ * As duplicated and skipped frames are not written, the timestamp of each
+ * frame is written to "prefix.txt" in mkvmerge timestamp format v2.
+ *
+ * Frames are converted and written on a separate thread. Frames are dropped if
+ * the output is unable to keep up.
+ *
+ * \param prefix	Output file name without extension.
+ * \param width		Width of video.
+ * \param height	Height of video.
+ * \param fps		Frames per second.
+ * \param sample_rate	Sample rate of audio.
+ * \return		Valid context used for capturing, or NULL on error.
+ */
+rec_raw_ctx *rec_raw_init(const char *prefix, int width, int height,
+			  double fps, Sint32 sample_rate);
+
+/**
+ * Capture the given surface as the video frame for the given frame number.
+ * The surface is free'd by the capture context.
+ */
+void rec_raw_video(rec_raw_ctx *ctx, SDL_Surface *surf, Uint32 frame);
+
+/**
+ * Capture a given number of stereo audio frames.
+ */
+void rec_raw_audio(rec_raw_ctx *ctx, const Sint16 *data, uint32_t frames);
+
+/**
+ * Finish capturing. The remaining data is written on a separate thread.
+ * The capture context is free'd and invalidated after this call.
+ */
+void rec_raw_end(rec_raw_ctx **ctxp);
+
+/**
+ * Wait for all finished recordings, replays and captures to be written to
+ * disk.
+ */
+void rec_wait_all(void);
+
 /**
- * Save a surface to a file.
+ * Save a surface to a file on a worker thread. The surface is freed once
+ * saved.
  */
 void rec_single_img(SDL_Surface *surf, const char *core_name);
@@ -22,21 +22,22 @@
   * Design to be as universal as possible, and for future extensions without
   * breaking compatibility.
   *
+  * All values are little-endian.
+  *
   * Structure:
   * u8 magic[10]
   * u8 version
-  * u8 file_version
+  * u8 ports
+  * u16 rec_len
+  * u16 block_frames
+  * u64 frames
+  * u64 index_offset
   * char rom_target[32]
   * char emu_target[32]
-  * char emu_version[32]
   * char tai_desc[32]
   * char tai_author[32]
-  * u64 frame_num
-  * u8 command;
-  * while command != HTAI_CMD_END
-  *	command_data;
-  * 	command;
-  * end
+  * block[]
+  * index
   *
   * magic
   * 	Unique set of bytes used to identify the file.
@@ -44,23 +45,32 @@
   *		0xAB, 'h', 't', 'a', 'i', 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
   *
   * version
-  *	File format version. This specification is for version 1.
+  *	File format version. This specification is for version 2. Version 1
+  *	files, which stored keyboard events, may still be played back but are
+  *	no longer recorded.
   *
-  * file_version
-  *	Version information of the file itself.
+  * ports
+  *	Number of ports in each record. Must be 4.
   *
-  * rom_target
-  *	Name of the target ROM name. Should only be used as a weak sign of
-  *	compatibility with the loaded game.
-  *	String may not be null terminated if its length is 32 characters.
+  * rec_len
+  *	Size of a record in bytes. Must be 56.
   *
-  * emu_target
-  *	Name of the target emulator name. Should only be used as a weak sign of
-  *	compatibility with the emulator.
-  *	String may not be null terminated if its length is 32 characters.
+  * block_frames
+  *	Number of records in each block. Every block other than the last must
+  *	hold this many records. Must be 1024.
+  *
+  * frames
+  *	Total number of records in the file. 0 if the recording was not
+  *	completed.
+  *
+  * index_offset
+  *	Offset of the index from the start of the file. 0 if the recording was
+  *	not completed, in which case the blocks are read in order until the
+  *	end of the file.
   *
-  * emu_version
-  *	Emulator version the file was created with.
+  * rom_target, emu_target
+  *	Name of the target ROM and emulator. Should only be used as a weak sign
+  *	of compatibility.
   *	String may not be null terminated if its length is 32 characters.
   *
   * tai_desc
@@ -71,82 +81,39 @@
   *	Author of the file.
   *	String may not be null terminated if its length is 32 characters.
   *
-  * frame_num
-  *  The frame number to execute command. Following frame numbers must either
-  *  be the same or higher.
-  *
-  * command
-  *	Command to execute. Must be one of:
-  *		HTAI_CMD_END = 0
-  *		HTAI_CMD_QUIT
-  *		HTAI_CMD_KEYBOARD
-  *		HTAI_CMD_TEXTEDIT
-  *		HTAI_CMD_TEXTINPUT
-  *		HTAI_CMD_MOUSE_MOTION
-  *		HTAI_CMD_MOUSE_BUTTON
-  *		HTAI_CMD_MOUSE_WHEEL
-  *		HTAI_CMD_CONTROLLER_AXIS
-  *		HTAI_CMD_CONTROLLER_BUTTON
-  *		HTAI_CMD_CONTROLLER_DEVICE
-  *		HTAI_CMD_TOUCH_FINGER
-  *
-  * command_data
-  *	HTAI_CMD_END:
-  *		N/A. No more input remaining. The program stays running.
-  *	HTAI_CMD_QUIT:
-  *		N/A. The program should immediately quit.
-  *	HTAI_CMD_KEYBOARD:
-  *		u8 state
-  *		u8 unused
-  *		u16_t keymod
-  *		u32_t scancode
-  *		u32_t keycode
-  *	HTAI_CMD_TEXTEDIT:
-  *		char[32] text
-  *		s32_t start
-  *		s32_t length
-  *	HTAI_CMD_TEXTINPUT:
-  *		char[32] text
-  *		s32_t start
-  *		s32_t length
-  *	HTAI_CMD_MOUSE_MOTION:
-  *		u32_t state
-  *		s32 x
-  *		s32 y
-  *	HTAI_CMD_MOUSE_BUTTON:
-  *		u8 button
-  *		u8 state
-  *		u8 clicks
-  *		u8 unused
-  *		s32 x
-  *		s32 y
-  *	HTAI_CMD_MOUSE_WHEEL:
-  *		s32 x
-  *		s32 y
-  *		u32 direction
-  *	HTAI_CMD_CONTROLLER_AXIS:
-  *		u8 axis
-  *		u8 unused
-  *		s16 value
-  *	HTAI_CMD_CONTROLLER_BUTTON:
-  *		u8 button
-  *		u8 state
-  *		u16 unused
-  *	HTAI_CMD_CONTROLLER_DEVICE:
-  *		u8 button
-  *		u8 state
-  *		u16 unused
-  *	HTAI_CMD_TOUCH_FINGER:
-  *		u8 type
-  *		u8 unused[3]
-  *		f32 x
-  *		f32 y
-  *		f32 pressure
+  * block
+  *	u32 frames
+  *	u32 comp_len
+  *	u8 data[comp_len]
+  *
+  *	data is a raw deflate stream of frames records. Each record is stored
+  *	as the exclusive-or with the previous record in the block, the first
+  *	record being stored as is. These are then stored byte-planar; the first
+  *	byte of every record, followed by the second byte of every record, and
+  *	so on. Each block may therefore be decoded independently.
+  *
+  * record
+  *	The input presented to the core for a single frame. For each port:
+  *		u16 buttons; bitmask of RETRO_DEVICE_ID_JOYPAD_*
+  *		s16 left_x
+  *		s16 left_y
+  *		s16 right_x
+  *		s16 right_y
+  *		s16 l2; analogue value of the trigger
+  *		s16 r2
+  *
+  * index
+  *	u32 count
+  *	For each block:
+  *		u64 offset; from the start of the file
+  *		u32 comp_len
+  *		u32 frames
   */
 
 #include <SDL.h>
 
 typedef struct tai_s tai;
+struct input_ctx_s;
 
 /**
  * Initialise tool assisted input context.
@@ -160,18 +127,89 @@ typedef struct tai_s tai;
 tai *tai_init(SDL_RWops *f, SDL_bool record);
 
 /**
- * Process event by either reading from HTAI file and generating an SDL_Event,
- * or by storing the given SDL_Event to a new HTAI file.
+ * Checks whether playback has finished. Events are neither recorded nor
+ * generated, as input is recorded by tai_record_frame() and played back by
+ * tai_play_frame().
  *
  * \param ctx		Tool assisted input context.
- * \param e		SDL_Event to record. Ignored when reading existing file.
+ * \param e		Unused.
+ * \return		1 if playback has finished, else 0.
  */
 int tai_process_event(tai *ctx, SDL_Event *e);
 
+/**
+ * Provides the input for the next frame from the file being played, by
+ * writing it directly to the input context. For version 2 files, the input
+ * snapshot is held, so that input_poll() does not overwrite it, and is
+ * released once playback has finished. For version 1 files, the keyboard
+ * events of the frame are applied to the keyboard state. Does nothing when
+ * recording, or if ctx is NULL.
+ *
+ * \param ctx		Tool assisted input context.
+ * \param in		Input context to provide input to.
+ * \return		1 if playback has finished, 0 on success, or -1 on
+ *			error. Playback is finished after an error.
+ */
+int tai_play_frame(tai *ctx, struct input_ctx_s *in);
+
+/**
+ * Obtains the next frame to be played.
+ *
+ * \return		Number of frames played, or -1 if not playing a
+ *			version 2 file.
+ */
+Sint64 tai_tell(const tai *ctx);
+
+/**
+ * Obtains the number of frames in the file being played.
+ *
+ * \return		Number of frames, or -1 if not playing a version 2
+ *			file.
+ */
+Sint64 tai_length(const tai *ctx);
+
+/**
+ * Sets the next frame to be played. The state of the core must be restored
+ * to the same frame by the caller.
+ *
+ * \param ctx		Tool assisted input context.
+ * \param frame		Frame to play next, no greater than tai_length().
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError().
+ */
+int tai_seek(tai *ctx, Uint64 frame);
+
+/**
+ * Records the input presented to the core in the last frame. Records are
+ * compressed and written a block at a time. Does nothing when playing, or if
+ * ctx is NULL.
+ *
+ * \param ctx		Tool assisted input context.
+ * \param in		Input context after the frame was run.
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError().
+ */
+int tai_record_frame(tai *ctx, const struct input_ctx_s *in);
+
 void tai_next_frame(tai *ctx);
 
 /**
- * Close and free the tool assisted input context. Finishes the recording
- * context. The SDL_RWops context will be closed.
+ * Generates a key event in the same way that a played back keyboard command
+ * does, without requiring an input file. May be called from any thread.
+ *
+ * \param sc		Scancode of the key.
+ * \param state		SDL_PRESSED or SDL_RELEASED.
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError().
+ */
+int tai_inject_key(SDL_Scancode sc, Uint8 state);
+
+/**
+ * Close and free the tool assisted input context. Finishes the recording by
+ * writing any remaining records and the index. The SDL_RWops context will be
+ * closed.
+ *
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError(). The context is freed regardless.
  */
 int tai_exit(tai *ctx);
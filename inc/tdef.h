@@ -0,0 +1,45 @@
+/**
+ * Tiny deflate compressor, producing data that tinflate can decompress.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#pragma once
+
+#include <SDL.h>
+
+#define TDEF_HASH_BITS	12
+#define TDEF_WINDOW	32768
+
+/* Largest compressed size of len bytes of data. */
+#define TDEF_BOUND(len)	((len) + (len) / 8 + 16)
+
+/* Match finder state. Kept by the caller so that compressing does not
+ * allocate memory. */
+struct tdef_work_s
+{
+	Uint32 head[1 << TDEF_HASH_BITS];
+	Uint32 prev[TDEF_WINDOW];
+};
+
+/**
+ * Compresses data into a single raw deflate block using the fixed Huffman
+ * codes. Long runs of repeated bytes compress well.
+ *
+ * \param w		Working memory.
+ * \param dst		Buffer to write compressed data to.
+ * \param dst_len	Size of dst. TDEF_BOUND(src_len) is always sufficient.
+ * \param src		Data to compress.
+ * \param src_len	Size of src.
+ * \return		Size of the compressed data, or 0 if dst is too small.
+ */
+size_t tdef_compress(struct tdef_work_s *w, void *dst, size_t dst_len,
+		     const void *src, size_t src_len);
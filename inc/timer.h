@@ -36,6 +36,62 @@ struct timer_ctx_s
 	SDL_atomic_t status_atomic;
 };
 
+/* Number of slots in the timer wheel, and the time each slot covers. Timeouts
+ * longer than a full turn of the wheel wait for additional turns. */
+#define TIMER_WHEEL_SLOTS	64
+#define TIMER_WHEEL_RES_MS	16
+
+/**
+ * A timeout on the timer wheel. Entries are embedded in the structure that
+ * owns them, so that adding a timeout never allocates. An entry must be
+ * zero initialised before first use.
+ */
+struct timer_entry_s
+{
+	struct timer_entry_s *next;
+	struct timer_entry_s **pprev;
+	Uint32 rounds;
+
+	void (*fn)(void *priv);
+	void *priv;
+};
+
+/**
+ * Executes timeouts on the thread that advances the wheel, which is the main
+ * loop.
+ */
+struct timer_wheel_s
+{
+	struct timer_entry_s *slot[TIMER_WHEEL_SLOTS];
+	Uint32 slot_now;
+	Uint32 last_ms;
+};
+
+/**
+ * Delays the start of each frame after VSYNC, so that input is read as late
+ * as possible whilst still finishing the frame before the next VSYNC.
+ */
+struct timer_delay_s
+{
+	Uint64 freq;
+
+	/* Time at which the previous frame was presented, or zero. */
+	Uint64 presented;
+
+	Uint32 refresh_us;
+
+	/* Recent peak time taken to process a frame, decaying slowly. */
+	Uint32 cost_us;
+
+	/* Time left spare before VSYNC, widened when VSYNC is missed. */
+	Uint32 margin_us;
+
+	Uint32 delay_us;
+
+	/* Number of frames before the delay may be raised again. */
+	Uint16 hold;
+};
+
 /* TODO: use Uint64 instead of double. */
 
 /**
@@ -59,3 +115,72 @@ void timer_profile_start(struct timer_ctx_s *const tim);
  * \returns	Negative for skip frame, 0 for no delay, else time to delay for.
  */
 int timer_profile_end(struct timer_ctx_s *const tim);
+
+/**
+ * Initialises the frame delay context with no delay.
+ *
+ * \param d		Frame delay context.
+ * \param refresh_hz	Refresh rate of the display.
+ */
+void timer_delay_init(struct timer_delay_s *d, double refresh_hz);
+
+/**
+ * Waits until the current delay has elapsed since the previous frame was
+ * presented. Must be called before input is read for the next frame.
+ */
+void timer_delay_wait(const struct timer_delay_s *d);
+
+/**
+ * Records that a frame was presented, and updates the delay. The delay is
+ * reduced immediately if VSYNC was missed, or if the time left before VSYNC
+ * becomes too small, and is only raised gradually.
+ *
+ * \param d		Frame delay context.
+ * \param now		Performance counter after the frame was presented.
+ * \param work_us	Time taken to process the frame in microseconds,
+ *			excluding the delay and the time waiting for VSYNC.
+ */
+void timer_delay_presented(struct timer_delay_s *d, Uint64 now,
+			   Uint32 work_us);
+
+/**
+ * Initialises an empty timer wheel.
+ *
+ * \param tw		Timer wheel to initialise.
+ * \param now_ms	Current time in milliseconds.
+ */
+void timer_wheel_init(struct timer_wheel_s *tw, Uint32 now_ms);
+
+/**
+ * Adds a timeout to the timer wheel. If the entry is already pending, it is
+ * rescheduled.
+ *
+ * \param tw		Timer wheel.
+ * \param e		Entry to schedule. Must remain valid until it expires or
+ *			is cancelled.
+ * \param timeout_ms	Time in milliseconds after which the entry expires.
+ * \param fn		Function to call on expiry. May be NULL if the entry is
+ *			only checked with timer_entry_pending().
+ * \param priv		Private pointer passed to fn.
+ */
+void timer_wheel_add(struct timer_wheel_s *tw, struct timer_entry_s *e,
+		     Uint32 timeout_ms, void (*fn)(void *priv), void *priv);
+
+/**
+ * Cancels a pending timeout. Does nothing if the entry is not pending.
+ */
+void timer_wheel_cancel(struct timer_entry_s *e);
+
+/**
+ * Returns whether the entry is waiting to expire.
+ */
+SDL_bool timer_entry_pending(const struct timer_entry_s *e);
+
+/**
+ * Expires all timeouts that are due. Must be called regularly, such as once
+ * per frame.
+ *
+ * \param tw		Timer wheel.
+ * \param now_ms	Current time in milliseconds.
+ */
+void timer_wheel_advance(struct timer_wheel_s *tw, Uint32 now_ms);
@@ -0,0 +1,57 @@
+/**
+ * Records timestamped events for viewing on a timeline.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#pragma once
+
+#include <SDL.h>
+
+/**
+ * Starts recording events. Events are written to the given file in the
+ * Chrome trace event JSON format when trace_exit() is called, which may be
+ * opened with chrome://tracing or Perfetto.
+ *
+ * Each thread records to its own ring buffer, which holds the most recent
+ * events only. Recording an event does not lock or allocate, except for the
+ * first event recorded by a thread.
+ *
+ * \param filename	File to write the trace to.
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError().
+ */
+int trace_init(const char *filename);
+
+/**
+ * Sets the name of the calling thread shown on the timeline.
+ *
+ * \param name	Name of the thread. Truncated to 15 characters.
+ */
+void trace_thread_name(const char *name);
+
+/**
+ * Marks the beginning and the end of a scope on the calling thread. Scopes
+ * must be nested. These functions do nothing if tracing was not started.
+ *
+ * \param name	Name of the scope. This must be a string literal, as only the
+ *		pointer is stored. It must not contain characters that
+ *		require escaping in JSON.
+ */
+void trace_begin(const char *name);
+void trace_end(const char *name);
+
+/**
+ * Writes the trace to the file given to trace_init() and stops recording.
+ * All other threads that record events must have finished before this is
+ * called. It is safe to call this function if tracing was not started.
+ */
+void trace_exit(void);
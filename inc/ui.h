@@ -16,6 +16,7 @@
 #include <SDL.h>
 #include <menu.h>
 #include <font.h>
+#include <timer.h>
 
 /**
  * Overlay system.
@@ -36,22 +37,70 @@ typedef enum {
 	ui_overlay_bot_right = 3
 } ui_overlay_corner_e;
 
-/* Private structures. */
-typedef struct ui_overlay_item ui_overlay_item_s;
-typedef struct ui_overlay_item ui_overlay_ctx;
+/* Maximum number of overlays shown at once, and the maximum length of the
+ * text of an overlay including the null terminator. Longer text is truncated. */
+#define UI_OVERLAY_MAX		16
+#define UI_OVERLAY_TEXT_MAX	64
+
+/* The members of these structures are private. They are only defined here so
+ * that the overlay context may be allocated statically. */
+typedef struct ui_overlay_item {
+	struct ui_overlay_ctx_s *owner;
+	struct timer_entry_s timeout;
+
+	SDL_Colour text_colour;
+	ui_overlay_corner_e corner;
+	char text[UI_OVERLAY_TEXT_MAX];
+
+	char *(*get_new_str)(void *priv);
+	void *priv;
+
+	/* Rendered text, and its size. The texture is reused when the text
+	 * changes if the size remains the same. */
+	SDL_Texture *tex;
+	unsigned tex_w, tex_h;
+	SDL_bool redraw;
+} ui_overlay_item_s;
+
+typedef struct ui_overlay_ctx_s {
+	ui_overlay_item_s item[UI_OVERLAY_MAX];
+
+	/* Indexes of the overlays shown in each corner, oldest first. */
+	Uint8 corner_idx[4][UI_OVERLAY_MAX];
+	Uint8 corner_n[4];
+
+	/* Stack of unused overlays. */
+	Uint8 free_idx[UI_OVERLAY_MAX];
+	Uint8 free_n;
+
+	/* All overlays are composited on to this texture, which is only
+	 * redrawn when an overlay changes. */
+	SDL_Texture *layer;
+	int layer_w, layer_h;
+	SDL_bool dirty;
+} ui_overlay_ctx;
+
+/**
+ * Initialise the overlay context. No memory is allocated by the overlay
+ * system.
+ *
+ * \param ctx		Overlay context.
+ */
+void ui_overlay_init(ui_overlay_ctx *ctx);
 
 /**
  * Add a new overlay.
  *
- * \param ui_overlay_ctx Private overlay context pointer. Must be initialised to
- * 			NULL.
+ * \param ctx		Overlay context.
+ * \param tw		Timer wheel used to delete the overlay after timeout_ms.
+ * 			Unused if timeout_ms is 0.
  * \param text_colour	The text colour.
  * \param corner	The corner in which to display the overlay. The overlay
  * 			will be displayed from the corner selected to the
  * 			vertical center of the screen.
  * \param text		Static text to render, or NULL if dynamic text is to be
  * 			acquired from the get_new_str function.
- * 			String must be null terminated.
+ * 			String must be null terminated. The text is copied.
  * \param timeout_ms	Number of milliseconds to show the overlay for. Set to
  * 			0 for no automatic deletion.
  * \param get_new_str	The function to call to obtain new text on each render.
@@ -59,38 +108,40 @@ typedef struct ui_overlay_item ui_overlay_ctx;
  * 			This function pointer must be NULL for static text.
  * \param priv		Private pointer to supply to the get_new_str function.
  * 			Unused when get_new_str is NULL.
- * \param free_text	Set to non-zero to call SDL_free automatically on text
- * 			when overlay is deleted.
- * \return		Context for specific overlay. NULL on failure.
+ * \return		Context for specific overlay. NULL if the maximum
+ * 			number of overlays are already shown.
  */
-ui_overlay_item_s *ui_add_overlay(ui_overlay_ctx **ctx, SDL_Colour text_colour,
-		ui_overlay_corner_e corner, char *text, Uint32 timeout_ms,
-		char *(*get_new_str)(void *priv), void *priv,
-		Uint8 free_text);
+ui_overlay_item_s *ui_add_overlay(ui_overlay_ctx *ctx,
+		struct timer_wheel_s *tw, SDL_Colour text_colour,
+		ui_overlay_corner_e corner, const char *text, Uint32 timeout_ms,
+		char *(*get_new_str)(void *priv), void *priv);
 
 /**
  * Render the overlays added to the list to the current renderer.
+ * Overlays are composited on to a cached texture, which is only redrawn when
+ * an overlay is added or deleted, or when the string of a dynamic overlay
+ * changes.
  *
  * \param ctx	Overlay context.
  * \param rend	SDL Renderer.
  * \param font	Font context.
  * \return	0 on success, else failure.
  */
-int ui_overlay_render(ui_overlay_ctx **ctx, SDL_Renderer *rend, font_ctx *font);
+int ui_overlay_render(ui_overlay_ctx *ctx, SDL_Renderer *rend, font_ctx *font);
 
 /**
  * Delete a specific overlay.
  *
- * \param p	Overlay context.
+ * \param ctx	Overlay context.
  * \param item	Specific overlay to delete.
  */
-void ui_overlay_delete(ui_overlay_ctx **p, ui_overlay_item_s *item);
+void ui_overlay_delete(ui_overlay_ctx *ctx, ui_overlay_item_s *item);
 
 /**
- * Delete all overlays.
- * \param p	Overlay context.
+ * Delete all overlays and free their textures.
+ * \param ctx	Overlay context.
  */
-void ui_overlay_delete_all(ui_overlay_ctx **p);
+void ui_overlay_delete_all(ui_overlay_ctx *ctx);
 
 typedef struct ui_s	ui;
 ui *ui_init(SDL_Renderer *rend);
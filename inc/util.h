@@ -33,23 +33,6 @@
 void gen_filename(char filename[atleast 64], const char *core_name,
 		  const char fmt[atleast 3]);
 
-/**
- * Modify an atomic variable to a value after a given time.
- *
- * \param timeout_ms	Time to wait in ms before modifying atomic variable.
- * \param atomic	The atomic variable to modify.
- * \param setval	The value to set the atomic variable to after timeout.
- * \param name		The name of the thread. Can be set to NULL.
- */
-void set_atomic_timeout(Uint32 timeout_ms, SDL_atomic_t *atomic, int setval,
-	const char *name);
-
-/**
- * Makes sure that delayed threads no longer attempt to modify data that may
- * now be out of scope.
- */
-void util_exit_all(void);
-
 /**
  * Converts SDL_Texture to SDL_Surface by drawing the given texture onto the
  * renderer, and reading the pixels back into a surface.
@@ -59,8 +42,65 @@ void util_exit_all(void);
  * \param src		Area of Texture to convert to surface. Passing NULL will
  * 			convert total area.
  * \param flip		Whether to flip the texture before conversion.
- * \return		SDL_Surface or NULL on error.
+ * \return		SDL_Surface or NULL on error. The surface should be
+ *			returned with util_surf_put() once it is no longer
+ *			required.
  */
 SDL_Surface *util_tex_to_surf(SDL_Renderer *rend, SDL_Texture *tex,
 			      const SDL_Rect *const src,
 			      const SDL_RendererFlip flip);
+
+/**
+ * Returns a surface of the given size and format, reusing a surface previously
+ * given to util_surf_put() where possible. The contents of the surface are
+ * undefined.
+ *
+ * \return		SDL_Surface or NULL on error.
+ */
+SDL_Surface *util_surf_get(int w, int h, Uint32 fmt);
+
+/**
+ * Returns a surface for reuse, or frees it if enough surfaces are already
+ * held. May be called from any thread. Safe to call with NULL.
+ */
+void util_surf_put(SDL_Surface *surf);
+
+/**
+ * Copies a surface into a surface obtained with util_surf_get().
+ *
+ * \return		SDL_Surface or NULL on error.
+ */
+SDL_Surface *util_surf_dup(SDL_Surface *surf);
+
+/* Initial value of a hash calculated with util_hash(). */
+#define UTIL_HASH_INIT	0x811C9DC5
+
+/**
+ * Continues the FNV-1a hash of a sequence of data.
+ *
+ * \param hash		Hash of the preceding data, or UTIL_HASH_INIT.
+ * \param data		Data to hash.
+ * \param len		Length of data in bytes.
+ * \return		Hash of the preceding data and the given data.
+ */
+Uint32 util_hash(Uint32 hash, const void *data, size_t len);
+
+/**
+ * Calculates the FNV-1a hash of the pixels of a frame. Padding at the end of
+ * each row is not included.
+ *
+ * \param data		Pixels of the frame.
+ * \param w		Width of the frame in pixels.
+ * \param h		Height of the frame in pixels.
+ * \param pitch		Length of each row in bytes.
+ * \param bpp		Bytes per pixel.
+ * \return		Hash of the frame.
+ */
+Uint32 util_hash_frame(const void *data, unsigned w, unsigned h, size_t pitch,
+		       unsigned bpp);
+
+/**
+ * Frees the surfaces held for reuse, and the texture used by
+ * util_tex_to_surf(). Must be called before the renderer is destroyed.
+ */
+void util_exit(void);
@@ -0,0 +1,76 @@
+/**
+ * Verifies that a replay produces the same output as a previous replay.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#pragma once
+
+#include <SDL.h>
+
+/**
+ * A hash trace is a text file with a line for each frame:
+ *	frame video audio [state]
+ *
+ * frame is a decimal number, and each hash is eight hexadecimal digits. The
+ * state hash is only present if the state of the core was hashed. Lines
+ * starting with '#' are ignored.
+ */
+
+typedef struct verify_ctx_s verify_ctx;
+
+struct verify_hash_s
+{
+	/* Hash of the last frame given by the core. */
+	Uint32 video;
+
+	/* Hash of the audio given by the core within the frame. */
+	Uint32 audio;
+
+	/* Hash of the serialised state of the core after the frame. */
+	Uint32 state;
+	SDL_bool has_state;
+};
+
+/**
+ * Prepares to verify a replay.
+ *
+ * \param trace		File to write the hash trace to, or NULL.
+ * \param golden	Hash trace to compare against, or NULL.
+ * \return		Verify context, or NULL on error with error in
+ *			SDL_GetError().
+ */
+verify_ctx *verify_init(const char *trace, const char *golden);
+
+/**
+ * Records the hashes of a frame, and compares them to the golden trace.
+ *
+ * \param ctx		Verify context.
+ * \param frame		Number of the frame.
+ * \param hash		Hashes of the frame.
+ * \return		0 if the frame matches the golden trace or there is no
+ *			golden trace, else 1.
+ */
+int verify_frame(verify_ctx *ctx, Uint32 frame,
+		 const struct verify_hash_s *hash);
+
+/**
+ * Logs the result of the comparison against the golden trace.
+ *
+ * \return		0 if every frame matched the golden trace, else
+ *			negative.
+ */
+int verify_report(verify_ctx *ctx);
+
+/**
+ * Closes the trace file and frees the context. Safe to call with NULL.
+ */
+void verify_exit(verify_ctx *ctx);
@@ -0,0 +1,197 @@
+/**
+ * Counts memory allocations made through SDL.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#include <SDL.h>
+#include <alloc.h>
+
+/* The size of each allocation is stored in front of it. This is large enough
+ * to keep the alignment given by the system allocator. */
+#define ALLOC_HDR	16
+#define ALLOC_SIZE_MAX	((size_t)-1)
+
+static struct alloc_track_s {
+	SDL_malloc_func real_malloc;
+	SDL_calloc_func real_calloc;
+	SDL_realloc_func real_realloc;
+	SDL_free_func real_free;
+
+	SDL_bool enabled;
+	SDL_threadID main_thread;
+	enum alloc_tag_e main_tag;
+
+	SDL_SpinLock lk;
+	struct alloc_stats_s stats;
+} track;
+
+static const char *const alloc_tag_names[ALLOC_TAG_MAX] = {
+	"main", "events", "run", "upload", "present", "threads"
+};
+
+static void alloc_count(size_t new_sz, size_t old_sz)
+{
+	enum alloc_tag_e tag = ALLOC_TAG_THREADS;
+	struct alloc_stats_s *s = &track.stats;
+
+	if(SDL_ThreadID() == track.main_thread)
+		tag = track.main_tag;
+
+	SDL_AtomicLock(&track.lk);
+	s->allocs++;
+	s->tag_allocs[tag]++;
+	s->cur_bytes += new_sz - old_sz;
+	if(s->cur_bytes > s->peak_bytes)
+		s->peak_bytes = s->cur_bytes;
+	SDL_AtomicUnlock(&track.lk);
+}
+
+static void *alloc_ret(Uint8 *base, size_t sz)
+{
+	if(base == NULL)
+		return NULL;
+
+	SDL_memcpy(base, &sz, sizeof(sz));
+	return base + ALLOC_HDR;
+}
+
+static size_t alloc_size(const void *mem)
+{
+	size_t sz;
+
+	SDL_memcpy(&sz, (const Uint8 *)mem - ALLOC_HDR, sizeof(sz));
+	return sz;
+}
+
+static void *SDLCALL track_malloc(size_t sz)
+{
+	void *mem;
+
+	if(sz > ALLOC_SIZE_MAX - ALLOC_HDR)
+		return NULL;
+
+	mem = alloc_ret(track.real_malloc(sz + ALLOC_HDR), sz);
+	if(mem != NULL)
+		alloc_count(sz, 0);
+
+	return mem;
+}
+
+static void *SDLCALL track_calloc(size_t nmemb, size_t sz)
+{
+	void *mem;
+	size_t total;
+
+	if(sz != 0 && nmemb > (ALLOC_SIZE_MAX - ALLOC_HDR) / sz)
+		return NULL;
+
+	total = nmemb * sz;
+	mem = alloc_ret(track.real_calloc(1, total + ALLOC_HDR), total);
+	if(mem != NULL)
+		alloc_count(total, 0);
+
+	return mem;
+}
+
+static void *SDLCALL track_realloc(void *mem, size_t sz)
+{
+	size_t old_sz;
+	void *new_mem;
+
+	if(mem == NULL)
+		return track_malloc(sz);
+
+	if(sz > ALLOC_SIZE_MAX - ALLOC_HDR)
+		return NULL;
+
+	old_sz = alloc_size(mem);
+	new_mem = alloc_ret(track.real_realloc((Uint8 *)mem - ALLOC_HDR,
+					       sz + ALLOC_HDR), sz);
+	if(new_mem != NULL)
+		alloc_count(sz, old_sz);
+
+	return new_mem;
+}
+
+static void SDLCALL track_free(void *mem)
+{
+	size_t sz;
+
+	if(mem == NULL)
+		return;
+
+	sz = alloc_size(mem);
+	SDL_AtomicLock(&track.lk);
+	track.stats.frees++;
+	track.stats.cur_bytes -= sz;
+	SDL_AtomicUnlock(&track.lk);
+
+	track.real_free((Uint8 *)mem - ALLOC_HDR);
+}
+
+int alloc_track_init(void)
+{
+	SDL_assert(track.enabled == SDL_FALSE);
+
+	SDL_GetMemoryFunctions(&track.real_malloc, &track.real_calloc,
+			       &track.real_realloc, &track.real_free);
+	track.main_thread = SDL_ThreadID();
+	track.main_tag = ALLOC_TAG_MAIN;
+
+	if(SDL_SetMemoryFunctions(track_malloc, track_calloc, track_realloc,
+				  track_free) != 0)
+		return -1;
+
+	track.enabled = SDL_TRUE;
+	return 0;
+}
+
+SDL_bool alloc_track_enabled(void)
+{
+	return track.enabled;
+}
+
+enum alloc_tag_e alloc_track_set_tag(enum alloc_tag_e tag)
+{
+	enum alloc_tag_e prev = track.main_tag;
+	track.main_tag = tag;
+	return prev;
+}
+
+void alloc_track_get(struct alloc_stats_s *stats)
+{
+	SDL_AtomicLock(&track.lk);
+	*stats = track.stats;
+	SDL_AtomicUnlock(&track.lk);
+}
+
+void alloc_track_report(void)
+{
+	struct alloc_stats_s s;
+
+	if(track.enabled == SDL_FALSE)
+		return;
+
+	alloc_track_get(&s);
+	SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+		    "Allocations: %" SDL_PRIu64 ", frees: %" SDL_PRIu64
+		    ", peak heap: %lu KiB, in use: %lu KiB",
+		    s.allocs, s.frees, (unsigned long)(s.peak_bytes / 1024),
+		    (unsigned long)(s.cur_bytes / 1024));
+
+	for(unsigned i = 0; i < ALLOC_TAG_MAX; i++)
+	{
+		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+			    "  %-8s %" SDL_PRIu64, alloc_tag_names[i],
+			    s.tag_allocs[i]);
+	}
+}
@@ -0,0 +1,320 @@
+/**
+ * Cache of compressed core states for seeking within a replay.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#include <SDL.h>
+#include <ckpt.h>
+#include <pool.h>
+#include <tdef.h>
+#include <tinf.h>
+#include <trace.h>
+
+struct ckpt_s {
+	Uint64 frame;
+	Uint32 comp_len;
+	Uint32 len;
+	Uint8 *data;
+};
+
+struct ckpt_ctx_s {
+	Uint32 interval;
+	size_t max_bytes;
+	size_t bytes;
+
+	/* Checkpoints in order of frame. Only modified by the thread that adds
+	 * checkpoints. */
+	struct ckpt_s *ckpts;
+	Uint32 count;
+	Uint32 alloc;
+
+	/* Copy of the state being compressed on a worker thread. The fields
+	 * below are owned by the worker whilst pending is set, and done is
+	 * posted once the worker has finished with them. */
+	SDL_bool pending;
+	SDL_sem *done;
+	Uint8 *raw;
+	size_t raw_alloc;
+	struct ckpt_s next;
+
+	/* Buffer that states are compressed into before being copied to a
+	 * checkpoint of the compressed size. */
+	Uint8 *comp;
+	size_t comp_len;
+	struct tdef_work_s *work;
+};
+
+ckpt_ctx *ckpt_init(Uint32 interval, size_t max_bytes)
+{
+	ckpt_ctx *ctx;
+
+	if(interval == 0)
+	{
+		SDL_SetError("Invalid checkpoint interval");
+		return NULL;
+	}
+
+	ctx = SDL_calloc(1, sizeof(*ctx));
+	if(ctx == NULL)
+		goto err;
+
+	ctx->work = SDL_malloc(sizeof(*ctx->work));
+	ctx->done = SDL_CreateSemaphore(0);
+	if(ctx->work == NULL || ctx->done == NULL)
+		goto err;
+
+	ctx->interval = interval;
+	ctx->max_bytes = max_bytes;
+	return ctx;
+
+err:
+	SDL_OutOfMemory();
+	ckpt_exit(ctx);
+	return NULL;
+}
+
+SDL_bool ckpt_due(const ckpt_ctx *ctx, Uint64 frame)
+{
+	if(frame % ctx->interval != 0)
+		return SDL_FALSE;
+
+	if(ctx->pending && frame <= ctx->next.frame)
+		return SDL_FALSE;
+
+	if(ctx->count != 0 && frame <= ctx->ckpts[ctx->count - 1].frame)
+		return SDL_FALSE;
+
+	return SDL_TRUE;
+}
+
+/**
+ * Drops every other checkpoint until the memory limit is met. The first
+ * checkpoint is always kept.
+ */
+static void ckpt_thin(ckpt_ctx *ctx)
+{
+	while(ctx->bytes > ctx->max_bytes && ctx->count > 1)
+	{
+		Uint32 kept = 0;
+
+		ctx->interval *= 2;
+		for(Uint32 i = 0; i < ctx->count; i++)
+		{
+			struct ckpt_s *c = &ctx->ckpts[i];
+
+			if(c->frame % ctx->interval != 0 && i != 0)
+			{
+				ctx->bytes -= c->comp_len;
+				SDL_free(c->data);
+				continue;
+			}
+
+			ctx->ckpts[kept++] = *c;
+		}
+
+		ctx->count = kept;
+		SDL_LogVerbose(SDL_LOG_CATEGORY_APPLICATION,
+			       "Checkpoint interval increased to %u frames",
+			       (unsigned)ctx->interval);
+	}
+}
+
+/**
+ * Compresses the pending state into a buffer of the compressed size. Executed
+ * on a worker thread. The compressed data is NULL on error.
+ */
+static void ckpt_compress_job(void *param)
+{
+	ckpt_ctx *ctx = param;
+	struct ckpt_s *c = &ctx->next;
+	size_t comp_len;
+
+	trace_begin("Compress checkpoint");
+	c->data = NULL;
+	comp_len = tdef_compress(ctx->work, ctx->comp, ctx->comp_len, ctx->raw,
+				 c->len);
+	if(comp_len != 0)
+		c->data = SDL_malloc(comp_len);
+
+	if(c->data != NULL)
+	{
+		SDL_memcpy(c->data, ctx->comp, comp_len);
+		c->comp_len = (Uint32)comp_len;
+	}
+
+	trace_end("Compress checkpoint");
+	SDL_SemPost(ctx->done);
+}
+
+/**
+ * Waits for the pending checkpoint to be compressed, and adds it to the list
+ * of checkpoints.
+ *
+ * \return		0 on success, else negative with error in
+ *			SDL_GetError().
+ */
+static int ckpt_sync(ckpt_ctx *ctx)
+{
+	struct ckpt_s *c;
+
+	if(ctx->pending == SDL_FALSE)
+		return 0;
+
+	SDL_SemWait(ctx->done);
+	ctx->pending = SDL_FALSE;
+
+	if(ctx->next.data == NULL)
+		return SDL_SetError("Unable to compress checkpoint");
+
+	if(ctx->count == ctx->alloc)
+	{
+		Uint32 n = ctx->alloc == 0 ? 64 : ctx->alloc * 2;
+
+		c = SDL_realloc(ctx->ckpts, n * sizeof(*c));
+		if(c == NULL)
+		{
+			SDL_free(ctx->next.data);
+			return SDL_OutOfMemory();
+		}
+
+		ctx->ckpts = c;
+		ctx->alloc = n;
+	}
+
+	ctx->ckpts[ctx->count++] = ctx->next;
+	ctx->bytes += ctx->next.comp_len;
+	ckpt_thin(ctx);
+	return 0;
+}
+
+int ckpt_add(ckpt_ctx *ctx, Uint64 frame, const void *state, size_t len)
+{
+	int ret = ckpt_sync(ctx);
+
+	if(len > ctx->raw_alloc)
+	{
+		Uint8 *raw = SDL_realloc(ctx->raw, len);
+		if(raw == NULL)
+			return SDL_OutOfMemory();
+
+		ctx->raw = raw;
+		ctx->raw_alloc = len;
+	}
+
+	if(TDEF_BOUND(len) > ctx->comp_len)
+	{
+		Uint8 *comp = SDL_realloc(ctx->comp, TDEF_BOUND(len));
+		if(comp == NULL)
+			return SDL_OutOfMemory();
+
+		ctx->comp = comp;
+		ctx->comp_len = TDEF_BOUND(len);
+	}
+
+	/* The state is copied so that the caller may continue whilst it is
+	 * compressed. */
+	SDL_memcpy(ctx->raw, state, len);
+	ctx->next.frame = frame;
+	ctx->next.len = (Uint32)len;
+	ctx->pending = SDL_TRUE;
+
+	if(pool_submit(ckpt_compress_job, ctx, POOL_PRIO_NORMAL) != 0)
+		ckpt_compress_job(ctx);
+
+	return ret;
+}
+
+/**
+ * Returns the number of checkpoints at or before a frame.
+ */
+static Uint32 ckpt_upper(const ckpt_ctx *ctx, Uint64 frame)
+{
+	Uint32 lo = 0, hi = ctx->count;
+
+	while(lo < hi)
+	{
+		Uint32 mid = lo + (hi - lo) / 2;
+
+		if(ctx->ckpts[mid].frame <= frame)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+int ckpt_find(ckpt_ctx *ctx, Uint64 frame, Uint64 *at)
+{
+	Uint32 n;
+
+	if(ckpt_sync(ctx) != 0)
+		return -1;
+
+	n = ckpt_upper(ctx, frame);
+	if(n == 0)
+		return -1;
+
+	*at = ctx->ckpts[n - 1].frame;
+	return 0;
+}
+
+int ckpt_load(ckpt_ctx *ctx, Uint64 frame, Uint64 *at, void *state,
+	      size_t *len)
+{
+	const struct ckpt_s *c;
+	unsigned long out_len;
+	Uint32 n;
+
+	if(ckpt_sync(ctx) != 0)
+		return -1;
+
+	n = ckpt_upper(ctx, frame);
+	if(n == 0)
+		return SDL_SetError("No checkpoint at or before frame %u",
+				    (unsigned)frame);
+
+	c = &ctx->ckpts[n - 1];
+	if(c->len > *len)
+		return SDL_SetError("Checkpoint is larger than the state buffer");
+
+	out_len = c->len;
+	if(tinf_uncompress(state, &out_len, c->data, c->comp_len) != TINF_OK ||
+	   out_len != c->len)
+		return SDL_SetError("Corrupt checkpoint at frame %u",
+				    (unsigned)c->frame);
+
+	*at = c->frame;
+	*len = c->len;
+	return 0;
+}
+
+void ckpt_exit(ckpt_ctx *ctx)
+{
+	if(ctx == NULL)
+		return;
+
+	/* The worker must finish with the buffers before they are freed. */
+	ckpt_sync(ctx);
+
+	for(Uint32 i = 0; i < ctx->count; i++)
+		SDL_free(ctx->ckpts[i].data);
+
+	if(ctx->done != NULL)
+		SDL_DestroySemaphore(ctx->done);
+
+	SDL_free(ctx->ckpts);
+	SDL_free(ctx->raw);
+	SDL_free(ctx->comp);
+	SDL_free(ctx->work);
+	SDL_free(ctx);
+}
@@ -19,9 +19,37 @@
 
 #include <font.h>
 
+/* Number of strings kept in the pre-rendered string cache, and the maximum
+ * length of a cached string. */
+#define FONT_CACHE_ENTRIES	16
+#define FONT_CACHE_STR_MAX	64
+
+/* Number of times a string is drawn per glyph before it is rendered to the
+ * texture of its cache entry. Text that changes every frame is therefore never
+ * rendered to a texture. */
+#define FONT_CACHE_PROMOTE	8
+
+/* Number of glyphs submitted in a single geometry call. */
+#define FONT_BATCH_GLYPHS	64
+
+struct font_cache_s {
+	/* Wide enough for the longest cached string, so that it is kept when
+	 * the entry is replaced. */
+	SDL_Texture *tex;
+	SDL_bool ready;
+	unsigned uses;
+	Uint32 last_used;
+	unsigned len;
+	char str[FONT_CACHE_STR_MAX];
+};
+
 struct font_ctx_s {
 	SDL_Texture *tex;
 	SDL_Renderer *rend;
+
+	font_batch_e batch;
+	Uint32 cache_tick;
+	struct font_cache_s cache[FONT_CACHE_ENTRIES];
 };
 
 #define FONT_BITMAP_WIDTH 144
@@ -175,7 +203,7 @@ font_ctx *FontStartup(SDL_Renderer *renderer)
 		{ 0xFF, 0xFF, 0xFF, 0xFF}  /* FG */
 	};
 	SDL_Surface *bmp_surf;
-	font_ctx *ctx = SDL_malloc(sizeof(font_ctx));
+	font_ctx *ctx = SDL_calloc(1, sizeof(font_ctx));
 	Uint8 *pixels = SDL_malloc(FONT_BITMAP_SIZE);
 
 	SDL_assert(renderer != NULL);
@@ -218,6 +246,11 @@ font_ctx *FontStartup(SDL_Renderer *renderer)
 	ctx->rend = renderer;
 	SDL_FreeSurface(bmp_surf);
 
+	/* Select the fastest method of drawing strings that is available. */
+	if(FontSetBatching(ctx, FONT_BATCH_GEOMETRY) != 0 &&
+	   FontSetBatching(ctx, FONT_BATCH_CACHE) != 0)
+		FontSetBatching(ctx, FONT_BATCH_NONE);
+
 out:
 	SDL_free(pixels);
 	return ctx;
@@ -234,11 +267,298 @@ void FontDrawSize(const unsigned text_len, unsigned *w, unsigned *h)
 	*h = FONT_CHAR_HEIGHT;
 }
 
+static Uint8 font_glyph(char c)
+{
+	if(c >= ' ' && c <= '~')
+		return c - ' ';
+
+	return '?' - ' ';
+}
+
+/**
+ * Draws each glyph with a separate call to SDL_RenderCopy().
+ */
+static int font_print_glyphs(font_ctx *const ctx, const char *text,
+			     const SDL_Rect *dst)
+{
+	SDL_Rect font_rect, screen_rect;
+
+	font_rect.w = FONT_CHAR_WIDTH;
+	font_rect.h = FONT_CHAR_HEIGHT;
+
+	screen_rect.w = FONT_CHAR_WIDTH * dst->w;
+	screen_rect.h = FONT_CHAR_HEIGHT * dst->h;
+	screen_rect.x = dst->x;
+	screen_rect.y = dst->y;
+
+	for(; *text != '\0'; text++)
+	{
+		Uint8 pos = font_glyph(*text);
+		int ret;
+
+		font_rect.x = (pos % FONT_COLUMNS) * FONT_CHAR_WIDTH;
+		font_rect.y = (pos / FONT_COLUMNS) * FONT_CHAR_HEIGHT;
+
+		ret = SDL_RenderCopy(ctx->rend, ctx->tex,
+				     &font_rect, &screen_rect);
+
+		if(ret != 0)
+			return ret;
+
+		screen_rect.x += screen_rect.w;
+	}
+
+	return 0;
+}
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+/**
+ * Draws the string as a list of textured quads, using a single call to
+ * SDL_RenderGeometry() for every FONT_BATCH_GLYPHS glyphs.
+ */
+static int font_print_geometry(font_ctx *const ctx, const char *text,
+			       const SDL_Rect *dst, SDL_Colour c)
+{
+	SDL_Vertex vert[FONT_BATCH_GLYPHS * 4];
+	int ind[FONT_BATCH_GLYPHS * 6];
+	const float gw = FONT_CHAR_WIDTH * dst->w;
+	const float gh = FONT_CHAR_HEIGHT * dst->h;
+	float x = dst->x;
+	const float y = dst->y;
+
+	while(*text != '\0')
+	{
+		int n = 0;
+
+		for(; n < FONT_BATCH_GLYPHS && *text != '\0'; n++, text++)
+		{
+			Uint8 pos = font_glyph(*text);
+			const float u0 = (float)((pos % FONT_COLUMNS) *
+				FONT_CHAR_WIDTH) / FONT_BITMAP_WIDTH;
+			const float v0 = (float)((pos / FONT_COLUMNS) *
+				FONT_CHAR_HEIGHT) / FONT_BITMAP_HEIGHT;
+			const float u1 = u0 +
+				(float)FONT_CHAR_WIDTH / FONT_BITMAP_WIDTH;
+			const float v1 = v0 +
+				(float)FONT_CHAR_HEIGHT / FONT_BITMAP_HEIGHT;
+			SDL_Vertex *v = &vert[n * 4];
+			int *i = &ind[n * 6];
+
+			v[0].position.x = x;
+			v[0].position.y = y;
+			v[0].tex_coord.x = u0;
+			v[0].tex_coord.y = v0;
+
+			v[1].position.x = x + gw;
+			v[1].position.y = y;
+			v[1].tex_coord.x = u1;
+			v[1].tex_coord.y = v0;
+
+			v[2].position.x = x + gw;
+			v[2].position.y = y + gh;
+			v[2].tex_coord.x = u1;
+			v[2].tex_coord.y = v1;
+
+			v[3].position.x = x;
+			v[3].position.y = y + gh;
+			v[3].tex_coord.x = u0;
+			v[3].tex_coord.y = v1;
+
+			v[0].color = v[1].color = v[2].color = v[3].color = c;
+
+			i[0] = n * 4 + 0;
+			i[1] = n * 4 + 1;
+			i[2] = n * 4 + 2;
+			i[3] = n * 4 + 0;
+			i[4] = n * 4 + 2;
+			i[5] = n * 4 + 3;
+
+			x += gw;
+		}
+
+		if(SDL_RenderGeometry(ctx->rend, ctx->tex, vert, n * 4,
+				      ind, n * 6) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/**
+ * Finds the cache entry for the given string. If the string is not cached, the
+ * least recently used entry is replaced, preferring entries that have not been
+ * rendered. The texture of the replaced entry is kept for reuse.
+ */
+static struct font_cache_s *font_cache_find(font_ctx *ctx, const char *text,
+					    unsigned len)
+{
+	struct font_cache_s *lru = NULL;
+
+	for(unsigned i = 0; i < FONT_CACHE_ENTRIES; i++)
+	{
+		struct font_cache_s *c = &ctx->cache[i];
+
+		if(c->len == len && SDL_memcmp(c->str, text, len) == 0)
+			return c;
+
+		if(lru == NULL || (lru->ready && !c->ready) ||
+		   (lru->ready == c->ready && c->last_used < lru->last_used))
+			lru = c;
+	}
+
+	SDL_memcpy(lru->str, text, len);
+	lru->len = len;
+	lru->ready = SDL_FALSE;
+	lru->uses = 0;
+	return lru;
+}
+
+/**
+ * Renders the string of a cache entry to its texture.
+ */
+static int font_cache_render(font_ctx *const ctx, struct font_cache_s *e,
+			     SDL_Colour c)
+{
+	SDL_Texture *prev_targ;
+	const SDL_Rect one = { 0, 0, 1, 1 };
+	char str[FONT_CACHE_STR_MAX];
+	int ret;
+
+	if(e->tex == NULL)
+	{
+		e->tex = SDL_CreateTexture(ctx->rend, SDL_PIXELFORMAT_ARGB8888,
+					   SDL_TEXTUREACCESS_TARGET,
+					   FONT_CACHE_STR_MAX * FONT_CHAR_WIDTH,
+					   FONT_CHAR_HEIGHT);
+		if(e->tex == NULL)
+			return -1;
+
+		SDL_SetTextureBlendMode(e->tex, SDL_BLENDMODE_BLEND);
+	}
+
+	SDL_memcpy(str, e->str, e->len);
+	str[e->len] = '\0';
+
+	/* The string is rendered in white, so that the colour may be changed
+	 * with the colour modulation of the cached texture. */
+	prev_targ = SDL_GetRenderTarget(ctx->rend);
+	SDL_SetTextureColorMod(ctx->tex, 0xFF, 0xFF, 0xFF);
+	SDL_SetTextureAlphaMod(ctx->tex, 0xFF);
+	SDL_SetRenderTarget(ctx->rend, e->tex);
+	SDL_SetRenderDrawColor(ctx->rend, 0xFF, 0xFF, 0xFF, 0x00);
+	SDL_RenderClear(ctx->rend);
+	ret = font_print_glyphs(ctx, str, &one);
+	SDL_SetRenderTarget(ctx->rend, prev_targ);
+	SDL_SetRenderDrawColor(ctx->rend, c.r, c.g, c.b, c.a);
+	SDL_SetTextureColorMod(ctx->tex, c.r, c.g, c.b);
+	SDL_SetTextureAlphaMod(ctx->tex, c.a);
+
+	e->ready = ret == 0;
+	return ret;
+}
+
+/**
+ * Draws the string from a cached texture once it has been drawn often enough,
+ * and per glyph otherwise.
+ */
+static int font_print_cached(font_ctx *const ctx, const char *text,
+			     const SDL_Rect *dst, SDL_Colour c)
+{
+	struct font_cache_s *e;
+	size_t len = SDL_strlen(text);
+	SDL_Rect src, screen_rect;
+
+	/* Long strings are unlikely to be repeated. */
+	if(len >= FONT_CACHE_STR_MAX)
+		return font_print_glyphs(ctx, text, dst);
+
+	e = font_cache_find(ctx, text, len);
+	e->last_used = ++ctx->cache_tick;
+
+	if(e->ready == SDL_FALSE)
+	{
+		if(++e->uses < FONT_CACHE_PROMOTE)
+			return font_print_glyphs(ctx, text, dst);
+
+		/* Try again later if the string could not be rendered. */
+		if(font_cache_render(ctx, e, c) != 0)
+		{
+			e->uses = 0;
+			return font_print_glyphs(ctx, text, dst);
+		}
+	}
+
+	SDL_SetTextureColorMod(e->tex, c.r, c.g, c.b);
+	SDL_SetTextureAlphaMod(e->tex, c.a);
+
+	src.x = 0;
+	src.y = 0;
+	src.w = len * FONT_CHAR_WIDTH;
+	src.h = FONT_CHAR_HEIGHT;
+	screen_rect.x = dst->x;
+	screen_rect.y = dst->y;
+	screen_rect.w = len * FONT_CHAR_WIDTH * dst->w;
+	screen_rect.h = FONT_CHAR_HEIGHT * dst->h;
+	return SDL_RenderCopy(ctx->rend, e->tex, &src, &screen_rect);
+}
+
+static void font_cache_clear(font_ctx *ctx)
+{
+	for(unsigned i = 0; i < FONT_CACHE_ENTRIES; i++)
+	{
+		if(ctx->cache[i].tex != NULL)
+			SDL_DestroyTexture(ctx->cache[i].tex);
+
+		SDL_zero(ctx->cache[i]);
+	}
+}
+
+int FontSetBatching(font_ctx *ctx, font_batch_e batch)
+{
+	switch(batch)
+	{
+	case FONT_BATCH_NONE:
+		break;
+
+	case FONT_BATCH_CACHE:
+		if(SDL_RenderTargetSupported(ctx->rend) == SDL_FALSE)
+			return SDL_SetError("Render targets are not supported");
+
+		break;
+
+	case FONT_BATCH_GEOMETRY:
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	{
+		/* An empty draw call checks that geometry is supported by
+		 * the renderer. */
+		const SDL_Vertex v = { 0 };
+		if(SDL_RenderGeometry(ctx->rend, ctx->tex, &v, 0,
+				      NULL, 0) != 0)
+			return -1;
+
+		break;
+	}
+#else
+		return SDL_SetError("Geometry rendering requires SDL 2.0.18");
+#endif
+
+	default:
+		return SDL_SetError("Invalid batching mode");
+	}
+
+	if(batch != FONT_BATCH_CACHE)
+		font_cache_clear(ctx);
+
+	ctx->batch = batch;
+	return 0;
+}
+
 int FontPrintToRenderer(font_ctx *const ctx, const char *text,
 			const SDL_Rect *dstscale)
 {
-	SDL_Rect font_rect, screen_rect;
 	SDL_Rect dst;
+	SDL_Colour c;
 
 	SDL_assert(ctx != NULL);
 	SDL_assert(text != NULL);
@@ -254,44 +574,25 @@ int FontPrintToRenderer(font_ctx *const ctx, const char *text,
 	else
 		dst = *dstscale;
 
-	font_rect.w = FONT_CHAR_WIDTH;
-	font_rect.h = FONT_CHAR_HEIGHT;
-
-	screen_rect.w = FONT_CHAR_WIDTH * dst.w;
-	screen_rect.h = FONT_CHAR_HEIGHT * dst.h;
-	screen_rect.x = dst.x;
-	screen_rect.y = dst.y;
+	SDL_GetRenderDrawColor(ctx->rend, &c.r, &c.g, &c.b, &c.a);
 
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	if(ctx->batch == FONT_BATCH_GEOMETRY)
 	{
-		Uint8 r, g, b, a;
-		SDL_GetRenderDrawColor(ctx->rend, &r, &g, &b, &a);
-		SDL_SetTextureColorMod(ctx->tex, r, g, b);
-		SDL_SetTextureAlphaMod(ctx->tex, a);
+		/* The colour is set per vertex instead. */
+		SDL_SetTextureColorMod(ctx->tex, 0xFF, 0xFF, 0xFF);
+		SDL_SetTextureAlphaMod(ctx->tex, 0xFF);
+		return font_print_geometry(ctx, text, &dst, c);
 	}
+#endif
 
-	do
-	{
-		Uint8 pos;
-		int ret;
-
-		if(*text >= ' ' && *text <= '~')
-			pos = *text - ' ';
-		else
-			pos = '?' - ' ';
-
-		font_rect.x = (pos % FONT_COLUMNS) * FONT_CHAR_WIDTH;
-		font_rect.y = (pos / FONT_COLUMNS) * FONT_CHAR_HEIGHT;
-
-		ret = SDL_RenderCopy(ctx->rend, ctx->tex,
-				     &font_rect, &screen_rect);
+	SDL_SetTextureColorMod(ctx->tex, c.r, c.g, c.b);
+	SDL_SetTextureAlphaMod(ctx->tex, c.a);
 
-		if(ret != 0)
-			return ret;
+	if(ctx->batch == FONT_BATCH_CACHE)
+		return font_print_cached(ctx, text, &dst, c);
 
-		screen_rect.x += screen_rect.w;
-	} while(*(text++));
-
-	return 0;
+	return font_print_glyphs(ctx, text, &dst);
 }
 
 void FontExit(font_ctx *ctx)
@@ -299,6 +600,7 @@ void FontExit(font_ctx *ctx)
 	if(ctx == NULL)
 		return;
 
+	font_cache_clear(ctx);
 	SDL_DestroyTexture(ctx->tex);
 	SDL_free(ctx);
 }
@@ -0,0 +1,214 @@
+/**
+ * Decides which frames to skip when the host is unable to keep up.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#include <SDL.h>
+#include <fskip.h>
+
+#define FSKIP_ONE		0x10000UL
+
+/* The cost of a frame is predicted from this percentile of recent frames, so
+ * that occasional slow frames are accounted for. */
+#define FSKIP_PERCENTILE	90
+
+/* The fraction of frames skipped is only lowered once a fraction lower by
+ * this much has been sufficient for FSKIP_HOLD_FRAMES consecutive frames. This
+ * stops the controller from alternating between two ratios. */
+#define FSKIP_HYSTERESIS	(FSKIP_ONE / 16)
+#define FSKIP_HOLD_FRAMES	120
+
+static void fskip_window_add(struct fskip_window_s *w, Uint32 v)
+{
+	unsigned i;
+
+	if(w->n == FSKIP_WINDOW)
+	{
+		Uint32 old = w->ring[w->pos];
+
+		for(i = 0; w->sorted[i] != old; i++)
+			;
+
+		SDL_memmove(&w->sorted[i], &w->sorted[i + 1],
+			    (w->n - i - 1) * sizeof(*w->sorted));
+		w->n--;
+	}
+
+	w->ring[w->pos] = v;
+	w->pos = (w->pos + 1) % FSKIP_WINDOW;
+
+	for(i = w->n; i > 0 && w->sorted[i - 1] > v; i--)
+		w->sorted[i] = w->sorted[i - 1];
+
+	w->sorted[i] = v;
+	w->n++;
+}
+
+static Uint32 fskip_window_pct(const struct fskip_window_s *w, unsigned pct)
+{
+	if(w->n == 0)
+		return 0;
+
+	return w->sorted[((w->n - 1) * pct) / 100];
+}
+
+/**
+ * Calculates the fraction of frames that must be skipped to process each frame
+ * within the target frame time on average.
+ */
+static Uint32 fskip_required_ratio(const struct fskip_ctx_s *fs)
+{
+	/* A small margin is left for the time spent outside of the measured
+	 * work. */
+	Uint32 budget = fs->target_us - fs->target_us / 16;
+	Uint32 max = (Uint32)((fs->limit * FSKIP_ONE) / (fs->limit + 1U));
+	Uint32 drawn, skipped;
+	Uint64 ratio;
+
+	drawn = fskip_window_pct(&fs->drawn, FSKIP_PERCENTILE);
+	if(drawn <= budget)
+		return 0;
+
+	/* Until a frame has been skipped, skipping is assumed to save a
+	 * quarter of the cost of a frame. */
+	if(fs->skipped.n != 0)
+		skipped = fskip_window_pct(&fs->skipped, FSKIP_PERCENTILE);
+	else
+		skipped = drawn - drawn / 4;
+
+	if(skipped >= budget || skipped >= drawn)
+		return max;
+
+	/* Skipping a fraction f of frames costs on average
+	 * (1 - f) * drawn + f * skipped per frame, which must be within the
+	 * budget. */
+	ratio = ((Uint64)(drawn - budget) * FSKIP_ONE) / (drawn - skipped);
+	return (Uint32)SDL_min(ratio, max);
+}
+
+void fskip_init(struct fskip_ctx_s *fs, double fps, Uint8 limit)
+{
+	SDL_zerop(fs);
+	fs->target_us = (Uint32)(1000000.0 / fps);
+	fs->limit = limit;
+}
+
+SDL_bool fskip_next(struct fskip_ctx_s *fs, SDL_bool behind)
+{
+	fs->skipping = SDL_FALSE;
+
+	if(behind == SDL_FALSE || fs->ratio == 0)
+	{
+		fs->credit = 0;
+		fs->run = 0;
+		return SDL_FALSE;
+	}
+
+	fs->credit += fs->ratio;
+	if(fs->credit >= FSKIP_ONE && fs->run < fs->limit)
+	{
+		fs->credit -= FSKIP_ONE;
+		fs->run++;
+		fs->skipping = SDL_TRUE;
+	}
+	else
+	{
+		/* Credit is not carried over a limit, so that the next run of
+		 * skipped frames is not longer than required. */
+		fs->credit = SDL_min(fs->credit, FSKIP_ONE);
+		fs->run = 0;
+	}
+
+	return fs->skipping;
+}
+
+void fskip_update(struct fskip_ctx_s *fs, Uint32 work_us)
+{
+	Uint32 required;
+
+	fskip_window_add(fs->skipping ? &fs->skipped : &fs->drawn, work_us);
+	required = fskip_required_ratio(fs);
+
+	if(required >= fs->ratio)
+	{
+		/* Falling behind is corrected immediately. */
+		fs->ratio = required;
+		fs->calm = 0;
+	}
+	else if(required + FSKIP_HYSTERESIS <= fs->ratio)
+	{
+		if(++fs->calm >= FSKIP_HOLD_FRAMES)
+		{
+			fs->ratio = required;
+			fs->calm = 0;
+		}
+	}
+	else
+	{
+		fs->calm = 0;
+	}
+}
+
+int fskip_profile_load(struct fskip_ctx_s *fs, const char *filename)
+{
+	char *txt, *end;
+	unsigned long drawn, skipped;
+
+	txt = SDL_LoadFile(filename, NULL);
+	if(txt == NULL)
+		return -1;
+
+	drawn = SDL_strtoul(txt, &end, 10);
+	skipped = SDL_strtoul(end, NULL, 10);
+	SDL_free(txt);
+
+	if(drawn == 0 || drawn > SDL_MAX_UINT32 || skipped > SDL_MAX_UINT32)
+		return SDL_SetError("Invalid frameskip profile");
+
+	/* The learned costs are replaced by measured costs as frames are
+	 * processed. */
+	for(unsigned i = 0; i < FSKIP_WINDOW; i++)
+	{
+		fskip_window_add(&fs->drawn, (Uint32)drawn);
+		if(skipped != 0)
+			fskip_window_add(&fs->skipped, (Uint32)skipped);
+	}
+
+	fs->ratio = fskip_required_ratio(fs);
+	return 0;
+}
+
+int fskip_profile_save(const struct fskip_ctx_s *fs, const char *filename)
+{
+	char txt[32];
+	SDL_RWops *f;
+	int len;
+
+	if(fs->drawn.n < FSKIP_WINDOW)
+		return SDL_SetError("Too few frames were processed");
+
+	len = SDL_snprintf(txt, sizeof(txt), "%u %u\n",
+		(unsigned)fskip_window_pct(&fs->drawn, FSKIP_PERCENTILE),
+		(unsigned)fskip_window_pct(&fs->skipped, FSKIP_PERCENTILE));
+
+	f = SDL_RWFromFile(filename, "wb");
+	if(f == NULL)
+		return -1;
+
+	if(SDL_RWwrite(f, txt, 1, (size_t)len) != (size_t)len)
+	{
+		SDL_RWclose(f);
+		return -1;
+	}
+
+	return SDL_RWclose(f);
+}
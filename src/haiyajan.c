@@ -24,15 +24,21 @@
 #include <optparse.h>
 
 #include <haiyajan.h>
+#include <alloc.h>
 #include <font.h>
 #include <input.h>
+#include <latency.h>
 #include <load.h>
 #include <play.h>
+#include <pmu.h>
+#include <pool.h>
 #include <rec.h>
 #include <sig.h>
 #include <timer.h>
+#include <trace.h>
 #include <ui.h>
 #include <util.h>
+#include <verify.h>
 
 #define PROG_NAME       "Haiyajan"
 
@@ -42,6 +48,16 @@
 
 #define NOTIF_TIMEOUT_MS	1000 * 4
 
+/* Checkpoints of a replay are added every few seconds, so that seeking never
+ * runs more than this many seconds of the replay. */
+#define CKPT_INTERVAL_SEC	5
+
+/* Once exceeded, every other checkpoint is dropped. */
+#define CKPT_MAX_MIB		256
+
+/* Distance that the seek hotkeys move within a replay. */
+#define SEEK_STEP_SEC		10
+
 static void prerun_checks(void)
 {
 	SDL_version compiled;
@@ -127,11 +143,53 @@ static void print_help(void)
 			"      --version    Print version information.\n"
 			"  -L, --libretro   Path to libretro core.\n"
 			"  -b, --benchmark  Benchmark and print average frames per second.\n"
+			"      --counters   Sample processor counters during the\n"
+			"                   benchmark (Linux only)\n"
+			"      --frame-delay\n"
+			"                   Delay each frame after VSYNC to reduce\n"
+			"                   input latency\n"
+			"      --alloc-stats\n"
+			"                   Count memory allocations in each frame\n"
+			"      --latency-test[=TRIALS]\n"
+			"                   Measure the time from a key press to\n"
+			"                   the change of the screen and exit\n"
 			"  -v, --verbose    Print verbose log messages.\n"
 			"  -V, --video      Video driver to use\n"
 			"  -R, --render     Render driver to use\n"
 			"      --tai-record Record a new tool assist input file\n"
-			"      --tai-play   Play a tool assist input file\n");
+			"      --tai-play   Play a tool assist input file\n"
+			"      --tai-seek=FRAME\n"
+			"                   Start playing the tool assist input\n"
+			"                   file at the given frame\n"
+			"      --verify=GOLDEN\n"
+			"                   Play the tool assist input file as fast\n"
+			"                   as possible and compare the hashes of\n"
+			"                   each frame against the GOLDEN trace\n"
+			"      --verify-trace=FILE\n"
+			"                   Write the hashes of each frame of the\n"
+			"                   tool assist input file to FILE\n"
+			"      --verify-state\n"
+			"                   Also hash the state of the core after\n"
+			"                   each frame when verifying\n"
+			"      --rec-raw[=PREFIX]\n"
+			"                   Record uncompressed video and audio to\n"
+			"                   PREFIX.y4m and PREFIX.wav\n"
+			"      --trace=FILE Write a timeline of each frame to FILE\n"
+			"                   in the Chrome trace event format\n"
+			"      --stutter-ms=MS\n"
+			"                   Save the timings of recent frames when a\n"
+			"                   frame is late by more than MS\n"
+#if ENABLE_VIDEO_RECORDING == 1
+			"      --rec-segment=SEC\n"
+			"                   Encode recordings in parallel segments\n"
+			"                   of the given number of seconds\n"
+			"      --replay=MIB Keep a replay of recent game play in the\n"
+			"                   given amount of memory\n"
+			"      --tai-render=FILE\n"
+			"                   Render the tool assist input file being\n"
+			"                   played to a video file and exit\n"
+#endif
+		);
 
 	for(i = 0; i < num_drivers; i++)
 	{
@@ -190,6 +248,22 @@ static void apply_settings(char **argv, struct haiyajan_ctx_s *h)
 			{"help",      'h', OPTPARSE_NONE},
 			{"tai-play",   2,  OPTPARSE_REQUIRED},
 			{"tai-record", 3,  OPTPARSE_REQUIRED},
+			{"rec-raw",    7,  OPTPARSE_OPTIONAL},
+			{"trace",      8,  OPTPARSE_REQUIRED},
+			{"stutter-ms", 9,  OPTPARSE_REQUIRED},
+			{"counters",   10, OPTPARSE_NONE},
+			{"alloc-stats", 11, OPTPARSE_NONE},
+			{"frame-delay", 12, OPTPARSE_NONE},
+			{"latency-test", 13, OPTPARSE_OPTIONAL},
+			{"verify",     14, OPTPARSE_REQUIRED},
+			{"verify-trace", 15, OPTPARSE_REQUIRED},
+			{"verify-state", 16, OPTPARSE_NONE},
+			{"tai-seek",   17, OPTPARSE_REQUIRED},
+#if ENABLE_VIDEO_RECORDING == 1
+			{"rec-segment", 4, OPTPARSE_REQUIRED},
+			{"replay",     5,  OPTPARSE_REQUIRED},
+			{"tai-render", 6,  OPTPARSE_REQUIRED},
+#endif
 			{0}
 		};
 	int option;
@@ -208,7 +282,7 @@ static void apply_settings(char **argv, struct haiyajan_ctx_s *h)
 		case 3:
 		{
 			SDL_RWops *tai_in;
-			const char *const mode[] = { "r", "w" };
+			const char *const mode[] = { "rb", "wb" };
 			int lut = option - 2;
 
 			tai_in = SDL_RWFromFile(options.optarg, mode[lut]);
@@ -232,6 +306,141 @@ static void apply_settings(char **argv, struct haiyajan_ctx_s *h)
 			break;
 		}
 
+		case 7:
+			cfg->rec_raw = 1;
+			SDL_free(cfg->rec_raw_prefix);
+			cfg->rec_raw_prefix = NULL;
+			if(options.optarg != NULL)
+				cfg->rec_raw_prefix = SDL_strdup(options.optarg);
+			break;
+
+		case 8:
+			if(trace_init(options.optarg) != 0)
+			{
+				SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
+					"Unable to start tracing: %s",
+					SDL_GetError());
+				goto err;
+			}
+			break;
+
+		case 9:
+		{
+			int ms = SDL_atoi(options.optarg);
+
+			if(ms <= 0 || ms > SDL_MAX_UINT16)
+			{
+				SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
+					"Invalid stutter threshold: %s",
+					options.optarg);
+				goto err;
+			}
+
+			cfg->stutter_ms = (Uint16)ms;
+			break;
+		}
+
+		case 10:
+			cfg->counters = 1;
+			break;
+
+		case 11:
+			/* Enabled in main() before SDL is initialised. */
+			break;
+
+		case 12:
+			cfg->frame_delay = 1;
+			break;
+
+		case 13:
+		{
+			int trials = 200;
+
+			if(options.optarg != NULL)
+				trials = SDL_atoi(options.optarg);
+
+			if(trials <= 0 || trials > SDL_MAX_UINT16)
+			{
+				SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
+					"Invalid number of latency trials: %s",
+					options.optarg);
+				goto err;
+			}
+
+			cfg->latency_trials = (Uint16)trials;
+			break;
+		}
+
+		case 14:
+			SDL_free(cfg->verify_golden);
+			cfg->verify_golden = SDL_strdup(options.optarg);
+			break;
+
+		case 15:
+			SDL_free(cfg->verify_trace);
+			cfg->verify_trace = SDL_strdup(options.optarg);
+			break;
+
+		case 16:
+			cfg->verify_state = 1;
+			break;
+
+		case 17:
+		{
+			char *end;
+
+			cfg->seek_frame = SDL_strtoull(options.optarg, &end, 10);
+			if(*end != '\0')
+			{
+				SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
+					"Invalid frame to seek to: %s",
+					options.optarg);
+				goto err;
+			}
+
+			cfg->seek = 1;
+			break;
+		}
+
+#if ENABLE_VIDEO_RECORDING == 1
+		case 4:
+		{
+			int sec = SDL_atoi(options.optarg);
+
+			if(sec <= 0 || sec > SDL_MAX_UINT8)
+			{
+				SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
+					"Invalid recording segment length: %s",
+					options.optarg);
+				goto err;
+			}
+
+			cfg->rec_segment_sec = (Uint8)sec;
+			break;
+		}
+
+		case 5:
+		{
+			int mib = SDL_atoi(options.optarg);
+
+			if(mib <= 0 || mib > SDL_MAX_UINT16)
+			{
+				SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
+					"Invalid replay memory size: %s",
+					options.optarg);
+				goto err;
+			}
+
+			cfg->replay_mib = (Uint16)mib;
+			break;
+		}
+
+		case 6:
+			SDL_free(cfg->render_filename);
+			cfg->render_filename = SDL_strdup(options.optarg);
+			break;
+#endif
+
 		case 'L':
 			cfg->core_filename = SDL_strdup(options.optarg);
 			break;
@@ -318,6 +527,34 @@ static void apply_settings(char **argv, struct haiyajan_ctx_s *h)
 	if(rem_arg != NULL)
 		cfg->content_filename = SDL_strdup(rem_arg);
 
+	if(cfg->render_filename != NULL && h->tai == NULL)
+	{
+		SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
+				"A tool assist input file to play must be "
+				"given to render a video");
+		goto err;
+	}
+
+	if((cfg->verify_golden != NULL || cfg->verify_trace != NULL) &&
+	   h->tai == NULL)
+	{
+		SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
+				"A tool assist input file to play must be "
+				"given to verify a replay");
+		goto err;
+	}
+
+	if(cfg->seek && h->tai == NULL)
+	{
+		SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
+				"A tool assist input file to play must be "
+				"given to seek within it");
+		goto err;
+	}
+
+	cfg->offline = cfg->render_filename != NULL ||
+		cfg->verify_golden != NULL || cfg->verify_trace != NULL;
+
 	/* Initialise default video driver if not done so already. */
 	if(video_init == 0 && SDL_VideoInit(NULL) != 0)
 	{
@@ -343,19 +580,12 @@ struct rec_txt_priv {
 char *get_rec_txt(void *priv)
 {
 	struct rec_txt_priv *rtxt = priv;
-	struct {
-		Sint64 (*get_size)(rec_ctx *);
-	} sz_map[2] = {
-		{rec_video_size},
-		{rec_audio_size}
-	};
 	/* Technically MiB and GiB. */
 	const char prefix_str[5][3] = {
 		" B", "KB", "MB", "GB", "TB"
 	};
-	Uint64 sz = 0;
+	Sint64 sz;
 	Uint8 prefix = 0;
-	unsigned i;
 
 	/* If recording has finished, free memory and delete overlay. */
 	if(rtxt->vid == NULL)
@@ -364,15 +594,11 @@ char *get_rec_txt(void *priv)
 		return NULL;
 	}
 
-	for(i = 0; i < (Uint8)SDL_arraysize(sz_map); i++)
+	sz = rec_size(rtxt->vid);
+	if(sz < 0)
 	{
-		Sint64 szret = sz_map[i].get_size(rtxt->vid);
-		if(szret < 0)
-		{
-			SDL_free(priv);
-			return NULL;
-		}
-		sz += szret;
+		SDL_free(priv);
+		return NULL;
 	}
 
 	while(sz > 1 * 1024)
@@ -381,26 +607,26 @@ char *get_rec_txt(void *priv)
 		prefix++;
 	}
 
-	SDL_snprintf(rtxt->str, sizeof(rtxt->str), "REC %2" SDL_PRIu64 " %.2s",
+	SDL_snprintf(rtxt->str, sizeof(rtxt->str), "REC %2" SDL_PRIs64 " %.2s",
 			sz, prefix_str[prefix]);
 
 	return rtxt->str;
 }
 #endif
 
-static SDL_atomic_t screenshot_timeout;
-static void take_screenshot(SDL_Renderer *rend, struct core_ctx_s *const ctx)
+static void take_screenshot(SDL_Renderer *rend, struct core_ctx_s *const ctx,
+			    struct timer_wheel_s *tw)
 {
+	static struct timer_entry_s screenshot_timeout;
 	SDL_Surface *surf;
 
 	/* Screenshots limited to 1 every second. Should not be used for
 	 * recording game play as a video, as this function is too slow for
 	 * that. */
-	if(SDL_AtomicGet(&screenshot_timeout) != 0)
+	if(timer_entry_pending(&screenshot_timeout))
 		return;
 
-	SDL_AtomicSet(&screenshot_timeout, 1);
-	set_atomic_timeout(1024, &screenshot_timeout, 0, "Enable Screenshot");
+	timer_wheel_add(tw, &screenshot_timeout, 1024, NULL, NULL);
 
 	surf = util_tex_to_surf(rend, ctx->sdl.core_tex,
 				&ctx->sdl.game_frame_res, ctx->env.flip);
@@ -418,16 +644,146 @@ err:
 	goto out;
 }
 
+static void handle_raw_toggle(struct haiyajan_ctx_s *ctx)
+{
+	SDL_Colour c = { 0x00, 0xFF, 0x00, SDL_ALPHA_OPAQUE };
+	char genprefix[64];
+	const char *prefix = ctx->stngs.rec_raw_prefix;
+	char *msg;
+
+	if(ctx->core.raw != NULL)
+	{
+		rec_raw_end(&ctx->core.raw);
+		msg = "Recording Saved";
+		goto out;
+	}
+
+	if(!ctx->core.env.status.bits.valid_frame)
+		return;
+
+	if(prefix == NULL)
+	{
+		/* Remove the extension from the generated file name. */
+		gen_filename(genprefix, ctx->core.core_short_name, "raw");
+		*SDL_strrchr(genprefix, '.') = '\0';
+		prefix = genprefix;
+	}
+
+	ctx->core.raw = rec_raw_init(prefix,
+			ctx->core.sdl.game_frame_res.w,
+			ctx->core.sdl.game_frame_res.h,
+			ctx->core.av_info.timing.fps,
+			SDL_ceil(ctx->core.av_info.timing.sample_rate));
+	if(ctx->core.raw == NULL)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO,
+			    "Unable to start raw capture: %s", SDL_GetError());
+		c.r = 0xFF;
+		c.g = 0x00;
+		msg = "Unable to start recording";
+		goto out;
+	}
+
+	SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Raw capture started to %s",
+		    prefix);
+	msg = "REC RAW";
+
+out:
+	ui_add_overlay(&ctx->ui_overlay, &ctx->timers, c, ui_overlay_bot_right,
+			msg, NOTIF_TIMEOUT_MS, NULL, NULL);
+}
+
 #if ENABLE_VIDEO_RECORDING == 1
-void cap_frame(rec_ctx *vid, SDL_Renderer *rend, SDL_Texture *tex,
-	       const SDL_Rect *src, SDL_RendererFlip flip)
+void cap_frame(rec_ctx *vid, rec_ctx *replay, SDL_Renderer *rend,
+	       SDL_Texture *tex, const SDL_Rect *src, SDL_RendererFlip flip,
+	       Uint32 frame)
 {
 	SDL_Surface *surf = util_tex_to_surf(rend, tex, src, flip);
 
 	if(surf == NULL)
 		return;
 
-	rec_enc_video(vid, surf);
+	/* Each encoder takes ownership of the surface given to it. */
+	if(replay != NULL)
+	{
+		rec_enc_video(replay,
+			      vid != NULL ? util_surf_dup(surf) : surf,
+			      frame);
+	}
+
+	if(vid != NULL)
+		rec_enc_video(vid, surf, frame);
+}
+
+/**
+ * Starts the instant replay once the first frame is available.
+ */
+static void start_replay(struct haiyajan_ctx_s *ctx)
+{
+	ctx->core.replay = rec_init(NULL,
+			ctx->core.sdl.game_frame_res.w,
+			ctx->core.sdl.game_frame_res.h,
+			ctx->core.av_info.timing.fps,
+			SDL_ceil(ctx->core.av_info.timing.sample_rate),
+			ctx->stngs.rec_segment_sec,
+			(size_t)ctx->stngs.replay_mib * 1024 * 1024, SDL_TRUE);
+
+	if(ctx->core.replay == NULL)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO,
+			    "Unable to start instant replay: %s",
+			    SDL_GetError());
+		/* Do not attempt to start the replay again. */
+		ctx->stngs.replay_mib = 0;
+	}
+}
+
+static void handle_replay_save(struct haiyajan_ctx_s *ctx)
+{
+	SDL_Colour c = { 0x00, 0xFF, 0x00, SDL_ALPHA_OPAQUE };
+	char *msg = "Replay Saved";
+	char replayfile[64];
+
+	if(ctx->core.replay == NULL)
+		return;
+
+	gen_filename(replayfile, ctx->core.core_short_name, "mkv");
+	if(rec_replay_save(ctx->core.replay, replayfile) != 0)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO,
+			    "Unable to save replay: %s", SDL_GetError());
+		c.r = 0xFF;
+		c.g = 0x00;
+		msg = "Unable to save replay";
+	}
+
+	ui_add_overlay(&ctx->ui_overlay, &ctx->timers, c, ui_overlay_bot_right,
+			msg, NOTIF_TIMEOUT_MS, NULL, NULL);
+}
+
+/**
+ * Starts recording the rendered video once the first frame is available.
+ * Every frame is encoded, no matter how long the encoder takes.
+ */
+static int start_render(struct haiyajan_ctx_s *ctx)
+{
+	ctx->core.vid = rec_init(ctx->stngs.render_filename,
+			ctx->core.sdl.game_frame_res.w,
+			ctx->core.sdl.game_frame_res.h,
+			ctx->core.av_info.timing.fps,
+			SDL_ceil(ctx->core.av_info.timing.sample_rate),
+			ctx->stngs.rec_segment_sec, 0, SDL_FALSE);
+	if(ctx->core.vid == NULL)
+	{
+		SDL_LogCritical(SDL_LOG_CATEGORY_VIDEO,
+				"Unable to start rendering to %s: %s",
+				ctx->stngs.render_filename, SDL_GetError());
+		return -1;
+	}
+
+	SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Rendering to %s",
+		    ctx->stngs.render_filename);
+	return 0;
 }
 
 static void handle_rec_toggle(struct haiyajan_ctx_s *ctx)
@@ -439,7 +795,7 @@ static void handle_rec_toggle(struct haiyajan_ctx_s *ctx)
 	{
 		char vidfile[64];
 		struct rec_txt_priv *rtxt;
-		gen_filename(vidfile, ctx->core.core_short_name, "h264");
+		gen_filename(vidfile, ctx->core.core_short_name, "mkv");
 
 		/* FIXME: add double to Sint32 sample
 		 * compensation should the sample rate
@@ -448,7 +804,8 @@ static void handle_rec_toggle(struct haiyajan_ctx_s *ctx)
 				ctx->core.sdl.game_frame_res.w,
 				ctx->core.sdl.game_frame_res.h,
 				ctx->core.av_info.timing.fps,
-				SDL_ceil(ctx->core.av_info.timing.sample_rate));
+				SDL_ceil(ctx->core.av_info.timing.sample_rate),
+				ctx->stngs.rec_segment_sec, 0, SDL_TRUE);
 		if(ctx->core.vid == NULL)
 		{
 			SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO,
@@ -457,10 +814,10 @@ static void handle_rec_toggle(struct haiyajan_ctx_s *ctx)
 			c.r = 0xFF;
 			c.g = 0x00;
 			c.b = 0x00;
-			ui_add_overlay(&ctx->ui_overlay, c,
+			ui_add_overlay(&ctx->ui_overlay, &ctx->timers, c,
 					ui_overlay_bot_right,
 					"Unable to start recording: libx264 failure",
-					NOTIF_TIMEOUT_MS, NULL, NULL, 0);
+					NOTIF_TIMEOUT_MS, NULL, NULL);
 			return;
 		}
 
@@ -470,15 +827,16 @@ static void handle_rec_toggle(struct haiyajan_ctx_s *ctx)
 			goto out;
 
 		rtxt->vid = ctx->core.vid;
-		ui_add_overlay(&ctx->ui_overlay, c, ui_overlay_bot_right, NULL,
-				0, get_rec_txt, rtxt, 0);
+		ui_add_overlay(&ctx->ui_overlay, &ctx->timers, c,
+				ui_overlay_bot_right, NULL, 0, get_rec_txt,
+				rtxt);
 	}
 	else if(ctx->core.vid != NULL)
 	{
 		rec_end(&ctx->core.vid);
-		ui_add_overlay(&ctx->ui_overlay, c, ui_overlay_bot_right,
+		ui_add_overlay(&ctx->ui_overlay, &ctx->timers, c, ui_overlay_bot_right,
 				"Recording Saved",
-				NOTIF_TIMEOUT_MS, NULL, NULL, 0);
+				NOTIF_TIMEOUT_MS, NULL, NULL);
 	}
 
 out:
@@ -486,18 +844,252 @@ out:
 }
 #endif
 
+static void draw_perf_hud(struct haiyajan_ctx_s *ctx)
+{
+	const struct retro_system_av_info *av = &ctx->core.av_info;
+	int audio_ms = -1;
+	int enc_backlog = -1;
+
+	/* Queued audio is stereo signed 16-bit. */
+	if(ctx->core.sdl.audio_dev != 0 && av->timing.sample_rate > 0.0)
+	{
+		Uint32 queued = SDL_GetQueuedAudioSize(ctx->core.sdl.audio_dev);
+		audio_ms = (int)((queued * 1000.0) /
+				 (av->timing.sample_rate * 4.0));
+	}
+
+#if ENABLE_VIDEO_RECORDING == 1
+	enc_backlog = rec_backlog(ctx->core.vid);
+#endif
+
+	perf_hud_render(&ctx->core.perf, ctx->rend, ctx->font, audio_ms,
+			enc_backlog);
+}
+
+/**
+ * Returns the file that the frame costs learned for the loaded core are kept
+ * in. The returned string must be freed with SDL_free().
+ */
+static char *get_fskip_profile_path(const struct core_ctx_s *core)
+{
+	char *pref, *path;
+	size_t len;
+
+	pref = SDL_GetPrefPath("", PROG_NAME);
+	if(pref == NULL)
+		return NULL;
+
+	len = SDL_strlen(pref) + sizeof(core->core_short_name) +
+	      sizeof("-frameskip.txt");
+	path = SDL_malloc(len);
+	if(path != NULL)
+	{
+		SDL_snprintf(path, len, "%s%.*s-frameskip.txt", pref,
+			     (int)sizeof(core->core_short_name),
+			     core->core_short_name);
+	}
+
+	SDL_free(pref);
+	return path;
+}
+
+/**
+ * Serialises the state of the core into a buffer that is kept for reuse.
+ *
+ * \return		State of the core, or NULL on error with error in
+ *			SDL_GetError().
+ */
+static void *serialize_core(struct haiyajan_ctx_s *ctx, size_t *len)
+{
+	struct core_ctx_s *core = &ctx->core;
+
+	/* The size of the state may change between frames. */
+	*len = core->fn.retro_serialize_size();
+	if(*len > ctx->state_buf_len)
+	{
+		void *buf = SDL_realloc(ctx->state_buf, *len);
+		if(buf == NULL)
+		{
+			SDL_OutOfMemory();
+			return NULL;
+		}
+
+		ctx->state_buf = buf;
+		ctx->state_buf_len = *len;
+	}
+
+	if(core->fn.retro_serialize(ctx->state_buf, *len) == false)
+	{
+		SDL_SetError("The core was unable to save its state");
+		return NULL;
+	}
+
+	return ctx->state_buf;
+}
+
+/**
+ * Hashes the output of the frame that has just run, and the state of the core
+ * if requested, and verifies them against the golden trace.
+ */
+static void verify_hashes(struct haiyajan_ctx_s *ctx)
+{
+	struct core_ctx_s *core = &ctx->core;
+	struct verify_hash_s hash;
+
+	hash.video = core->env.frame_hash;
+	hash.audio = core->env.audio_hash;
+	hash.state = 0;
+	hash.has_state = SDL_FALSE;
+	core->env.audio_hash = UTIL_HASH_INIT;
+
+	if(ctx->stngs.verify_state)
+	{
+		size_t len;
+		const void *state = serialize_core(ctx, &len);
+
+		/* A state that could not be serialised is hashed as zero, so
+		 * that it differs from a golden trace in which it could. */
+		hash.has_state = SDL_TRUE;
+		if(state != NULL)
+			hash.state = util_hash(UTIL_HASH_INIT, state, len);
+	}
+
+	/* Without a trace to complete, there is no need to continue after
+	 * the first divergence. */
+	if(verify_frame(ctx->verify, core->env.frames, &hash) != 0 &&
+	   ctx->stngs.verify_trace == NULL)
+		ctx->quit = 1;
+}
+
+/**
+ * Adds a checkpoint of the replay being played, if one is due before the next
+ * frame is played. The state is serialised here, but is compressed on a worker
+ * thread.
+ */
+static void add_checkpoint(struct haiyajan_ctx_s *ctx)
+{
+	const Sint64 pos = tai_tell(ctx->tai);
+	const void *state;
+	size_t len;
+
+	if(pos < 0 || ckpt_due(ctx->ckpt, (Uint64)pos) == SDL_FALSE)
+		return;
+
+	state = serialize_core(ctx, &len);
+	if(state == NULL || ckpt_add(ctx->ckpt, (Uint64)pos, state, len) != 0)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+			    "Seeking within the replay is disabled, as a "
+			    "checkpoint could not be added: %s",
+			    SDL_GetError());
+		ckpt_exit(ctx->ckpt);
+		ctx->ckpt = NULL;
+	}
+}
+
+/**
+ * Seeks within the replay being played. The latest checkpoint before the
+ * frame is restored, unless the frame is ahead within the current interval,
+ * and the core is run without presenting frames until the frame is reached.
+ * Checkpoints are added along the way.
+ */
+static void seek_replay(struct haiyajan_ctx_s *ctx, Sint64 frame)
+{
+	struct core_ctx_s *core = &ctx->core;
+	const Uint64 beg = SDL_GetPerformanceCounter();
+	const Sint64 len = tai_length(ctx->tai);
+	Sint64 pos = tai_tell(ctx->tai);
+	SDL_bool recording = core->raw != NULL;
+	Uint64 at;
+
+	if(ctx->ckpt == NULL || pos < 0)
+		return;
+
+#if ENABLE_VIDEO_RECORDING == 1
+	recording = recording || core->vid != NULL;
+#endif
+	/* The audio of the skipped frames would be recorded. */
+	if(recording)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+			    "Seeking is not possible whilst recording");
+		return;
+	}
+
+	frame = SDL_max(frame, 0);
+	frame = SDL_min(frame, len);
+
+	/* There is no checkpoint yet when seeking before the first frame. */
+	add_checkpoint(ctx);
+	if(ctx->ckpt == NULL || ckpt_find(ctx->ckpt, (Uint64)frame, &at) != 0)
+		return;
+
+	if(frame < pos || (Sint64)at > pos)
+	{
+		/* Every checkpoint was serialised to the state buffer, so it is
+		 * large enough for any of them. */
+		size_t state_len = ctx->state_buf_len;
+
+		if(ckpt_load(ctx->ckpt, (Uint64)frame, &at, ctx->state_buf,
+			     &state_len) != 0)
+		{
+			SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+				    "Unable to seek: %s", SDL_GetError());
+			return;
+		}
+
+		if(core->fn.retro_unserialize(ctx->state_buf, state_len) ==
+				false)
+		{
+			SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+				    "Unable to seek: the core was unable to "
+				    "restore its state");
+			return;
+		}
+
+		tai_seek(ctx->tai, at);
+		pos = (Sint64)at;
+	}
+
+	trace_begin("Seek");
+	while(pos < frame)
+	{
+		if(ctx->ckpt != NULL)
+			add_checkpoint(ctx);
+
+		tai_play_frame(ctx->tai, &core->inp);
+
+		/* Only the frame before the target is drawn. */
+		core->env.status.bits.video_disabled = pos + 1 < frame;
+		play_frame(core);
+		pos++;
+	}
+	trace_end("Seek");
+
+	core->env.status.bits.video_disabled = 0;
+	if(core->sdl.audio_dev != 0)
+		SDL_ClearQueuedAudio(core->sdl.audio_dev);
+
+	SDL_LogVerbose(SDL_LOG_CATEGORY_APPLICATION,
+		       "Seeked to frame %" SDL_PRIs64 " in %" SDL_PRIu64 " ms",
+		       pos, ((SDL_GetPerformanceCounter() - beg) * 1000) /
+		       SDL_GetPerformanceFrequency());
+}
+
 static void process_events(struct haiyajan_ctx_s *ctx)
 {
 	SDL_Event ev;
 
-	if(ctx->tai != NULL)
-		tai_process_event(ctx->tai, NULL);
+	/* When rendering or verifying, exit once the input file has
+	 * finished. */
+	if(ctx->tai != NULL && tai_process_event(ctx->tai, NULL) != 0 &&
+			ctx->stngs.offline)
+		ctx->quit = 1;
 
 	while(SDL_PollEvent(&ev) != 0)
 	{
-		if(ctx->tai != NULL)
-			tai_process_event(ctx->tai, &ev);
-		
+		ctx->core.perf.events++;
+
 		if(ev.type == SDL_QUIT)
 		{
 			ctx->quit = 1;
@@ -551,16 +1143,44 @@ static void process_events(struct haiyajan_ctx_s *ctx)
 			case INPUT_EVENT_TAKE_SCREENSHOT:
 			{
 				SDL_Colour c = { 0, 0xFF, 0, 0xFF };
-				take_screenshot(ctx->rend, &ctx->core);
-				ui_add_overlay(&ctx->ui_overlay, c,
+				take_screenshot(ctx->rend, &ctx->core,
+						&ctx->timers);
+				ui_add_overlay(&ctx->ui_overlay, &ctx->timers, c,
 						ui_overlay_top_right,
 						"SCREENSHOT", NOTIF_TIMEOUT_MS,
-						NULL, NULL, 0);
+						NULL, NULL);
 				break;
 			}
-#if ENABLE_VIDEO_RECORDING == 1
 			case INPUT_EVENT_RECORD_VIDEO_TOGGLE:
-				handle_rec_toggle(ctx);
+				if(ctx->stngs.rec_raw)
+					handle_raw_toggle(ctx);
+#if ENABLE_VIDEO_RECORDING == 1
+				else
+					handle_rec_toggle(ctx);
+#endif
+				break;
+
+			case INPUT_EVENT_TOGGLE_INFO:
+				ctx->show_perf = !ctx->show_perf;
+				break;
+
+			case INPUT_EVENT_SEEK_BACK:
+			case INPUT_EVENT_SEEK_FORWARD:
+			{
+				Sint64 step = (Sint64)(SEEK_STEP_SEC *
+					ctx->core.av_info.timing.fps);
+
+				if(ev.user.code == INPUT_EVENT_SEEK_BACK)
+					step = -step;
+
+				seek_replay(ctx, tai_tell(ctx->tai) + step);
+				break;
+			}
+
+#if ENABLE_VIDEO_RECORDING == 1
+
+			case INPUT_EVENT_SAVE_REPLAY:
+				handle_replay_save(ctx);
 				break;
 #endif
 		}
@@ -654,20 +1274,19 @@ static int haiyajan_init_core(struct haiyajan_ctx_s *h, char *core_filename,
 		gl_reset_context(ctx->sdl.gl);
 
 	do {
-		char *buf = SDL_malloc(64);
-		if(buf == NULL)
-			break;
+		char buf[UI_OVERLAY_TEXT_MAX];
 
-		SDL_snprintf(buf, 64, "Playing with %s",
+		SDL_snprintf(buf, sizeof(buf), "Playing with %s",
 				h->core.sys_info.library_name);
-		ui_add_overlay(&h->ui_overlay, c, ui_overlay_bot_left,
-				buf, NOTIF_TIMEOUT_MS, NULL, NULL, 1);
+		ui_add_overlay(&h->ui_overlay, &h->timers, c,
+				ui_overlay_bot_left, buf, NOTIF_TIMEOUT_MS,
+				NULL, NULL);
 	} while(0);
 
 	do
 	{
 		const struct license_info_s *l;
-		char *buf;
+		char buf[UI_OVERLAY_TEXT_MAX];
 
 		if(h->core.ext_fn.re_core_get_license_info == NULL)
 			break;
@@ -676,14 +1295,11 @@ static int haiyajan_init_core(struct haiyajan_ctx_s *h, char *core_filename,
 		if(l->license_fullname == NULL)
 			break;
 
-		buf = SDL_malloc(128);
-		if(buf == NULL)
-			break;
-
-		SDL_snprintf(buf, 128, "Released under the %s",
+		SDL_snprintf(buf, sizeof(buf), "Released under the %s",
 				l->license_fullname);
-		ui_add_overlay(&h->ui_overlay, c, ui_overlay_bot_left,
-				buf, NOTIF_TIMEOUT_MS, NULL, NULL, 1);
+		ui_add_overlay(&h->ui_overlay, &h->timers, c,
+				ui_overlay_bot_left, buf, NOTIF_TIMEOUT_MS,
+				NULL, NULL);
 	} while(0);
 
 	return 0;
@@ -697,8 +1313,16 @@ int main(int argc, char *argv[])
 	int ret = EXIT_FAILURE;
 	struct haiyajan_ctx_s h = {0};
 
-	/* Ignore argc being unused warning. */
-	(void)argc;
+	/* Allocations must be counted from the first call to SDL, so this
+	 * option is checked before the other options are parsed. */
+	for(int i = 1; i < argc; i++)
+	{
+		if(SDL_strcmp(argv[i], "--alloc-stats") == 0)
+		{
+			alloc_track_init();
+			break;
+		}
+	}
 
 	SDL_SetMainReady();
 
@@ -730,17 +1354,34 @@ int main(int argc, char *argv[])
 	}
 
 	apply_settings(argv, &h);
+	perf_init(&h.core.perf);
+	timer_wheel_init(&h.timers, SDL_GetTicks());
+	ui_overlay_init(&h.ui_overlay);
+
+	if(pool_init(0) != 0)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+			    "Unable to start worker threads: %s",
+			    SDL_GetError());
+	}
+
+	{
+		Uint32 flags = SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE;
+
+		/* A renderer is still required to render offline. */
+		if(h.stngs.offline)
+			flags |= SDL_WINDOW_HIDDEN;
 
-	h.win = SDL_CreateWindow(PROG_NAME, SDL_WINDOWPOS_UNDEFINED,
-				   SDL_WINDOWPOS_UNDEFINED, 320, 240,
-				   SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
+		h.win = SDL_CreateWindow(PROG_NAME, SDL_WINDOWPOS_UNDEFINED,
+				SDL_WINDOWPOS_UNDEFINED, 320, 240, flags);
+	}
 	if(h.win == NULL)
 		goto err;
 
 	{
 		Uint32 flags =
 			SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE;
-		if(!h.stngs.benchmark)
+		if(!h.stngs.benchmark && !h.stngs.offline)
 			flags |= SDL_RENDERER_PRESENTVSYNC;
 
 		h.rend = SDL_CreateRenderer(h.win, -1, flags);
@@ -792,63 +1433,293 @@ int main(int argc, char *argv[])
 	input_init(&h.core.inp);
 	/* TODO: Add return check. */
 	timer_init(&h.core.tim, h.core.av_info.timing.fps);
+	h.core.perf.target_us =
+		(Uint32)(1000000.0 / h.core.av_info.timing.fps);
+	h.core.perf.stutter_us = h.stngs.stutter_ms * 1000UL;
+
+	fskip_init(&h.fskip, h.core.av_info.timing.fps,
+		   h.stngs.frameskip_limit);
+
+	/* The delay is measured from VSYNC, which is disabled when
+	 * benchmarking or running offline. */
+	if(h.stngs.frame_delay && (h.stngs.benchmark || h.stngs.offline))
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+			    "Frame delay requires VSYNC and will not be used");
+		h.stngs.frame_delay = 0;
+	}
+
+	if(h.stngs.frame_delay)
+	{
+		SDL_DisplayMode mode;
+		double hz = h.core.av_info.timing.fps;
+
+		if(SDL_GetWindowDisplayMode(h.win, &mode) == 0 &&
+		   mode.refresh_rate > 0)
+			hz = mode.refresh_rate;
+
+		timer_delay_init(&h.frame_delay, hz);
+	}
+
+	/* The response is detected from the frames given by the core, which
+	 * are not presented when running offline, and are not available to
+	 * the frontend from hardware rendered cores. */
+	if(h.stngs.latency_trials != 0 &&
+	   (h.stngs.offline || h.core.env.status.bits.opengl_required))
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+			    "Input latency can not be measured with this "
+			    "core or whilst rendering or verifying");
+		h.stngs.latency_trials = 0;
+	}
+
+	if(h.stngs.latency_trials != 0)
+	{
+		h.latency = latency_init(h.stngs.latency_trials,
+					 h.core.av_info.timing.fps);
+		if(h.latency == NULL)
+			goto err;
+
+		h.core.env.status.bits.hash_frames = 1;
+	}
+
+	if(h.stngs.verify_golden != NULL || h.stngs.verify_trace != NULL)
+	{
+		h.verify = verify_init(h.stngs.verify_trace,
+				       h.stngs.verify_golden);
+		if(h.verify == NULL)
+			goto err;
+
+		if(h.core.env.status.bits.opengl_required)
+		{
+			SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+				    "Frames of hardware rendered cores can "
+				    "not be verified");
+		}
+
+		if(h.stngs.verify_state &&
+		   h.core.fn.retro_serialize_size() == 0)
+		{
+			SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+				    "The state of this core can not be "
+				    "verified, as it does not support "
+				    "serialisation");
+			h.stngs.verify_state = 0;
+		}
+
+		h.core.env.status.bits.hash_frames = 1;
+		h.core.env.status.bits.hash_audio = 1;
+		h.core.env.audio_hash = UTIL_HASH_INIT;
+	}
+
+	/* Checkpoints are added whilst a replay is played, so that it may be
+	 * seeked within. */
+	if(tai_tell(h.tai) >= 0 && !h.stngs.offline)
+	{
+		if(h.core.fn.retro_serialize_size() == 0)
+		{
+			SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+				    "Seeking within the replay is not "
+				    "possible, as the core does not support "
+				    "serialisation");
+		}
+		else
+		{
+			h.ckpt = ckpt_init((Uint32)(CKPT_INTERVAL_SEC *
+					h.core.av_info.timing.fps),
+					CKPT_MAX_MIB * 1024UL * 1024UL);
+		}
+	}
+
+	if(h.stngs.seek && h.ckpt == NULL)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+			    "Playback will start from the first frame");
+	}
+	else if(h.stngs.seek)
+		seek_replay(&h, (Sint64)h.stngs.seek_frame);
+	h.fskip_profile = get_fskip_profile_path(&h.core);
+	if(h.fskip_profile != NULL &&
+	   fskip_profile_load(&h.fskip, h.fskip_profile) != 0)
+	{
+		SDL_LogVerbose(SDL_LOG_CATEGORY_APPLICATION,
+			       "Frameskip profile not loaded: %s",
+			       SDL_GetError());
+	}
+
+	if(h.stngs.benchmark && h.stngs.counters)
+	{
+		h.pmu = pmu_init();
+		if(h.pmu == NULL)
+		{
+			SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+				    "Processor counters will not be sampled: %s",
+				    SDL_GetError());
+		}
+	}
 	h.font = FontStartup(h.rend);
 
+	/* Audio is not played when running offline. */
+	if(h.stngs.offline && h.core.sdl.audio_dev != 0)
+	{
+		SDL_CloseAudioDevice(h.core.sdl.audio_dev);
+		h.core.sdl.audio_dev = 0;
+	}
+
 	while(h.core.env.status.bits.shutdown == 0 && h.quit == 0)
 	{
 		static int tim_cmd = 0;
-		static Uint8 frames_skipped = 0;
+		Uint64 work_beg;
+		Uint32 work_us;
 
 		timer_profile_start(&h.core.tim);
+		perf_frame_begin(&h.core.perf);
+		timer_wheel_advance(&h.timers, SDL_GetTicks());
 		if(tim_cmd > 0)
 		{
+			trace_begin("Delay");
 			SDL_Delay(tim_cmd);
-			h.core.env.status.bits.video_disabled = 0;
-		}
-		else if(tim_cmd < 0 && frames_skipped > 0
-#if ENABLE_VIDEO_RECORDING == 1
-				&& h.core.vid == NULL
-#endif
-		       )
-		{
-			/* Disable video for the skipped frame to improve
-			 * performance. But only when we're not recording a
-			 * video. */
-			h.core.env.status.bits.video_disabled = 1;
-			frames_skipped--;
+			trace_end("Delay");
 		}
-		else
+		else if(tim_cmd == 0 && h.stngs.frame_delay)
 		{
-			h.core.env.status.bits.video_disabled = 0;
-			frames_skipped = h.stngs.frameskip_limit;
+			/* Input is read as late as possible before the next
+			 * VSYNC. */
+			trace_begin("Frame Delay");
+			timer_delay_wait(&h.frame_delay);
+			trace_end("Frame Delay");
 		}
 
+		/* Disable video for the skipped frame to improve performance.
+		 * Recordings are timestamped by frame number, so skipped
+		 * frames do not cause desync whilst recording. */
+		work_beg = SDL_GetPerformanceCounter();
+		h.core.env.status.bits.video_disabled =
+			fskip_next(&h.fskip, tim_cmd < 0);
+
 		h.core.env.frames++;
 		if(h.tai != NULL)
 			tai_next_frame(h.tai);
 
+		perf_phase_begin(&h.core.perf, PERF_PHASE_EVENTS);
 		process_events(&h);
+		if(h.ckpt != NULL)
+			add_checkpoint(&h);
+
+		if(tai_play_frame(h.tai, &h.core.inp) != 0 &&
+				h.stngs.offline)
+			h.quit = 1;
+		perf_phase_end(&h.core.perf, PERF_PHASE_EVENTS);
+
 		SDL_SetRenderDrawColor(h.rend, 0x00, 0x00, 0x00, 0x00);
 		SDL_RenderClear(h.rend);
+
+		perf_phase_begin(&h.core.perf, PERF_PHASE_RUN);
+		if(h.pmu != NULL)
+			pmu_begin(h.pmu);
+
 		play_frame(&h.core);
+
+		if(h.pmu != NULL)
+			pmu_end(h.pmu);
+		perf_phase_end(&h.core.perf, PERF_PHASE_RUN);
+
+		if(tai_record_frame(h.tai, &h.core.inp) != 0)
+		{
+			SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+				"Unable to record tool assisted input: %s",
+				SDL_GetError());
+			tai_exit(h.tai);
+			h.tai = NULL;
+		}
+
+		if(h.verify != NULL)
+			verify_hashes(&h);
+
+		perf_frame_status(&h.core.perf,
+				  h.core.env.status.bits.video_disabled,
+				  !h.core.env.status.bits.valid_frame);
+
 		SDL_RenderCopyEx(h.rend, h.core.sdl.core_tex,
 				 &h.core.sdl.game_frame_res,
 				 &h.core_tex_targ, 0.0, NULL,
 				 h.core.env.flip);
 
 #if ENABLE_VIDEO_RECORDING == 1
-		if(h.core.vid != NULL)
+		/* Duplicate frames are not encoded; the timestamp of the next
+		 * unique frame accounts for them. */
+		if(h.stngs.replay_mib != 0 && h.core.replay == NULL &&
+		   h.core.env.status.bits.valid_frame)
+			start_replay(&h);
+
+		if(h.stngs.render_filename != NULL && h.core.vid == NULL &&
+		   h.core.env.status.bits.valid_frame && start_render(&h) != 0)
+			break;
+
+		if((h.core.vid != NULL || h.core.replay != NULL) &&
+		   h.core.env.status.bits.valid_frame)
 		{
-			cap_frame(h.core.vid, h.rend, h.core.sdl.core_tex,
-				  &h.core.sdl.game_frame_res, h.core.env.flip);
+			trace_begin("Capture");
+			cap_frame(h.core.vid, h.core.replay, h.rend,
+				  h.core.sdl.core_tex,
+				  &h.core.sdl.game_frame_res, h.core.env.flip,
+				  h.core.env.frames);
+			trace_end("Capture");
 		}
 #endif
+		if(h.core.raw != NULL && h.core.env.status.bits.valid_frame)
+		{
+			trace_begin("Capture");
+			rec_raw_video(h.core.raw,
+				      util_tex_to_surf(h.rend,
+						       h.core.sdl.core_tex,
+						       &h.core.sdl.game_frame_res,
+						       h.core.env.flip),
+				      h.core.env.frames);
+			trace_end("Capture");
+		}
+
 		SDL_SetRenderTarget(h.rend, NULL);
+
+		/* Running offline is as fast as the core and encoder allow,
+		 * and every frame is encoded. */
+		if(h.stngs.offline)
+		{
+			tim_cmd = 0;
+			continue;
+		}
+
+		trace_begin("Overlays");
 		ui_overlay_render(&h.ui_overlay, h.rend, h.font);
 
+		if(h.show_perf)
+			draw_perf_hud(&h);
+		trace_end("Overlays");
+
+		/* Time spent waiting for VSYNC is not included in the cost of
+		 * the frame. */
+		work_us = (Uint32)(((SDL_GetPerformanceCounter() - work_beg) *
+				    1000000) / h.core.perf.freq);
+		fskip_update(&h.fskip, work_us);
+
 		/* Only draw to screen if we're not falling behind. */
-		if(tim_cmd >= 0 || frames_skipped == 0)
+		if(h.core.env.status.bits.video_disabled == 0)
+		{
+			perf_phase_begin(&h.core.perf, PERF_PHASE_PRESENT);
 			SDL_RenderPresent(h.rend);
+			perf_phase_end(&h.core.perf, PERF_PHASE_PRESENT);
+
+			if(h.stngs.frame_delay)
+			{
+				timer_delay_presented(&h.frame_delay,
+						      SDL_GetPerformanceCounter(),
+						      work_us);
+			}
+
+			if(h.latency != NULL &&
+			   latency_presented(h.latency, h.core.env.frame_hash))
+				h.quit = 1;
+		}
 
 		tim_cmd = timer_profile_end(&h.core.tim);
 
@@ -865,9 +1736,9 @@ int main(int argc, char *argv[])
 			if(benchmark_beg == 0)
 			{
 				SDL_Colour c = { 0xFF, 0x00, 0x00, SDL_ALPHA_OPAQUE };
-				ui_add_overlay(&h.ui_overlay, c, ui_overlay_top_right, NULL,
-						0, get_benchmark_txt,
-						&btxt, 0);
+				ui_add_overlay(&h.ui_overlay, &h.timers, c,
+						ui_overlay_top_right, NULL, 0,
+						get_benchmark_txt, &btxt);
 				benchmark_beg = SDL_GetTicks();
 			}
 
@@ -882,6 +1753,7 @@ int main(int argc, char *argv[])
 				SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
 						"Benchmark: %u FPS",
 						btxt.fps);
+				pmu_report(h.pmu);
 				break;
 			}
 		}
@@ -889,14 +1761,24 @@ int main(int argc, char *argv[])
 
 #if ENABLE_VIDEO_RECORDING == 1
 	rec_end(&h.core.vid);
+	rec_end(&h.core.replay);
 #endif
-	while(h.ui_overlay != NULL)
-		ui_overlay_delete_all(&h.ui_overlay);
+	rec_raw_end(&h.core.raw);
+	rec_wait_all();
+	ui_overlay_delete_all(&h.ui_overlay);
 
+	if(h.fskip_profile != NULL &&
+	   fskip_profile_save(&h.fskip, h.fskip_profile) != 0)
+	{
+		SDL_LogVerbose(SDL_LOG_CATEGORY_APPLICATION,
+			       "Frameskip profile not saved: %s",
+			       SDL_GetError());
+	}
+
+	latency_report(h.latency);
 	tai_exit(h.tai);
-	util_exit_all();
 	FontExit(h.font);
-	ret = EXIT_SUCCESS;
+	ret = verify_report(h.verify) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 
 out:
 	/* TODO: Free UI.*/
@@ -910,11 +1792,27 @@ out:
 		play_deinit_cb(&h.core);
 	}
 
+	/* Finish background jobs before their resources are destroyed. */
+	pool_exit();
+	trace_exit();
+	pmu_exit(h.pmu);
+	latency_exit(h.latency);
+	verify_exit(h.verify);
+	ckpt_exit(h.ckpt);
+
+	util_exit();
 	SDL_DestroyRenderer(h.rend);
 	SDL_DestroyWindow(h.win);
 	SDL_VideoQuit();
 	SDL_Quit();
 	free_settings(&h.core);
+	SDL_free(h.stngs.render_filename);
+	SDL_free(h.stngs.verify_trace);
+	SDL_free(h.stngs.verify_golden);
+	SDL_free(h.state_buf);
+	SDL_free(h.stngs.rec_raw_prefix);
+	SDL_free(h.fskip_profile);
+	alloc_track_report();
 
 	if(ret == EXIT_SUCCESS)
 	{
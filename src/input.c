@@ -81,7 +81,10 @@ void input_init(struct input_ctx_s *in_ctx)
 		{ SDL_SCANCODE_I,	{ INPUT_CMD_EVENT, INPUT_EVENT_TOGGLE_INFO }},
 		{ SDL_SCANCODE_F,	{ INPUT_CMD_EVENT, INPUT_EVENT_TOGGLE_FULLSCREEN }},
 		{ SDL_SCANCODE_P,	{ INPUT_CMD_EVENT, INPUT_EVENT_TAKE_SCREENSHOT }},
-		{ SDL_SCANCODE_V,	{ INPUT_CMD_EVENT, INPUT_EVENT_RECORD_VIDEO_TOGGLE }}
+		{ SDL_SCANCODE_V,	{ INPUT_CMD_EVENT, INPUT_EVENT_RECORD_VIDEO_TOGGLE }},
+		{ SDL_SCANCODE_B,	{ INPUT_CMD_EVENT, INPUT_EVENT_SAVE_REPLAY }},
+		{ SDL_SCANCODE_COMMA,	{ INPUT_CMD_EVENT, INPUT_EVENT_SEEK_BACK }},
+		{ SDL_SCANCODE_PERIOD,	{ INPUT_CMD_EVENT, INPUT_EVENT_SEEK_FORWARD }}
 	};
 	unsigned i;
 
@@ -195,6 +198,12 @@ static void input_set_keyboard(input_device_s *dev, const SDL_Scancode sc,
 	}
 }
 
+void input_set_key(struct input_ctx_s *in_ctx, SDL_Scancode sc, Uint8 state)
+{
+	input_set_keyboard(&in_ctx->player[0], sc, state,
+			   in_ctx->input_cmd_event);
+}
+
 void input_handle_event(struct input_ctx_s *const in_ctx, const SDL_Event *ev)
 {
 	if(ev->type == SDL_KEYDOWN)
@@ -303,11 +312,13 @@ void input_add_controller(struct input_ctx_s *ctx, unsigned port,
 	return;
 }
 
-Sint16 input_get(const struct input_ctx_s *const in_ctx,
-				 unsigned port, unsigned device, unsigned index,
-				 unsigned id)
+/* Triggers pressed further than this are reported as a pressed L2 or R2
+ * button. */
+#define INPUT_TRIGGER_PRESSED	(SDL_MAX_SINT16 / 4)
+
+static void input_poll_pad(SDL_GameController *gc, struct input_snap_s *s)
 {
-	static SDL_GameControllerButton lr_to_gcb[] =
+	static const SDL_GameControllerButton lr_to_gcb[] =
 	{
 		SDL_CONTROLLER_BUTTON_B,
 		SDL_CONTROLLER_BUTTON_Y,
@@ -321,15 +332,107 @@ Sint16 input_get(const struct input_ctx_s *const in_ctx,
 		SDL_CONTROLLER_BUTTON_X,
 		SDL_CONTROLLER_BUTTON_LEFTSHOULDER,
 		SDL_CONTROLLER_BUTTON_RIGHTSHOULDER,
-		-1, /* L2 */
-		-1, /* R2 */
+		SDL_CONTROLLER_BUTTON_INVALID, /* L2 */
+		SDL_CONTROLLER_BUTTON_INVALID, /* R2 */
 		SDL_CONTROLLER_BUTTON_LEFTSTICK,
 		SDL_CONTROLLER_BUTTON_RIGHTSTICK
 	};
-	const SDL_GameControllerAxis lr_to_gcax[2][2] = {
-		{ SDL_CONTROLLER_AXIS_LEFTX, SDL_CONTROLLER_AXIS_LEFTY },
-		{ SDL_CONTROLLER_AXIS_RIGHTX, SDL_CONTROLLER_AXIS_RIGHTY }
-	};
+	Uint16 btns = 0;
+
+	for(unsigned id = 0; id < SDL_arraysize(lr_to_gcb); id++)
+	{
+		Sint16 val;
+
+		if(lr_to_gcb[id] != SDL_CONTROLLER_BUTTON_INVALID)
+		{
+			val = SDL_GameControllerGetButton(gc, lr_to_gcb[id]) ?
+				SDL_MAX_SINT16 : 0;
+		}
+		else
+		{
+			val = SDL_GameControllerGetAxis(gc,
+				id == INPUT_JOYPAD_L2 ?
+				SDL_CONTROLLER_AXIS_TRIGGERLEFT :
+				SDL_CONTROLLER_AXIS_TRIGGERRIGHT);
+		}
+
+		s->btn_analog[id] = val;
+		btns |= (Uint16)((val > INPUT_TRIGGER_PRESSED) << id);
+	}
+
+	s->btns = btns;
+	s->stick[RETRO_DEVICE_INDEX_ANALOG_LEFT][RETRO_DEVICE_ID_ANALOG_X] =
+		SDL_GameControllerGetAxis(gc, SDL_CONTROLLER_AXIS_LEFTX);
+	s->stick[RETRO_DEVICE_INDEX_ANALOG_LEFT][RETRO_DEVICE_ID_ANALOG_Y] =
+		SDL_GameControllerGetAxis(gc, SDL_CONTROLLER_AXIS_LEFTY);
+	s->stick[RETRO_DEVICE_INDEX_ANALOG_RIGHT][RETRO_DEVICE_ID_ANALOG_X] =
+		SDL_GameControllerGetAxis(gc, SDL_CONTROLLER_AXIS_RIGHTX);
+	s->stick[RETRO_DEVICE_INDEX_ANALOG_RIGHT][RETRO_DEVICE_ID_ANALOG_Y] =
+		SDL_GameControllerGetAxis(gc, SDL_CONTROLLER_AXIS_RIGHTY);
+}
+
+static void input_poll_keyboard(const input_device_s *dev,
+		struct input_snap_s *s)
+{
+	const Uint16 btns = dev->type.keyboard.btns.all;
+
+	for(unsigned id = 0; id < SDL_arraysize(s->btn_analog); id++)
+		s->btn_analog[id] = ((btns >> id) & 1) ? SDL_MAX_SINT16 : 0;
+
+	s->btns = btns;
+	s->stick[RETRO_DEVICE_INDEX_ANALOG_LEFT][RETRO_DEVICE_ID_ANALOG_X] =
+		dev->type.keyboard.left_x;
+	s->stick[RETRO_DEVICE_INDEX_ANALOG_LEFT][RETRO_DEVICE_ID_ANALOG_Y] =
+		dev->type.keyboard.left_y;
+	s->stick[RETRO_DEVICE_INDEX_ANALOG_RIGHT][RETRO_DEVICE_ID_ANALOG_X] =
+		dev->type.keyboard.right_x;
+	s->stick[RETRO_DEVICE_INDEX_ANALOG_RIGHT][RETRO_DEVICE_ID_ANALOG_Y] =
+		dev->type.keyboard.right_y;
+}
+
+void input_poll(struct input_ctx_s *in_ctx)
+{
+	if(in_ctx->held)
+		return;
+
+	/* Keyboard state is kept from the key events handled in
+	 * input_handle_event(). Game controllers are read directly, so they
+	 * are updated here rather than by pumping the whole event queue. The
+	 * resulting snapshot is what tool assisted input records each frame,
+	 * and playback replaces it by holding the input context. */
+	SDL_GameControllerUpdate();
+
+	for(unsigned port = 0; port < MAX_PLAYERS; port++)
+	{
+		const input_device_s *dev = &in_ctx->player[port];
+		struct input_snap_s *s = &in_ctx->snap[port];
+
+		switch(dev->hai_type)
+		{
+		case RETRO_INPUT_KEYBOARD:
+			input_poll_keyboard(dev, s);
+			break;
+
+		case RETRO_INPUT_JOYPAD:
+		case RETRO_INPUT_ANALOG:
+			if(dev->type.pad.ctx != NULL)
+			{
+				input_poll_pad(dev->type.pad.ctx, s);
+				break;
+			}
+		/* Fall-through */
+		default:
+			SDL_zerop(s);
+			break;
+		}
+	}
+}
+
+Sint16 input_get(const struct input_ctx_s *const in_ctx,
+				 unsigned port, unsigned device, unsigned index,
+				 unsigned id)
+{
+	const struct input_snap_s *s;
 
 	if(port >= MAX_PLAYERS)
 		return 0;
@@ -351,66 +454,28 @@ Sint16 input_get(const struct input_ctx_s *const in_ctx,
 		log_lim |= 1 << port;
 	}
 
-	switch(in_ctx->player[port].hai_type)
-	{
-	case RETRO_INPUT_KEYBOARD:
-		switch(device)
-		{
-		case RETRO_INPUT_ANALOG:
-		{
-			if(id == RETRO_DEVICE_ID_ANALOG_X)
-			{
-				if(index == RETRO_DEVICE_INDEX_ANALOG_LEFT)
-					return in_ctx->player[port].type.keyboard.left_x;
-				else if(index == RETRO_DEVICE_INDEX_ANALOG_RIGHT)
-					return in_ctx->player[port].type.keyboard.right_x;
-			}
-			else if(id == RETRO_DEVICE_ID_ANALOG_Y)
-			{
-				if(index == RETRO_DEVICE_INDEX_ANALOG_LEFT)
-					return in_ctx->player[port].type.keyboard.left_y;
-				else if(index == RETRO_DEVICE_INDEX_ANALOG_RIGHT)
-					return in_ctx->player[port].type.keyboard.right_y;
-			}
-
-			return 0;
-		}
-		case RETRO_INPUT_JOYPAD:
-			return (in_ctx->player[port].type.keyboard.btns.all >> id) & 1;
-		}
-		break;
+	s = &in_ctx->snap[port];
 
-	case RETRO_INPUT_JOYPAD:
-	case RETRO_INPUT_ANALOG:
+	switch(device)
 	{
-		switch(device)
-		{
+	case RETRO_DEVICE_JOYPAD:
+		/* All buttons at once, as advertised by
+		 * RETRO_ENVIRONMENT_GET_INPUT_BITMASKS. */
+		if(id == RETRO_DEVICE_ID_JOYPAD_MASK)
+			return (Sint16)s->btns;
+		else if(id >= SDL_arraysize(s->btn_analog))
+			return 0;
 
-		case RETRO_INPUT_ANALOG:
-			/* Only analogue input devices are supported by libretro analog
-			* inputs. */
+		return (s->btns >> id) & 1;
 
-			if(index < RETRO_DEVICE_INDEX_ANALOG_BUTTON)
-			{
-				return SDL_GameControllerGetAxis(in_ctx->player[port].type.pad.ctx,
-				                                 lr_to_gcax[index][id]);
-			}
-		/* Fall-through */
-		case RETRO_INPUT_JOYPAD:
-		{
-			SDL_GameControllerButton btn = lr_to_gcb[id];
-			if(btn != -1)
-				return SDL_GameControllerGetButton(in_ctx->player[port].type.pad.ctx, btn);
-			else if(id == RETRO_DEVICE_ID_JOYPAD_L2)
-				return SDL_GameControllerGetAxis(in_ctx->player[port].type.pad.ctx, SDL_CONTROLLER_AXIS_TRIGGERLEFT);
-			else if(id == RETRO_DEVICE_ID_JOYPAD_R2)
-				return SDL_GameControllerGetAxis(in_ctx->player[port].type.pad.ctx, SDL_CONTROLLER_AXIS_TRIGGERRIGHT);
+	case RETRO_DEVICE_ANALOG:
+		if(index < RETRO_DEVICE_INDEX_ANALOG_BUTTON &&
+				id <= RETRO_DEVICE_ID_ANALOG_Y)
+			return s->stick[index][id];
+		else if(index == RETRO_DEVICE_INDEX_ANALOG_BUTTON &&
+				id < SDL_arraysize(s->btn_analog))
+			return s->btn_analog[id];
 
-			break;
-		}
-		}
-	}
-	default:
 		break;
 	}
 
@@ -0,0 +1,270 @@
+/**
+ * Measures the time from input to the presentation of its response.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#include <SDL.h>
+#include <latency.h>
+#include <tai.h>
+
+/* Frames presented between trials, so that the release of the key has been
+ * handled and the next press lands on a different phase of the frame. */
+#define LATENCY_SETTLE_MIN	4
+#define LATENCY_SETTLE_RANGE	8
+
+/* A trial is abandoned if the screen has not changed within this many frames
+ * of the key press. */
+#define LATENCY_TIMEOUT_FRAMES	60
+
+enum latency_state_e {
+	/* Waiting for the screen to settle before the next trial. */
+	LATENCY_SETTLE,
+
+	/* The key press will be injected by a timer. */
+	LATENCY_ARMED,
+
+	/* The key has been pressed, and the screen has not yet changed. */
+	LATENCY_WAIT
+};
+
+struct latency_ctx_s {
+	Uint64 freq;
+	Uint32 period_ms;
+	Uint32 rng;
+
+	enum latency_state_e state;
+
+	/* Frames left to settle, or frames presented since the key press. */
+	unsigned frames;
+
+	/* Hash of the screen before the key press. */
+	Uint32 baseline;
+
+	SDL_TimerID timer;
+
+	/* Set by the timer thread once the key press has been injected at
+	 * inject_at. */
+	SDL_atomic_t injected;
+	Uint64 inject_at;
+
+	unsigned trials;
+	unsigned measured;
+	unsigned missed;
+	Uint32 *samples_us;
+};
+
+static Uint32 latency_rand(latency_ctx *ctx)
+{
+	ctx->rng ^= ctx->rng << 13;
+	ctx->rng ^= ctx->rng >> 17;
+	ctx->rng ^= ctx->rng << 5;
+	return ctx->rng;
+}
+
+static Uint32 SDLCALL latency_inject(Uint32 interval, void *param)
+{
+	latency_ctx *ctx = param;
+	(void) interval;
+
+	ctx->inject_at = SDL_GetPerformanceCounter();
+	if(tai_inject_key(LATENCY_KEY, SDL_PRESSED) != 0)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_TEST,
+			    "Unable to inject key press: %s", SDL_GetError());
+	}
+
+	SDL_AtomicSet(&ctx->injected, 1);
+	return 0;
+}
+
+static void latency_next_trial(latency_ctx *ctx)
+{
+	tai_inject_key(LATENCY_KEY, SDL_RELEASED);
+	SDL_AtomicSet(&ctx->injected, 0);
+	ctx->timer = 0;
+	ctx->state = LATENCY_SETTLE;
+	ctx->frames = LATENCY_SETTLE_MIN +
+		latency_rand(ctx) % LATENCY_SETTLE_RANGE;
+}
+
+latency_ctx *latency_init(unsigned trials, double fps)
+{
+	latency_ctx *ctx;
+
+	if(trials == 0 || fps <= 0.0)
+	{
+		SDL_SetError("Invalid latency test parameters");
+		return NULL;
+	}
+
+	ctx = SDL_calloc(1, sizeof(*ctx));
+	if(ctx == NULL)
+		goto err;
+
+	ctx->samples_us = SDL_malloc(trials * sizeof(*ctx->samples_us));
+	if(ctx->samples_us == NULL)
+		goto err;
+
+	ctx->freq = SDL_GetPerformanceFrequency();
+	ctx->period_ms = SDL_max((Uint32)(1000.0 / fps), 1U);
+	ctx->rng = (Uint32)SDL_GetPerformanceCounter() | 1;
+	ctx->trials = trials;
+	ctx->state = LATENCY_SETTLE;
+	ctx->frames = LATENCY_SETTLE_MIN;
+
+	SDL_LogInfo(SDL_LOG_CATEGORY_TEST,
+		    "Measuring input latency over %u trials", trials);
+	return ctx;
+
+err:
+	SDL_OutOfMemory();
+	latency_exit(ctx);
+	return NULL;
+}
+
+SDL_bool latency_presented(latency_ctx *ctx, Uint32 hash)
+{
+	const Uint64 now = SDL_GetPerformanceCounter();
+
+	switch(ctx->state)
+	{
+	case LATENCY_SETTLE:
+		if(--ctx->frames != 0)
+			break;
+
+		/* The key is pressed at a random point within the next
+		 * frame. */
+		ctx->baseline = hash;
+		ctx->state = LATENCY_ARMED;
+		ctx->timer = SDL_AddTimer(1 + latency_rand(ctx) %
+					  ctx->period_ms, latency_inject, ctx);
+		if(ctx->timer == 0)
+		{
+			SDL_LogWarn(SDL_LOG_CATEGORY_TEST,
+				    "Unable to start trial: %s",
+				    SDL_GetError());
+			ctx->missed++;
+			latency_next_trial(ctx);
+		}
+
+		break;
+
+	case LATENCY_ARMED:
+		if(SDL_AtomicGet(&ctx->injected) == 0)
+		{
+			/* The screen changed without any input. */
+			ctx->baseline = hash;
+			break;
+		}
+
+		ctx->state = LATENCY_WAIT;
+		ctx->frames = 0;
+	/* Fall-through */
+	case LATENCY_WAIT:
+		if(hash != ctx->baseline)
+		{
+			ctx->samples_us[ctx->measured++] = (Uint32)
+				(((now - ctx->inject_at) * 1000000) / ctx->freq);
+			latency_next_trial(ctx);
+		}
+		else if(++ctx->frames > LATENCY_TIMEOUT_FRAMES)
+		{
+			ctx->missed++;
+			latency_next_trial(ctx);
+		}
+
+		break;
+	}
+
+	return ctx->measured + ctx->missed >= ctx->trials ? SDL_TRUE : SDL_FALSE;
+}
+
+static int latency_cmp(const void *a, const void *b)
+{
+	Uint32 x = *(const Uint32 *)a;
+	Uint32 y = *(const Uint32 *)b;
+	return (x > y) - (x < y);
+}
+
+int latency_get_stats(latency_ctx *ctx, struct latency_stats_s *st)
+{
+	const unsigned n = ctx->measured;
+	const Uint32 *s = ctx->samples_us;
+	Uint64 sum = 0;
+
+	SDL_zerop(st);
+	st->measured = n;
+	st->missed = ctx->missed;
+
+	if(n == 0)
+		return SDL_SetError("No input latency was measured");
+
+	SDL_qsort(ctx->samples_us, n, sizeof(*s), latency_cmp);
+	for(unsigned i = 0; i < n; i++)
+		sum += s[i];
+
+	st->min_us = s[0];
+	st->mean_us = (Uint32)(sum / n);
+	st->p50_us = s[n / 2];
+	st->p90_us = s[(n * 90) / 100];
+	st->p99_us = s[(n * 99) / 100];
+	st->max_us = s[n - 1];
+	return 0;
+}
+
+void latency_report(latency_ctx *ctx)
+{
+	struct latency_stats_s st;
+
+	if(ctx == NULL)
+		return;
+
+	if(latency_get_stats(ctx, &st) != 0)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_TEST, "%s", SDL_GetError());
+		return;
+	}
+
+	SDL_LogInfo(SDL_LOG_CATEGORY_TEST,
+		    "Input to present latency over %u trials in ms "
+		    "(min, average, median, p90, p99, max):", st.measured);
+	SDL_LogInfo(SDL_LOG_CATEGORY_TEST,
+		    "  %.2f %.2f %.2f %.2f %.2f %.2f",
+		    st.min_us / 1000.0, st.mean_us / 1000.0,
+		    st.p50_us / 1000.0, st.p90_us / 1000.0,
+		    st.p99_us / 1000.0, st.max_us / 1000.0);
+
+	if(st.missed != 0)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_TEST,
+			    "%u trials had no response within %u frames",
+			    st.missed, LATENCY_TIMEOUT_FRAMES);
+	}
+}
+
+void latency_exit(latency_ctx *ctx)
+{
+	if(ctx == NULL)
+		return;
+
+	/* If the timer could not be removed, it is already injecting the key
+	 * press, and must finish before the context is freed. */
+	if(ctx->state == LATENCY_ARMED &&
+	   SDL_RemoveTimer(ctx->timer) == SDL_FALSE)
+	{
+		while(SDL_AtomicGet(&ctx->injected) == 0)
+			SDL_Delay(1);
+	}
+
+	SDL_free(ctx->samples_us);
+	SDL_free(ctx);
+}
@@ -0,0 +1,346 @@
+/**
+ * Measures the time spent in each phase of a frame.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#include <SDL.h>
+#include <alloc.h>
+#include <perf.h>
+#include <pool.h>
+#include <trace.h>
+
+#define PERF_HUD_LINES		3
+#define PERF_HUD_GRAPH_H	48
+#define PERF_HUD_MARGIN		2
+#define PERF_FLIGHT_MASK	(PERF_FLIGHT_FRAMES - 1)
+
+struct perf_flight_save_s {
+	char filename[64];
+	unsigned len;
+	struct perf_flight_s f[PERF_FLIGHT_FRAMES];
+};
+
+static const char *const perf_phase_name[PERF_PHASE_MAX] = {
+	"Events", "Run", "Upload", "Present"
+};
+
+static Uint32 perf_us(const struct perf_ctx_s *p, Uint64 beg, Uint64 end)
+{
+	return (Uint32)(((end - beg) * 1000000) / p->freq);
+}
+
+void perf_init(struct perf_ctx_s *p)
+{
+	SDL_zerop(p);
+	p->freq = SDL_GetPerformanceFrequency();
+	p->frame_beg = SDL_GetPerformanceCounter();
+}
+
+static void perf_check_stutter(struct perf_ctx_s *p,
+			       const struct perf_flight_s *f)
+{
+	char filename[48];
+
+	if(p->stutter_cooldown != 0)
+	{
+		p->stutter_cooldown--;
+		return;
+	}
+
+	/* The first frame includes the time taken to start. */
+	if(p->stutter_us == 0 || f->frame == 0 ||
+	   f->frame_us <= p->target_us + p->stutter_us)
+		return;
+
+	/* Frames that stutter shortly after are included in this file. */
+	p->stutter_cooldown = PERF_FLIGHT_FRAMES / 2;
+
+	SDL_snprintf(filename, sizeof(filename), "haiyajan-stutter-%u.txt",
+		     (unsigned)f->frame);
+	if(perf_flight_save(p, filename) != 0)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+			    "Unable to save frame timings: %s",
+			    SDL_GetError());
+	}
+}
+
+static Uint32 perf_frame_allocs(struct perf_ctx_s *p)
+{
+	struct alloc_stats_s s;
+	Uint64 main_allocs;
+	Uint32 allocs;
+
+	if(alloc_track_enabled() == SDL_FALSE)
+		return 0;
+
+	alloc_track_get(&s);
+	main_allocs = s.allocs - s.tag_allocs[ALLOC_TAG_THREADS];
+	allocs = (Uint32)(main_allocs - p->allocs_prev);
+	p->allocs_prev = main_allocs;
+
+	return allocs;
+}
+
+void perf_frame_begin(struct perf_ctx_s *p)
+{
+	Uint64 now = SDL_GetPerformanceCounter();
+	struct perf_flight_s *f = &p->flight[p->frames & PERF_FLIGHT_MASK];
+
+	f->allocs = perf_frame_allocs(p);
+
+	f->frame = p->frames++;
+	f->frame_us = perf_us(p, p->frame_beg, now);
+	f->audio_queued = p->audio_queued;
+	f->events = p->events;
+	f->flags = p->flags;
+	p->events = 0;
+	p->flags = 0;
+
+	p->frame_pos = (p->frame_pos + 1) % PERF_HISTORY;
+	p->frame_us[p->frame_pos] = f->frame_us;
+	p->frame_beg = now;
+
+	for(unsigned i = 0; i < PERF_PHASE_MAX; i++)
+	{
+		f->phase_us[i] = p->phase_us[i];
+
+		/* Moving average over approximately 16 frames. */
+		p->phase_avg_us[i] -= p->phase_avg_us[i] / 16;
+		p->phase_avg_us[i] += p->phase_us[i] / 16;
+		p->phase_us[i] = 0;
+	}
+
+	perf_check_stutter(p, f);
+}
+
+void perf_frame_status(struct perf_ctx_s *p, SDL_bool skipped, SDL_bool dup)
+{
+	if(skipped)
+	{
+		p->frames_skipped++;
+		p->flags |= PERF_FLAG_SKIPPED;
+	}
+	else if(dup)
+	{
+		p->frames_dup++;
+		p->flags |= PERF_FLAG_DUPLICATE;
+	}
+}
+
+void perf_phase_begin(struct perf_ctx_s *p, enum perf_phase_e phase)
+{
+	trace_begin(perf_phase_name[phase]);
+	alloc_track_set_tag(ALLOC_TAG_EVENTS + phase);
+	p->phase_beg[phase] = SDL_GetPerformanceCounter();
+}
+
+void perf_phase_end(struct perf_ctx_s *p, enum perf_phase_e phase)
+{
+	p->phase_us[phase] += perf_us(p, p->phase_beg[phase],
+				      SDL_GetPerformanceCounter());
+	alloc_track_set_tag(ALLOC_TAG_MAIN);
+	trace_end(perf_phase_name[phase]);
+}
+
+unsigned perf_flight_len(const struct perf_ctx_s *p)
+{
+	return SDL_min(p->frames, PERF_FLIGHT_FRAMES);
+}
+
+const struct perf_flight_s *perf_flight_get(const struct perf_ctx_s *p,
+					    unsigned i)
+{
+	Uint32 first = p->frames - perf_flight_len(p);
+	return &p->flight[(first + i) & PERF_FLIGHT_MASK];
+}
+
+/**
+ * Writes an unsigned integer followed by the given character. Library
+ * functions are avoided as they are not async-signal-safe.
+ */
+static size_t perf_fmt_u32(char *out, Uint32 v, char end)
+{
+	char tmp[10];
+	size_t n = 0, len = 0;
+
+	do {
+		tmp[n++] = (char)('0' + v % 10);
+		v /= 10;
+	} while(v != 0);
+
+	while(n != 0)
+		out[len++] = tmp[--n];
+
+	out[len++] = end;
+	return len;
+}
+
+size_t perf_flight_line(const struct perf_flight_s *f, char *line)
+{
+	size_t len = 0;
+
+	len += perf_fmt_u32(line + len, f->frame, ' ');
+	len += perf_fmt_u32(line + len, f->frame_us, ' ');
+	for(unsigned i = 0; i < PERF_PHASE_MAX; i++)
+		len += perf_fmt_u32(line + len, f->phase_us[i], ' ');
+
+	len += perf_fmt_u32(line + len, f->audio_queued, ' ');
+	len += perf_fmt_u32(line + len, f->allocs, ' ');
+	len += perf_fmt_u32(line + len, f->events, ' ');
+	len += perf_fmt_u32(line + len, f->flags, '\n');
+
+	return len;
+}
+
+static void perf_flight_save_job(void *param)
+{
+	struct perf_flight_save_s *fs = param;
+	char line[PERF_FLIGHT_LINE_MAX];
+	SDL_RWops *f;
+
+	f = SDL_RWFromFile(fs->filename, "wb");
+	if(f == NULL)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+			    "Unable to save frame timings: %s",
+			    SDL_GetError());
+		goto out;
+	}
+
+	SDL_RWwrite(f, PERF_FLIGHT_HEADER, 1,
+		    sizeof(PERF_FLIGHT_HEADER) - 1);
+	for(unsigned i = 0; i < fs->len; i++)
+		SDL_RWwrite(f, line, 1, perf_flight_line(&fs->f[i], line));
+
+	SDL_RWclose(f);
+	SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+		    "Frame timings saved to \"%s\"", fs->filename);
+
+out:
+	SDL_free(fs);
+}
+
+int perf_flight_save(const struct perf_ctx_s *p, const char *filename)
+{
+	struct perf_flight_save_s *fs;
+
+	fs = SDL_malloc(sizeof(struct perf_flight_save_s));
+	if(fs == NULL)
+		return SDL_OutOfMemory();
+
+	SDL_strlcpy(fs->filename, filename, sizeof(fs->filename));
+	fs->len = perf_flight_len(p);
+	for(unsigned i = 0; i < fs->len; i++)
+		fs->f[i] = *perf_flight_get(p, i);
+
+	/* Save on this thread if the pool is unavailable. */
+	if(pool_submit(perf_flight_save_job, fs, POOL_PRIO_LOW) != 0)
+		perf_flight_save_job(fs);
+
+	return 0;
+}
+
+void perf_hud_render(const struct perf_ctx_s *p, SDL_Renderer *rend,
+		     font_ctx *font, int audio_ms, int enc_backlog)
+{
+	char txt[PERF_HUD_LINES][64];
+	SDL_Point graph[PERF_HISTORY];
+	SDL_Rect bg;
+	SDL_Rect dst = { PERF_HUD_MARGIN, PERF_HUD_MARGIN, 1, 1 };
+	const Uint32 *avg = p->phase_avg_us;
+	Uint8 r, g, b, a;
+	unsigned w = 0, h;
+	int graph_y;
+
+	SDL_snprintf(txt[0], sizeof(txt[0]),
+		     "EVT %5.2f RUN %5.2f UPL %5.2f PRE %5.2f",
+		     avg[PERF_PHASE_EVENTS] / 1000.0,
+		     avg[PERF_PHASE_RUN] / 1000.0,
+		     avg[PERF_PHASE_UPLOAD] / 1000.0,
+		     avg[PERF_PHASE_PRESENT] / 1000.0);
+	SDL_snprintf(txt[1], sizeof(txt[1]),
+		     "FRAME %5.2f ms SKIP %u DUP %u",
+		     p->frame_us[p->frame_pos] / 1000.0,
+		     (unsigned)p->frames_skipped, (unsigned)p->frames_dup);
+
+	if(alloc_track_enabled())
+	{
+		size_t len = SDL_strlen(txt[1]);
+		SDL_snprintf(txt[1] + len, sizeof(txt[1]) - len,
+			     " ALLOC %u", (unsigned)
+			     p->flight[(p->frames - 1) & PERF_FLIGHT_MASK].allocs);
+	}
+
+	if(audio_ms < 0)
+		SDL_strlcpy(txt[2], "AUDIO --", sizeof(txt[2]));
+	else
+		SDL_snprintf(txt[2], sizeof(txt[2]), "AUDIO %3d ms", audio_ms);
+
+	if(enc_backlog >= 0)
+	{
+		size_t len = SDL_strlen(txt[2]);
+		SDL_snprintf(txt[2] + len, sizeof(txt[2]) - len,
+			     " ENC %d", enc_backlog);
+	}
+
+	for(unsigned i = 0; i < PERF_HUD_LINES; i++)
+	{
+		unsigned lw;
+		FontDrawSize(SDL_strlen(txt[i]), &lw, &h);
+		if(lw > w)
+			w = lw;
+	}
+
+	if(w < PERF_HISTORY)
+		w = PERF_HISTORY;
+
+	bg.x = 0;
+	bg.y = 0;
+	bg.w = w + PERF_HUD_MARGIN * 2;
+	bg.h = h * PERF_HUD_LINES + PERF_HUD_GRAPH_H + PERF_HUD_MARGIN * 3;
+	graph_y = bg.h - PERF_HUD_MARGIN;
+
+	SDL_GetRenderDrawColor(rend, &r, &g, &b, &a);
+	SDL_SetRenderDrawBlendMode(rend, SDL_BLENDMODE_BLEND);
+	SDL_SetRenderDrawColor(rend, 0x00, 0x00, 0x00, 0xA0);
+	SDL_RenderFillRect(rend, &bg);
+
+	SDL_SetRenderDrawColor(rend, 0xFF, 0xFF, 0xFF, SDL_ALPHA_OPAQUE);
+	for(unsigned i = 0; i < PERF_HUD_LINES; i++)
+	{
+		FontPrintToRenderer(font, txt[i], &dst);
+		dst.y += h;
+	}
+
+	/* The target frame time is drawn half way up the graph. */
+	SDL_SetRenderDrawColor(rend, 0x00, 0x80, 0x00, SDL_ALPHA_OPAQUE);
+	SDL_RenderDrawLine(rend, PERF_HUD_MARGIN,
+			   graph_y - PERF_HUD_GRAPH_H / 2,
+			   PERF_HUD_MARGIN + PERF_HISTORY - 1,
+			   graph_y - PERF_HUD_GRAPH_H / 2);
+
+	/* Oldest frame first. */
+	for(unsigned i = 0; i < PERF_HISTORY; i++)
+	{
+		Uint32 us = p->frame_us[(p->frame_pos + 1 + i) % PERF_HISTORY];
+		Uint64 y = ((Uint64)us * (PERF_HUD_GRAPH_H / 2)) /
+			SDL_max(p->target_us, 1);
+
+		graph[i].x = PERF_HUD_MARGIN + i;
+		graph[i].y = graph_y - (int)SDL_min(y, PERF_HUD_GRAPH_H);
+	}
+
+	SDL_SetRenderDrawColor(rend, 0xFF, 0xFF, 0x00, SDL_ALPHA_OPAQUE);
+	SDL_RenderDrawLines(rend, graph, PERF_HISTORY);
+	SDL_SetRenderDrawColor(rend, r, g, b, a);
+}
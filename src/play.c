@@ -19,6 +19,8 @@
 #include <play.h>
 #include <input.h>
 #include <rec.h>
+#include <trace.h>
+#include <util.h>
 
 #define NUM_ELEMS(x) (sizeof(x) / sizeof(*x))
 
@@ -68,6 +70,18 @@ void play_libretro_log(enum retro_log_level level, const char *fmt, ...)
 		ctx_retro->core_short_name, buf);
 }
 
+/**
+ * Returns the directory of the executable. The string is owned by the core
+ * context and is freed in play_deinit_cb().
+ */
+static const char *play_base_path(void)
+{
+	if(ctx_retro->base_path == NULL)
+		ctx_retro->base_path = SDL_GetBasePath();
+
+	return ctx_retro->base_path;
+}
+
 bool cb_retro_environment(unsigned cmd, void *data)
 {
 	const Uint8 exp = (cmd >> 4);
@@ -110,9 +124,8 @@ bool cb_retro_environment(unsigned cmd, void *data)
 	/* FIXME: Set this to something better. */
 	case RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY:
 	{
-		/* FIXME: Fix memory leak. */
 		const char **sys_dir = data;
-		*sys_dir = SDL_GetBasePath();
+		*sys_dir = play_base_path();
 
 		if(*sys_dir == NULL)
 			return false;
@@ -260,22 +273,8 @@ bool cb_retro_environment(unsigned cmd, void *data)
 	{
 		const char **core_path = data;
 
-		/* FIXME: fix memory leak. */
-		char *tmp = SDL_strdup(ctx_retro->core_filename);
-		//size_t len = SDL_strlen(ctx_retro->file_core);
-		*core_path = tmp;
-
-#if 0
-		for(char *i = tmp + len; i != tmp; i--)
-		{
-			if(*i == ctx_retro->path_sep)
-			{
-				*i = '\0';
-				break;
-			}
-		}
-#endif
-
+		/* The string remains valid until the core is unloaded. */
+		*core_path = ctx_retro->core_filename;
 		break;
 	}
 
@@ -298,7 +297,7 @@ bool cb_retro_environment(unsigned cmd, void *data)
 	{
 		const char **save_dir = data;
 		/* FIXME: temporary. */
-		*save_dir = SDL_GetBasePath();
+		*save_dir = play_base_path();
 
 		if(*save_dir == NULL)
 			return false;
@@ -374,6 +373,16 @@ bool cb_retro_environment(unsigned cmd, void *data)
 		break;
 	}
 
+	case (RETRO_ENVIRONMENT_GET_INPUT_BITMASKS & 0xFF):
+	{
+		/* Some cores only check the return value. */
+		bool *bitmasks = data;
+		if(bitmasks != NULL)
+			*bitmasks = true;
+
+		break;
+	}
+
 	case RETRO_ENVIRONMENT_GET_PREFERRED_HW_RENDER:
 	{
 		unsigned *pref = data;
@@ -420,6 +429,12 @@ void cb_retro_video_refresh(const void *data, unsigned width, unsigned height,
 	if(data == RETRO_HW_FRAME_BUFFER_VALID)
 		return;
 
+	if(ctx_retro->env.status.bits.hash_frames)
+	{
+		ctx_retro->env.frame_hash = util_hash_frame(data, width, height,
+				pitch, SDL_BYTESPERPIXEL(ctx_retro->env.pixel_fmt));
+	}
+
 	SDL_assert(width <= ctx_retro->av_info.geometry.max_width);
 	SDL_assert(height <= ctx_retro->av_info.geometry.max_height);
 
@@ -439,48 +454,75 @@ void cb_retro_video_refresh(const void *data, unsigned width, unsigned height,
 	if(ctx_retro->env.status.bits.opengl_required)
 		return;
 
+	perf_phase_begin(&ctx_retro->perf, PERF_PHASE_UPLOAD);
 	if(SDL_UpdateTexture(ctx_retro->sdl.core_tex, &ctx_retro->sdl.game_frame_res, data, (int)pitch) != 0)
 	{
 		SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
 			"Texture could not updated: %s",
 			SDL_GetError());
 	}
+	perf_phase_end(&ctx_retro->perf, PERF_PHASE_UPLOAD);
 
 	return;
 }
 
 void cb_retro_audio_sample(int16_t left, int16_t right)
 {
-	(void)left;
-	(void)right;
+	if(ctx_retro->env.status.bits.hash_audio)
+	{
+		const int16_t s[2] = { left, right };
+		ctx_retro->env.audio_hash =
+			util_hash(ctx_retro->env.audio_hash, s, sizeof(s));
+	}
+
 	return;
 }
 
 size_t cb_retro_audio_sample_batch(const int16_t *data, size_t frames)
 {
-	if(ctx_retro->sdl.audio_dev == 0)
-		goto out;
+	trace_begin("Audio");
 
-	/* If the audio driver is lagging too far behind, reset the queue. */
-	if(SDL_GetQueuedAudioSize(ctx_retro->sdl.audio_dev) >= 32768UL)
-		SDL_ClearQueuedAudio(ctx_retro->sdl.audio_dev);
+	if(ctx_retro->env.status.bits.hash_audio)
+	{
+		ctx_retro->env.audio_hash = util_hash(ctx_retro->env.audio_hash,
+				data, frames * sizeof(int16_t) * 2);
+	}
+
+	/* Audio is recorded even if there is no audio device. */
+	if(ctx_retro->raw != NULL)
+		rec_raw_audio(ctx_retro->raw, data, frames);
 
 #if ENABLE_VIDEO_RECORDING == 1
 	if(ctx_retro->vid != NULL)
 	{
 		rec_enc_audio(ctx_retro->vid, data, frames);
 	}
+
+	if(ctx_retro->replay != NULL)
+		rec_enc_audio(ctx_retro->replay, data, frames);
 #endif
 
+	if(ctx_retro->sdl.audio_dev == 0)
+		goto out;
+
+	/* If the audio driver is lagging too far behind, reset the queue. */
+	ctx_retro->perf.audio_queued =
+		SDL_GetQueuedAudioSize(ctx_retro->sdl.audio_dev);
+	if(ctx_retro->perf.audio_queued >= 32768UL)
+		SDL_ClearQueuedAudio(ctx_retro->sdl.audio_dev);
+
 	SDL_QueueAudio(ctx_retro->sdl.audio_dev, data, (Uint32)frames * sizeof(Uint16) * 2);
 
 out:
+	trace_end("Audio");
 	return frames;
 }
 
 void cb_retro_input_poll(void)
 {
-	return;
+	trace_begin("Input Poll");
+	input_poll(&ctx_retro->inp);
+	trace_end("Input Poll");
 }
 
 int16_t cb_retro_input_state(unsigned port, unsigned device, unsigned index,
@@ -666,6 +708,8 @@ void play_deinit_cb(struct core_ctx_s *ctx)
 	}
 
 	SDL_CloseAudioDevice(ctx->sdl.audio_dev);
+	SDL_free(ctx->base_path);
+	ctx->base_path = NULL;
 	ctx_retro = NULL;
 }
 
@@ -0,0 +1,307 @@
+/**
+ * Samples processor event counters.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* Required for syscall(). */
+#define _GNU_SOURCE
+#endif
+
+#include <SDL.h>
+#include <pmu.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define PMU_COUNTERS_MAX	5
+
+/* Number of samples kept for each counter. Once full, samples are replaced at
+ * random so that the percentiles remain representative of the whole run. */
+#define PMU_SAMPLES_MAX		16384
+
+struct pmu_event_s {
+	const char *name;
+	Uint32 type;
+	Uint64 config;
+};
+
+struct pmu_ctx_s {
+	/* Counters are opened as a single group led by fd[0], so that they are
+	 * scheduled on to the processor together and read in a single call. */
+	unsigned n;
+	int fd[PMU_COUNTERS_MAX];
+	const struct pmu_event_s *ev[PMU_COUNTERS_MAX];
+	Uint64 beg[PMU_COUNTERS_MAX];
+	Uint64 beg_enabled;
+	Uint64 beg_running;
+	SDL_bool beg_valid;
+	Uint64 sum[PMU_COUNTERS_MAX];
+
+	/* Spans that were sampled, and spans that were skipped as the counters
+	 * could not be read or were not scheduled. */
+	Uint64 spans;
+	Uint64 skipped;
+	Uint32 rng;
+	Uint64 *samples[PMU_COUNTERS_MAX];
+};
+
+static const struct pmu_event_s pmu_hw_events[] = {
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "cache misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+};
+
+/* Used in place of the hardware events if none of them are available. */
+static const struct pmu_event_s pmu_sw_events[] = {
+	{ "task clock ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ "context switches", PERF_TYPE_SOFTWARE,
+		PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "cpu migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS }
+};
+
+static const struct pmu_event_s pmu_page_faults = {
+	"page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS
+};
+
+static int pmu_open(pmu_ctx *ctx, const struct pmu_event_s *ev)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	SDL_zero(attr);
+	attr.size = sizeof(attr);
+	attr.type = ev->type;
+	attr.config = ev->config;
+	/* Only user space is counted so that the default value of
+	 * perf_event_paranoid is sufficient. */
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	/* The times allow the values to be scaled if the group is multiplexed
+	 * with other events. */
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+		PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	/* An event that does not fit in the group fails to open. */
+	fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1,
+			  ctx->n == 0 ? -1 : ctx->fd[0], 0);
+	if(fd < 0)
+		return -1;
+
+	ctx->samples[ctx->n] = SDL_malloc(PMU_SAMPLES_MAX * sizeof(Uint64));
+	if(ctx->samples[ctx->n] == NULL)
+	{
+		close(fd);
+		return -1;
+	}
+
+	ctx->fd[ctx->n] = fd;
+	ctx->ev[ctx->n] = ev;
+	ctx->n++;
+	return 0;
+}
+
+/**
+ * Reads all counters of the group.
+ *
+ * \return		0 on success, or -1 if the counters could not be read.
+ */
+static int pmu_read(const pmu_ctx *ctx, Uint64 *val, Uint64 *enabled,
+		    Uint64 *running)
+{
+	/* Number of counters, time enabled, time running, then the values in
+	 * the order that the counters were opened. */
+	Uint64 buf[3 + PMU_COUNTERS_MAX];
+	const size_t len = (3 + ctx->n) * sizeof(Uint64);
+
+	if(read(ctx->fd[0], buf, len) != (ssize_t)len || buf[0] != ctx->n)
+		return -1;
+
+	*enabled = buf[1];
+	*running = buf[2];
+	SDL_memcpy(val, buf + 3, ctx->n * sizeof(Uint64));
+	return 0;
+}
+
+pmu_ctx *pmu_init(void)
+{
+	pmu_ctx *ctx;
+
+	ctx = SDL_calloc(1, sizeof(pmu_ctx));
+	if(ctx == NULL)
+	{
+		SDL_OutOfMemory();
+		return NULL;
+	}
+
+	ctx->rng = 0x9E3779B9;
+
+	for(unsigned i = 0; i < SDL_arraysize(pmu_hw_events); i++)
+		pmu_open(ctx, &pmu_hw_events[i]);
+
+	if(ctx->n == 0)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+			    "Hardware performance counters are unavailable; "
+			    "using software counters instead");
+
+		for(unsigned i = 0; i < SDL_arraysize(pmu_sw_events); i++)
+			pmu_open(ctx, &pmu_sw_events[i]);
+	}
+
+	pmu_open(ctx, &pmu_page_faults);
+
+	if(ctx->n == 0)
+	{
+		SDL_free(ctx);
+		SDL_SetError("Unable to open any performance counters");
+		return NULL;
+	}
+
+	return ctx;
+}
+
+void pmu_begin(pmu_ctx *ctx)
+{
+	ctx->beg_valid = pmu_read(ctx, ctx->beg, &ctx->beg_enabled,
+				  &ctx->beg_running) == 0;
+}
+
+void pmu_end(pmu_ctx *ctx)
+{
+	Uint64 end[PMU_COUNTERS_MAX];
+	Uint64 enabled, running;
+	Uint64 slot = ctx->spans;
+	double scale = 1.0;
+
+	/* Counters are read first so that the bookkeeping is not counted. */
+	if(pmu_read(ctx, end, &enabled, &running) != 0 ||
+	   ctx->beg_valid == SDL_FALSE || running <= ctx->beg_running)
+	{
+		ctx->skipped++;
+		return;
+	}
+
+	/* Estimate the full count if the group was only scheduled on to the
+	 * processor for part of the span. */
+	enabled -= ctx->beg_enabled;
+	running -= ctx->beg_running;
+	if(running < enabled)
+		scale = (double)enabled / (double)running;
+
+	if(slot >= PMU_SAMPLES_MAX)
+	{
+		/* Xorshift is sufficient for reservoir sampling. */
+		ctx->rng ^= ctx->rng << 13;
+		ctx->rng ^= ctx->rng >> 17;
+		ctx->rng ^= ctx->rng << 5;
+		slot = ctx->rng % (ctx->spans + 1);
+	}
+
+	for(unsigned i = 0; i < ctx->n; i++)
+	{
+		Uint64 d = (Uint64)((double)(end[i] - ctx->beg[i]) * scale);
+
+		ctx->sum[i] += d;
+		if(slot < PMU_SAMPLES_MAX)
+			ctx->samples[i][slot] = d;
+	}
+
+	ctx->spans++;
+}
+
+static int pmu_cmp(const void *a, const void *b)
+{
+	Uint64 x = *(const Uint64 *)a;
+	Uint64 y = *(const Uint64 *)b;
+	return (x > y) - (x < y);
+}
+
+void pmu_report(pmu_ctx *ctx)
+{
+	size_t len;
+
+	if(ctx == NULL || ctx->spans == 0)
+		return;
+
+	len = (size_t)SDL_min(ctx->spans, PMU_SAMPLES_MAX);
+	SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+		    "Counters per retro_run() over %" SDL_PRIu64 " frames "
+		    "(average, median, p90, p99):", ctx->spans);
+
+	for(unsigned i = 0; i < ctx->n; i++)
+	{
+		Uint64 *s = ctx->samples[i];
+
+		SDL_qsort(s, len, sizeof(*s), pmu_cmp);
+		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+			    "  %-16s %12" SDL_PRIu64 " %12" SDL_PRIu64
+			    " %12" SDL_PRIu64 " %12" SDL_PRIu64,
+			    ctx->ev[i]->name, ctx->sum[i] / ctx->spans,
+			    s[len / 2], s[(len * 90) / 100], s[(len * 99) / 100]);
+	}
+
+	if(ctx->skipped != 0)
+	{
+		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+			    "  %" SDL_PRIu64 " frames were not sampled as the "
+			    "counters were unavailable", ctx->skipped);
+	}
+}
+
+void pmu_exit(pmu_ctx *ctx)
+{
+	if(ctx == NULL)
+		return;
+
+	/* The group leader is closed last. */
+	for(unsigned i = ctx->n; i-- > 0;)
+	{
+		close(ctx->fd[i]);
+		SDL_free(ctx->samples[i]);
+	}
+
+	SDL_free(ctx);
+}
+
+#else
+
+pmu_ctx *pmu_init(void)
+{
+	SDL_SetError("Performance counters are only supported on Linux");
+	return NULL;
+}
+
+void pmu_begin(pmu_ctx *ctx)
+{
+	(void) ctx;
+}
+
+void pmu_end(pmu_ctx *ctx)
+{
+	(void) ctx;
+}
+
+void pmu_report(pmu_ctx *ctx)
+{
+	(void) ctx;
+}
+
+void pmu_exit(pmu_ctx *ctx)
+{
+	(void) ctx;
+}
+
+#endif
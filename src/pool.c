@@ -0,0 +1,250 @@
+/**
+ * Worker thread pool for background jobs.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#include <SDL.h>
+#include <pool.h>
+#include <trace.h>
+
+/* Number of jobs that may be queued for each priority. Must be a power of
+ * two. */
+#define POOL_QUEUE_LEN		256
+#define POOL_QUEUE_MASK		(POOL_QUEUE_LEN - 1)
+#define POOL_WORKERS_MAX	8
+
+struct pool_job_s {
+	pool_job_fn fn;
+	void *param;
+};
+
+/* Each cell holds a sequence number which tells producers and consumers
+ * whether the cell is free to be written to or ready to be read from. */
+struct pool_cell_s {
+	SDL_atomic_t seq;
+	struct pool_job_s job;
+};
+
+/* Bounded multiple producer, multiple consumer queue. */
+struct pool_queue_s {
+	struct pool_cell_s cell[POOL_QUEUE_LEN];
+	SDL_atomic_t enq;
+	SDL_atomic_t deq;
+};
+
+static struct pool_s {
+	struct pool_queue_s q[POOL_PRIO_MAX];
+
+	SDL_sem *sem;
+	SDL_Thread *th[POOL_WORKERS_MAX];
+	unsigned workers;
+
+	SDL_atomic_t running;
+	SDL_atomic_t quit;
+} pool;
+
+/* Differences are calculated on unsigned integers so that the counters may
+ * safely wrap around. */
+static int seq_diff(int a, int b)
+{
+	return (int)((unsigned)a - (unsigned)b);
+}
+
+static int pool_enqueue(struct pool_queue_s *q, const struct pool_job_s *job)
+{
+	struct pool_cell_s *cell;
+	int pos = SDL_AtomicGet(&q->enq);
+
+	for(;;)
+	{
+		int diff;
+
+		cell = &q->cell[(unsigned)pos & POOL_QUEUE_MASK];
+		diff = seq_diff(SDL_AtomicGet(&cell->seq), pos);
+
+		if(diff == 0)
+		{
+			if(SDL_AtomicCAS(&q->enq, pos, seq_diff(pos, -1)))
+				break;
+		}
+		else if(diff < 0)
+			return -1;
+
+		pos = SDL_AtomicGet(&q->enq);
+	}
+
+	cell->job = *job;
+	SDL_AtomicSet(&cell->seq, seq_diff(pos, -1));
+	return 0;
+}
+
+static int pool_dequeue(struct pool_queue_s *q, struct pool_job_s *job)
+{
+	struct pool_cell_s *cell;
+	int pos = SDL_AtomicGet(&q->deq);
+
+	for(;;)
+	{
+		int diff;
+
+		cell = &q->cell[(unsigned)pos & POOL_QUEUE_MASK];
+		diff = seq_diff(SDL_AtomicGet(&cell->seq), seq_diff(pos, -1));
+
+		if(diff == 0)
+		{
+			if(SDL_AtomicCAS(&q->deq, pos, seq_diff(pos, -1)))
+				break;
+		}
+		else if(diff < 0)
+			return -1;
+
+		pos = SDL_AtomicGet(&q->deq);
+	}
+
+	*job = cell->job;
+	SDL_AtomicSet(&cell->seq, seq_diff(pos, -POOL_QUEUE_LEN));
+	return 0;
+}
+
+/**
+ * Takes the next queued job, highest priority first.
+ */
+static int pool_next(struct pool_job_s *job)
+{
+	for(unsigned p = 0; p < POOL_PRIO_MAX; p++)
+	{
+		if(pool_dequeue(&pool.q[p], job) == 0)
+			return 0;
+	}
+
+	return -1;
+}
+
+static int pool_worker(void *param)
+{
+	(void)param;
+
+	SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+	trace_thread_name("Worker");
+
+	for(;;)
+	{
+		struct pool_job_s job;
+		/* Must be read before the queues are checked, so that jobs
+		 * queued before pool_exit() are never left behind. */
+		int quit = SDL_AtomicGet(&pool.quit);
+
+		if(pool_next(&job) == 0)
+		{
+			job.fn(job.param);
+			continue;
+		}
+
+		if(quit != 0)
+			break;
+
+		SDL_SemWait(pool.sem);
+	}
+
+	return 0;
+}
+
+int pool_init(unsigned workers)
+{
+	char name[16];
+
+	SDL_assert(SDL_AtomicGet(&pool.running) == 0);
+
+	if(workers == 0)
+	{
+		int cpus = SDL_GetCPUCount();
+
+		/* Keep one CPU for the emulation thread. */
+		workers = cpus > 2 ? (unsigned)cpus - 1 : 1;
+	}
+
+	if(workers > POOL_WORKERS_MAX)
+		workers = POOL_WORKERS_MAX;
+
+	for(unsigned p = 0; p < POOL_PRIO_MAX; p++)
+	{
+		struct pool_queue_s *q = &pool.q[p];
+
+		for(int i = 0; i < POOL_QUEUE_LEN; i++)
+			SDL_AtomicSet(&q->cell[i].seq, i);
+
+		SDL_AtomicSet(&q->enq, 0);
+		SDL_AtomicSet(&q->deq, 0);
+	}
+
+	SDL_AtomicSet(&pool.quit, 0);
+	pool.workers = 0;
+
+	pool.sem = SDL_CreateSemaphore(0);
+	if(pool.sem == NULL)
+		return -1;
+
+	for(unsigned i = 0; i < workers; i++)
+	{
+		SDL_snprintf(name, sizeof(name), "Worker %u", i);
+		pool.th[i] = SDL_CreateThread(pool_worker, name, NULL);
+		if(pool.th[i] == NULL)
+			break;
+
+		pool.workers++;
+	}
+
+	if(pool.workers == 0)
+	{
+		SDL_DestroySemaphore(pool.sem);
+		pool.sem = NULL;
+		return -1;
+	}
+
+	SDL_AtomicSet(&pool.running, 1);
+	return 0;
+}
+
+int pool_submit(pool_job_fn fn, void *param, enum pool_prio_e prio)
+{
+	struct pool_job_s job = { fn, param };
+
+	SDL_assert_paranoid(fn != NULL);
+	SDL_assert_paranoid(prio < POOL_PRIO_MAX);
+
+	if(SDL_AtomicGet(&pool.running) == 0)
+		return SDL_SetError("Thread pool is not running");
+
+	if(pool_enqueue(&pool.q[prio], &job) != 0)
+		return SDL_SetError("Thread pool queue is full");
+
+	SDL_SemPost(pool.sem);
+	return 0;
+}
+
+void pool_exit(void)
+{
+	if(SDL_AtomicGet(&pool.running) == 0)
+		return;
+
+	SDL_AtomicSet(&pool.running, 0);
+	SDL_AtomicSet(&pool.quit, 1);
+	for(unsigned i = 0; i < pool.workers; i++)
+		SDL_SemPost(pool.sem);
+
+	for(unsigned i = 0; i < pool.workers; i++)
+		SDL_WaitThread(pool.th[i], NULL);
+
+	pool.workers = 0;
+	SDL_DestroySemaphore(pool.sem);
+	pool.sem = NULL;
+}
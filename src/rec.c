@@ -13,17 +13,106 @@
  */
 
 #include <SDL.h>
+#include <pool.h>
 #include <rec.h>
+#include <trace.h>
 #include <util.h>
 
 #if ENABLE_WEBP_SCREENSHOTS == 1
 #include <webp/encode.h>
 #endif
 
+/* Number of recordings and replays still being written to disk. */
+static SDL_atomic_t rec_writers;
+
 #if ENABLE_VIDEO_RECORDING == 1
 #include <wavpack/wavpack.h>
 #include <x264.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Matroska element IDs used by the muxer. */
+#define MKV_ID_EBML			0x1A45DFA3
+#define MKV_ID_EBMLVERSION		0x4286
+#define MKV_ID_EBMLREADVERSION		0x42F7
+#define MKV_ID_EBMLMAXIDLENGTH		0x42F2
+#define MKV_ID_EBMLMAXSIZELENGTH	0x42F3
+#define MKV_ID_DOCTYPE			0x4282
+#define MKV_ID_DOCTYPEVERSION		0x4287
+#define MKV_ID_DOCTYPEREADVERSION	0x4285
+#define MKV_ID_SEGMENT			0x18538067
+#define MKV_ID_SEEKHEAD			0x114D9B74
+#define MKV_ID_SEEK			0x4DBB
+#define MKV_ID_SEEKID			0x53AB
+#define MKV_ID_SEEKPOSITION		0x53AC
+#define MKV_ID_INFO			0x1549A966
+#define MKV_ID_TIMESTAMPSCALE		0x2AD7B1
+#define MKV_ID_DURATION			0x4489
+#define MKV_ID_MUXINGAPP		0x4D80
+#define MKV_ID_WRITINGAPP		0x5741
+#define MKV_ID_TRACKS			0x1654AE6B
+#define MKV_ID_TRACKENTRY		0xAE
+#define MKV_ID_TRACKNUMBER		0xD7
+#define MKV_ID_TRACKUID			0x73C5
+#define MKV_ID_TRACKTYPE		0x83
+#define MKV_ID_FLAGLACING		0x9C
+#define MKV_ID_CODECID			0x86
+#define MKV_ID_CODECPRIVATE		0x63A2
+#define MKV_ID_VIDEO			0xE0
+#define MKV_ID_PIXELWIDTH		0xB0
+#define MKV_ID_PIXELHEIGHT		0xBA
+#define MKV_ID_AUDIO			0xE1
+#define MKV_ID_SAMPLINGFREQUENCY	0xB5
+#define MKV_ID_CHANNELS			0x9F
+#define MKV_ID_BITDEPTH			0x6264
+#define MKV_ID_CLUSTER			0x1F43B675
+#define MKV_ID_TIMESTAMP		0xE7
+#define MKV_ID_SIMPLEBLOCK		0xA3
+#define MKV_ID_CUES			0x1C53BB6B
+#define MKV_ID_CUEPOINT			0xBB
+#define MKV_ID_CUETIME			0xB3
+#define MKV_ID_CUETRACKPOSITIONS	0xB7
+#define MKV_ID_CUETRACK			0xF7
+#define MKV_ID_CUECLUSTERPOSITION	0xF1
+
+#define MKV_TRACK_VIDEO		1
+#define MKV_TRACK_AUDIO		2
+
+/* An element size of all ones signals that the size is unknown. This allows
+ * a recording to remain playable if Haiyajan does not exit cleanly. */
+#define MKV_SIZE_UNKNOWN	0x01FFFFFFFFFFFFFF
+
+/* Queued audio is written to the current cluster regardless of the video
+ * timestamp once it spans this many milliseconds more than the video is
+ * expected to lag behind by. */
+#define MKV_AUDIO_QUEUE_MS	10000
+
+/* Number of interleaved samples held by the audio ring buffer. Must be a power
+ * of two. This is over a second of stereo audio at 48 kHz. */
+#define AUDIO_RING_SAMPLES	(1 << 17)
+
+/* Number of interleaved samples given to Wavpack at once. */
+#define AUDIO_ENC_SAMPLES	4096
+
+/* Time that the audio encoder waits for new samples before polling again. */
+#define AUDIO_ENC_POLL_MS	10
+
+/* Maximum number of encoders used when encoding in segments. */
+#define SEG_MAX_ENCODERS	16
+
+/* Approximate memory limit of frames waiting to be encoded in segment mode.
+ * The emulation thread is blocked once this is reached. */
+#define SEG_QUEUE_BYTES		(512 * 1024 * 1024)
+
+/* Wavpack block header flags. */
+#define WV_INITIAL_BLOCK	0x800
+#define WV_FINAL_BLOCK		0x1000
+#define WV_HEADER_SZ		32
+
 enum vid_thread_cmd {
 	VID_CMD_NO_CMD = 0,
 	VID_CMD_ENCODE_INIT,
@@ -37,21 +126,165 @@ struct venc_stor_s {
 	union {
 		SDL_Surface *pixels;
 	} dat;
+
+	/* Presentation timestamp of the frame in units of frames. */
+	Sint64 pts;
+};
+
+/* Growable byte buffer used to construct EBML elements in memory. */
+struct mkv_buf_s {
+	Uint8 *dat;
+	size_t len;
+	size_t cap;
+};
+
+/* Complete cluster held in memory. The body excludes the cluster timestamp so
+ * that it may be rebased. */
+struct mkv_cluster_s {
+	Uint64 tc;
+	SDL_bool key;
+	struct mkv_buf_s body;
+	struct mkv_cluster_s *next;
+};
+
+struct mkv_s {
+	SDL_RWops *f;
+	SDL_mutex *mtx;
+
+	/* Copy of everything written before the first cluster. */
+	struct mkv_buf_s hdr;
+
+	/* File offsets of values that are only known once recording ends. */
+	Sint64 segment_size_pos;
+	Sint64 segment_data_pos;
+	Sint64 cues_seek_pos;
+	Sint64 duration_pos;
+	Sint64 audio_priv_pos;
+
+	/* The current cluster is constructed in memory and written to the
+	 * file in a single call once it is complete. */
+	struct mkv_buf_s cluster;
+	Uint64 cluster_tc;
+	SDL_bool cluster_open;
+	SDL_bool cluster_key;
+
+	/* Audio frames waiting for a video frame of an equal or later
+	 * timestamp, so that the two tracks are interleaved. Audio is only
+	 * written ahead of the video once the queue spans audio_q_ms. */
+	struct mkv_buf_s audio_q;
+	size_t audio_q_rd;
+	Uint64 audio_q_ms;
+
+	/* Frame being assembled from multiple Wavpack blocks. */
+	struct mkv_buf_s audio_frame;
+	Uint64 audio_frame_tc;
+
+	struct mkv_buf_s cues;
+	Uint64 last_tc;
+	Uint16 audio_version;
+	Sint64 written;
+
+	/* In replay mode, clusters are kept in a ring in memory of at most
+	 * replay_max bytes instead of being written to the output file. */
+	size_t replay_max;
+	size_t replay_sz;
+	struct mkv_cluster_s *replay_head;
+	struct mkv_cluster_s *replay_tail;
+};
+
+struct seg_out_s;
+
+/* Frame given to a segment encoder. A NULL surface marks the end of the
+ * segment. */
+struct seg_item_s {
+	SDL_Surface *surf;
+	Sint64 pts;
+	struct seg_out_s *out;
+	struct seg_item_s *next;
+};
+
+/* Encoded segment waiting to be written to the container in order. */
+struct seg_out_s {
+	Uint32 seg;
+
+	/* Frames stored as timestamp, length, key frame flag, and data. */
+	struct mkv_buf_s frames;
+
+	/* Allocated with the segment so that ending a segment cannot fail. */
+	struct seg_item_s end;
+	struct seg_out_s *next;
+};
+
+struct seg_enc_s {
+	rec_ctx *ctx;
+	SDL_Thread *th;
+	SDL_mutex *mtx;
+	SDL_cond *cond;
+	struct seg_item_s *head;
+	struct seg_item_s *tail;
+	SDL_bool quit;
 };
 
 struct rec_s {
 	/* Audio */
-	SDL_RWops *fa;
 	WavpackContext *wpc;
-	void *first_block;
-	Sint32 first_block_sz;
+	Sint32 sample_rate;
+
+	/* Single producer, single consumer ring of interleaved samples. The
+	 * emulation thread writes to the ring, and the audio encoder thread
+	 * reads from it. Indexes are free running and wrap on overflow. */
+	Sint16 *aring;
+	SDL_atomic_t aring_wr;
+	SDL_atomic_t aring_rd;
+	SDL_atomic_t aring_dropped;
+
+	/* Samples that were dropped and are yet to be replaced with silence,
+	 * so that the audio that follows keeps its timestamp. Only used by the
+	 * emulation thread. */
+	Uint32 aring_gap;
+	SDL_atomic_t aenc_quit;
+	SDL_sem *aenc_sem;
+	SDL_Thread *aenc_th;
 	Sint32 *samples;
-	Uint64 samples_sz;
+
+	/* Set once Wavpack has failed, so that it is only reported once. */
+	SDL_bool aenc_failed;
+
+	/* If set, wait for the encoders instead of dropping input. */
+	SDL_bool offline;
+
+	/* Set whilst rec_init() waits for the video encoder to initialise in
+	 * offline recordings. Both point to the stack of rec_init(). */
+	SDL_sem *venc_init_done;
+	int *venc_init_ret;
 
 	/* Video */
-	SDL_RWops *fv;
 	x264_t *h;
 	x264_param_t param;
+	double fps;
+	Sint64 first_frame;
+	SDL_bool first_frame_set;
+
+	/* Segment encoding splits the video into closed GOPs that are encoded
+	 * in parallel by separate x264 instances. Disabled if seg_frames is
+	 * zero. */
+	Uint32 seg_frames;
+	Uint32 seg_cur;
+	Sint64 seg_start_pts;
+	struct seg_out_s *seg_out;
+	Uint8 seg_nenc;
+	struct seg_enc_s seg_enc[SEG_MAX_ENCODERS];
+	SDL_sem *seg_free;
+	Uint32 seg_free_max;
+	Uint32 seg_dropped;
+
+	/* Finished segments, sorted by segment number. */
+	SDL_mutex *seg_mtx;
+	struct seg_out_s *seg_done;
+	Uint32 seg_next;
+
+	/* Container */
+	struct mkv_s mkv;
 
 	/* Preset value pointing to x264_preset_names[] */
 	Uint8 preset;
@@ -65,6 +298,589 @@ struct rec_s {
 /* Max preset is fast. */
 static const Uint8 preset_max = 5;
 
+static int mkv_buf_reserve(struct mkv_buf_s *b, size_t n)
+{
+	size_t cap = b->cap == 0 ? 4096 : b->cap;
+	Uint8 *dat;
+
+	if(b->len + n <= b->cap)
+		return 0;
+
+	while(cap < b->len + n)
+		cap *= 2;
+
+	dat = SDL_realloc(b->dat, cap);
+	if(dat == NULL)
+		return -1;
+
+	b->dat = dat;
+	b->cap = cap;
+	return 0;
+}
+
+static void mkv_put(struct mkv_buf_s *b, const void *dat, size_t len)
+{
+	if(mkv_buf_reserve(b, len) != 0)
+		return;
+
+	SDL_memcpy(b->dat + b->len, dat, len);
+	b->len += len;
+}
+
+static void mkv_put_be(struct mkv_buf_s *b, Uint64 val, Uint8 bytes)
+{
+	Uint8 out[8];
+	Uint8 i;
+
+	for(i = 0; i < bytes; i++)
+		out[i] = (Uint8)(val >> (8 * (bytes - i - 1)));
+
+	mkv_put(b, out, bytes);
+}
+
+/**
+ * Overwrites a big endian value previously reserved within the buffer.
+ */
+static void mkv_set_be(struct mkv_buf_s *b, size_t off, Uint64 val,
+		       Uint8 bytes)
+{
+	size_t len = b->len;
+
+	if(b->dat == NULL || off + bytes > len)
+		return;
+
+	b->len = off;
+	mkv_put_be(b, val, bytes);
+	b->len = len;
+}
+
+static void mkv_put_id(struct mkv_buf_s *b, Uint32 id)
+{
+	Uint8 bytes = 1;
+
+	if(id > 0xFFFFFF)
+		bytes = 4;
+	else if(id > 0xFFFF)
+		bytes = 3;
+	else if(id > 0xFF)
+		bytes = 2;
+
+	mkv_put_be(b, id, bytes);
+}
+
+/**
+ * Writes an EBML variable length integer. The smallest possible length is
+ * used unless bytes is non-zero, in which case the given length is used.
+ */
+static void mkv_put_vint(struct mkv_buf_s *b, Uint64 val, Uint8 bytes)
+{
+	if(bytes == 0)
+	{
+		bytes = 1;
+		while(bytes < 8 && val >= (((Uint64)1 << (7 * bytes)) - 1))
+			bytes++;
+	}
+
+	val |= (Uint64)1 << (7 * bytes);
+	mkv_put_be(b, val, bytes);
+}
+
+static void mkv_put_uint(struct mkv_buf_s *b, Uint32 id, Uint64 val)
+{
+	Uint8 bytes = 1;
+
+	while(bytes < 8 && (val >> (8 * bytes)) != 0)
+		bytes++;
+
+	mkv_put_id(b, id);
+	mkv_put_vint(b, bytes, 0);
+	mkv_put_be(b, val, bytes);
+}
+
+static void mkv_put_float(struct mkv_buf_s *b, Uint32 id, double val)
+{
+	union {
+		double f;
+		Uint64 u;
+	} conv;
+
+	conv.f = val;
+	mkv_put_id(b, id);
+	mkv_put_vint(b, 8, 0);
+	mkv_put_be(b, conv.u, 8);
+}
+
+static void mkv_put_bin(struct mkv_buf_s *b, Uint32 id, const void *dat,
+			size_t len)
+{
+	mkv_put_id(b, id);
+	mkv_put_vint(b, len, 0);
+	mkv_put(b, dat, len);
+}
+
+static void mkv_put_str(struct mkv_buf_s *b, Uint32 id, const char *str)
+{
+	mkv_put_bin(b, id, str, SDL_strlen(str));
+}
+
+/**
+ * Starts a master element with a fixed size field that is filled in with
+ * mkv_end_master().
+ *
+ * \return	Offset of the size field within the buffer.
+ */
+static size_t mkv_start_master(struct mkv_buf_s *b, Uint32 id)
+{
+	size_t off;
+
+	mkv_put_id(b, id);
+	off = b->len;
+	mkv_put_vint(b, 0, 8);
+	return off;
+}
+
+static void mkv_end_master(struct mkv_buf_s *b, size_t off)
+{
+	Uint64 sz = b->len - off - 8;
+	mkv_set_be(b, off, sz | ((Uint64)1 << 56), 8);
+}
+
+/**
+ * Writes the given buffer to the output file and empties the buffer.
+ */
+static int mkv_flush_buf(struct mkv_s *m, struct mkv_buf_s *b)
+{
+	int ret = 0;
+
+	if(b->len == 0)
+		return 0;
+
+	if(SDL_RWwrite(m->f, b->dat, b->len, 1) != 1)
+		ret = -1;
+	else
+		m->written += b->len;
+
+	b->len = 0;
+	return ret;
+}
+
+/**
+ * Overwrites a previously written value at a given offset in the file.
+ */
+static void mkv_patch(struct mkv_s *m, Sint64 pos, Uint64 val, Uint8 bytes)
+{
+	struct mkv_buf_s b = { 0 };
+	Sint64 end;
+
+	if(pos <= 0)
+		return;
+
+	mkv_put_be(&b, val, bytes);
+	end = SDL_RWtell(m->f);
+	SDL_RWseek(m->f, pos, RW_SEEK_SET);
+	SDL_RWwrite(m->f, b.dat, b.len, 1);
+	SDL_RWseek(m->f, end, RW_SEEK_SET);
+	SDL_free(b.dat);
+}
+
+/**
+ * Writes a cluster to the output file, and adds it to the seeking index if it
+ * begins with a video key frame.
+ */
+static void mkv_write_cluster(struct mkv_s *m, Uint64 tc, SDL_bool key,
+			      struct mkv_buf_s *body)
+{
+	struct mkv_buf_s hdr = { 0 };
+	Sint64 pos = m->written - m->segment_data_pos;
+	size_t sz;
+
+	mkv_put_id(&hdr, MKV_ID_CLUSTER);
+	sz = hdr.len;
+	mkv_put_vint(&hdr, 0, 8);
+	mkv_put_uint(&hdr, MKV_ID_TIMESTAMP, tc);
+	mkv_set_be(&hdr, sz, (hdr.len - sz - 8 + body->len) | ((Uint64)1 << 56),
+		   8);
+
+	if(mkv_flush_buf(m, &hdr) != 0 || mkv_flush_buf(m, body) != 0)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO,
+			    "Unable to write cluster to recording: %s",
+			    SDL_GetError());
+	}
+
+	SDL_free(hdr.dat);
+
+	/* Only clusters starting with a video key frame are useful for
+	 * seeking. */
+	if(key)
+	{
+		size_t cp = mkv_start_master(&m->cues, MKV_ID_CUEPOINT);
+		size_t tp;
+
+		mkv_put_uint(&m->cues, MKV_ID_CUETIME, tc);
+		tp = mkv_start_master(&m->cues, MKV_ID_CUETRACKPOSITIONS);
+		mkv_put_uint(&m->cues, MKV_ID_CUETRACK, MKV_TRACK_VIDEO);
+		mkv_put_uint(&m->cues, MKV_ID_CUECLUSTERPOSITION, pos);
+		mkv_end_master(&m->cues, tp);
+		mkv_end_master(&m->cues, cp);
+	}
+}
+
+static void mkv_free_clusters(struct mkv_cluster_s *c)
+{
+	while(c != NULL)
+	{
+		struct mkv_cluster_s *next = c->next;
+		SDL_free(c->body.dat);
+		SDL_free(c);
+		c = next;
+	}
+}
+
+/**
+ * Adds the current cluster to the replay ring, and removes the oldest
+ * clusters until the ring is within its size limit. The ring always starts
+ * with a video key frame.
+ */
+static void mkv_replay_push(struct mkv_s *m)
+{
+	struct mkv_cluster_s *c = SDL_malloc(sizeof(struct mkv_cluster_s));
+
+	if(c == NULL)
+	{
+		m->cluster.len = 0;
+		return;
+	}
+
+	c->tc = m->cluster_tc;
+	c->key = m->cluster_key;
+	c->body = m->cluster;
+	c->next = NULL;
+	SDL_memset(&m->cluster, 0, sizeof(m->cluster));
+
+	if(m->replay_tail == NULL)
+		m->replay_head = c;
+	else
+		m->replay_tail->next = c;
+
+	m->replay_tail = c;
+	m->replay_sz += c->body.len;
+
+	while(m->replay_head != NULL &&
+	      (m->replay_sz > m->replay_max ||
+	       m->replay_head->key == SDL_FALSE))
+	{
+		struct mkv_cluster_s *old = m->replay_head;
+
+		m->replay_head = old->next;
+		if(m->replay_head == NULL)
+			m->replay_tail = NULL;
+
+		m->replay_sz -= old->body.len;
+		old->next = NULL;
+		mkv_free_clusters(old);
+	}
+}
+
+static void mkv_flush_cluster(struct mkv_s *m)
+{
+	if(m->cluster_open == SDL_FALSE)
+		return;
+
+	m->cluster_open = SDL_FALSE;
+
+	if(m->replay_max != 0)
+		mkv_replay_push(m);
+	else
+		mkv_write_cluster(m, m->cluster_tc, m->cluster_key,
+				  &m->cluster);
+}
+
+static void mkv_put_block(struct mkv_s *m, Uint8 track, Uint64 tc,
+			  SDL_bool key, const void *dat, size_t len)
+{
+	Sint64 rel = (Sint64)tc - (Sint64)m->cluster_tc;
+	SDL_bool new_cluster = m->cluster_open == SDL_FALSE;
+
+	/* New clusters are started on video key frames, and when the relative
+	 * timestamp no longer fits in the block header. */
+	if(track == MKV_TRACK_VIDEO && key && m->cluster.len != 0)
+		new_cluster = SDL_TRUE;
+	else if(rel > SDL_MAX_SINT16 || rel < SDL_MIN_SINT16)
+		new_cluster = SDL_TRUE;
+
+	if(new_cluster)
+	{
+		mkv_flush_cluster(m);
+		m->cluster_open = SDL_TRUE;
+		m->cluster_tc = tc;
+		m->cluster_key = (track == MKV_TRACK_VIDEO && key);
+		rel = 0;
+	}
+
+	mkv_put_id(&m->cluster, MKV_ID_SIMPLEBLOCK);
+	mkv_put_vint(&m->cluster, len + 4, 0);
+	mkv_put_vint(&m->cluster, track, 1);
+	mkv_put_be(&m->cluster, (Uint16)(Sint16)rel, 2);
+	mkv_put_be(&m->cluster, key ? 0x80 : 0x00, 1);
+	mkv_put(&m->cluster, dat, len);
+
+	if(tc > m->last_tc)
+		m->last_tc = tc;
+}
+
+/**
+ * Write queued audio frames with a timestamp up to and including tc.
+ */
+static void mkv_flush_audio(struct mkv_s *m, Uint64 tc)
+{
+	while(m->audio_q_rd < m->audio_q.len)
+	{
+		Uint64 atc;
+		Uint32 len;
+		const Uint8 *p = m->audio_q.dat + m->audio_q_rd;
+
+		SDL_memcpy(&atc, p, sizeof(atc));
+		SDL_memcpy(&len, p + sizeof(atc), sizeof(len));
+		if(atc > tc)
+			break;
+
+		mkv_put_block(m, MKV_TRACK_AUDIO, atc, SDL_TRUE,
+			      p + sizeof(atc) + sizeof(len), len);
+		m->audio_q_rd += sizeof(atc) + sizeof(len) + len;
+	}
+
+	if(m->audio_q_rd == m->audio_q.len)
+	{
+		m->audio_q.len = 0;
+		m->audio_q_rd = 0;
+	}
+}
+
+static void mkv_write_video(struct mkv_s *m, Uint64 tc, SDL_bool key,
+			    const void *dat, size_t len)
+{
+	SDL_LockMutex(m->mtx);
+	mkv_flush_audio(m, tc);
+	mkv_put_block(m, MKV_TRACK_VIDEO, tc, key, dat, len);
+	SDL_UnlockMutex(m->mtx);
+}
+
+static void mkv_write_audio(struct mkv_s *m, Uint64 tc, const void *dat,
+			    Uint32 len)
+{
+	SDL_LockMutex(m->mtx);
+	mkv_put(&m->audio_q, &tc, sizeof(tc));
+	mkv_put(&m->audio_q, &len, sizeof(len));
+	mkv_put(&m->audio_q, dat, len);
+
+	/* Do not hold on to audio indefinitely if video is not arriving. */
+	{
+		Uint64 oldest;
+
+		SDL_memcpy(&oldest, m->audio_q.dat + m->audio_q_rd,
+			   sizeof(oldest));
+		if(tc > oldest && tc - oldest > m->audio_q_ms)
+			mkv_flush_audio(m, tc);
+	}
+
+	SDL_UnlockMutex(m->mtx);
+}
+
+/**
+ * Writes the EBML header, and the segment header up to the first cluster.
+ */
+static int mkv_init(struct mkv_s *m, int width, int height,
+		    Sint32 sample_rate, const Uint8 *avcc, size_t avcc_len)
+{
+	struct mkv_buf_s b = { 0 };
+	const Uint8 wv_version[2] = { 0x07, 0x04 };
+	size_t master, track, sub;
+	size_t seek_cues;
+	size_t seek_info;
+	size_t seek_tracks;
+	size_t duration;
+	size_t audio_priv;
+	size_t seg_size;
+	size_t seg_data;
+	int ret;
+
+	master = mkv_start_master(&b, MKV_ID_EBML);
+	mkv_put_uint(&b, MKV_ID_EBMLVERSION, 1);
+	mkv_put_uint(&b, MKV_ID_EBMLREADVERSION, 1);
+	mkv_put_uint(&b, MKV_ID_EBMLMAXIDLENGTH, 4);
+	mkv_put_uint(&b, MKV_ID_EBMLMAXSIZELENGTH, 8);
+	mkv_put_str(&b, MKV_ID_DOCTYPE, "matroska");
+	mkv_put_uint(&b, MKV_ID_DOCTYPEVERSION, 4);
+	mkv_put_uint(&b, MKV_ID_DOCTYPEREADVERSION, 2);
+	mkv_end_master(&b, master);
+
+	mkv_put_id(&b, MKV_ID_SEGMENT);
+	seg_size = b.len;
+	mkv_put_be(&b, MKV_SIZE_UNKNOWN, 8);
+	seg_data = b.len;
+
+	/* Seek positions are written with a fixed width so that they may be
+	 * modified once the recording has finished. */
+	master = mkv_start_master(&b, MKV_ID_SEEKHEAD);
+	sub = mkv_start_master(&b, MKV_ID_SEEK);
+	mkv_put_bin(&b, MKV_ID_SEEKID, "\x15\x49\xA9\x66", 4);
+	mkv_put_id(&b, MKV_ID_SEEKPOSITION);
+	mkv_put_vint(&b, 8, 0);
+	seek_info = b.len;
+	mkv_put_be(&b, 0, 8);
+	mkv_end_master(&b, sub);
+	sub = mkv_start_master(&b, MKV_ID_SEEK);
+	mkv_put_bin(&b, MKV_ID_SEEKID, "\x16\x54\xAE\x6B", 4);
+	mkv_put_id(&b, MKV_ID_SEEKPOSITION);
+	mkv_put_vint(&b, 8, 0);
+	seek_tracks = b.len;
+	mkv_put_be(&b, 0, 8);
+	mkv_end_master(&b, sub);
+	sub = mkv_start_master(&b, MKV_ID_SEEK);
+	mkv_put_bin(&b, MKV_ID_SEEKID, "\x1C\x53\xBB\x6B", 4);
+	mkv_put_id(&b, MKV_ID_SEEKPOSITION);
+	mkv_put_vint(&b, 8, 0);
+	seek_cues = b.len;
+	mkv_put_be(&b, 0, 8);
+	mkv_end_master(&b, sub);
+	mkv_end_master(&b, master);
+
+	/* Segment information. */
+	master = b.len;
+	{
+		size_t info = mkv_start_master(&b, MKV_ID_INFO);
+		mkv_put_uint(&b, MKV_ID_TIMESTAMPSCALE, 1000000);
+		mkv_put_str(&b, MKV_ID_MUXINGAPP, "Haiyajan");
+		mkv_put_str(&b, MKV_ID_WRITINGAPP, "Haiyajan");
+		mkv_put_id(&b, MKV_ID_DURATION);
+		mkv_put_vint(&b, 8, 0);
+		duration = b.len;
+		mkv_put_be(&b, 0, 8);
+		mkv_end_master(&b, info);
+	}
+	mkv_set_be(&b, seek_info, master - seg_data, 8);
+
+	/* Track information. */
+	master = b.len;
+	{
+		size_t tracks = mkv_start_master(&b, MKV_ID_TRACKS);
+
+		track = mkv_start_master(&b, MKV_ID_TRACKENTRY);
+		mkv_put_uint(&b, MKV_ID_TRACKNUMBER, MKV_TRACK_VIDEO);
+		mkv_put_uint(&b, MKV_ID_TRACKUID, MKV_TRACK_VIDEO);
+		mkv_put_uint(&b, MKV_ID_TRACKTYPE, 1);
+		mkv_put_uint(&b, MKV_ID_FLAGLACING, 0);
+		mkv_put_str(&b, MKV_ID_CODECID, "V_MPEG4/ISO/AVC");
+		mkv_put_bin(&b, MKV_ID_CODECPRIVATE, avcc, avcc_len);
+		sub = mkv_start_master(&b, MKV_ID_VIDEO);
+		mkv_put_uint(&b, MKV_ID_PIXELWIDTH, width);
+		mkv_put_uint(&b, MKV_ID_PIXELHEIGHT, height);
+		mkv_end_master(&b, sub);
+		mkv_end_master(&b, track);
+
+		track = mkv_start_master(&b, MKV_ID_TRACKENTRY);
+		mkv_put_uint(&b, MKV_ID_TRACKNUMBER, MKV_TRACK_AUDIO);
+		mkv_put_uint(&b, MKV_ID_TRACKUID, MKV_TRACK_AUDIO);
+		mkv_put_uint(&b, MKV_ID_TRACKTYPE, 2);
+		mkv_put_uint(&b, MKV_ID_FLAGLACING, 0);
+		mkv_put_str(&b, MKV_ID_CODECID, "A_WAVPACK4");
+		/* The stream version is corrected from the first Wavpack block
+		 * once the recording has finished. */
+		audio_priv = b.len + 3;
+		mkv_put_bin(&b, MKV_ID_CODECPRIVATE, wv_version,
+			    sizeof(wv_version));
+		sub = mkv_start_master(&b, MKV_ID_AUDIO);
+		mkv_put_float(&b, MKV_ID_SAMPLINGFREQUENCY, sample_rate);
+		mkv_put_uint(&b, MKV_ID_CHANNELS, 2);
+		mkv_put_uint(&b, MKV_ID_BITDEPTH, 16);
+		mkv_end_master(&b, sub);
+		mkv_end_master(&b, track);
+
+		mkv_end_master(&b, tracks);
+	}
+	mkv_set_be(&b, seek_tracks, master - seg_data, 8);
+
+	if(b.dat == NULL)
+		return -1;
+
+	m->segment_size_pos = m->written + seg_size;
+	m->segment_data_pos = m->written + seg_data;
+	m->cues_seek_pos = m->written + seek_cues;
+	m->duration_pos = m->written + duration;
+	m->audio_priv_pos = m->written + audio_priv;
+	m->audio_version = 0x0407;
+
+	/* The header is kept so that replays can be saved to new files. */
+	mkv_put(&m->hdr, b.dat, b.len);
+	if(m->f != NULL)
+		ret = mkv_flush_buf(m, &b);
+	else
+		ret = 0;
+
+	SDL_free(b.dat);
+	return ret;
+}
+
+/**
+ * Writes remaining data and the seeking index, and completes the values that
+ * were left unknown in the header.
+ */
+static void mkv_end(struct mkv_s *m, double frame_ms)
+{
+	union {
+		double f;
+		Uint64 u;
+	} dur;
+	Sint64 cues_pos;
+
+	SDL_LockMutex(m->mtx);
+	mkv_flush_audio(m, (Uint64)-1);
+	mkv_flush_cluster(m);
+
+	/* Nothing is written in replay mode unless saved beforehand. */
+	if(m->f == NULL)
+		goto out;
+
+	cues_pos = m->written - m->segment_data_pos;
+	if(m->cues.len != 0)
+	{
+		struct mkv_buf_s hdr = { 0 };
+		mkv_put_id(&hdr, MKV_ID_CUES);
+		mkv_put_vint(&hdr, m->cues.len, 8);
+		mkv_flush_buf(m, &hdr);
+		mkv_flush_buf(m, &m->cues);
+		SDL_free(hdr.dat);
+		mkv_patch(m, m->cues_seek_pos, cues_pos, 8);
+	}
+
+	dur.f = (double)m->last_tc + frame_ms;
+	mkv_patch(m, m->duration_pos, dur.u, 8);
+	mkv_patch(m, m->audio_priv_pos,
+		  ((m->audio_version & 0xFF) << 8) | (m->audio_version >> 8),
+		  2);
+	mkv_patch(m, m->segment_size_pos,
+		  (m->written - m->segment_data_pos) | ((Uint64)1 << 56), 8);
+	SDL_RWclose(m->f);
+
+out:
+	SDL_UnlockMutex(m->mtx);
+
+	mkv_free_clusters(m->replay_head);
+	SDL_free(m->hdr.dat);
+	SDL_free(m->cluster.dat);
+	SDL_free(m->audio_q.dat);
+	SDL_free(m->audio_frame.dat);
+	SDL_free(m->cues.dat);
+	SDL_DestroyMutex(m->mtx);
+}
+
+static Uint32 read_le32(const Uint8 *p)
+{
+	return (Uint32)p[0] | ((Uint32)p[1] << 8) | ((Uint32)p[2] << 16) |
+	       ((Uint32)p[3] << 24);
+}
+
 static void x264_log(void *priv, int i_level, const char *fmt, va_list ap)
 {
 	const SDL_LogPriority lvlmap[] = {
@@ -82,50 +898,555 @@ static void x264_log(void *priv, int i_level, const char *fmt, va_list ap)
 	SDL_LogMessageV(SDL_LOG_CATEGORY_VIDEO, lvlmap[i_level], buf, ap);
 }
 
+/**
+ * Converts Wavpack blocks into Matroska A_WAVPACK4 frames. The leading block
+ * header fields that are redundant in Matroska are stripped.
+ */
 static int wav_pack_write_file(void *priv, void *data, int32_t bcount)
 {
 	rec_ctx *ctx = priv;
+	struct mkv_s *m;
+	const Uint8 *blk = data;
+	Uint32 ck_size, block_samples, flags;
+	Uint64 block_index;
+	SDL_bool single;
 
 	/* If ctx == NULL, then Initialisation error or data is for lossless
 	 * wvc data. */
 	if(ctx == NULL)
 		return SDL_FALSE;
 
-	if(ctx->first_block == NULL)
+	if(bcount < WV_HEADER_SZ || SDL_memcmp(blk, "wvpk", 4) != 0)
+		return SDL_FALSE;
+
+	m = &ctx->mkv;
+	ck_size = read_le32(blk + 4);
+	block_index = ((Uint64)blk[10] << 32) | read_le32(blk + 16);
+	block_samples = read_le32(blk + 20);
+	flags = read_le32(blk + 24);
+
+	if(ck_size + 8 > (Uint32)bcount || block_samples == 0)
+		return SDL_TRUE;
+
+	m->audio_version = blk[8] | (blk[9] << 8);
+	single = (flags & WV_INITIAL_BLOCK) && (flags & WV_FINAL_BLOCK);
+
+	if(flags & WV_INITIAL_BLOCK)
+	{
+		m->audio_frame.len = 0;
+		m->audio_frame_tc = (block_index * 1000) / ctx->sample_rate;
+		mkv_put(&m->audio_frame, blk + 20, 4);
+	}
+
+	/* Flags and CRC are copied as is, keeping them little endian. */
+	mkv_put(&m->audio_frame, blk + 24, 8);
+	if(!single)
+	{
+		Uint32 sz = ck_size + 8 - WV_HEADER_SZ;
+		const Uint8 sz_le[4] = {
+			sz & 0xFF, (sz >> 8) & 0xFF,
+			(sz >> 16) & 0xFF, (sz >> 24) & 0xFF
+		};
+		mkv_put(&m->audio_frame, sz_le, sizeof(sz_le));
+	}
+	mkv_put(&m->audio_frame, blk + WV_HEADER_SZ,
+		ck_size + 8 - WV_HEADER_SZ);
+
+	if(flags & WV_FINAL_BLOCK)
+	{
+		mkv_write_audio(m, m->audio_frame_tc, m->audio_frame.dat,
+				(Uint32)m->audio_frame.len);
+		m->audio_frame.len = 0;
+	}
+
+	return SDL_TRUE;
+}
+
+/**
+ * Concatenates the length prefixed NAL units of an encoded frame, and writes
+ * them as a single video block.
+ */
+static void write_frame_nals(rec_ctx *ctx, x264_nal_t *nal, int i_nal,
+			     const x264_picture_t *pic_out,
+			     struct mkv_buf_s *seg)
+{
+	struct mkv_buf_s frame = { 0 };
+	Uint8 key = pic_out->b_keyframe ? SDL_TRUE : SDL_FALSE;
+	Uint64 tc;
+
+	for(int i = 0; i < i_nal; i++)
+		mkv_put(&frame, nal[i].p_payload, nal[i].i_payload);
+
+	if(frame.dat == NULL)
+		return;
+
+	if(pic_out->i_pts < 0)
+		tc = 0;
+	else
+		tc = (Uint64)((double)pic_out->i_pts * 1000.0 / ctx->fps);
+
+	/* Frames of a segment are held until all prior segments have been
+	 * written. */
+	if(seg != NULL)
+	{
+		Uint32 len = (Uint32)frame.len;
+		mkv_put(seg, &tc, sizeof(tc));
+		mkv_put(seg, &len, sizeof(len));
+		mkv_put(seg, &key, sizeof(key));
+		mkv_put(seg, frame.dat, frame.len);
+	}
+	else
+		mkv_write_video(&ctx->mkv, tc, key, frame.dat, frame.len);
+
+	SDL_free(frame.dat);
+}
+
+/**
+ * Adds a finished segment to the list of finished segments, and writes all
+ * segments that follow the last written segment to the container.
+ */
+static void seg_publish(rec_ctx *ctx, struct seg_out_s *out)
+{
+	struct seg_out_s **p = &ctx->seg_done;
+
+	SDL_LockMutex(ctx->seg_mtx);
+	while(*p != NULL && (*p)->seg < out->seg)
+		p = &(*p)->next;
+
+	out->next = *p;
+	*p = out;
+
+	while(ctx->seg_done != NULL && ctx->seg_done->seg == ctx->seg_next)
+	{
+		struct seg_out_s *o = ctx->seg_done;
+		size_t rd = 0;
+
+		while(rd < o->frames.len)
+		{
+			const Uint8 *f = o->frames.dat + rd;
+			Uint64 tc;
+			Uint32 len;
+
+			SDL_memcpy(&tc, f, sizeof(tc));
+			SDL_memcpy(&len, f + sizeof(tc), sizeof(len));
+			f += sizeof(tc) + sizeof(len);
+			mkv_write_video(&ctx->mkv, tc, f[0], f + 1, len);
+			rd += sizeof(tc) + sizeof(len) + 1 + len;
+		}
+
+		ctx->seg_done = o->next;
+		ctx->seg_next++;
+		SDL_free(o->frames.dat);
+		SDL_free(o);
+	}
+	SDL_UnlockMutex(ctx->seg_mtx);
+}
+
+static void seg_push(struct seg_enc_s *enc, struct seg_item_s *item)
+{
+	item->next = NULL;
+
+	SDL_LockMutex(enc->mtx);
+	if(enc->tail == NULL)
+		enc->head = item;
+	else
+		enc->tail->next = item;
+
+	enc->tail = item;
+	SDL_CondSignal(enc->cond);
+	SDL_UnlockMutex(enc->mtx);
+}
+
+/**
+ * Encodes each segment given to it with a new x264 instance, so that the
+ * segments are independent of each other.
+ */
+static int seg_thread_enc(void *data)
+{
+	struct seg_enc_s *enc = data;
+	rec_ctx *ctx = enc->ctx;
+	x264_param_t param;
+	x264_t *h = NULL;
+	SDL_bool first = SDL_TRUE;
+
+	trace_thread_name("Segment Encode");
+
+	while(1)
+	{
+		struct seg_item_s *item;
+		x264_picture_t pic;
+		x264_picture_t pic_out;
+		x264_nal_t *nal;
+		int i_nal;
+
+		SDL_LockMutex(enc->mtx);
+		while(enc->head == NULL && enc->quit == SDL_FALSE)
+			SDL_CondWait(enc->cond, enc->mtx);
+
+		item = enc->head;
+		if(item != NULL)
+		{
+			enc->head = item->next;
+			if(enc->head == NULL)
+				enc->tail = NULL;
+		}
+		SDL_UnlockMutex(enc->mtx);
+
+		/* Exit once requested to and all segments are finished. */
+		if(item == NULL)
+			break;
+
+		if(item->surf == NULL)
+		{
+			/* Flush delayed frames to close the GOP. */
+			while(h != NULL && x264_encoder_delayed_frames(h))
+			{
+				int sz = x264_encoder_encode(h, &nal, &i_nal,
+							     NULL, &pic_out);
+				if(sz < 0)
+					break;
+
+				if(sz > 0)
+					write_frame_nals(ctx, nal, i_nal,
+							 &pic_out,
+							 &item->out->frames);
+			}
+
+			if(h != NULL)
+				x264_encoder_close(h);
+
+			h = NULL;
+			first = SDL_TRUE;
+			seg_publish(ctx, item->out);
+			continue;
+		}
+
+		if(first)
+		{
+			param = ctx->param;
+			h = x264_encoder_open(&param);
+			if(h == NULL)
+			{
+				SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO,
+					    "Unable to open encoder for "
+					    "segment %u",
+					    (unsigned)item->out->seg);
+			}
+		}
+
+		if(h != NULL)
+		{
+			x264_picture_init(&pic);
+			pic.img.i_csp = X264_CSP_RGB;
+			pic.img.i_plane = 1;
+			pic.img.i_stride[0] = item->surf->pitch;
+			pic.img.plane[0] = item->surf->pixels;
+			pic.i_type = first ? X264_TYPE_IDR : X264_TYPE_AUTO;
+			pic.i_pts = item->pts;
+
+			trace_begin("Encode frame");
+			if(x264_encoder_encode(h, &nal, &i_nal, &pic,
+					       &pic_out) > 0)
+			{
+				write_frame_nals(ctx, nal, i_nal, &pic_out,
+						 &item->out->frames);
+			}
+			trace_end("Encode frame");
+		}
+
+		first = SDL_FALSE;
+		util_surf_put(item->surf);
+		SDL_free(item);
+		SDL_SemPost(ctx->seg_free);
+	}
+
+	return 0;
+}
+
+/**
+ * Gives the current segment to its encoder to finish.
+ */
+static void seg_close(rec_ctx *ctx)
+{
+	struct seg_out_s *out = ctx->seg_out;
+
+	if(out == NULL)
+		return;
+
+	out->end.surf = NULL;
+	out->end.out = out;
+	seg_push(&ctx->seg_enc[out->seg % ctx->seg_nenc], &out->end);
+	ctx->seg_out = NULL;
+	ctx->seg_cur++;
+}
+
+/**
+ * Queues a frame for encoding in its segment. Segments are distributed to
+ * encoders in turn.
+ */
+static void seg_dispatch(rec_ctx *ctx, SDL_Surface *surf, Sint64 pts)
+{
+	struct seg_item_s *item;
+
+	if(ctx->seg_out != NULL &&
+	   pts - ctx->seg_start_pts >= (Sint64)ctx->seg_frames)
+		seg_close(ctx);
+
+	if(ctx->seg_out == NULL)
+	{
+		ctx->seg_out = SDL_calloc(1, sizeof(struct seg_out_s));
+		if(ctx->seg_out == NULL)
+			goto err;
+
+		ctx->seg_out->seg = ctx->seg_cur;
+		ctx->seg_start_pts = pts;
+	}
+
+	/* Limit the memory used by frames waiting to be encoded. The
+	 * emulation thread waits on venc_slk whilst a frame is dispatched, so
+	 * the frame is dropped instead of waiting in real time mode. */
+	if(ctx->offline)
+		SDL_SemWait(ctx->seg_free);
+	else if(SDL_SemTryWait(ctx->seg_free) != 0)
+	{
+		ctx->seg_dropped++;
+		goto err;
+	}
+
+	item = SDL_malloc(sizeof(struct seg_item_s));
+	if(item == NULL)
+	{
+		SDL_SemPost(ctx->seg_free);
+		goto err;
+	}
+
+	item->surf = surf;
+	item->pts = pts;
+	item->out = ctx->seg_out;
+	seg_push(&ctx->seg_enc[ctx->seg_out->seg % ctx->seg_nenc], item);
+	return;
+
+err:
+	util_surf_put(surf);
+}
+
+/**
+ * Waits for all segment encoders to finish, and frees their resources.
+ */
+static void seg_stop(rec_ctx *ctx)
+{
+	for(Uint8 i = 0; i < ctx->seg_nenc; i++)
+	{
+		struct seg_enc_s *enc = &ctx->seg_enc[i];
+
+		if(enc->th != NULL)
+		{
+			SDL_LockMutex(enc->mtx);
+			enc->quit = SDL_TRUE;
+			SDL_CondSignal(enc->cond);
+			SDL_UnlockMutex(enc->mtx);
+			SDL_WaitThread(enc->th, NULL);
+			enc->th = NULL;
+		}
+
+		SDL_DestroyCond(enc->cond);
+		SDL_DestroyMutex(enc->mtx);
+	}
+
+	/* Segments that could not be written due to an earlier failure. */
+	while(ctx->seg_done != NULL)
+	{
+		struct seg_out_s *o = ctx->seg_done;
+		ctx->seg_done = o->next;
+		SDL_free(o->frames.dat);
+		SDL_free(o);
+	}
+
+	if(ctx->seg_free != NULL)
+		SDL_DestroySemaphore(ctx->seg_free);
+
+	if(ctx->seg_dropped != 0)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO,
+			    "Segment encoders fell behind; %u frames were not "
+			    "recorded", (unsigned)ctx->seg_dropped);
+	}
+
+	SDL_DestroyMutex(ctx->seg_mtx);
+	ctx->seg_nenc = 0;
+}
+
+/**
+ * Creates the AVC decoder configuration record from the SPS and PPS NAL units
+ * given by x264, and initialises the container with it.
+ */
+static int init_container(rec_ctx *ctx)
+{
+	struct mkv_buf_s avcc = { 0 };
+	const Uint8 *sps = NULL, *pps = NULL;
+	Uint16 sps_len = 0, pps_len = 0;
+	x264_nal_t *nal;
+	int nnal;
+	int ret;
+
+	if(x264_encoder_headers(ctx->h, &nal, &nnal) < 0)
+		return -1;
+
+	for(int i = 0; i < nnal; i++)
+	{
+		/* Skip the four byte length prefix. */
+		if(nal[i].i_type == NAL_SPS)
+		{
+			sps = nal[i].p_payload + 4;
+			sps_len = nal[i].i_payload - 4;
+		}
+		else if(nal[i].i_type == NAL_PPS)
+		{
+			pps = nal[i].p_payload + 4;
+			pps_len = nal[i].i_payload - 4;
+		}
+	}
+
+	if(sps == NULL || pps == NULL || sps_len < 4)
+	{
+		SDL_SetError("x264 did not provide parameter sets");
+		return -1;
+	}
+
+	mkv_put_be(&avcc, 1, 1);
+	mkv_put(&avcc, sps + 1, 3);
+	mkv_put_be(&avcc, 0xFF, 1);
+	mkv_put_be(&avcc, 0xE1, 1);
+	mkv_put_be(&avcc, sps_len, 2);
+	mkv_put(&avcc, sps, sps_len);
+	mkv_put_be(&avcc, 1, 1);
+	mkv_put_be(&avcc, pps_len, 2);
+	mkv_put(&avcc, pps, pps_len);
+
+	SDL_LockMutex(ctx->mkv.mtx);
+	ret = mkv_init(&ctx->mkv, ctx->param.i_width, ctx->param.i_height,
+		       ctx->sample_rate, avcc.dat, avcc.len);
+	SDL_UnlockMutex(ctx->mkv.mtx);
+
+	SDL_free(avcc.dat);
+	return ret;
+}
+
+/**
+ * Sign extends 16-bit samples to the 32-bit samples expected by Wavpack.
+ */
+static void widen_samples(Sint32 *restrict out, const Sint16 *restrict in,
+			  size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for(; i + 8 <= n; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		/* Place each sample in the upper half of a 32-bit lane, and
+		 * shift it back down to extend the sign. */
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		_mm_storeu_si128((__m128i *)(out + i), lo);
+		_mm_storeu_si128((__m128i *)(out + i + 4), hi);
+	}
+#elif defined(__ARM_NEON)
+	for(; i + 8 <= n; i += 8)
 	{
-		/* TODO: Use WavpackUpdateNumSamples() on this before closing file. */
-		ctx->first_block = SDL_malloc(bcount);
-		SDL_memcpy(ctx->first_block, data, bcount);
-		ctx->first_block_sz = bcount;
+		int16x8_t v = vld1q_s16(in + i);
+		vst1q_s32(out + i, vmovl_s16(vget_low_s16(v)));
+		vst1q_s32(out + i + 4, vmovl_s16(vget_high_s16(v)));
 	}
+#endif
 
-	return SDL_RWwrite(ctx->fa, data, bcount, 1) > 0 ? SDL_TRUE : SDL_FALSE;
+	for(; i < n; i++)
+		out[i] = in[i];
+}
+
+/**
+ * Encodes audio placed in the ring buffer by rec_enc_audio(). Exits once
+ * requested to and the ring buffer is empty.
+ */
+static int aud_thread_enc(void *data)
+{
+	rec_ctx *ctx = data;
+
+	SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+	trace_thread_name("Audio Encode");
+
+	while(1)
+	{
+		Uint32 rd = (Uint32)SDL_AtomicGet(&ctx->aring_rd);
+		Uint32 wr = (Uint32)SDL_AtomicGet(&ctx->aring_wr);
+		Uint32 avail = wr - rd;
+		Uint32 off = rd & (AUDIO_RING_SAMPLES - 1);
+		Uint32 n;
+
+		if(avail == 0)
+		{
+			if(SDL_AtomicGet(&ctx->aenc_quit) != 0)
+				break;
+
+			SDL_SemWaitTimeout(ctx->aenc_sem, AUDIO_ENC_POLL_MS);
+			continue;
+		}
+
+		/* Only whole stereo frames up to the end of the ring are
+		 * encoded at once. */
+		n = SDL_min(avail, AUDIO_ENC_SAMPLES);
+		n = SDL_min(n, AUDIO_RING_SAMPLES - off);
+		n &= ~1U;
+
+		trace_begin("Encode audio");
+		widen_samples(ctx->samples, ctx->aring + off, n);
+		SDL_AtomicSet(&ctx->aring_rd, (int)(rd + n));
+
+		if(WavpackPackSamples(ctx->wpc, ctx->samples, n / 2) == 0 &&
+		   ctx->aenc_failed == SDL_FALSE)
+		{
+			ctx->aenc_failed = SDL_TRUE;
+			SDL_LogWarn(SDL_LOG_CATEGORY_AUDIO, "Wavpack was unable to "
+				    "encode audio; audio will not be recorded, "
+				    "and this message will no longer appear.");
+		}
+		trace_end("Encode audio");
+	}
+
+	return 0;
 }
 
 static int vid_thread_cmd(void *data)
 {
 	rec_ctx *ctx = data;
+	SDL_sem *init_done = ctx->venc_init_done;
+	int *init_ret = ctx->venc_init_ret;
 
+	trace_thread_name("Encode");
 	ctx->h = x264_encoder_open(&ctx->param);
 	if(ctx->h == NULL)
 		goto end;
 
-	{
-		x264_nal_t *nal;
-		int nnal;
-		if(x264_encoder_headers(ctx->h, &nal, &nnal) < 0)
-			goto end;
+	if(init_container(ctx) != 0)
+		goto end;
 
-		for(int i = 0; i < nnal; i++)
-		{
-			if(SDL_RWwrite(ctx->fv, nal[i].p_payload,
-				       nal[i].i_payload, 1) == 0)
-				goto end;
-		}
+	/* In segment mode, this encoder was only used to obtain the parameter
+	 * sets, which are identical for all segment encoders. */
+	if(ctx->seg_frames != 0)
+	{
+		x264_encoder_close(ctx->h);
+		ctx->h = NULL;
 	}
 
 	ctx->venc_stor.cmd = VID_CMD_NO_CMD;
 
+	if(init_done != NULL)
+	{
+		*init_ret = 0;
+		SDL_SemPost(init_done);
+		init_done = NULL;
+	}
+
 	SDL_AtomicUnlock(&ctx->venc_slk);
 
 	/* Loop until a request is made to finish video recording. */
@@ -144,6 +1465,16 @@ static int vid_thread_cmd(void *data)
 		case VID_CMD_ENCODE_FRAME:
 		{
 			int i_nal;
+
+			if(ctx->seg_frames != 0)
+			{
+				trace_begin("Dispatch frame");
+				seg_dispatch(ctx, ctx->venc_stor.dat.pixels,
+					     ctx->venc_stor.pts);
+				trace_end("Dispatch frame");
+				break;
+			}
+
 			int i_frame_size;
 			x264_picture_t pic;
 			x264_picture_t pic_out;
@@ -157,28 +1488,29 @@ static int vid_thread_cmd(void *data)
 			pic.img.plane[0] = ctx->venc_stor.dat.pixels->pixels;
 
 			pic.i_type = X264_TYPE_AUTO;
+			pic.i_pts = ctx->venc_stor.pts;
 
+			trace_begin("Encode frame");
 			i_frame_size = x264_encoder_encode(ctx->h, &nal, &i_nal,
 							   &pic, &pic_out);
-			if(i_frame_size < 0)
-				break;
+			util_surf_put(ctx->venc_stor.dat.pixels);
 
-			if(i_frame_size == 0)
-				break;
-
-			for(int i = 0; i < i_nal; i++)
-			{
-				SDL_RWwrite(ctx->fv, nal[i].p_payload,
-					    nal[i].i_payload, 1);
-			}
-
-			SDL_FreeSurface(ctx->venc_stor.dat.pixels);
+			if(i_frame_size > 0)
+				write_frame_nals(ctx, nal, i_nal, &pic_out,
+						 NULL);
 
+			trace_end("Encode frame");
 			break;
 		}
 
 		case VID_CMD_ENCODE_FINISH:
 		{
+			if(ctx->seg_frames != 0)
+			{
+				seg_close(ctx);
+				goto end;
+			}
+
 			/* Flush delayed frames */
 			while(x264_encoder_delayed_frames(ctx->h))
 			{
@@ -194,17 +1526,10 @@ static int vid_thread_cmd(void *data)
 				if(i_frame_size == 0)
 					continue;
 
-				for(int i = 0; i < i_nal; i++)
-				{
-					SDL_RWwrite(ctx->fv, nal[i].p_payload,
-						    nal[i].i_payload, 1);
-				}
+				write_frame_nals(ctx, nal, i_nal, &pic_out,
+						 NULL);
 			}
 
-			SDL_free(ctx->samples);
-			ctx->samples = NULL;
-			ctx->samples_sz = 0;
-
 			goto end;
 		}
 		}
@@ -213,57 +1538,77 @@ static int vid_thread_cmd(void *data)
 	}
 
 end:
-	x264_encoder_close(ctx->h);
+	if(ctx->h != NULL)
+		x264_encoder_close(ctx->h);
+
+	if(ctx->seg_nenc != 0)
+		seg_stop(ctx);
+
+	/* The audio encoder drains the ring before exiting. */
+	SDL_AtomicSet(&ctx->aenc_quit, 1);
+	SDL_SemPost(ctx->aenc_sem);
+	SDL_WaitThread(ctx->aenc_th, NULL);
+
 	WavpackFlushSamples(ctx->wpc);
+	WavpackCloseFile(ctx->wpc);
 
-	if(ctx->first_block != NULL)
+	if(SDL_AtomicGet(&ctx->aring_dropped) != 0)
 	{
-		WavpackUpdateNumSamples(ctx->wpc, ctx->first_block);
-		SDL_RWseek(ctx->fa, 0, RW_SEEK_SET);
-		SDL_RWwrite(ctx->fa, ctx->first_block, ctx->first_block_sz, 1);
+		SDL_LogWarn(SDL_LOG_CATEGORY_AUDIO,
+			    "Audio encoder fell behind; %d samples were "
+			    "replaced with silence",
+			    SDL_AtomicGet(&ctx->aring_dropped));
 	}
 
-	WavpackCloseFile(ctx->wpc);
-
-	SDL_RWclose(ctx->fv);
-	SDL_RWclose(ctx->fa);
+	mkv_end(&ctx->mkv, 1000.0 / ctx->fps);
 
+	SDL_DestroySemaphore(ctx->aenc_sem);
+	SDL_free(ctx->aring);
+	SDL_free(ctx->samples);
 	SDL_free(ctx);
+	SDL_AtomicAdd(&rec_writers, -1);
+
+	/* The context has been freed, so rec_init() must not return it. */
+	if(init_done != NULL)
+	{
+		*init_ret = -1;
+		SDL_SemPost(init_done);
+	}
 
 	return 0;
 }
 
 rec_ctx *rec_init(const char *fileout, int width, int height, double fps,
-	      Sint32 sample_rate)
+	      Sint32 sample_rate, Uint8 segment_sec, size_t replay_bytes,
+	      SDL_bool realtime)
 {
 	rec_ctx *ctx = SDL_calloc(1, sizeof(rec_ctx));
+	SDL_sem *init_done = NULL;
+	int init_ret = -1;
 
 	if(ctx == NULL)
 		goto out;
 
+	ctx->offline = realtime ? SDL_FALSE : SDL_TRUE;
+
 	ctx->venc_mtx = SDL_CreateMutex();
 	ctx->venc_cond = SDL_CreateCond();
+	ctx->mkv.mtx = SDL_CreateMutex();
+	ctx->sample_rate = sample_rate > 0 ? sample_rate : 1;
 
 	/* Initialise Wavpack */
 	SDL_LogVerbose(SDL_LOG_CATEGORY_AUDIO, "Initialising Wavpack %s",
 		       WavpackGetLibraryVersionString());
 
-	/* TODO: Fix this workaround. */
+	/* A replay is only written to a file on request. */
+	ctx->mkv.replay_max = replay_bytes;
+	ctx->mkv.audio_q_ms = MKV_AUDIO_QUEUE_MS;
+	if(replay_bytes == 0)
 	{
-		char *fileout_wav = SDL_strdup(fileout);
-		char *dot_loc = SDL_strrchr(fileout_wav, '.');
-		*(++dot_loc) = 'w';
-		*(++dot_loc) = 'v';
-		*(++dot_loc) = '\0';
-		ctx->fa = SDL_RWFromFile(fileout_wav, "wb");
-		SDL_free(fileout_wav);
+		ctx->mkv.f = SDL_RWFromFile(fileout, "wb");
+		if(ctx->mkv.f == NULL)
+			goto err;
 	}
-	if(ctx->fa == NULL)
-		goto err;
-
-	ctx->fv = SDL_RWFromFile(fileout, "wb");
-	if(ctx->fv == NULL)
-		goto err;
 
 	ctx->wpc = WavpackOpenFileOutput(wav_pack_write_file, ctx, NULL);
 	WavpackConfig config = {
@@ -286,6 +1631,16 @@ rec_ctx *rec_init(const char *fileout, int width, int height, double fps,
 
 	SDL_assert_always(WavpackPackInit(ctx->wpc));
 
+	ctx->aring = SDL_malloc(AUDIO_RING_SAMPLES * sizeof(*ctx->aring));
+	ctx->samples = SDL_malloc(AUDIO_ENC_SAMPLES * sizeof(*ctx->samples));
+	ctx->aenc_sem = SDL_CreateSemaphore(0);
+	if(ctx->aring == NULL || ctx->samples == NULL || ctx->aenc_sem == NULL)
+		goto err;
+
+	ctx->aenc_th = SDL_CreateThread(aud_thread_enc, "Audio Encode", ctx);
+	if(ctx->aenc_th == NULL)
+		goto err;
+
 	x264_param_default(&ctx->param);
 	ctx->preset = preset_max;
 
@@ -298,7 +1653,6 @@ rec_ctx *rec_init(const char *fileout, int width, int height, double fps,
 	ctx->param.pf_log = x264_log;
 	ctx->param.i_csp = X264_CSP_RGB;
 	ctx->param.i_bitdepth = 8;
-	ctx->param.b_vfr_input = 0;
 	ctx->param.rc.i_rc_method = X264_RC_CRF;
 	ctx->param.rc.f_rf_constant = 18;
 	ctx->param.b_opencl = 1;
@@ -314,36 +1668,165 @@ rec_ctx *rec_init(const char *fileout, int width, int height, double fps,
 		fps = 1.0;
 
 	SDL_assert(fps < 256.0);
+	ctx->fps = fps;
 	ctx->param.i_fps_num = (uint32_t)(fps * 16777216.0);
 	ctx->param.i_fps_den = 16777216;
 	SDL_LogVerbose(SDL_LOG_CATEGORY_VIDEO, "Requested video FPS: %.1f",
 		       ((float)ctx->param.i_fps_num / ctx->param.i_fps_den));
 
+	/* Timestamps are given in units of emulated frames, so that skipped and
+	 * duplicated frames do not desynchronise the audio and video. */
+	ctx->param.b_vfr_input = 1;
+	ctx->param.i_timebase_num = ctx->param.i_fps_den;
+	ctx->param.i_timebase_den = ctx->param.i_fps_num;
+
+	/* Matroska stores NAL units with a length prefix, and the parameter
+	 * sets in the track header. */
+	ctx->param.b_annexb = 0;
 	ctx->param.i_threads = 0;
 	ctx->param.b_repeat_headers = 0;
+
+	/* Shorter GOPs reduce the amount of the replay that is lost when the
+	 * oldest GOP is dropped. */
+	if(replay_bytes != 0)
+		ctx->param.i_keyint_max = (int)SDL_ceil(fps * 2.0);
+
+	if(segment_sec != 0)
+	{
+		int cpus = SDL_GetCPUCount();
+		Uint32 frame_sz = (Uint32)width * (Uint32)height * 3;
+
+		ctx->seg_frames = (Uint32)SDL_ceil(fps * segment_sec);
+		ctx->seg_nenc = SDL_min(SDL_max(cpus / 2, 2), SEG_MAX_ENCODERS);
+
+		/* Share the available processors between the encoders. Each
+		 * segment is a closed GOP starting with an IDR frame. */
+		ctx->param.i_threads = SDL_max(cpus / ctx->seg_nenc, 1);
+		ctx->param.i_keyint_max = ctx->seg_frames;
+		ctx->param.b_open_gop = 0;
+		ctx->param.b_repeat_headers = 1;
+
+		ctx->seg_mtx = SDL_CreateMutex();
+		ctx->seg_free_max =
+			SDL_max(SEG_QUEUE_BYTES / SDL_max(frame_sz, 1), 1);
+		ctx->seg_free = SDL_CreateSemaphore(ctx->seg_free_max);
+		if(ctx->seg_mtx == NULL || ctx->seg_free == NULL)
+			goto err;
+
+		/* Video is only written once a segment and all segments before
+		 * it are encoded, so it lags behind the audio by up to the
+		 * frames waiting to be encoded and a segment per encoder. */
+		ctx->mkv.audio_q_ms += (Uint64)((double)(ctx->seg_free_max +
+			ctx->seg_frames * (ctx->seg_nenc + 1U)) * 1000.0 / fps);
+
+		for(Uint8 i = 0; i < ctx->seg_nenc; i++)
+		{
+			struct seg_enc_s *enc = &ctx->seg_enc[i];
+
+			enc->ctx = ctx;
+			enc->mtx = SDL_CreateMutex();
+			enc->cond = SDL_CreateCond();
+			if(enc->mtx == NULL || enc->cond == NULL)
+				goto err;
+
+			enc->th = SDL_CreateThread(seg_thread_enc,
+						   "Segment Encode", enc);
+			if(enc->th == NULL)
+				goto err;
+		}
+
+		SDL_LogVerbose(SDL_LOG_CATEGORY_VIDEO,
+			       "Encoding %u frame segments with %u encoders",
+			       (unsigned)ctx->seg_frames,
+			       (unsigned)ctx->seg_nenc);
+	}
+
+	/* Offline recordings must not lose any frames, so the result of
+	 * initialising the video encoder is waited for. */
+	if(ctx->offline)
+	{
+		init_done = SDL_CreateSemaphore(0);
+		if(init_done == NULL)
+			goto err;
+
+		ctx->venc_init_done = init_done;
+		ctx->venc_init_ret = &init_ret;
+	}
+
 	ctx->venc_stor.cmd = VID_CMD_ENCODE_INIT;
 
 	/* Block until Initialisation is complete. */
 	SDL_AtomicLock(&ctx->venc_slk);
+	SDL_AtomicAdd(&rec_writers, 1);
 	ctx->venc_th = SDL_CreateThread(vid_thread_cmd, "Encode", ctx);
+	if(ctx->venc_th == NULL)
+	{
+		SDL_AtomicAdd(&rec_writers, -1);
+		goto err;
+	}
+
+	SDL_DetachThread(ctx->venc_th);
+
+	if(init_done != NULL)
+	{
+		/* The encoder thread frees the context if it fails. */
+		SDL_SemWait(init_done);
+		SDL_DestroySemaphore(init_done);
+		if(init_ret != 0)
+		{
+			SDL_SetError("Unable to initialise the video encoder");
+			ctx = NULL;
+		}
+	}
 
 out:
 	return ctx;
 
 err:
+	if(ctx->seg_nenc != 0)
+		seg_stop(ctx);
+
+	if(ctx->aenc_th != NULL)
+	{
+		SDL_AtomicSet(&ctx->aenc_quit, 1);
+		SDL_WaitThread(ctx->aenc_th, NULL);
+	}
+
+	if(ctx->mkv.f != NULL)
+		SDL_RWclose(ctx->mkv.f);
+
+	if(ctx->aenc_sem != NULL)
+		SDL_DestroySemaphore(ctx->aenc_sem);
+
+	if(init_done != NULL)
+		SDL_DestroySemaphore(init_done);
+
+	SDL_DestroyMutex(ctx->mkv.mtx);
+	SDL_free(ctx->aring);
+	SDL_free(ctx->samples);
 	SDL_free(ctx);
 	ctx = NULL;
 	goto out;
 }
 
-void rec_enc_video(rec_ctx *ctx, SDL_Surface *surf)
+void rec_enc_video(rec_ctx *ctx, SDL_Surface *surf, Uint32 frame)
 {
 	if(ctx == NULL || ctx->venc_stor.cmd == VID_CMD_ENCODE_INIT ||
 	   surf == NULL)
+	{
+		util_surf_put(surf);
 		return;
+	}
+
+	if(ctx->first_frame_set == SDL_FALSE)
+	{
+		ctx->first_frame = frame;
+		ctx->first_frame_set = SDL_TRUE;
+	}
 
 	SDL_AtomicLock(&ctx->venc_slk);
 	ctx->venc_stor.dat.pixels = surf;
+	ctx->venc_stor.pts = (Sint64)frame - ctx->first_frame;
 	ctx->venc_stor.cmd = VID_CMD_ENCODE_FRAME;
 
 	SDL_LockMutex(ctx->venc_mtx);
@@ -365,7 +1848,8 @@ static void apply_preset(rec_ctx *ctx)
 
 void rec_set_crf(rec_ctx *ctx, Uint8 crf)
 {
-	if(ctx == NULL)
+	/* Segment encoders are configured when each segment starts. */
+	if(ctx == NULL || ctx->seg_frames != 0)
 		return;
 
 	SDL_AtomicLock(&ctx->venc_slk);
@@ -377,7 +1861,7 @@ void rec_set_crf(rec_ctx *ctx, Uint8 crf)
 void rec_speedup(rec_ctx *ctx)
 {
 	if(ctx == NULL || ctx->venc_stor.cmd == VID_CMD_ENCODE_INIT ||
-	   ctx->preset <= 2)
+	   ctx->seg_frames != 0 || ctx->preset <= 2)
 		return;
 
 	SDL_AtomicLock(&ctx->venc_slk);
@@ -389,7 +1873,7 @@ void rec_speedup(rec_ctx *ctx)
 void rec_relax(rec_ctx *ctx)
 {
 	if(ctx == NULL || ctx->venc_stor.cmd == VID_CMD_ENCODE_INIT ||
-	   ctx->preset == preset_max)
+	   ctx->seg_frames != 0 || ctx->preset == preset_max)
 		return;
 
 	SDL_AtomicLock(&ctx->venc_slk);
@@ -400,64 +1884,81 @@ void rec_relax(rec_ctx *ctx)
 
 void rec_enc_audio(rec_ctx *ctx, const Sint16 *data, uint32_t frames)
 {
-	int ret;
-	size_t samples = frames * 2;
+	Uint32 samples = frames * 2;
+	Uint32 wr, rd, off, first;
 
-	if(ctx == NULL || ctx->venc_stor.cmd == VID_CMD_ENCODE_INIT)
+	/* The ring is ready before the video encoder has initialised, but
+	 * audio is held back to match the video in real time recordings. */
+	if(ctx == NULL ||
+	   (ctx->venc_stor.cmd == VID_CMD_ENCODE_INIT && !ctx->offline))
 		return;
 
-	if(ctx->samples_sz < samples * sizeof(Sint32))
+	wr = (Uint32)SDL_AtomicGet(&ctx->aring_wr);
+	rd = (Uint32)SDL_AtomicGet(&ctx->aring_rd);
+
+	while(ctx->offline && samples > AUDIO_RING_SAMPLES - (wr - rd) &&
+	      samples <= AUDIO_RING_SAMPLES)
 	{
-		ctx->samples_sz = samples * sizeof(Sint32);
-		ctx->samples = SDL_realloc(ctx->samples, ctx->samples_sz);
+		SDL_Delay(1);
+		rd = (Uint32)SDL_AtomicGet(&ctx->aring_rd);
 	}
 
-	if(ctx->samples == NULL)
+	/* Previously dropped samples are replaced with silence before any
+	 * further samples are written. */
+	while(ctx->aring_gap != 0 && wr - rd < AUDIO_RING_SAMPLES)
 	{
-		static Uint8 once = 1;
-		if(once == 0)
-			return;
-
-		once = 0;
-		SDL_LogWarn(SDL_LOG_CATEGORY_AUDIO, "Unable to allocate audio"
-						    " buffer; audio will not be recorded, "
-						    "and this message will no longer appear.");
-		return;
+		off = wr & (AUDIO_RING_SAMPLES - 1);
+		first = SDL_min(ctx->aring_gap, AUDIO_RING_SAMPLES - (wr - rd));
+		first = SDL_min(first, AUDIO_RING_SAMPLES - off);
+		SDL_memset(ctx->aring + off, 0, first * sizeof(*ctx->aring));
+		ctx->aring_gap -= first;
+		wr += first;
 	}
 
-	for(size_t i = 0; i < samples; i++)
-		ctx->samples[i] = data[i];
-
-	ret = WavpackPackSamples(ctx->wpc, ctx->samples, frames);
-	if(ret == 0)
+	/* Drop the samples if the encoder has fallen behind, rather than
+	 * stalling the emulation thread. */
+	if(ctx->aring_gap != 0 || samples > AUDIO_RING_SAMPLES - (wr - rd))
 	{
-		static Uint8 once = 1;
-		if(once == 0)
-			return;
-
-		SDL_LogWarn(SDL_LOG_CATEGORY_AUDIO, "Wavpack was unable to "
-						    "encode audio; audio will not be "
-						    "recorded, and this message will no longer appear.");
-		return;
+		SDL_AtomicAdd(&ctx->aring_dropped, (int)samples);
+		ctx->aring_gap += samples;
+		goto out;
 	}
 
-	return;
+	off = wr & (AUDIO_RING_SAMPLES - 1);
+	first = SDL_min(samples, AUDIO_RING_SAMPLES - off);
+	SDL_memcpy(ctx->aring + off, data, first * sizeof(*data));
+	SDL_memcpy(ctx->aring, data + first, (samples - first) * sizeof(*data));
+	wr += samples;
+
+out:
+	/* Publish the samples to the encoder thread. */
+	SDL_AtomicSet(&ctx->aring_wr, (int)wr);
 }
 
-Sint64 rec_video_size(rec_ctx *ctx)
+Sint64 rec_size(rec_ctx *ctx)
 {
+	Sint64 sz;
+
 	if(ctx == NULL || ctx->venc_stor.cmd == VID_CMD_ENCODE_FINISH)
 		return -1;
 
-	return SDL_RWtell(ctx->fv);
+	SDL_LockMutex(ctx->mkv.mtx);
+	sz = ctx->mkv.written + ctx->mkv.cluster.len + ctx->mkv.replay_sz;
+	SDL_UnlockMutex(ctx->mkv.mtx);
+
+	return sz;
 }
 
-Sint64 rec_audio_size(rec_ctx *ctx)
+int rec_backlog(rec_ctx *ctx)
 {
-	if(ctx == NULL || ctx->venc_stor.cmd == VID_CMD_ENCODE_FINISH)
+	if(ctx == NULL)
 		return -1;
 
-	return SDL_RWtell(ctx->fa);
+	if(ctx->seg_free != NULL)
+		return (int)(ctx->seg_free_max - SDL_SemValue(ctx->seg_free));
+
+	/* Without segments, at most one frame waits for the encoder. */
+	return ctx->venc_stor.cmd == VID_CMD_ENCODE_FRAME ? 1 : 0;
 }
 
 void rec_end(rec_ctx **ctxp)
@@ -477,8 +1978,571 @@ void rec_end(rec_ctx **ctxp)
 	return;
 }
 
+struct replay_save_s {
+	struct mkv_s mkv;
+	struct mkv_cluster_s *clusters;
+	double frame_ms;
+	char *fileout;
+};
+
+/**
+ * Writes the clusters taken from the replay ring to a new file, with
+ * timestamps starting from zero.
+ */
+static void replay_save_job(void *data)
+{
+	struct replay_save_s *rs = data;
+	struct mkv_s *m = &rs->mkv;
+	Uint64 base = rs->clusters->tc;
+
+	trace_begin("Save replay");
+	mkv_flush_buf(m, &m->hdr);
+	for(struct mkv_cluster_s *c = rs->clusters; c != NULL; c = c->next)
+		mkv_write_cluster(m, c->tc - base, c->key, &c->body);
+
+	mkv_end(m, rs->frame_ms);
+	SDL_LogInfo(SDL_LOG_CATEGORY_VIDEO, "Replay saved to \"%s\"",
+		    rs->fileout);
+
+	mkv_free_clusters(rs->clusters);
+	SDL_free(rs->fileout);
+	SDL_free(rs);
+	trace_end("Save replay");
+	SDL_AtomicAdd(&rec_writers, -1);
+}
+
+int rec_replay_save(rec_ctx *ctx, const char *fileout)
+{
+	struct replay_save_s *rs;
+	struct mkv_s *m;
+
+	if(ctx == NULL || ctx->mkv.replay_max == 0)
+		return SDL_SetError("Replay recording is not active");
+
+	rs = SDL_calloc(1, sizeof(struct replay_save_s));
+	if(rs == NULL)
+		return SDL_OutOfMemory();
+
+	rs->fileout = SDL_strdup(fileout);
+	rs->frame_ms = 1000.0 / ctx->fps;
+	rs->mkv.mtx = SDL_CreateMutex();
+	if(rs->fileout == NULL || rs->mkv.mtx == NULL)
+		goto err;
+
+	/* The replay is updated by the muxer under the lock. */
+	m = &ctx->mkv;
+	SDL_LockMutex(m->mtx);
+	if(m->replay_head == NULL && m->cluster_key == SDL_FALSE)
+	{
+		SDL_UnlockMutex(m->mtx);
+		SDL_SetError("Replay is empty");
+		goto err;
+	}
+
+	rs->mkv.f = SDL_RWFromFile(fileout, "wb");
+	if(rs->mkv.f == NULL)
+	{
+		SDL_UnlockMutex(m->mtx);
+		goto err;
+	}
+
+	/* Take ownership of the replay, so that encoding may continue while
+	 * the replay is written to disk. */
+	mkv_flush_cluster(m);
+	rs->clusters = m->replay_head;
+	m->replay_head = NULL;
+	m->replay_tail = NULL;
+	m->replay_sz = 0;
+
+	mkv_put(&rs->mkv.hdr, m->hdr.dat, m->hdr.len);
+	rs->mkv.segment_size_pos = m->segment_size_pos;
+	rs->mkv.segment_data_pos = m->segment_data_pos;
+	rs->mkv.cues_seek_pos = m->cues_seek_pos;
+	rs->mkv.duration_pos = m->duration_pos;
+	rs->mkv.audio_priv_pos = m->audio_priv_pos;
+	rs->mkv.audio_version = m->audio_version;
+	rs->mkv.last_tc = m->last_tc;
+	SDL_UnlockMutex(m->mtx);
+
+	if(rs->clusters == NULL)
+	{
+		SDL_SetError("Replay is empty");
+		goto err;
+	}
+
+	rs->mkv.last_tc -= rs->clusters->tc;
+
+	SDL_AtomicAdd(&rec_writers, 1);
+	if(pool_submit(replay_save_job, rs, POOL_PRIO_NORMAL) != 0)
+	{
+		SDL_AtomicAdd(&rec_writers, -1);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	if(rs->mkv.f != NULL)
+		SDL_RWclose(rs->mkv.f);
+
+	mkv_free_clusters(rs->clusters);
+	SDL_DestroyMutex(rs->mkv.mtx);
+	SDL_free(rs->mkv.hdr.dat);
+	SDL_free(rs->fileout);
+	SDL_free(rs);
+	return -1;
+}
+
 #endif /* ENABLE_VIDEO_RECORDING */
 
+/* Size of each write made by the raw capture backend. */
+#define RAW_WRITE_SZ		(4 * 1024 * 1024)
+
+/* Frames waiting to be written before further frames are dropped. Must be a
+ * power of two. */
+#define RAW_QUEUE_MAX		64
+
+/* Interleaved audio samples waiting to be written before further samples are
+ * dropped. Must be a power of two. */
+#define RAW_AUDIO_SAMPLES	(1 << 17)
+
+/* Time that the capture thread waits for more data before checking again. */
+#define RAW_POLL_MS		10
+
+#if SDL_VERSION_ATLEAST(2, 0, 10)
+#define raw_alloc(sz)	SDL_SIMDAlloc(sz)
+#define raw_free(ptr)	SDL_SIMDFree(ptr)
+#else
+#define raw_alloc(sz)	SDL_malloc(sz)
+#define raw_free(ptr)	SDL_free(ptr)
+#endif
+
+/* Output file that is written to in blocks of RAW_WRITE_SZ bytes. */
+struct raw_stream_s {
+	SDL_RWops *f;
+	Uint8 *buf;
+	size_t len;
+	Uint64 written;
+};
+
+struct raw_frame_s {
+	SDL_Surface *surf;
+	Uint32 frame;
+};
+
+struct rec_raw_s {
+	struct raw_stream_s vid;
+	struct raw_stream_s aud;
+	struct raw_stream_s ts;
+	int width;
+	int height;
+	double fps;
+	Sint32 sample_rate;
+	Uint8 *yuv;
+	size_t yuv_sz;
+	Uint32 first_frame;
+	SDL_bool first_frame_set;
+
+	/* Single producer, single consumer rings of frames and interleaved
+	 * samples. The emulation thread writes to the rings, and the capture
+	 * thread reads from them. Indexes are free running and wrap on
+	 * overflow. */
+	struct raw_frame_s vring[RAW_QUEUE_MAX];
+	SDL_atomic_t vring_wr;
+	SDL_atomic_t vring_rd;
+	Sint16 *aring;
+	SDL_atomic_t aring_wr;
+	SDL_atomic_t aring_rd;
+
+	SDL_atomic_t dropped_frames;
+	SDL_atomic_t dropped_samples;
+	SDL_atomic_t quit;
+	SDL_sem *sem;
+	SDL_Thread *th;
+};
+
+static int raw_stream_open(struct raw_stream_s *s, const char *prefix,
+			   const char *ext)
+{
+	size_t len = SDL_strlen(prefix) + SDL_strlen(ext) + 2;
+	char *filename = SDL_malloc(len);
+
+	if(filename == NULL)
+		return SDL_OutOfMemory();
+
+	SDL_snprintf(filename, len, "%s.%s", prefix, ext);
+	s->buf = raw_alloc(RAW_WRITE_SZ);
+	s->f = SDL_RWFromFile(filename, "wb");
+	SDL_free(filename);
+
+	if(s->buf == NULL || s->f == NULL)
+		return -1;
+
+	return 0;
+}
+
+static void raw_stream_put(struct raw_stream_s *s, const void *dat,
+			   size_t len)
+{
+	const Uint8 *p = dat;
+
+	while(len > 0)
+	{
+		size_t n = SDL_min(len, RAW_WRITE_SZ - s->len);
+
+		SDL_memcpy(s->buf + s->len, p, n);
+		s->len += n;
+		p += n;
+		len -= n;
+
+		if(s->len == RAW_WRITE_SZ)
+		{
+			if(SDL_RWwrite(s->f, s->buf, RAW_WRITE_SZ, 1) != 1)
+			{
+				SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO,
+					    "Unable to write raw capture: %s",
+					    SDL_GetError());
+			}
+
+			s->written += s->len;
+			s->len = 0;
+		}
+	}
+}
+
+static void raw_stream_flush(struct raw_stream_s *s)
+{
+	if(s->f != NULL && s->len != 0)
+		SDL_RWwrite(s->f, s->buf, s->len, 1);
+
+	s->written += s->len;
+	s->len = 0;
+}
+
+static void raw_stream_close(struct raw_stream_s *s)
+{
+	raw_stream_flush(s);
+
+	if(s->f != NULL)
+		SDL_RWclose(s->f);
+
+	raw_free(s->buf);
+}
+
+/**
+ * Writes a WAV header. The sizes are unknown until the capture has finished,
+ * so the maximum values are used which is understood by most readers of
+ * streamed WAV data.
+ */
+static void raw_wav_header(struct raw_stream_s *s, Sint32 sample_rate,
+			   Uint32 data_sz)
+{
+	Uint8 hdr[44];
+	Uint32 riff_sz = data_sz == SDL_MAX_UINT32 ? data_sz : data_sz + 36;
+	const Uint32 vals[] = {
+		riff_sz, 16, 1 | (2 << 16), (Uint32)sample_rate,
+		(Uint32)sample_rate * 4, 4 | (16 << 16), data_sz
+	};
+	const unsigned offs[] = { 4, 16, 20, 24, 28, 32, 40 };
+
+	SDL_memcpy(hdr, "RIFF....WAVEfmt ........................data", 40);
+	for(unsigned i = 0; i < SDL_arraysize(vals); i++)
+	{
+		hdr[offs[i] + 0] = vals[i] & 0xFF;
+		hdr[offs[i] + 1] = (vals[i] >> 8) & 0xFF;
+		hdr[offs[i] + 2] = (vals[i] >> 16) & 0xFF;
+		hdr[offs[i] + 3] = (vals[i] >> 24) & 0xFF;
+	}
+
+	raw_stream_put(s, hdr, sizeof(hdr));
+}
+
+static void raw_write_frame(rec_raw_ctx *ctx, const struct raw_frame_s *item)
+{
+	SDL_Surface *surf = item->surf;
+	char ts[32];
+	int len;
+
+	if(surf->w != ctx->width || surf->h != ctx->height)
+	{
+		SDL_AtomicAdd(&ctx->dropped_frames, 1);
+		return;
+	}
+
+	if(SDL_ConvertPixels(surf->w, surf->h, surf->format->format,
+			     surf->pixels, surf->pitch, SDL_PIXELFORMAT_IYUV,
+			     ctx->yuv, ctx->width) != 0)
+	{
+		SDL_AtomicAdd(&ctx->dropped_frames, 1);
+		return;
+	}
+
+	raw_stream_put(&ctx->vid, "FRAME\n", 6);
+	raw_stream_put(&ctx->vid, ctx->yuv, ctx->yuv_sz);
+
+	/* Presentation time of each frame in milliseconds. */
+	len = SDL_snprintf(ts, sizeof(ts), "%.3f\n",
+			   (double)(item->frame - ctx->first_frame) * 1000.0 /
+			   ctx->fps);
+	raw_stream_put(&ctx->ts, ts, len);
+}
+
+/**
+ * Writes the audio samples in the ring, up to the end of the ring.
+ *
+ * \return		SDL_TRUE if samples were written.
+ */
+static SDL_bool raw_write_audio(rec_raw_ctx *ctx)
+{
+	Uint32 rd = (Uint32)SDL_AtomicGet(&ctx->aring_rd);
+	Uint32 wr = (Uint32)SDL_AtomicGet(&ctx->aring_wr);
+	Uint32 off = rd & (RAW_AUDIO_SAMPLES - 1);
+	Uint32 n = SDL_min(wr - rd, RAW_AUDIO_SAMPLES - off);
+	Sint16 *dat = ctx->aring + off;
+
+	if(n == 0)
+		return SDL_FALSE;
+
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+	for(Uint32 i = 0; i < n; i++)
+		dat[i] = SDL_SwapLE16(dat[i]);
+#endif
+	raw_stream_put(&ctx->aud, dat, n * sizeof(Sint16));
+	SDL_AtomicSet(&ctx->aring_rd, (int)(rd + n));
+	return SDL_TRUE;
+}
+
+static int raw_thread(void *data)
+{
+	rec_raw_ctx *ctx = data;
+
+	trace_thread_name("Raw Capture");
+
+	while(1)
+	{
+		/* Read before the rings, so that they are empty once the last
+		 * of the input has been written. */
+		int quit = SDL_AtomicGet(&ctx->quit);
+		Uint32 rd = (Uint32)SDL_AtomicGet(&ctx->vring_rd);
+		Uint32 wr = (Uint32)SDL_AtomicGet(&ctx->vring_wr);
+		SDL_bool idle = SDL_TRUE;
+
+		if(rd != wr)
+		{
+			struct raw_frame_s *item =
+				&ctx->vring[rd & (RAW_QUEUE_MAX - 1)];
+
+			trace_begin("Write frame");
+			raw_write_frame(ctx, item);
+			util_surf_put(item->surf);
+			SDL_AtomicSet(&ctx->vring_rd, (int)(rd + 1));
+			trace_end("Write frame");
+			idle = SDL_FALSE;
+		}
+
+		if(raw_write_audio(ctx))
+			idle = SDL_FALSE;
+
+		if(idle == SDL_FALSE)
+			continue;
+
+		if(quit != 0)
+			break;
+
+		SDL_SemWaitTimeout(ctx->sem, RAW_POLL_MS);
+	}
+
+	if(SDL_AtomicGet(&ctx->dropped_frames) != 0)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_VIDEO,
+			    "%d frames were not captured",
+			    SDL_AtomicGet(&ctx->dropped_frames));
+	}
+
+	if(SDL_AtomicGet(&ctx->dropped_samples) != 0)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_AUDIO,
+			    "%d audio samples were not captured",
+			    SDL_AtomicGet(&ctx->dropped_samples));
+	}
+
+	/* Correct the WAV header if the output is not a pipe. */
+	raw_stream_flush(&ctx->aud);
+	if(SDL_RWseek(ctx->aud.f, 0, RW_SEEK_SET) == 0)
+	{
+		Uint64 data_sz = ctx->aud.written - 44;
+
+		if(data_sz > SDL_MAX_UINT32 - 36)
+			data_sz = SDL_MAX_UINT32;
+
+		raw_wav_header(&ctx->aud, ctx->sample_rate, (Uint32)data_sz);
+	}
+
+	raw_stream_close(&ctx->aud);
+
+	raw_stream_close(&ctx->vid);
+	raw_stream_close(&ctx->ts);
+	raw_free(ctx->yuv);
+	SDL_free(ctx->aring);
+	SDL_DestroySemaphore(ctx->sem);
+	SDL_free(ctx);
+	SDL_AtomicAdd(&rec_writers, -1);
+
+	return 0;
+}
+
+rec_raw_ctx *rec_raw_init(const char *prefix, int width, int height,
+			  double fps, Sint32 sample_rate)
+{
+	rec_raw_ctx *ctx = SDL_calloc(1, sizeof(rec_raw_ctx));
+	size_t chroma;
+	char hdr[128];
+	int len;
+
+	if(ctx == NULL)
+	{
+		SDL_OutOfMemory();
+		goto out;
+	}
+
+	if(fps < 1.0)
+		fps = 1.0;
+
+	ctx->width = width;
+	ctx->height = height;
+	ctx->fps = fps;
+	ctx->sample_rate = sample_rate;
+
+	/* Planar YUV 4:2:0, with chroma planes rounded up for odd sizes. */
+	chroma = (size_t)((width + 1) / 2) * (size_t)((height + 1) / 2);
+	ctx->yuv_sz = (size_t)width * (size_t)height + chroma * 2;
+	ctx->yuv = raw_alloc(ctx->yuv_sz);
+	ctx->aring = SDL_malloc(RAW_AUDIO_SAMPLES * sizeof(*ctx->aring));
+	ctx->sem = SDL_CreateSemaphore(0);
+	if(ctx->yuv == NULL || ctx->aring == NULL || ctx->sem == NULL)
+		goto err;
+
+	/* Opening a named pipe blocks until it is opened by the reader. */
+	if(raw_stream_open(&ctx->vid, prefix, "y4m") != 0 ||
+	   raw_stream_open(&ctx->aud, prefix, "wav") != 0 ||
+	   raw_stream_open(&ctx->ts, prefix, "txt") != 0)
+		goto err;
+
+	len = SDL_snprintf(hdr, sizeof(hdr),
+			   "YUV4MPEG2 W%d H%d F%u:1000 Ip A1:1 C420jpeg\n",
+			   width, height, (unsigned)SDL_ceil(fps * 1000.0));
+	raw_stream_put(&ctx->vid, hdr, len);
+	raw_wav_header(&ctx->aud, sample_rate, SDL_MAX_UINT32);
+
+	/* Timestamps are compatible with mkvmerge. */
+	raw_stream_put(&ctx->ts, "# timestamp format v2\n", 22);
+
+	SDL_AtomicAdd(&rec_writers, 1);
+	ctx->th = SDL_CreateThread(raw_thread, "Raw Capture", ctx);
+	if(ctx->th == NULL)
+	{
+		SDL_AtomicAdd(&rec_writers, -1);
+		goto err;
+	}
+
+	SDL_DetachThread(ctx->th);
+
+out:
+	return ctx;
+
+err:
+	raw_stream_close(&ctx->vid);
+	raw_stream_close(&ctx->aud);
+	raw_stream_close(&ctx->ts);
+	raw_free(ctx->yuv);
+	SDL_free(ctx->aring);
+	if(ctx->sem != NULL)
+		SDL_DestroySemaphore(ctx->sem);
+	SDL_free(ctx);
+	ctx = NULL;
+	goto out;
+}
+
+void rec_raw_video(rec_raw_ctx *ctx, SDL_Surface *surf, Uint32 frame)
+{
+	struct raw_frame_s *item;
+	Uint32 wr, rd;
+
+	if(ctx == NULL || surf == NULL)
+		goto drop;
+
+	if(ctx->first_frame_set == SDL_FALSE)
+	{
+		ctx->first_frame = frame;
+		ctx->first_frame_set = SDL_TRUE;
+	}
+
+	/* Do not block the emulation thread if the reader is slow. */
+	wr = (Uint32)SDL_AtomicGet(&ctx->vring_wr);
+	rd = (Uint32)SDL_AtomicGet(&ctx->vring_rd);
+	if(wr - rd >= RAW_QUEUE_MAX)
+	{
+		SDL_AtomicAdd(&ctx->dropped_frames, 1);
+		goto drop;
+	}
+
+	item = &ctx->vring[wr & (RAW_QUEUE_MAX - 1)];
+	item->surf = surf;
+	item->frame = frame;
+
+	/* Publish the frame to the capture thread. */
+	SDL_AtomicSet(&ctx->vring_wr, (int)(wr + 1));
+	SDL_SemPost(ctx->sem);
+	return;
+
+drop:
+	util_surf_put(surf);
+}
+
+void rec_raw_audio(rec_raw_ctx *ctx, const Sint16 *data, uint32_t frames)
+{
+	Uint32 samples = frames * 2;
+	Uint32 wr, rd, off, first;
+
+	if(ctx == NULL || frames == 0)
+		return;
+
+	wr = (Uint32)SDL_AtomicGet(&ctx->aring_wr);
+	rd = (Uint32)SDL_AtomicGet(&ctx->aring_rd);
+	if(samples > RAW_AUDIO_SAMPLES - (wr - rd))
+	{
+		SDL_AtomicAdd(&ctx->dropped_samples, (int)samples);
+		return;
+	}
+
+	off = wr & (RAW_AUDIO_SAMPLES - 1);
+	first = SDL_min(samples, RAW_AUDIO_SAMPLES - off);
+	SDL_memcpy(ctx->aring + off, data, first * sizeof(*data));
+	SDL_memcpy(ctx->aring, data + first, (samples - first) * sizeof(*data));
+
+	/* Publish the samples to the capture thread. */
+	SDL_AtomicSet(&ctx->aring_wr, (int)(wr + samples));
+	SDL_SemPost(ctx->sem);
+}
+
+void rec_raw_end(rec_raw_ctx **ctxp)
+{
+	rec_raw_ctx *ctx = *ctxp;
+
+	if(ctx == NULL)
+		return;
+
+	SDL_AtomicSet(&ctx->quit, 1);
+	SDL_SemPost(ctx->sem);
+	*ctxp = NULL;
+}
+
+void rec_wait_all(void)
+{
+	while(SDL_AtomicGet(&rec_writers) > 0)
+		SDL_Delay(10);
+}
+
 struct img_stor_s {
 	SDL_Surface *surf;
 	char core_name[12];
@@ -487,7 +2551,7 @@ struct img_stor_s {
 /**
  * Saves the SDL Surface to a WEBP or BMP image on the filesystem.
  */
-static int rec_single_img_thread(void *param)
+static void rec_single_img_job(void *param)
 {
 	struct img_stor_s *img = param;
 	SDL_Surface *surf;
@@ -500,11 +2564,7 @@ static int rec_single_img_thread(void *param)
 	const char fmt[] = "bmp";
 #endif
 
-	SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
-
-	if(param == NULL)
-		return -1;
-
+	trace_begin("Screenshot");
 	surf = img->surf;
 	gen_filename(filename, img->core_name, fmt);
 
@@ -529,19 +2589,26 @@ static int rec_single_img_thread(void *param)
 		    "Screenshot saved to \"%s\"\n", filename);
 
 out:
-	SDL_FreeSurface(surf);
+	util_surf_put(surf);
 	SDL_free(param);
-	return 0;
+	trace_end("Screenshot");
 }
 
 void rec_single_img(SDL_Surface *surf, const char *core_name)
 {
-	SDL_Thread *thread;
 	struct img_stor_s *img;
 
 	img = SDL_malloc(sizeof(struct img_stor_s));
+	if(img == NULL)
+	{
+		util_surf_put(surf);
+		return;
+	}
+
 	img->surf = surf;
 	SDL_strlcpy(img->core_name, core_name, SDL_arraysize(img->core_name));
-	thread = SDL_CreateThread(rec_single_img_thread, "Screenshot", img);
-	SDL_DetachThread(thread);
+
+	/* Save the screenshot on this thread if the pool is unavailable. */
+	if(pool_submit(rec_single_img_job, img, POOL_PRIO_LOW) != 0)
+		rec_single_img_job(img);
 }
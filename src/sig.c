@@ -17,8 +17,15 @@
 #include <stdlib.h>
 
 #include <haiyajan.h>
+#include <perf.h>
 #include <sig.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#define SIG_FLIGHT_FILE "haiyajan-crash.txt"
+#endif
+
 static const struct haiyajan_ctx_s *ctx;
 
 static void log_out(void *priv, int cat, SDL_LogPriority pri, const char *msg)
@@ -30,9 +37,52 @@ static void log_out(void *priv, int cat, SDL_LogPriority pri, const char *msg)
 	putc('\n', stderr);
 }
 
+/**
+ * Saves the timings of the frames leading up to the error. Only
+ * async-signal-safe functions are used, as the state of the C library is
+ * unknown.
+ */
+static void save_flight(const struct perf_ctx_s *p)
+{
+#ifdef SIG_FLIGHT_FILE
+	char line[PERF_FLIGHT_LINE_MAX];
+	unsigned len = perf_flight_len(p);
+	int fd;
+
+	fd = open(SIG_FLIGHT_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return;
+
+	if(write(fd, PERF_FLIGHT_HEADER, sizeof(PERF_FLIGHT_HEADER) - 1) < 0)
+		goto out;
+
+	for(unsigned i = 0; i < len; i++)
+	{
+		size_t n = perf_flight_line(perf_flight_get(p, i), line);
+		if(write(fd, line, n) < 0)
+			goto out;
+	}
+
+	{
+		static const char msg[] =
+			"Frame timings were saved to " SIG_FLIGHT_FILE ".\n";
+		if(write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0)
+			goto out;
+	}
+
+out:
+	close(fd);
+#else
+	(void) p;
+#endif
+}
 
 static void sig_handler(int sig)
 {
+	/* Saved first, as the functions used below may deadlock if the error
+	 * occurred within the C library. */
+	save_flight(&ctx->core.perf);
+
 	SDL_LogSetOutputFunction(log_out, NULL);
 
 	fputs("\nUnfortunately a critical error has occurred due to ", stderr);
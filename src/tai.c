@@ -1,5 +1,8 @@
 ﻿#include <SDL.h>
+#include <input.h>
 #include <tai.h>
+#include <tdef.h>
+#include <tinf.h>
 
 #ifdef _MSC_VER
 #define ALIGN(bits) __declspec(align(bits))
@@ -12,18 +15,6 @@
 #define SDL_PRIu64 "I64u"
 #endif
 
-ALIGN(8) struct tai_frame_s {
-	Uint64 frame_num;
-	Uint8 command;
-};
-
-ALIGN(8) struct tai_s {
-	SDL_RWops *f;
-	SDL_bool record;
-	Uint64 frame;
-	Uint64 next_frame;
-};
-
 ALIGN(8) struct tai_header_s {
 	Uint8 magic[10];
 	Uint8 version;
@@ -50,65 +41,555 @@ ALIGN(8) struct tai_dat_keyboard_s {
 	Uint32 keycode;
 };
 
+/* Layout of version 2 files. See tai.h for the specification. */
+#define TAI_HDR_LEN		160
+#define TAI_PORT_LEN		14
+#define TAI_REC_LEN		(TAI_PORT_LEN * MAX_PLAYERS)
+#define TAI_BLOCK_FRAMES	1024
+#define TAI_BLOCK_LEN		(TAI_REC_LEN * TAI_BLOCK_FRAMES)
+#define TAI_BLOCK_HDR_LEN	8
+#define TAI_INDEX_ENTRY_LEN	16
+#define TAI_COMP_LEN		(TAI_BLOCK_HDR_LEN + TDEF_BOUND(TAI_BLOCK_LEN))
+
+static const Uint8 tai_magic[10] = {
+	0xAB, 'h', 't', 'a', 'i', 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
+};
+
+struct tai_block_s {
+	Uint64 offset;
+	Uint32 len;
+	Uint32 frames;
+};
+
+ALIGN(8) struct tai_s {
+	SDL_RWops *f;
+	SDL_bool record;
+	Uint64 frame;
+	Uint64 next_frame;
+
+	/* Set once playback has reached the end of the file. */
+	SDL_bool finished;
+
+	/* Version of the file being played. New files are always recorded in
+	 * the latest version. */
+	Uint8 version;
+
+	/* The remaining members are only used by version 2 files. */
+
+	/* Number of frames in the file, and the next frame to be played. */
+	Uint64 frames;
+	Uint64 pos;
+
+	/* Offset at which the next block is written. */
+	Uint64 offset;
+
+	/* Index of blocks in the file. */
+	struct tai_block_s *blocks;
+	Uint32 nblocks;
+	Uint32 blocks_alloc;
+
+	/* Records of the block being played or recorded. When playing,
+	 * cur_block is the block held in recs. When recording, buffered is the
+	 * number of records not yet written. */
+	Uint8 *recs;
+	Uint32 cur_block;
+	Uint32 buffered;
+
+	/* Delta encoded records, and their compressed form preceded by the
+	 * block header. */
+	Uint8 *planar;
+	Uint8 *comp;
+	struct tdef_work_s *work;
+};
+
+static void tai_put16(Uint8 *p, Uint16 v)
+{
+	p[0] = (Uint8)v;
+	p[1] = (Uint8)(v >> 8);
+}
+
+static void tai_put32(Uint8 *p, Uint32 v)
+{
+	tai_put16(p, (Uint16)v);
+	tai_put16(p + 2, (Uint16)(v >> 16));
+}
+
+static void tai_put64(Uint8 *p, Uint64 v)
+{
+	tai_put32(p, (Uint32)v);
+	tai_put32(p + 4, (Uint32)(v >> 32));
+}
+
+static Uint16 tai_get16(const Uint8 *p)
+{
+	return (Uint16)(p[0] | (p[1] << 8));
+}
+
+static Uint32 tai_get32(const Uint8 *p)
+{
+	return tai_get16(p) | ((Uint32)tai_get16(p + 2) << 16);
+}
+
+static Uint64 tai_get64(const Uint8 *p)
+{
+	return tai_get32(p) | ((Uint64)tai_get32(p + 4) << 32);
+}
+
+/**
+ * Each port is stored as the joypad buttons, the left and right analogue
+ * sticks, and the L2 and R2 triggers.
+ */
+static void tai_pack(Uint8 *rec, const struct input_ctx_s *in)
+{
+	for(unsigned port = 0; port < MAX_PLAYERS; port++)
+	{
+		const struct input_snap_s *s = &in->snap[port];
+
+		tai_put16(rec + 0, s->btns);
+		tai_put16(rec + 2, (Uint16)s->stick[0][0]);
+		tai_put16(rec + 4, (Uint16)s->stick[0][1]);
+		tai_put16(rec + 6, (Uint16)s->stick[1][0]);
+		tai_put16(rec + 8, (Uint16)s->stick[1][1]);
+		tai_put16(rec + 10, (Uint16)s->btn_analog[INPUT_JOYPAD_L2]);
+		tai_put16(rec + 12, (Uint16)s->btn_analog[INPUT_JOYPAD_R2]);
+		rec += TAI_PORT_LEN;
+	}
+}
+
+static void tai_unpack(const Uint8 *rec, struct input_ctx_s *in)
+{
+	for(unsigned port = 0; port < MAX_PLAYERS; port++)
+	{
+		struct input_snap_s *s = &in->snap[port];
+
+		s->btns = tai_get16(rec + 0);
+		s->stick[0][0] = (Sint16)tai_get16(rec + 2);
+		s->stick[0][1] = (Sint16)tai_get16(rec + 4);
+		s->stick[1][0] = (Sint16)tai_get16(rec + 6);
+		s->stick[1][1] = (Sint16)tai_get16(rec + 8);
+
+		for(unsigned id = 0; id < SDL_arraysize(s->btn_analog); id++)
+		{
+			s->btn_analog[id] = ((s->btns >> id) & 1) ?
+				SDL_MAX_SINT16 : 0;
+		}
+
+		s->btn_analog[INPUT_JOYPAD_L2] = (Sint16)tai_get16(rec + 10);
+		s->btn_analog[INPUT_JOYPAD_R2] = (Sint16)tai_get16(rec + 12);
+		rec += TAI_PORT_LEN;
+	}
+}
+
+/**
+ * Each record is stored as its difference to the previous record, and the
+ * bytes at the same position of each record are grouped together. Input that
+ * does not change between frames then becomes long runs of zeros.
+ */
+static void tai_delta_encode(Uint8 *planar, const Uint8 *recs, Uint32 frames)
+{
+	for(Uint32 b = 0; b < TAI_REC_LEN; b++)
+	{
+		Uint8 prev = 0;
+
+		for(Uint32 f = 0; f < frames; f++)
+		{
+			Uint8 cur = recs[f * TAI_REC_LEN + b];
+			planar[b * frames + f] = cur ^ prev;
+			prev = cur;
+		}
+	}
+}
+
+static void tai_delta_decode(Uint8 *recs, const Uint8 *planar, Uint32 frames)
+{
+	for(Uint32 b = 0; b < TAI_REC_LEN; b++)
+	{
+		Uint8 prev = 0;
+
+		for(Uint32 f = 0; f < frames; f++)
+		{
+			prev ^= planar[b * frames + f];
+			recs[f * TAI_REC_LEN + b] = prev;
+		}
+	}
+}
+
+static int tai_push_key(Uint8 state, Uint16 keymod, SDL_Scancode sc,
+		SDL_Keycode sym)
+{
+	SDL_Event gen;
+
+	SDL_zero(gen);
+	gen.type = state == SDL_PRESSED ? SDL_KEYDOWN : SDL_KEYUP;
+	gen.key.timestamp = SDL_GetTicks();
+	gen.key.state = state;
+	gen.key.repeat = 0;
+	gen.key.keysym.mod = keymod;
+	gen.key.keysym.scancode = sc;
+	gen.key.keysym.sym = sym;
+
+	return SDL_PushEvent(&gen) == 1 ? 0 : -1;
+}
+
+int tai_inject_key(SDL_Scancode sc, Uint8 state)
+{
+	return tai_push_key(state, KMOD_NONE, sc, SDL_GetKeyFromScancode(sc));
+}
+
+static int tai_add_block(tai *ctx, Uint64 offset, Uint32 len, Uint32 frames)
+{
+	if(ctx->nblocks == ctx->blocks_alloc)
+	{
+		Uint32 n = ctx->blocks_alloc == 0 ? 64 : ctx->blocks_alloc * 2;
+		struct tai_block_s *b;
+
+		b = SDL_realloc(ctx->blocks, n * sizeof(*b));
+		if(b == NULL)
+			return SDL_OutOfMemory();
+
+		ctx->blocks = b;
+		ctx->blocks_alloc = n;
+	}
+
+	ctx->blocks[ctx->nblocks].offset = offset;
+	ctx->blocks[ctx->nblocks].len = len;
+	ctx->blocks[ctx->nblocks].frames = frames;
+	ctx->nblocks++;
+	return 0;
+}
+
+/**
+ * Compresses the buffered records and writes them as a block with a single
+ * write.
+ */
+static int tai_flush(tai *ctx)
+{
+	size_t len;
+
+	if(ctx->buffered == 0)
+		return 0;
+
+	tai_delta_encode(ctx->planar, ctx->recs, ctx->buffered);
+	len = tdef_compress(ctx->work, ctx->comp + TAI_BLOCK_HDR_LEN,
+			    TAI_COMP_LEN - TAI_BLOCK_HDR_LEN, ctx->planar,
+			    ctx->buffered * TAI_REC_LEN);
+	if(len == 0)
+		return SDL_SetError("Unable to compress tool assisted input");
+
+	tai_put32(ctx->comp, ctx->buffered);
+	tai_put32(ctx->comp + 4, (Uint32)len);
+	len += TAI_BLOCK_HDR_LEN;
+
+	if(SDL_RWwrite(ctx->f, ctx->comp, 1, len) != len)
+		return -1;
+
+	if(tai_add_block(ctx, ctx->offset, (Uint32)len - TAI_BLOCK_HDR_LEN,
+			 ctx->buffered) != 0)
+		return -1;
+
+	ctx->offset += len;
+	ctx->buffered = 0;
+	return 0;
+}
+
+/**
+ * Writes the index of blocks, and completes the header with the number of
+ * frames and the offset of the index.
+ */
+static int tai_finish(tai *ctx)
+{
+	Uint8 hdr[16];
+	Uint8 *idx;
+	size_t len;
+	int ret = -1;
+
+	if(tai_flush(ctx) != 0)
+		return -1;
+
+	len = 4 + (size_t)ctx->nblocks * TAI_INDEX_ENTRY_LEN;
+	idx = SDL_malloc(len);
+	if(idx == NULL)
+		return SDL_OutOfMemory();
+
+	tai_put32(idx, ctx->nblocks);
+	for(Uint32 i = 0; i < ctx->nblocks; i++)
+	{
+		Uint8 *e = idx + 4 + i * TAI_INDEX_ENTRY_LEN;
+		tai_put64(e, ctx->blocks[i].offset);
+		tai_put32(e + 8, ctx->blocks[i].len);
+		tai_put32(e + 12, ctx->blocks[i].frames);
+	}
+
+	if(SDL_RWwrite(ctx->f, idx, 1, len) != len)
+		goto out;
+
+	tai_put64(hdr, ctx->frames);
+	tai_put64(hdr + 8, ctx->offset);
+	if(SDL_RWseek(ctx->f, 16, RW_SEEK_SET) < 0 ||
+	   SDL_RWwrite(ctx->f, hdr, 1, sizeof(hdr)) != sizeof(hdr))
+		goto out;
+
+	ret = 0;
+
+out:
+	SDL_free(idx);
+	return ret;
+}
+
+static int tai_init_record(tai *ctx)
+{
+	Uint8 hdr[TAI_HDR_LEN] = { 0 };
+
+	ctx->work = SDL_malloc(sizeof(*ctx->work));
+	if(ctx->work == NULL)
+		return SDL_OutOfMemory();
+
+	SDL_memcpy(hdr, tai_magic, sizeof(tai_magic));
+	hdr[10] = 2;
+	hdr[11] = MAX_PLAYERS;
+	tai_put16(hdr + 12, TAI_REC_LEN);
+	tai_put16(hdr + 14, TAI_BLOCK_FRAMES);
+
+	/* The number of frames and the index offset are written once the
+	 * recording is complete. */
+	SDL_strlcpy((char *)hdr + 32, "Unknown", 32);
+	SDL_strlcpy((char *)hdr + 64, "Unknown", 32);
+	SDL_strlcpy((char *)hdr + 96, "Test", 32);
+	SDL_strlcpy((char *)hdr + 128, "No Author", 32);
+
+	if(SDL_RWwrite(ctx->f, hdr, 1, sizeof(hdr)) != sizeof(hdr))
+		return -1;
+
+	ctx->version = 2;
+	ctx->offset = TAI_HDR_LEN;
+	return 0;
+}
+
+/**
+ * Reads the index of blocks. If the recording was not completed, the index is
+ * recreated from the header of each block instead.
+ */
+static int tai_read_index(tai *ctx, Uint64 index_offset)
+{
+	const Sint64 size = SDL_RWseek(ctx->f, 0, RW_SEEK_END);
+	Uint8 *idx = NULL;
+	Uint8 cnt[4];
+	Uint32 n;
+	size_t len;
+	int ret = -1;
+
+	if(size < 0)
+		return SDL_SetError("Unable to read tool assisted input index");
+
+	if(index_offset == 0)
+	{
+		Uint64 offset = TAI_HDR_LEN;
+		Uint8 bh[TAI_BLOCK_HDR_LEN];
+
+		/* Blocks are read until one is incomplete or invalid, or a
+		 * block that is not full has been read. */
+		ctx->frames = 0;
+		while(SDL_RWseek(ctx->f, (Sint64)offset, RW_SEEK_SET) >= 0 &&
+		      SDL_RWread(ctx->f, bh, 1, sizeof(bh)) == sizeof(bh))
+		{
+			Uint32 frames = tai_get32(bh);
+			Uint32 blen = tai_get32(bh + 4);
+
+			if(frames == 0 || frames > TAI_BLOCK_FRAMES ||
+			   blen > TAI_COMP_LEN - TAI_BLOCK_HDR_LEN ||
+			   offset + TAI_BLOCK_HDR_LEN + blen > (Uint64)size)
+				break;
+
+			if(tai_add_block(ctx, offset, blen, frames) != 0)
+				return -1;
+
+			ctx->frames += frames;
+			offset += TAI_BLOCK_HDR_LEN + (Uint64)blen;
+
+			if(frames != TAI_BLOCK_FRAMES)
+				break;
+		}
+
+		SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+			    "TAI: Recording was not completed; recovered %"
+			    SDL_PRIu64 " frames", ctx->frames);
+		return 0;
+	}
+
+	if((Uint64)size < sizeof(cnt) ||
+	   index_offset > (Uint64)size - sizeof(cnt) ||
+	   SDL_RWseek(ctx->f, (Sint64)index_offset, RW_SEEK_SET) < 0 ||
+	   SDL_RWread(ctx->f, cnt, 1, sizeof(cnt)) != sizeof(cnt))
+		return SDL_SetError("Unable to read tool assisted input index");
+
+	/* The entries must fit within the file, and their total length within
+	 * 32 bits. */
+	n = tai_get32(cnt);
+	if(n > ((Uint64)size - index_offset - sizeof(cnt)) /
+			TAI_INDEX_ENTRY_LEN ||
+	   n > SDL_MAX_UINT32 / TAI_INDEX_ENTRY_LEN)
+		return SDL_SetError("Invalid tool assisted input index");
+
+	len = (size_t)n * TAI_INDEX_ENTRY_LEN;
+	idx = SDL_malloc(len + 1);
+	if(idx == NULL)
+		return SDL_OutOfMemory();
+
+	if(SDL_RWread(ctx->f, idx, 1, len) != len)
+	{
+		SDL_SetError("Unable to read tool assisted input index");
+		goto out;
+	}
+
+	for(Uint32 i = 0; i < n; i++)
+	{
+		const Uint8 *e = idx + (size_t)i * TAI_INDEX_ENTRY_LEN;
+		Uint64 offset = tai_get64(e);
+		Uint32 blen = tai_get32(e + 8);
+		Uint32 frames = tai_get32(e + 12);
+
+		if(offset < TAI_HDR_LEN ||
+		   blen > TAI_COMP_LEN - TAI_BLOCK_HDR_LEN ||
+		   frames > TAI_BLOCK_FRAMES ||
+		   offset > (Uint64)size ||
+		   (Uint64)size - offset < TAI_BLOCK_HDR_LEN + (Uint64)blen)
+		{
+			SDL_SetError("Invalid tool assisted input block");
+			goto out;
+		}
+
+		if(tai_add_block(ctx, offset, blen, frames) != 0)
+			goto out;
+	}
+
+	ret = 0;
+
+out:
+	SDL_free(idx);
+	return ret;
+}
+
+static int tai_init_play(tai *ctx)
+{
+	Uint8 hdr[TAI_HDR_LEN];
+	Uint64 frames = 0;
+
+	if(SDL_RWseek(ctx->f, 0, RW_SEEK_SET) < 0 ||
+	   SDL_RWread(ctx->f, hdr, 1, sizeof(hdr)) != sizeof(hdr))
+		return SDL_SetError("Invalid tool assisted input file: too short");
+
+	if(hdr[11] != MAX_PLAYERS || tai_get16(hdr + 12) != TAI_REC_LEN ||
+	   tai_get16(hdr + 14) != TAI_BLOCK_FRAMES)
+		return SDL_SetError("Unsupported tool assisted input layout");
+
+	ctx->frames = tai_get64(hdr + 16);
+	if(tai_read_index(ctx, tai_get64(hdr + 24)) != 0)
+		return -1;
+
+	/* Frames are located by assuming that every block but the last is
+	 * full. */
+	for(Uint32 i = 0; i < ctx->nblocks; i++)
+	{
+		const struct tai_block_s *b = &ctx->blocks[i];
+
+		if(b->frames != TAI_BLOCK_FRAMES && i != ctx->nblocks - 1)
+			return SDL_SetError("Invalid tool assisted input block");
+
+		frames += b->frames;
+	}
+
+	if(frames != ctx->frames)
+		return SDL_SetError("Invalid tool assisted input index");
+
+	ctx->cur_block = SDL_MAX_UINT32;
+	return 0;
+}
+
+static int tai_load_block(tai *ctx, Uint32 blk)
+{
+	const struct tai_block_s *b = &ctx->blocks[blk];
+	const size_t len = TAI_BLOCK_HDR_LEN + b->len;
+	unsigned long out_len = (unsigned long)b->frames * TAI_REC_LEN;
+
+	if(SDL_RWseek(ctx->f, (Sint64)b->offset, RW_SEEK_SET) < 0 ||
+	   SDL_RWread(ctx->f, ctx->comp, 1, len) != len)
+		return SDL_SetError("Unable to read tool assisted input block");
+
+	if(tai_get32(ctx->comp) != b->frames ||
+	   tinf_uncompress(ctx->planar, &out_len, ctx->comp + TAI_BLOCK_HDR_LEN,
+			   b->len) != TINF_OK ||
+	   out_len != (unsigned long)b->frames * TAI_REC_LEN)
+		return SDL_SetError("Corrupt tool assisted input block");
+
+	tai_delta_decode(ctx->recs, ctx->planar, b->frames);
+	ctx->cur_block = blk;
+	return 0;
+}
+
 tai *tai_init(SDL_RWops *f, SDL_bool record)
 {
-	tai *ctx = SDL_malloc(sizeof(tai));
+	tai *ctx = SDL_calloc(1, sizeof(tai));
 	if(ctx == NULL)
 		goto out;
 
 	ctx->f = f;
 	ctx->record = record;
 	ctx->frame = 0;
+	ctx->finished = SDL_FALSE;
 
-	if(record)
+	ctx->recs = SDL_malloc(TAI_BLOCK_LEN);
+	ctx->planar = SDL_malloc(TAI_BLOCK_LEN);
+	ctx->comp = SDL_malloc(TAI_COMP_LEN);
+	if(ctx->recs == NULL || ctx->planar == NULL || ctx->comp == NULL)
 	{
-		size_t ret;
-		const struct tai_header_s hdr = {
-			.magic = {
-				0xAB, 'h', 't', 'a', 'i', 0xBB,
-				0x0D, 0x0A, 0x1A, 0x0A
-			},
-			.version = 1,
-			.file_version = 1,
-			.rom_target = "Unknown",
-			.emu_target = "Unknown",
-			.emu_version = "Unknown",
-			.tai_desc = "Test",
-			.tai_author = "No Author"
-		};
+		SDL_OutOfMemory();
+		goto err;
+	}
 
-		SDL_RWseek(f, 0, RW_SEEK_SET);
-		ret = SDL_RWwrite(f, &hdr, 1, sizeof(hdr));
-		if(ret < sizeof(hdr))
-		{
-			SDL_free(ctx);
-			ctx = NULL;
-			goto out;
-		}
+	if(record)
+	{
+		if(tai_init_record(ctx) != 0)
+			goto err;
 	}
 	else
 	{
-		size_t ret;
-		struct tai_header_s hdr;
-		const Uint8 magic[10] = {
-			0xAB, 'h', 't', 'a', 'i', 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
-		};
+		Uint8 id[sizeof(tai_magic) + 1];
 
 		SDL_RWseek(f, 0, RW_SEEK_SET);
-		ret = SDL_RWread(f, &hdr, 1, sizeof(hdr));
-		if(ret < sizeof(hdr))
+		if(SDL_RWread(f, id, 1, sizeof(id)) != sizeof(id))
+		{
+			SDL_SetError("Invalid tool assisted input file: too short");
 			goto err;
+		}
 
-		if(SDL_memcmp(&hdr, magic, sizeof(magic)) != 0)
+		if(SDL_memcmp(id, tai_magic, sizeof(tai_magic)) != 0)
 		{
 			SDL_SetError("Invalid tool assisted input file: magic mismatch");
 			goto err;
 		}
 
-		/* Read first frame information. */
-		ret = SDL_RWread(ctx->f, &ctx->next_frame, sizeof(ctx->next_frame), 1);
-		if(ret < 1)
-			goto err;
+		ctx->version = id[sizeof(tai_magic)];
+		if(ctx->version == 2)
+		{
+			if(tai_init_play(ctx) != 0)
+				goto err;
+		}
+		else
+		{
+			size_t ret;
+
+			/* Version 1 files are played back as events. */
+			SDL_RWseek(f, sizeof(struct tai_header_s), RW_SEEK_SET);
+
+			/* Read first frame information. */
+			ret = SDL_RWread(ctx->f, &ctx->next_frame,
+					 sizeof(ctx->next_frame), 1);
+			if(ret < 1)
+			{
+				SDL_SetError("Invalid tool assisted input file: too short");
+				goto err;
+			}
+		}
 	}
 
 	SDL_LogVerbose(SDL_LOG_CATEGORY_TEST, "Initialised TAI module for %s",
@@ -118,6 +599,11 @@ out:
 	return ctx;
 
 err:
+	SDL_free(ctx->blocks);
+	SDL_free(ctx->work);
+	SDL_free(ctx->comp);
+	SDL_free(ctx->planar);
+	SDL_free(ctx->recs);
 	SDL_free(ctx);
 	ctx = NULL;
 	goto out;
@@ -128,77 +614,16 @@ void tai_next_frame(tai *ctx)
 	ctx->frame++;
 }
 
-int tai_process_event(tai *ctx, SDL_Event *e)
+/**
+ * Version 1 files store keyboard events. The events for the current frame are
+ * applied to the keyboard state directly, so that input_poll() samples them
+ * in the same frame.
+ */
+static int tai_play_events(tai *ctx, struct input_ctx_s *in)
 {
-	if(ctx == NULL)
-		return 0;
+	if(ctx->finished)
+		return 1;
 
-	if(ctx->record == SDL_TRUE)
-	{
-		if(e == NULL)
-			goto out;
-
-		switch(e->type)
-		{
-#if 0
-		case SDL_CONTROLLERBUTTONUP:
-		case SDL_CONTROLLERBUTTONDOWN:
-			SDL_WriteLE64(ctx->f, ctx->frame);
-			SDL_WriteU8(ctx->f, HTAI_CMD_CONTROLLER_BUTTON);
-			SDL_WriteU8(ctx->f, e->cbutton.button);
-			SDL_WriteU8(ctx->f, e->cbutton.state);
-			SDL_RWseek(ctx->f, sizeof(Uint16), RW_SEEK_CUR);
-			SDL_LogVerbose(SDL_LOG_CATEGORY_TEST,
-				"TAI: Recorded controller button %d at frame %lu",
-				e->cbutton.button, ctx->frame);
-			break;
-
-		case SDL_CONTROLLERAXISMOTION:
-			SDL_RWwrite(ctx->f, &ctx->frame, sizeof(ctx->frame), 1);
-			htai_type = HTAI_CMD_CONTROLLER_AXIS;
-			SDL_RWwrite(ctx->f, &htai_type, sizeof(htai_type), 1);
-			SDL_RWwrite(ctx->f, &e->caxis.axis,
-					sizeof(e->caxis.axis), 1);
-			SDL_RWseek(ctx->f, sizeof(Uint8), RW_SEEK_CUR);
-			SDL_RWwrite(ctx->f, &e->caxis.value,
-					sizeof(e->caxis.value), 1);
-			SDL_LogVerbose(SDL_LOG_CATEGORY_TEST,
-				"TAI: Recorded controller axis modification at frame %lu",
-				ctx->frame);
-			break;
-#endif
-		case SDL_QUIT:
-			SDL_WriteLE64(ctx->f, ctx->frame);
-			SDL_WriteU8(ctx->f, HTAI_CMD_QUIT);
-			break;
-
-
-		case SDL_KEYUP:
-		case SDL_KEYDOWN:
-			SDL_WriteLE64(ctx->f, ctx->frame);
-			SDL_WriteU8(ctx->f, HTAI_CMD_KEYBOARD);
-			SDL_WriteU8(ctx->f, e->key.state);
-			SDL_WriteU8(ctx->f, 0); /* skip byte */
-			SDL_WriteLE16(ctx->f, e->key.keysym.mod);
-			SDL_WriteLE32(ctx->f, e->key.keysym.scancode);
-			SDL_WriteLE32(ctx->f, e->key.keysym.sym);
-
-			/* TODO: make logging universal */
-			SDL_LogVerbose(SDL_LOG_CATEGORY_TEST,
-				"TAI: Recorded keyboard input %s %s at frame %" SDL_PRIu64,
-				SDL_GetKeyName(e->key.keysym.sym),
-				e->key.state ? "pressed" : "released",
-				ctx->frame);
-			break;
-
-		default:
-			break;
-		}
-
-		goto out;
-	}
-
-	/* If playing tool assisted input file. */
 	while(ctx->frame == ctx->next_frame)
 	{
 		SDL_Event gen;
@@ -210,8 +635,10 @@ int tai_process_event(tai *ctx, SDL_Event *e)
 		switch(cmd)
 		{
 		case HTAI_CMD_END:
-			tai_exit(ctx);
-			return 0;
+			/* The context remains valid until tai_exit() is
+			 * called by the owner. */
+			ctx->finished = SDL_TRUE;
+			return 1;
 
 		case HTAI_CMD_QUIT:
 			gen.type = SDL_QUIT;
@@ -231,20 +658,8 @@ int tai_process_event(tai *ctx, SDL_Event *e)
 				goto err;
 			}
 
-			gen.type = keydat.state ? SDL_KEYUP : SDL_KEYDOWN;
-			gen.key.timestamp = SDL_GetTicks(); /* TODO */
-			gen.key.state = keydat.state;
-			gen.key.repeat = 0;
-			gen.key.keysym.mod = keydat.keymod;
-			gen.key.keysym.scancode = keydat.scancode;
-			gen.key.keysym.sym = keydat.keycode;
-			if(SDL_PushEvent(&gen) != 1)
-			{
-				SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
-					"TAI: Unable to push event: %s",
-					SDL_GetError());
-				break;
-			}
+			input_set_key(in, (SDL_Scancode)keydat.scancode,
+				      keydat.state);
 			SDL_LogVerbose(SDL_LOG_CATEGORY_TEST,
 				"TAI: Command Keyboard input %s %s at frame %" SDL_PRIu64,
 				SDL_GetKeyName(keydat.keycode),
@@ -257,37 +672,131 @@ int tai_process_event(tai *ctx, SDL_Event *e)
 			SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
 				"TAI: Invalid command %hu read at %" SDL_PRIs64 "; exiting.",
 				cmd, SDL_RWtell(ctx->f));
-			tai_exit(ctx);
 			goto err;
 		}
 
-		SDL_PumpEvents();
-
 		ret = SDL_RWread(ctx->f, &ctx->next_frame, sizeof(ctx->next_frame), 1);
 		if(ret < 1)
 			goto err;
 	}
 
-out:
 	return 0;
 
 err:
+	ctx->finished = SDL_TRUE;
 	return -1;
 }
 
+int tai_play_frame(tai *ctx, struct input_ctx_s *in)
+{
+	Uint32 blk;
+
+	if(ctx == NULL || ctx->record)
+		return 0;
+
+	if(ctx->version != 2)
+		return tai_play_events(ctx, in);
+
+	if(ctx->finished || ctx->pos >= ctx->frames)
+		goto finished;
+
+	blk = (Uint32)(ctx->pos / TAI_BLOCK_FRAMES);
+	if(blk != ctx->cur_block && tai_load_block(ctx, blk) != 0)
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+			     "TAI: %s; exiting.", SDL_GetError());
+		ctx->finished = SDL_TRUE;
+		in->held = SDL_FALSE;
+		return -1;
+	}
+
+	tai_unpack(ctx->recs + (ctx->pos % TAI_BLOCK_FRAMES) * TAI_REC_LEN, in);
+	in->held = SDL_TRUE;
+	ctx->pos++;
+	return 0;
+
+finished:
+	/* Input is returned to the user. */
+	ctx->finished = SDL_TRUE;
+	in->held = SDL_FALSE;
+	return 1;
+}
+
+Sint64 tai_tell(const tai *ctx)
+{
+	if(ctx == NULL || ctx->record || ctx->version != 2)
+		return -1;
+
+	return (Sint64)ctx->pos;
+}
+
+Sint64 tai_length(const tai *ctx)
+{
+	if(ctx == NULL || ctx->record || ctx->version != 2)
+		return -1;
+
+	return (Sint64)ctx->frames;
+}
+
+int tai_seek(tai *ctx, Uint64 frame)
+{
+	if(tai_tell(ctx) < 0)
+		return SDL_SetError("Tool assisted input is not seekable");
+
+	if(frame > ctx->frames)
+		return SDL_SetError("Frame %" SDL_PRIu64 " is beyond the end of "
+				    "the tool assisted input", frame);
+
+	/* The block holding the frame is loaded by tai_play_frame(). */
+	ctx->pos = frame;
+	ctx->finished = SDL_FALSE;
+	return 0;
+}
+
+int tai_record_frame(tai *ctx, const struct input_ctx_s *in)
+{
+	if(ctx == NULL || ctx->record == SDL_FALSE)
+		return 0;
+
+	tai_pack(ctx->recs + ctx->buffered * TAI_REC_LEN, in);
+	ctx->buffered++;
+	ctx->frames++;
+
+	if(ctx->buffered == TAI_BLOCK_FRAMES)
+		return tai_flush(ctx);
+
+	return 0;
+}
+
+int tai_process_event(tai *ctx, SDL_Event *e)
+{
+	(void) e;
+
+	if(ctx == NULL || ctx->record == SDL_TRUE)
+		return 0;
+
+	if(ctx->version == 2 && ctx->pos >= ctx->frames)
+		return 1;
+
+	return ctx->finished;
+}
+
 int tai_exit(tai *ctx)
 {
+	int ret = 0;
+
 	if(ctx == NULL)
 		return 0;
 
 	if(ctx->record == SDL_TRUE)
-	{
-		SDL_WriteLE64(ctx->f, ctx->frame);
-		SDL_WriteU8(ctx->f, HTAI_CMD_END);
-	}
+		ret = tai_finish(ctx);
 
 	SDL_RWclose(ctx->f);
+	SDL_free(ctx->blocks);
+	SDL_free(ctx->work);
+	SDL_free(ctx->comp);
+	SDL_free(ctx->planar);
+	SDL_free(ctx->recs);
 	SDL_free(ctx);
-	ctx = NULL;
-	return 0;
+	return ret;
 }
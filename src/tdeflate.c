@@ -0,0 +1,215 @@
+/**
+ * Tiny deflate compressor, producing data that tinflate can decompress.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#include <SDL.h>
+#include <tdef.h>
+
+#define TDEF_MIN_MATCH	3
+#define TDEF_MAX_MATCH	258
+
+/* Number of earlier positions with the same hash that are compared when
+ * searching for a match. */
+#define TDEF_CHAIN	32
+
+struct tdef_bits_s
+{
+	Uint8 *out;
+	Uint8 *end;
+	Uint32 buf;
+	unsigned n;
+	SDL_bool overflow;
+};
+
+static const Uint16 len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const Uint8 len_bits[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const Uint16 dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+	16385, 24577
+};
+
+static const Uint8 dist_bits[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static void tdef_put(struct tdef_bits_s *b, Uint32 bits, unsigned n)
+{
+	b->buf |= bits << b->n;
+	b->n += n;
+
+	while(b->n >= 8)
+	{
+		if(b->out == b->end)
+		{
+			b->overflow = SDL_TRUE;
+			return;
+		}
+
+		*b->out++ = (Uint8)b->buf;
+		b->buf >>= 8;
+		b->n -= 8;
+	}
+}
+
+/* Huffman codes are stored with the most significant bit first. */
+static void tdef_put_code(struct tdef_bits_s *b, Uint32 code, unsigned n)
+{
+	Uint32 rev = 0;
+
+	for(unsigned i = 0; i < n; i++)
+	{
+		rev = (rev << 1) | (code & 1);
+		code >>= 1;
+	}
+
+	tdef_put(b, rev, n);
+}
+
+static void tdef_put_sym(struct tdef_bits_s *b, unsigned sym)
+{
+	if(sym < 144)
+		tdef_put_code(b, 0x30 + sym, 8);
+	else if(sym < 256)
+		tdef_put_code(b, 0x190 + sym - 144, 9);
+	else if(sym < 280)
+		tdef_put_code(b, sym - 256, 7);
+	else
+		tdef_put_code(b, 0xC0 + sym - 280, 8);
+}
+
+static void tdef_put_match(struct tdef_bits_s *b, unsigned len, unsigned dist)
+{
+	unsigned i;
+
+	for(i = SDL_arraysize(len_base) - 1; len_base[i] > len; i--)
+		;
+
+	tdef_put_sym(b, 257 + i);
+	tdef_put(b, len - len_base[i], len_bits[i]);
+
+	for(i = SDL_arraysize(dist_base) - 1; dist_base[i] > dist; i--)
+		;
+
+	tdef_put_code(b, i, 5);
+	tdef_put(b, dist - dist_base[i], dist_bits[i]);
+}
+
+static Uint32 tdef_hash(const Uint8 *p)
+{
+	Uint32 v = ((Uint32)p[0] << 16) | ((Uint32)p[1] << 8) | p[2];
+	return (v * 2654435761U) >> (32 - TDEF_HASH_BITS);
+}
+
+static void tdef_insert(struct tdef_work_s *w, const Uint8 *src, size_t pos)
+{
+	Uint32 h = tdef_hash(src + pos);
+
+	w->prev[pos & (TDEF_WINDOW - 1)] = w->head[h];
+	w->head[h] = (Uint32)pos + 1;
+}
+
+size_t tdef_compress(struct tdef_work_s *w, void *dst, size_t dst_len,
+		     const void *src, size_t src_len)
+{
+	const Uint8 *in = src;
+	struct tdef_bits_s b = { dst, (Uint8 *)dst + dst_len, 0, 0, SDL_FALSE };
+	size_t pos = 0;
+
+	SDL_memset(w->head, 0, sizeof(w->head));
+
+	/* A single final block using the fixed Huffman codes. */
+	tdef_put(&b, 1, 1);
+	tdef_put(&b, 1, 2);
+
+	while(pos < src_len)
+	{
+		size_t max = SDL_min(src_len - pos, TDEF_MAX_MATCH);
+		size_t best_len = 0, best_dist = 0;
+
+		if(max >= TDEF_MIN_MATCH)
+		{
+			Uint32 cand = w->head[tdef_hash(in + pos)];
+
+			for(unsigned chain = 0; cand != 0 && chain < TDEF_CHAIN;
+					chain++)
+			{
+				size_t c = cand - 1;
+				size_t len = 0;
+
+				if(pos - c > TDEF_WINDOW)
+					break;
+
+				while(len < max && in[c + len] == in[pos + len])
+					len++;
+
+				if(len > best_len)
+				{
+					best_len = len;
+					best_dist = pos - c;
+					if(len == max)
+						break;
+				}
+
+				/* Entries older than the window have been
+				 * replaced. */
+				cand = w->prev[c & (TDEF_WINDOW - 1)];
+				if(cand == 0 || cand - 1 >= c)
+					break;
+			}
+
+			tdef_insert(w, in, pos);
+		}
+
+		if(best_len >= TDEF_MIN_MATCH)
+		{
+			tdef_put_match(&b, (unsigned)best_len,
+				       (unsigned)best_dist);
+
+			for(size_t i = 1; i < best_len; i++)
+			{
+				if(pos + i + TDEF_MIN_MATCH <= src_len)
+					tdef_insert(w, in, pos + i);
+			}
+
+			pos += best_len;
+		}
+		else
+		{
+			tdef_put_sym(&b, in[pos]);
+			pos++;
+		}
+
+		if(b.overflow)
+			return 0;
+	}
+
+	/* End of block, then pad to a whole byte. */
+	tdef_put_sym(&b, 256);
+	if(b.n != 0)
+		tdef_put(&b, 0, 8 - b.n);
+
+	if(b.overflow)
+		return 0;
+
+	return (size_t)(b.out - (Uint8 *)dst);
+}
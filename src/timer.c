@@ -100,3 +100,177 @@ int timer_profile_end(struct timer_ctx_s *const tim)
 	/* Play the next frame on the next VSYNC call as normal. */
 	return 0;
 }
+
+/* The delay is raised by at most this much per frame. */
+#define TIMER_DELAY_STEP_US	250
+
+/* Number of frames that the delay is not raised for after VSYNC is missed. */
+#define TIMER_DELAY_HOLD	240
+
+void timer_delay_init(struct timer_delay_s *d, double refresh_hz)
+{
+	SDL_zerop(d);
+	d->freq = SDL_GetPerformanceFrequency();
+	d->refresh_us = (Uint32)(1000000.0 / refresh_hz);
+	d->margin_us = SDL_max(d->refresh_us / 16, 1000);
+}
+
+void timer_delay_wait(const struct timer_delay_s *d)
+{
+	Uint64 until;
+	Uint64 now = SDL_GetPerformanceCounter();
+
+	if(d->delay_us == 0 || d->presented == 0)
+		return;
+
+	until = d->presented + (d->delay_us * d->freq) / 1000000;
+	if(now >= until)
+		return;
+
+	/* SDL_Delay() may oversleep, so the last millisecond is waited for
+	 * by polling the counter. */
+	if(until - now > d->freq / 500)
+	{
+		Uint32 ms = (Uint32)(((until - now) * 1000) / d->freq) - 1;
+		SDL_Delay(ms);
+	}
+
+	while(SDL_GetPerformanceCounter() < until)
+		;
+}
+
+void timer_delay_presented(struct timer_delay_s *d, Uint64 now,
+			   Uint32 work_us)
+{
+	const Uint32 base_margin = SDL_max(d->refresh_us / 16, 1000);
+	Uint32 target = 0;
+
+	d->cost_us -= d->cost_us / 32;
+	if(work_us > d->cost_us)
+		d->cost_us = work_us;
+
+	if(d->presented != 0)
+	{
+		Uint64 period_us = ((now - d->presented) * 1000000) / d->freq;
+
+		/* A frame that took one and a half refresh periods to present
+		 * has missed VSYNC. */
+		if(period_us > d->refresh_us + d->refresh_us / 2)
+		{
+			d->delay_us /= 2;
+			d->margin_us = SDL_min(d->margin_us * 2,
+					       d->refresh_us / 2);
+			d->hold = TIMER_DELAY_HOLD;
+		}
+	}
+
+	d->presented = now;
+
+	if(d->margin_us > base_margin)
+		d->margin_us -= (d->margin_us - base_margin + 255) / 256;
+
+	if(d->cost_us + d->margin_us < d->refresh_us)
+		target = d->refresh_us - d->cost_us - d->margin_us;
+
+	if(target <= d->delay_us)
+		d->delay_us = target;
+	else if(d->hold != 0)
+		d->hold--;
+	else
+		d->delay_us += SDL_min(target - d->delay_us,
+				       TIMER_DELAY_STEP_US);
+}
+
+void timer_wheel_init(struct timer_wheel_s *tw, Uint32 now_ms)
+{
+	SDL_zero(tw->slot);
+	tw->slot_now = 0;
+	tw->last_ms = now_ms;
+}
+
+void timer_wheel_add(struct timer_wheel_s *tw, struct timer_entry_s *e,
+		     Uint32 timeout_ms, void (*fn)(void *priv), void *priv)
+{
+	Uint32 ticks;
+	Uint32 slot;
+
+	timer_wheel_cancel(e);
+
+	/* The current slot has already been partially elapsed, so an extra
+	 * slot is added to make sure that the entry never expires early. */
+	ticks = timeout_ms / TIMER_WHEEL_RES_MS + 1;
+
+	slot = (tw->slot_now + ticks) % TIMER_WHEEL_SLOTS;
+	e->rounds = (ticks - 1) / TIMER_WHEEL_SLOTS;
+	e->fn = fn;
+	e->priv = priv;
+
+	e->next = tw->slot[slot];
+	if(e->next != NULL)
+		e->next->pprev = &e->next;
+
+	e->pprev = &tw->slot[slot];
+	tw->slot[slot] = e;
+}
+
+void timer_wheel_cancel(struct timer_entry_s *e)
+{
+	if(e->pprev == NULL)
+		return;
+
+	*e->pprev = e->next;
+	if(e->next != NULL)
+		e->next->pprev = e->pprev;
+
+	e->next = NULL;
+	e->pprev = NULL;
+}
+
+SDL_bool timer_entry_pending(const struct timer_entry_s *e)
+{
+	return e->pprev != NULL ? SDL_TRUE : SDL_FALSE;
+}
+
+void timer_wheel_advance(struct timer_wheel_s *tw, Uint32 now_ms)
+{
+	while(now_ms - tw->last_ms >= TIMER_WHEEL_RES_MS)
+	{
+		struct timer_entry_s **slot;
+		struct timer_entry_s *pending;
+		struct timer_entry_s *e;
+
+		tw->last_ms += TIMER_WHEEL_RES_MS;
+		tw->slot_now = (tw->slot_now + 1) % TIMER_WHEEL_SLOTS;
+		slot = &tw->slot[tw->slot_now];
+
+		/* Move the entries of this slot to a separate list, so that
+		 * callbacks may add entries to this slot, or cancel any entry,
+		 * while the list is processed. */
+		pending = *slot;
+		*slot = NULL;
+		if(pending != NULL)
+			pending->pprev = &pending;
+
+		while((e = pending) != NULL)
+		{
+			timer_wheel_cancel(e);
+
+			if(e->rounds == 0)
+			{
+				if(e->fn != NULL)
+					e->fn(e->priv);
+
+				continue;
+			}
+
+			/* Wait for another turn of the wheel. */
+			e->rounds--;
+			e->next = *slot;
+			if(e->next != NULL)
+				e->next->pprev = &e->next;
+
+			e->pprev = slot;
+			*slot = e;
+		}
+	}
+}
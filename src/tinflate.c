@@ -122,6 +122,49 @@ static tinf_error_code tinf_build_tree(struct tinf_tree *t,
 	return TINF_OK;
 }
 
+/* Build fixed Huffman trees */
+static void tinf_build_fixed_trees(struct tinf_tree *lt, struct tinf_tree *dt)
+{
+	int i;
+
+	/* Build fixed literal/length tree */
+	for (i = 0; i < 16; ++i) {
+		lt->counts[i] = 0;
+	}
+
+	lt->counts[7] = 24;
+	lt->counts[8] = 152;
+	lt->counts[9] = 112;
+
+	for (i = 0; i < 24; ++i) {
+		lt->symbols[i] = 256 + i;
+	}
+	for (i = 0; i < 144; ++i) {
+		lt->symbols[24 + i] = i;
+	}
+	for (i = 0; i < 8; ++i) {
+		lt->symbols[24 + 144 + i] = 280 + i;
+	}
+	for (i = 0; i < 112; ++i) {
+		lt->symbols[24 + 144 + 8 + i] = 144 + i;
+	}
+
+	lt->max_sym = 285;
+
+	/* Build fixed distance tree */
+	for (i = 0; i < 16; ++i) {
+		dt->counts[i] = 0;
+	}
+
+	dt->counts[5] = 30;
+
+	for (i = 0; i < 30; ++i) {
+		dt->symbols[i] = i;
+	}
+
+	dt->max_sym = 29;
+}
+
 /* -- Decode functions -- */
 
 static void tinf_refill(struct tinf_data *d, unsigned char num)
@@ -430,6 +473,16 @@ static tinf_error_code tinf_inflate_block_data(struct tinf_data *d,
 	}
 }
 
+/* Inflate a block of data compressed with fixed Huffman trees */
+static tinf_error_code tinf_inflate_fixed_block(struct tinf_data *d)
+{
+	/* Build fixed trees */
+	tinf_build_fixed_trees(&d->ltree, &d->dtree);
+
+	/* Decode block using fixed trees */
+	return tinf_inflate_block_data(d, &d->ltree, &d->dtree);
+}
+
 /* Inflate a block of data compressed with dynamic Huffman trees */
 static tinf_error_code tinf_inflate_dynamic_block(struct tinf_data *d)
 {
@@ -474,7 +527,10 @@ tinf_error_code tinf_uncompress(void *dest, unsigned long *destLen,
 		/* Read block type (2 bits) */
 		btype = tinf_getbits(&d, 2);
 
-		if(btype == 2) {
+		if(btype == 1) {
+			res = tinf_inflate_fixed_block(&d);
+		}
+		else if(btype == 2) {
 			res = tinf_inflate_dynamic_block(&d);
 		}
 		else {
@@ -0,0 +1,225 @@
+/**
+ * Records timestamped events for viewing on a timeline.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#include <SDL.h>
+#include <trace.h>
+
+/* Number of events kept for each thread. Must be a power of two. */
+#define TRACE_RING_LEN		65536
+#define TRACE_RING_MASK		(TRACE_RING_LEN - 1)
+#define TRACE_THREADS_MAX	32
+
+struct trace_ev_s {
+	Uint64 ts;
+	const char *name;
+	char ph;
+};
+
+struct trace_ring_s {
+	SDL_threadID tid;
+	char name[16];
+
+	/* Number of events written. Only the owning thread writes to the
+	 * ring. */
+	SDL_atomic_t head;
+	struct trace_ev_s ev[TRACE_RING_LEN];
+};
+
+static struct trace_s {
+	SDL_atomic_t enabled;
+	char *filename;
+	Uint64 base;
+	SDL_TLSID tls;
+
+	SDL_atomic_t nrings;
+	struct trace_ring_s *ring[TRACE_THREADS_MAX];
+} trace;
+
+/* Stored in place of a ring for threads that could not be given one, so that
+ * they do not try again for each event. */
+static char trace_no_ring;
+
+static struct trace_ring_s *trace_get_ring(void)
+{
+	struct trace_ring_s *r = SDL_TLSGet(trace.tls);
+	int slot;
+
+	if(r == (void *)&trace_no_ring)
+		return NULL;
+
+	if(r != NULL)
+		return r;
+
+	slot = SDL_AtomicAdd(&trace.nrings, 1);
+	if(slot >= TRACE_THREADS_MAX)
+		goto err;
+
+	r = SDL_calloc(1, sizeof(*r));
+	if(r == NULL)
+		goto err;
+
+	r->tid = SDL_ThreadID();
+	SDL_snprintf(r->name, sizeof(r->name), "Thread %lu",
+		     (unsigned long)r->tid);
+	trace.ring[slot] = r;
+	SDL_TLSSet(trace.tls, r, NULL);
+	return r;
+
+err:
+	SDL_TLSSet(trace.tls, &trace_no_ring, NULL);
+	return NULL;
+}
+
+static void trace_put(const char *name, char ph)
+{
+	struct trace_ring_s *r;
+	struct trace_ev_s *ev;
+	Uint32 head;
+
+	if(SDL_AtomicGet(&trace.enabled) == 0)
+		return;
+
+	r = trace_get_ring();
+	if(r == NULL)
+		return;
+
+	/* The oldest event is overwritten when the ring is full. */
+	head = (Uint32)SDL_AtomicGet(&r->head);
+	ev = &r->ev[head & TRACE_RING_MASK];
+	ev->ts = SDL_GetPerformanceCounter();
+	ev->name = name;
+	ev->ph = ph;
+	SDL_AtomicSet(&r->head, (int)(head + 1));
+}
+
+void trace_begin(const char *name)
+{
+	trace_put(name, 'B');
+}
+
+void trace_end(const char *name)
+{
+	trace_put(name, 'E');
+}
+
+void trace_thread_name(const char *name)
+{
+	struct trace_ring_s *r;
+
+	if(SDL_AtomicGet(&trace.enabled) == 0)
+		return;
+
+	r = trace_get_ring();
+	if(r == NULL)
+		return;
+
+	SDL_strlcpy(r->name, name, sizeof(r->name));
+}
+
+int trace_init(const char *filename)
+{
+	SDL_assert(SDL_AtomicGet(&trace.enabled) == 0);
+
+	trace.tls = SDL_TLSCreate();
+	if(trace.tls == 0)
+		return -1;
+
+	trace.filename = SDL_strdup(filename);
+	if(trace.filename == NULL)
+		return SDL_OutOfMemory();
+
+	SDL_AtomicSet(&trace.nrings, 0);
+	trace.base = SDL_GetPerformanceCounter();
+	SDL_AtomicSet(&trace.enabled, 1);
+	trace_thread_name("Main");
+
+	return 0;
+}
+
+static void trace_write(SDL_RWops *f, const char *str)
+{
+	SDL_RWwrite(f, str, 1, SDL_strlen(str));
+}
+
+static void trace_write_ring(SDL_RWops *f, struct trace_ring_s *r,
+			     double us_per_tick, SDL_bool *first)
+{
+	char line[192];
+	Uint32 head = (Uint32)SDL_AtomicGet(&r->head);
+	Uint32 i = head > TRACE_RING_LEN ? head - TRACE_RING_LEN : 0;
+
+	SDL_snprintf(line, sizeof(line),
+		     "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		     "\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+		     *first ? "" : ",\n", (unsigned long)r->tid, r->name);
+	trace_write(f, line);
+	*first = SDL_FALSE;
+
+	for(; i != head; i++)
+	{
+		const struct trace_ev_s *ev = &r->ev[i & TRACE_RING_MASK];
+		double ts = (double)(ev->ts - trace.base) * us_per_tick;
+
+		SDL_snprintf(line, sizeof(line),
+			     ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+			     "\"pid\":1,\"tid\":%lu}",
+			     ev->name, ev->ph, ts, (unsigned long)r->tid);
+		trace_write(f, line);
+	}
+}
+
+void trace_exit(void)
+{
+	SDL_RWops *f;
+	SDL_bool first = SDL_TRUE;
+	int nrings;
+	double us_per_tick;
+
+	if(SDL_AtomicGet(&trace.enabled) == 0)
+		return;
+
+	SDL_AtomicSet(&trace.enabled, 0);
+	nrings = SDL_min(SDL_AtomicGet(&trace.nrings), TRACE_THREADS_MAX);
+	us_per_tick = 1000000.0 / (double)SDL_GetPerformanceFrequency();
+
+	f = SDL_RWFromFile(trace.filename, "wb");
+	if(f == NULL)
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+			     "Unable to write trace: %s", SDL_GetError());
+		goto out;
+	}
+
+	trace_write(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for(int i = 0; i < nrings; i++)
+	{
+		if(trace.ring[i] != NULL)
+			trace_write_ring(f, trace.ring[i], us_per_tick, &first);
+	}
+	trace_write(f, "\n]}\n");
+	SDL_RWclose(f);
+
+	SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Trace saved to \"%s\"",
+		    trace.filename);
+
+out:
+	for(int i = 0; i < TRACE_THREADS_MAX; i++)
+	{
+		SDL_free(trace.ring[i]);
+		trace.ring[i] = NULL;
+	}
+
+	SDL_free(trace.filename);
+	trace.filename = NULL;
+}
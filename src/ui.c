@@ -24,237 +24,334 @@ struct ui_s {
 	SDL_Renderer *rend;
 };
 
-static SDL_SpinLock overlay_lock = { 0 };
-struct ui_overlay_tip {
-	ui_overlay_ctx **p;
+static void ui_overlay_timeout(void *priv)
+{
+	ui_overlay_item_s *item = priv;
+	ui_overlay_delete(item->owner, item);
+}
+
+void ui_overlay_init(ui_overlay_ctx *ctx)
+{
+	SDL_zerop(ctx);
+
+	/* Overlays are taken from the top of the stack, so the first overlay
+	 * will be at index 0. */
+	for(unsigned i = 0; i < UI_OVERLAY_MAX; i++)
+	{
+		ctx->free_idx[i] = UI_OVERLAY_MAX - 1 - i;
+		ctx->item[i].owner = ctx;
+	}
+
+	ctx->free_n = UI_OVERLAY_MAX;
+}
+
+ui_overlay_item_s *ui_add_overlay(ui_overlay_ctx *ctx,
+		struct timer_wheel_s *tw, SDL_Colour text_colour,
+		ui_overlay_corner_e corner, const char *text, Uint32 timeout_ms,
+		char *(*get_new_str)(void *priv), void *priv)
+{
 	ui_overlay_item_s *item;
-};
-static Uint32 ui_overlay_timeout(Uint32 interval, void *param);
+	Uint8 idx;
 
-struct ui_overlay_item {
-	struct ui_overlay_item *prev;
+	if(ctx->free_n == 0)
+	{
+		SDL_SetError("Too many overlays");
+		return NULL;
+	}
 
-	SDL_Colour text_colour;
-	ui_overlay_corner_e corner;
+	idx = ctx->free_idx[--ctx->free_n];
+	ctx->corner_idx[corner][ctx->corner_n[corner]++] = idx;
 
-	char *text;
-	Uint8 free_text;
+	item = &ctx->item[idx];
+	item->text_colour = text_colour;
+	item->corner = corner;
+	item->get_new_str = get_new_str;
+	item->priv = priv;
+	item->tex = NULL;
+	item->redraw = SDL_FALSE;
+	item->text[0] = '\0';
 
-	char *(*get_new_str)(void *priv);
-	void *priv;
+	if(text != NULL)
+		SDL_strlcpy(item->text, text, sizeof(item->text));
 
-	SDL_Texture *tex;
-	struct ui_overlay_item *next;
-};
+	if(timeout_ms != 0)
+	{
+		timer_wheel_add(tw, &item->timeout, timeout_ms,
+				ui_overlay_timeout, item);
+	}
+
+	ctx->dirty = SDL_TRUE;
+	return item;
+}
 
-ui_overlay_item_s *ui_add_overlay(ui_overlay_ctx **ctx, SDL_Colour text_colour,
-		ui_overlay_corner_e corner, char *text, Uint32 timeout_ms,
-		char *(*get_new_str)(void *priv), void *priv,
-		Uint8 free_text)
+void ui_overlay_delete(ui_overlay_ctx *ctx, ui_overlay_item_s *item)
 {
-	ui_overlay_item_s *list;
-	ui_overlay_item_s *new = SDL_malloc(sizeof(ui_overlay_item_s));
-	struct ui_overlay_tip *tim = SDL_malloc(sizeof(struct ui_overlay_tip));
+	Uint8 idx = (Uint8)(item - ctx->item);
+	Uint8 *ci = ctx->corner_idx[item->corner];
+	Uint8 *n = &ctx->corner_n[item->corner];
 
-	/* Allocate new item. */
-	if(new == NULL || tim == NULL)
-		return NULL;
+	SDL_assert(idx < UI_OVERLAY_MAX);
 
-	SDL_AtomicLock(&overlay_lock);
-	list = *ctx;
+	timer_wheel_cancel(&item->timeout);
 
-	/* Obtain the last item in the linked list. */
-	while(list != NULL && list->next != NULL)
-		list = list->next;
+	if(item->tex != NULL)
+		SDL_DestroyTexture(item->tex);
 
-	if(list != NULL)
-	{
-		/* Create a new overlay. */
-		list->next = new;
-		if(list->next == NULL)
-			goto err;
+	item->tex = NULL;
 
-		list->next->prev = list;
-		list = list->next;
-	}
-	else
+	/* Keep the remaining overlays in the corner in order. */
+	for(Uint8 i = 0; i < *n; i++)
 	{
-		/* If no overlay exists yet, create the first overlay and set
-		 * the context to the first item. */
-		*ctx = new;
-		list = *ctx;
-		if(list == NULL)
-			goto err;
-
-		list->prev = NULL;
+		if(ci[i] != idx)
+			continue;
+
+		SDL_memmove(&ci[i], &ci[i + 1], *n - i - 1);
+		(*n)--;
+		ctx->free_idx[ctx->free_n++] = idx;
+		break;
 	}
 
-	list->text_colour = text_colour;
-	list->corner = corner;
-	list->text = text;
-	list->free_text = free_text;
-	list->get_new_str = get_new_str;
-	list->priv = priv;
-	list->tex = NULL;
-	list->next = NULL;
+	ctx->dirty = SDL_TRUE;
+}
 
-	if(timeout_ms != 0)
+void ui_overlay_delete_all(ui_overlay_ctx *ctx)
+{
+	for(unsigned c = 0; c < SDL_arraysize(ctx->corner_n); c++)
 	{
-		tim->p = ctx;
-		tim->item = list;
-		SDL_AddTimer(timeout_ms, ui_overlay_timeout, tim);
+		while(ctx->corner_n[c] != 0)
+		{
+			ui_overlay_delete(ctx,
+				&ctx->item[ctx->corner_idx[c][0]]);
+		}
 	}
 
-out:
-	SDL_AtomicUnlock(&overlay_lock);
-	return list;
+	if(ctx->layer != NULL)
+		SDL_DestroyTexture(ctx->layer);
 
-err:
-	list = NULL;
-	goto out;
+	ctx->layer = NULL;
+	ctx->layer_w = 0;
+	ctx->layer_h = 0;
 }
 
-void ui_overlay_delete(ui_overlay_ctx **p, ui_overlay_item_s *item)
+/**
+ * Obtains the latest string of a dynamic overlay. Returns SDL_TRUE if the
+ * string differs from the one that was last rendered, or if the overlay should
+ * be deleted, in which case new_str is set to NULL.
+ */
+static SDL_bool ui_overlay_update_text(ui_overlay_item_s *item,
+				       const char **new_str)
 {
-	if(item->free_text)
-		SDL_free(item->text);
-
-	/* If this is the tip of the linked list, then set the next item as the
-	 * tip. If there is no next item, then the tip is set to NULL. */
-	if(*p == item)
-		*p = item->next;
-
-	if(item->next != NULL)
-		item->next->prev = item->prev;
+	*new_str = item->get_new_str(item->priv);
+	if(*new_str == NULL)
+		return SDL_TRUE;
 
-	if(item->prev != NULL)
-		item->prev->next = item->next;
+	/* Only the text that fits is compared. */
+	if(SDL_strncmp(item->text, *new_str, sizeof(item->text) - 1) == 0)
+		return SDL_FALSE;
 
-	SDL_free(item);
-	return;
+	SDL_strlcpy(item->text, *new_str, sizeof(item->text));
+	return SDL_TRUE;
 }
 
-void ui_overlay_delete_all(ui_overlay_ctx **p)
+/**
+ * Renders the text of an overlay on to its own texture.
+ */
+static int ui_overlay_render_text(ui_overlay_item_s *item,
+				  SDL_Renderer *rend, font_ctx *font)
 {
-	while(*p != NULL)
-		ui_overlay_delete(p, *p);
-}
+	const unsigned margin = 2;
+	SDL_Colour c = item->text_colour;
+	SDL_Rect txt_dst = { margin, margin, 1, 1 };
+	unsigned txtw, txth;
 
-Uint32 ui_overlay_timeout(Uint32 interval, void *param)
-{
-	struct ui_overlay_tip *tim = param;
-	(void) interval;
+	FontDrawSize(SDL_strlen(item->text), &txtw, &txth);
+	txtw += margin;
+	txth += margin;
+
+	item->redraw = SDL_FALSE;
+	if(item->tex != NULL && (item->tex_w != txtw || item->tex_h != txth))
+	{
+		SDL_DestroyTexture(item->tex);
+		item->tex = NULL;
+	}
+
+	if(item->tex == NULL)
+	{
+		item->tex = SDL_CreateTexture(rend, SDL_PIXELFORMAT_ARGB8888,
+					      SDL_TEXTUREACCESS_TARGET,
+					      txtw, txth);
+		if(item->tex == NULL)
+			return -1;
+	}
+
+	item->tex_w = txtw;
+	item->tex_h = txth;
+
+	/* Overlays never overlap, so the background does not need to be
+	 * blended when composited on to the layer. */
+	SDL_SetTextureBlendMode(item->tex, SDL_BLENDMODE_NONE);
+	SDL_SetRenderTarget(rend, item->tex);
+	SDL_SetRenderDrawColor(rend, 0x00, 0x00, 0x00, UI_OVERLAY_BG_ALPHA);
+	SDL_RenderClear(rend);
+
+	SDL_SetRenderDrawColor(rend, c.r, c.g, c.b, c.a);
+	if(item->text[0] != '\0')
+		FontPrintToRenderer(font, item->text, &txt_dst);
 
-	SDL_AtomicLock(&overlay_lock);
-	ui_overlay_delete(tim->p, tim->item);
-	SDL_AtomicUnlock(&overlay_lock);
-	SDL_free(param);
 	return 0;
 }
 
-int ui_overlay_render(ui_overlay_ctx **p, SDL_Renderer *rend, font_ctx *font)
+/**
+ * Redraws all overlays on to the layer texture.
+ */
+static int ui_overlay_composite(ui_overlay_ctx *ctx, SDL_Renderer *rend,
+				font_ctx *font, int w, int h)
 {
-	int w, h;
+	SDL_Texture *prev_targ = SDL_GetRenderTarget(rend);
+	const unsigned padding = 2;
 	int ret = 0;
-	Uint8 corner_use[4] = { 0 };
-	ui_overlay_ctx *ctx = *p;
 
-	SDL_RenderGetLogicalSize(rend, &w, &h);
+	if(ctx->layer == NULL || ctx->layer_w != w || ctx->layer_h != h)
+	{
+		if(ctx->layer != NULL)
+			SDL_DestroyTexture(ctx->layer);
+
+		ctx->layer = SDL_CreateTexture(rend, SDL_PIXELFORMAT_ARGB8888,
+					       SDL_TEXTUREACCESS_TARGET, w, h);
+		if(ctx->layer == NULL)
+			return -1;
 
-	while(ctx != NULL)
+		SDL_SetTextureBlendMode(ctx->layer, SDL_BLENDMODE_BLEND);
+		ctx->layer_w = w;
+		ctx->layer_h = h;
+	}
+
+	/* Text is rendered first, as it requires changing the render
+	 * target. */
+	for(unsigned c = 0; c < SDL_arraysize(ctx->corner_n); c++)
 	{
-		ui_overlay_item_s *next = ctx->next;
-		SDL_Colour c = ctx->text_colour;
-		unsigned txth, txtw;
-		const unsigned margin = 2;
-		const unsigned padding = 2;
-		SDL_Rect dst;
-
-		/* Get new string if requested. */
-		if(ctx->get_new_str != NULL)
-			ctx->text = ctx->get_new_str(ctx->priv);
-
-		/* If text is NULL, then delete overlay. */
-		if(ctx->text == NULL)
+		for(Uint8 i = 0; i < ctx->corner_n[c]; i++)
 		{
-			ui_overlay_delete(p, ctx);
-			ctx = next;
-			continue;
+			ui_overlay_item_s *item =
+				&ctx->item[ctx->corner_idx[c][i]];
+
+			if((item->tex == NULL || item->redraw) &&
+			   ui_overlay_render_text(item, rend, font) != 0)
+				ret = -1;
 		}
+	}
 
-		FontDrawSize(strlen(ctx->text), &txtw, &txth);
-		txtw += margin;
-		txth += margin;
+	SDL_SetRenderTarget(rend, ctx->layer);
+	SDL_SetRenderDrawColor(rend, 0x00, 0x00, 0x00, 0x00);
+	SDL_RenderClear(rend);
 
-		if(ctx->tex == NULL)
+	for(unsigned c = 0; c < SDL_arraysize(ctx->corner_n); c++)
+	{
+		int y = 0;
+
+		for(Uint8 i = 0; i < ctx->corner_n[c]; i++)
 		{
-			SDL_Texture *prev_targ = SDL_GetRenderTarget(rend);
-			SDL_Rect txt_dst = { margin, margin, 1, 1 };
-
-			/* If a new string isn't required, and a texture has
-			 * not already been cached, create a texture and cache
-			 * it. */
-			ctx->tex = SDL_CreateTexture(rend,
-					SDL_PIXELFORMAT_ARGB8888,
-					SDL_TEXTUREACCESS_TARGET, txtw, txth);
-			if(ctx->tex == NULL)
-				continue;
+			ui_overlay_item_s *item =
+				&ctx->item[ctx->corner_idx[c][i]];
+			SDL_Rect dst;
 
-			SDL_SetTextureBlendMode(ctx->tex, SDL_BLENDMODE_BLEND);
-			SDL_SetRenderTarget(rend, ctx->tex);
-			SDL_SetRenderDrawColor(rend, 0x00, 0x00, 0x00,
-					UI_OVERLAY_BG_ALPHA);
-			SDL_RenderClear(rend);
+			if(item->tex == NULL)
+				continue;
 
-			SDL_SetRenderDrawColor(rend, c.r, c.g, c.b, c.a);
-			FontPrintToRenderer(font, ctx->text, &txt_dst);
-			SDL_SetRenderTarget(rend, prev_targ);
+			dst.w = item->tex_w;
+			dst.h = item->tex_h;
+
+			switch(item->corner)
+			{
+			case ui_overlay_top_left:
+				dst.x = 0;
+				dst.y = y;
+				break;
+
+			case ui_overlay_top_right:
+				dst.x = w - dst.w;
+				dst.y = y;
+				break;
+
+			case ui_overlay_bot_left:
+				dst.x = 0;
+				dst.y = h - y - dst.h;
+				break;
+
+			case ui_overlay_bot_right:
+				dst.x = w - dst.w;
+				dst.y = h - y - dst.h;
+				break;
+			}
+
+			/* Add space between overlays. */
+			y += dst.h + padding;
+			SDL_RenderCopy(rend, item->tex, NULL, &dst);
 		}
+	}
 
-		/* Render text */
-		dst.w = txtw;
-		dst.h = txth;
+	SDL_SetRenderTarget(rend, prev_targ);
 
-		/* Add one pixel space between overlays. */
-		if(corner_use[ctx->corner] != 0)
-			txth += padding;
+	/* Try again on the next frame if an overlay could not be drawn. */
+	ctx->dirty = ret != 0 ? SDL_TRUE : SDL_FALSE;
+	return ret;
+}
 
-		switch(ctx->corner)
-		{
-		case ui_overlay_top_left:
-			dst.x = 0;
-			dst.y = txth * corner_use[ctx->corner];
-			break;
-
-		case ui_overlay_top_right:
-			dst.x = w - txtw;
-			dst.y = txth * corner_use[ctx->corner];
-			break;
-
-		case ui_overlay_bot_left:
-			dst.x = 0;
-			dst.y = h - (txth * (corner_use[ctx->corner] + 1));
-			break;
-
-		case ui_overlay_bot_right:
-			dst.x = w - txtw;
-			dst.y = h - (txth * (corner_use[ctx->corner] + 1));
-			break;
-		}
+int ui_overlay_render(ui_overlay_ctx *ctx, SDL_Renderer *rend, font_ctx *font)
+{
+	int w, h;
+	unsigned shown = 0;
+
+	SDL_RenderGetLogicalSize(rend, &w, &h);
+	if(w == 0 || h == 0)
+		SDL_GetRendererOutputSize(rend, &w, &h);
 
-		corner_use[ctx->corner]++;
-		SDL_RenderCopy(rend, ctx->tex, NULL, &dst);
+	if(w != ctx->layer_w || h != ctx->layer_h)
+		ctx->dirty = SDL_TRUE;
 
-		if(ctx->get_new_str != NULL)
+	/* Check dynamic overlays for new text. */
+	for(unsigned c = 0; c < SDL_arraysize(ctx->corner_n); c++)
+	{
+		Uint8 i = 0;
+
+		while(i < ctx->corner_n[c])
 		{
-			SDL_DestroyTexture(ctx->tex);
-			ctx->tex = NULL;
+			ui_overlay_item_s *item =
+				&ctx->item[ctx->corner_idx[c][i]];
+			const char *new_str;
+
+			if(item->get_new_str == NULL ||
+			   !ui_overlay_update_text(item, &new_str))
+			{
+				i++;
+				continue;
+			}
+
+			ctx->dirty = SDL_TRUE;
+
+			/* If text is NULL, then delete overlay. The next
+			 * overlay is moved in to this position. */
+			if(new_str == NULL)
+			{
+				ui_overlay_delete(ctx, item);
+				continue;
+			}
+
+			item->redraw = SDL_TRUE;
+			i++;
 		}
 
-		ctx = next;
+		shown += ctx->corner_n[c];
 	}
 
-	return ret;
+	if(shown == 0)
+		return 0;
+
+	if(ctx->dirty && ui_overlay_composite(ctx, rend, font, w, h) != 0 &&
+	   ctx->layer == NULL)
+		return -1;
+
+	return SDL_RenderCopy(rend, ctx->layer, NULL, NULL);
 }
 
 #if 0
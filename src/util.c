@@ -37,63 +37,103 @@ void gen_filename(char filename[atleast 64], const char *core_name,
 		     fmt);
 }
 
-struct at_tim_s {
-	Uint32 timeout_ms;
-	SDL_atomic_t *atomic;
-	int setval;
-};
-
-static SDL_atomic_t util_exit_threads;
-
-static int util_timeout_thread(void *param)
+/* Number of surfaces kept for reuse by util_surf_get(). */
+#define UTIL_SURF_POOL_MAX	8
+
+static struct util_cache_s {
+	/* Render target used to read back textures. */
+	SDL_Renderer *target_rend;
+	SDL_Texture *target;
+
+	/* Surfaces returned with util_surf_put(). Surfaces are returned by
+	 * encoder threads, so access is guarded by a spinlock. */
+	SDL_SpinLock surf_lk;
+	unsigned nsurf;
+	SDL_Surface *surf[UTIL_SURF_POOL_MAX];
+} cache;
+
+SDL_Surface *util_surf_get(int w, int h, Uint32 fmt)
 {
-	struct at_tim_s *at = param;
+	SDL_Surface *surf = NULL;
+
+	SDL_AtomicLock(&cache.surf_lk);
+	for(unsigned i = 0; i < cache.nsurf; i++)
+	{
+		SDL_Surface *s = cache.surf[i];
 
-	SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
-	SDL_Delay(at->timeout_ms);
+		if(s->w != w || s->h != h || s->format->format != fmt)
+			continue;
 
-	if(SDL_AtomicGet(&util_exit_threads) == 0)
-		goto out;
+		surf = s;
+		cache.surf[i] = cache.surf[--cache.nsurf];
+		break;
+	}
+	SDL_AtomicUnlock(&cache.surf_lk);
 
-	SDL_AtomicSet(at->atomic, at->setval);
+	if(surf != NULL)
+		return surf;
 
-out:
-	SDL_free(at);
-	return 0;
+	return SDL_CreateRGBSurfaceWithFormat(0, w, h, SDL_BITSPERPIXEL(fmt),
+					      fmt);
 }
 
-void set_atomic_timeout(Uint32 timeout_ms, SDL_atomic_t *atomic, int setval,
-			const char *name)
+void util_surf_put(SDL_Surface *surf)
 {
-	SDL_Thread *t;
-	struct at_tim_s *at = SDL_malloc(sizeof(struct at_tim_s));
-	const char *const placeholder = "Timeout";
-
-	SDL_assert_paranoid(timeout_ms > 0);
-	SDL_assert_paranoid(atomic != NULL);
+	if(surf == NULL)
+		return;
 
-	if(at == NULL)
+	SDL_AtomicLock(&cache.surf_lk);
+	if(cache.nsurf < UTIL_SURF_POOL_MAX)
 	{
-		SDL_AtomicSet(atomic, setval);
-		return;
+		cache.surf[cache.nsurf++] = surf;
+		surf = NULL;
 	}
+	SDL_AtomicUnlock(&cache.surf_lk);
 
-	SDL_AtomicSet(&util_exit_threads, 1);
-	at->timeout_ms = timeout_ms;
-	at->atomic = atomic;
-	at->setval = setval;
+	/* The pool is full. */
+	SDL_FreeSurface(surf);
+}
+
+SDL_Surface *util_surf_dup(SDL_Surface *surf)
+{
+	SDL_Surface *dup;
+	size_t row = (size_t)surf->w * surf->format->BytesPerPixel;
+
+	dup = util_surf_get(surf->w, surf->h, surf->format->format);
+	if(dup == NULL)
+		return NULL;
 
-	if(name == NULL)
-		name = placeholder;
+	for(int y = 0; y < surf->h; y++)
+	{
+		SDL_memcpy((Uint8 *)dup->pixels + (size_t)y * dup->pitch,
+			   (const Uint8 *)surf->pixels + (size_t)y * surf->pitch,
+			   row);
+	}
 
-	t = SDL_CreateThread(util_timeout_thread, name, at);
-	SDL_DetachThread(t);
+	return dup;
 }
 
-void util_exit_all(void)
+static SDL_Texture *util_get_target(SDL_Renderer *rend, Uint32 fmt,
+				    const SDL_Rect *src)
 {
-	SDL_AtomicSet(&util_exit_threads, 0);
-	return;
+	int w = 0, h = 0;
+
+	if(cache.target != NULL && cache.target_rend == rend)
+		SDL_QueryTexture(cache.target, NULL, NULL, &w, &h);
+
+	/* The target is only recreated when it is too small, so that it is
+	 * not recreated for every frame. */
+	if(w >= src->w && h >= src->h)
+		return cache.target;
+
+	if(cache.target != NULL)
+		SDL_DestroyTexture(cache.target);
+
+	cache.target = SDL_CreateTexture(rend, fmt, SDL_TEXTUREACCESS_TARGET,
+					 SDL_max(w, src->w),
+					 SDL_max(h, src->h));
+	cache.target_rend = rend;
+	return cache.target;
 }
 
 SDL_Surface *util_tex_to_surf(SDL_Renderer *rend, SDL_Texture *tex,
@@ -109,8 +149,7 @@ SDL_Surface *util_tex_to_surf(SDL_Renderer *rend, SDL_Texture *tex,
 		return NULL;
 
 	/* TODO: Can be optimised if no flipping is required. */
-	core_tex = SDL_CreateTexture(rend, fmt, SDL_TEXTUREACCESS_TARGET,
-				     src->w, src->h);
+	core_tex = util_get_target(rend, fmt, src);
 	if(core_tex == NULL)
 		return NULL;
 
@@ -124,20 +163,60 @@ SDL_Surface *util_tex_to_surf(SDL_Renderer *rend, SDL_Texture *tex,
 	if(SDL_RenderCopyEx(rend, tex, src, src, 0.0, NULL, flip) != 0)
 		goto err;
 
-	surf = SDL_CreateRGBSurfaceWithFormat(0, src->w, src->h,
-					      SDL_BITSPERPIXEL(fmt), fmt);
+	surf = util_surf_get(src->w, src->h, fmt);
 	if(surf == NULL)
 		goto err;
 
 	/* TODO: Convert format (if required) in new thread. */
 	if(SDL_RenderReadPixels(rend, src, fmt, surf->pixels, surf->pitch) != 0)
 	{
-		SDL_FreeSurface(surf);
+		util_surf_put(surf);
+		surf = NULL;
 		goto err;
 	}
 
 err:
 	SDL_SetRenderTarget(rend, NULL);
-	SDL_DestroyTexture(core_tex);
 	return surf;
 }
+
+Uint32 util_hash(Uint32 hash, const void *data, size_t len)
+{
+	const Uint8 *p = data;
+
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= p[i];
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+Uint32 util_hash_frame(const void *data, unsigned w, unsigned h, size_t pitch,
+		       unsigned bpp)
+{
+	const Uint8 *row = data;
+	const size_t len = (size_t)w * bpp;
+	Uint32 hash = UTIL_HASH_INIT;
+
+	for(unsigned y = 0; y < h; y++, row += pitch)
+		hash = util_hash(hash, row, len);
+
+	return hash;
+}
+
+void util_exit(void)
+{
+	if(cache.target != NULL)
+	{
+		SDL_DestroyTexture(cache.target);
+		cache.target = NULL;
+		cache.target_rend = NULL;
+	}
+
+	SDL_AtomicLock(&cache.surf_lk);
+	while(cache.nsurf != 0)
+		SDL_FreeSurface(cache.surf[--cache.nsurf]);
+	SDL_AtomicUnlock(&cache.surf_lk);
+}
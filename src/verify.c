@@ -0,0 +1,262 @@
+/**
+ * Verifies that a replay produces the same output as a previous replay.
+ * Copyright (C) 2020  Mahyar Koshkouei
+ *
+ * This is free software, and you are welcome to redistribute it under the terms
+ * of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ *
+ * See the LICENSE file for more details.
+ */
+
+#include <SDL.h>
+#include <verify.h>
+
+struct verify_ctx_s {
+	SDL_RWops *trace;
+
+	/* Contents of the golden trace, and the next line to be compared. */
+	char *golden;
+	char *golden_pos;
+
+	/* Number of frames verified. */
+	Uint32 frames;
+
+	/* Set once a frame differs, or the golden trace ends early. Only the
+	 * first difference is reported. */
+	SDL_bool diverged;
+
+	/* Set once a missing state hash has been reported. */
+	SDL_bool state_warned;
+};
+
+/**
+ * Reads the next frame from the golden trace.
+ *
+ * \return		SDL_TRUE if a frame was read, or SDL_FALSE at the end
+ *			of the golden trace.
+ */
+static SDL_bool verify_next_golden(verify_ctx *ctx, Uint32 *frame,
+		struct verify_hash_s *hash)
+{
+	while(*ctx->golden_pos != '\0')
+	{
+		char *line = ctx->golden_pos;
+		char *end = SDL_strchr(line, '\n');
+		unsigned f, v, a, s;
+		int n;
+
+		if(end != NULL)
+		{
+			*end = '\0';
+			ctx->golden_pos = end + 1;
+		}
+		else
+			ctx->golden_pos = line + SDL_strlen(line);
+
+		if(line[0] == '#')
+			continue;
+
+		n = SDL_sscanf(line, "%u %x %x %x", &f, &v, &a, &s);
+		if(n < 3)
+			continue;
+
+		*frame = f;
+		hash->video = v;
+		hash->audio = a;
+		hash->state = s;
+		hash->has_state = n == 4 ? SDL_TRUE : SDL_FALSE;
+		return SDL_TRUE;
+	}
+
+	return SDL_FALSE;
+}
+
+verify_ctx *verify_init(const char *trace, const char *golden)
+{
+	static const char hdr[] = "# Haiyajan hash trace: frame video audio "
+		"[state]\n";
+	verify_ctx *ctx;
+
+	ctx = SDL_calloc(1, sizeof(*ctx));
+	if(ctx == NULL)
+	{
+		SDL_OutOfMemory();
+		return NULL;
+	}
+
+	if(golden != NULL)
+	{
+		ctx->golden = SDL_LoadFile(golden, NULL);
+		if(ctx->golden == NULL)
+			goto err;
+
+		ctx->golden_pos = ctx->golden;
+	}
+
+	if(trace != NULL)
+	{
+		ctx->trace = SDL_RWFromFile(trace, "wb");
+		if(ctx->trace == NULL)
+			goto err;
+
+		if(SDL_RWwrite(ctx->trace, hdr, 1, sizeof(hdr) - 1) !=
+				sizeof(hdr) - 1)
+			goto err;
+	}
+
+	return ctx;
+
+err:
+	verify_exit(ctx);
+	return NULL;
+}
+
+static void verify_trace(verify_ctx *ctx, Uint32 frame,
+		const struct verify_hash_s *hash)
+{
+	char line[48];
+	int len;
+
+	if(hash->has_state)
+	{
+		len = SDL_snprintf(line, sizeof(line), "%u %08X %08X %08X\n",
+				   (unsigned)frame, (unsigned)hash->video,
+				   (unsigned)hash->audio,
+				   (unsigned)hash->state);
+	}
+	else
+	{
+		len = SDL_snprintf(line, sizeof(line), "%u %08X %08X\n",
+				   (unsigned)frame, (unsigned)hash->video,
+				   (unsigned)hash->audio);
+	}
+
+	if(SDL_RWwrite(ctx->trace, line, 1, len) != (size_t)len)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_TEST,
+			    "Unable to write hash trace: %s", SDL_GetError());
+		SDL_RWclose(ctx->trace);
+		ctx->trace = NULL;
+	}
+}
+
+int verify_frame(verify_ctx *ctx, Uint32 frame,
+		 const struct verify_hash_s *hash)
+{
+	struct verify_hash_s exp;
+	Uint32 exp_frame;
+	SDL_bool same;
+
+	ctx->frames++;
+
+	if(ctx->trace != NULL)
+		verify_trace(ctx, frame, hash);
+
+	if(ctx->golden == NULL || ctx->diverged)
+		return ctx->diverged;
+
+	if(verify_next_golden(ctx, &exp_frame, &exp) == SDL_FALSE)
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_TEST,
+			     "The golden trace ends before frame %u",
+			     (unsigned)frame);
+		ctx->diverged = SDL_TRUE;
+		return 1;
+	}
+
+	if(hash->has_state != exp.has_state && ctx->state_warned == SDL_FALSE)
+	{
+		SDL_LogWarn(SDL_LOG_CATEGORY_TEST,
+			    "The state of the core is only hashed in one of "
+			    "the traces, and will not be compared");
+		ctx->state_warned = SDL_TRUE;
+	}
+
+	same = exp_frame == frame && exp.video == hash->video &&
+		exp.audio == hash->audio;
+	if(hash->has_state && exp.has_state)
+		same = same && exp.state == hash->state;
+
+	if(same)
+		return 0;
+
+	ctx->diverged = SDL_TRUE;
+	SDL_LogError(SDL_LOG_CATEGORY_TEST,
+		     "First divergence from the golden trace at frame %u:",
+		     (unsigned)frame);
+
+	if(exp_frame != frame)
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_TEST,
+			     "  golden trace is at frame %u",
+			     (unsigned)exp_frame);
+	}
+
+	if(exp.video != hash->video)
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_TEST,
+			     "  video %08X, expected %08X",
+			     (unsigned)hash->video, (unsigned)exp.video);
+	}
+
+	if(exp.audio != hash->audio)
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_TEST,
+			     "  audio %08X, expected %08X",
+			     (unsigned)hash->audio, (unsigned)exp.audio);
+	}
+
+	if(hash->has_state && exp.has_state && exp.state != hash->state)
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_TEST,
+			     "  state %08X, expected %08X",
+			     (unsigned)hash->state, (unsigned)exp.state);
+	}
+
+	return 1;
+}
+
+int verify_report(verify_ctx *ctx)
+{
+	struct verify_hash_s exp;
+	Uint32 exp_frame;
+
+	if(ctx == NULL || ctx->golden == NULL)
+		return 0;
+
+	if(ctx->diverged)
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_TEST,
+			     "Replay did not match the golden trace");
+		return -1;
+	}
+
+	if(verify_next_golden(ctx, &exp_frame, &exp))
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_TEST,
+			     "Replay ended after %u frames, before the "
+			     "golden trace", (unsigned)ctx->frames);
+		return -1;
+	}
+
+	SDL_LogInfo(SDL_LOG_CATEGORY_TEST,
+		    "Replay matched the golden trace over %u frames",
+		    (unsigned)ctx->frames);
+	return 0;
+}
+
+void verify_exit(verify_ctx *ctx)
+{
+	if(ctx == NULL)
+		return;
+
+	if(ctx->trace != NULL)
+		SDL_RWclose(ctx->trace);
+
+	SDL_free(ctx->golden);
+	SDL_free(ctx);
+}
@@ -17,12 +17,23 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <alloc.h>
+#include <ckpt.h>
 #include <font.h>
+#include <fskip.h>
 #include <haiyajan.h>
+#include <input.h>
+#include <latency.h>
 #include <load.h>
 #include <menu.h>
+#include <perf.h>
+#include <play.h>
+#include <pool.h>
+#include <tai.h>
 #include <timer.h>
 #include <ui.h>
+#include <util.h>
+#include <verify.h>
 
 #include "minctest.h"
 
@@ -103,6 +114,55 @@ void test_retro_av(void)
 	}
 }
 
+static void test_timer_wheel_cb(void *priv)
+{
+	int *fired = priv;
+	(*fired)++;
+}
+
+/**
+ * Tests that timeouts expire once, never early, and that they may be
+ * cancelled.
+ */
+void test_timer_wheel(void)
+{
+	struct timer_wheel_s tw;
+	struct timer_entry_s a = { 0 }, b = { 0 }, c = { 0 };
+	int fired_a = 0, fired_b = 0, fired_c = 0;
+	Uint32 now = SDL_MAX_UINT32 - 500;
+
+	timer_wheel_init(&tw, now);
+	timer_wheel_add(&tw, &a, 100, test_timer_wheel_cb, &fired_a);
+	timer_wheel_add(&tw, &b, 5000, test_timer_wheel_cb, &fired_b);
+	timer_wheel_add(&tw, &c, 100, test_timer_wheel_cb, &fired_c);
+	timer_wheel_cancel(&c);
+	lok(timer_entry_pending(&a));
+	lok(!timer_entry_pending(&c));
+
+	/* Time wraps around during the test. */
+	for(Uint32 t = 0; t < 100; t++)
+		timer_wheel_advance(&tw, ++now);
+
+	lequal(fired_a, 0);
+
+	for(Uint32 t = 0; t < 40; t++)
+		timer_wheel_advance(&tw, ++now);
+
+	lequal(fired_a, 1);
+	lok(!timer_entry_pending(&a));
+
+	now += 4800;
+	timer_wheel_advance(&tw, now);
+	lequal(fired_b, 0);
+	lok(timer_entry_pending(&b));
+
+	now += 200;
+	timer_wheel_advance(&tw, now);
+	lequal(fired_b, 1);
+	lequal(fired_a, 1);
+	lequal(fired_c, 0);
+}
+
 void test_ui_drawing(void)
 {
 	SDL_Surface *ref = SDL_LoadBMP("../meta/menu_320x240.bmp");
@@ -132,8 +192,865 @@ void test_ui_drawing(void)
 	SDL_FreeSurface(ref);
 }
 
+/**
+ * Tests that the flight recorder keeps the most recent frames in order.
+ */
+void test_perf_flight(void)
+{
+	static struct perf_ctx_s p;
+	char line[PERF_FLIGHT_LINE_MAX + 1];
+	const struct perf_flight_s *f;
+	size_t len;
+
+	perf_init(&p);
+	for(unsigned i = 0; i < PERF_FLIGHT_FRAMES + 100; i++)
+	{
+		p.events = (Uint16)i;
+		perf_frame_status(&p, SDL_FALSE, (i & 1) ? SDL_TRUE : SDL_FALSE);
+		perf_frame_begin(&p);
+	}
+
+	lequal((int)perf_flight_len(&p), PERF_FLIGHT_FRAMES);
+	lequal((int)p.frames_dup, (PERF_FLIGHT_FRAMES + 100) / 2);
+
+	f = perf_flight_get(&p, 0);
+	lequal((int)f->frame, 100);
+	lequal((int)f->events, 100);
+	lequal((int)f->flags, 0);
+
+	f = perf_flight_get(&p, PERF_FLIGHT_FRAMES - 1);
+	lequal((int)f->frame, PERF_FLIGHT_FRAMES + 99);
+	lequal((int)f->flags, PERF_FLAG_DUPLICATE);
+
+	len = perf_flight_line(f, line);
+	line[len] = '\0';
+	lok(len <= PERF_FLIGHT_LINE_MAX);
+	lok(line[len - 1] == '\n');
+	lok(SDL_strtoul(line, NULL, 10) == PERF_FLIGHT_FRAMES + 99);
+}
+
+static char *test_alloc_overlay_str(void *priv)
+{
+	static char str[16];
+	const struct core_ctx_s *ctx = priv;
+
+	SDL_snprintf(str, sizeof(str), "%05u",
+		     (unsigned)(ctx->env.frames % 100000));
+	return str;
+}
+
+static Uint64 test_alloc_main(void)
+{
+	struct alloc_stats_s s;
+
+	alloc_track_get(&s);
+	return s.allocs - s.tag_allocs[ALLOC_TAG_THREADS];
+}
+
+/**
+ * Tests that the main thread does not allocate memory whilst playing frames,
+ * once the caches used by each frame have been filled.
+ */
+void test_steady_state_alloc(void)
+{
+	static struct core_ctx_s ctx;
+	static ui_overlay_ctx overlay;
+	const SDL_Colour c = { 0xFF, 0xFF, 0xFF, SDL_ALPHA_OPAQUE };
+	struct timer_wheel_s tw;
+	SDL_Surface *surf;
+	SDL_Renderer *rend;
+	font_ctx *font;
+	Uint64 beg = 0;
+
+	if(load_libretro_core("./libretro_av/libretro-av.so", &ctx))
+	{
+		SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION, "%s",
+			SDL_GetError());
+		abort();
+	}
+
+	play_init_cb(&ctx);
+	lequal(load_libretro_file(&ctx), 0);
+
+	surf = SDL_CreateRGBSurfaceWithFormat(0, 320, 240, 32,
+			SDL_PIXELFORMAT_ARGB8888);
+	rend = SDL_CreateSoftwareRenderer(surf);
+	font = FontStartup(rend);
+	lequal(play_init_av(&ctx, rend), 0);
+
+	perf_init(&ctx.perf);
+	timer_wheel_init(&tw, 0);
+	ui_overlay_init(&overlay);
+	ui_add_overlay(&overlay, &tw, c, ui_overlay_top_left, NULL, 0,
+			test_alloc_overlay_str, &ctx);
+
+	for(unsigned i = 0; i < 300; i++)
+	{
+		SDL_Surface *cap;
+
+		if(i == 200)
+			beg = test_alloc_main();
+
+		perf_frame_begin(&ctx.perf);
+		perf_phase_begin(&ctx.perf, PERF_PHASE_RUN);
+		play_frame(&ctx);
+		perf_phase_end(&ctx.perf, PERF_PHASE_RUN);
+
+		SDL_RenderCopy(rend, ctx.sdl.core_tex,
+				&ctx.sdl.game_frame_res, NULL);
+
+		/* Captured frames are returned once they are encoded. */
+		cap = util_tex_to_surf(rend, ctx.sdl.core_tex,
+				&ctx.sdl.game_frame_res, ctx.env.flip);
+		lok(cap != NULL);
+		util_surf_put(cap);
+
+		ui_overlay_render(&overlay, rend, font);
+		SDL_RenderPresent(rend);
+	}
+
+	lequal((int)(test_alloc_main() - beg), 0);
+
+	ui_overlay_delete_all(&overlay);
+	FontExit(font);
+	util_exit();
+	unload_libretro_file(&ctx);
+	unload_libretro_core(&ctx);
+	play_deinit_cb(&ctx);
+	SDL_DestroyRenderer(rend);
+	SDL_FreeSurface(surf);
+}
+
+/**
+ * Tests that the frameskip controller only skips frames whilst behind, and
+ * only as many as are required to maintain full speed.
+ */
+void test_fskip(void)
+{
+	static struct fskip_ctx_s fs;
+	unsigned skipped = 0;
+
+	/* Frames that take 8 ms in a 100 FPS core are never skipped. */
+	fskip_init(&fs, 100.0, 4);
+	for(unsigned i = 0; i < 200; i++)
+	{
+		lok(fskip_next(&fs, SDL_TRUE) == SDL_FALSE);
+		fskip_update(&fs, 8000);
+	}
+
+	/* Drawn frames take 12 ms, and skipped frames take 6 ms, so just
+	 * under half of the frames must be skipped. */
+	for(unsigned i = 0; i < 1000; i++)
+	{
+		SDL_bool skip = fskip_next(&fs, SDL_TRUE);
+
+		if(i >= 500 && skip)
+			skipped++;
+
+		fskip_update(&fs, skip ? 6000 : 12000);
+	}
+
+	lok(skipped >= 200 && skipped <= 240);
+
+	/* Frames are not skipped if emulation is keeping up. */
+	for(unsigned i = 0; i < 10; i++)
+		lok(fskip_next(&fs, SDL_FALSE) == SDL_FALSE);
+
+	/* Skipping stops once frames are fast enough again, after a short
+	 * delay. */
+	fskip_update(&fs, 5000);
+	lok(fs.ratio != 0);
+
+	for(unsigned i = 0; i < 300; i++)
+	{
+		SDL_bool skip = fskip_next(&fs, SDL_TRUE);
+		fskip_update(&fs, skip ? 4000 : 5000);
+	}
+
+	lok(fs.ratio == 0);
+}
+
+/**
+ * Tests that the frame delay rises gradually to leave a margin before VSYNC,
+ * and backs off when VSYNC is missed or the margin becomes too small.
+ */
+void test_frame_delay(void)
+{
+	struct timer_delay_s d;
+	Uint64 now, period;
+
+	timer_delay_init(&d, 60.0);
+	now = d.freq;
+	period = (d.freq * d.refresh_us) / 1000000;
+
+	for(unsigned i = 0; i < 100; i++)
+	{
+		now += period;
+		timer_delay_presented(&d, now, 5000);
+	}
+
+	lequal((int)d.delay_us, (int)(d.refresh_us - 5000 - d.margin_us));
+
+	/* A missed VSYNC halves the delay, which is then held. */
+	now += period * 2;
+	timer_delay_presented(&d, now, 5000);
+	lok(d.delay_us <= (d.refresh_us - 5000) / 2);
+
+	for(unsigned i = 0; i < 200; i++)
+	{
+		now += period;
+		timer_delay_presented(&d, now, 5000);
+	}
+
+	lok(d.delay_us <= (d.refresh_us - 5000) / 2);
+
+	for(unsigned i = 0; i < 600; i++)
+	{
+		now += period;
+		timer_delay_presented(&d, now, 5000);
+	}
+
+	lok(d.delay_us > (d.refresh_us - 5000) / 2);
+
+	/* A frame that leaves less than the margin before VSYNC removes the
+	 * delay immediately. */
+	now += period;
+	timer_delay_presented(&d, now, d.refresh_us - 500);
+	lequal((int)d.delay_us, 0);
+}
+
+static void test_pool_job(void *param)
+{
+	SDL_AtomicIncRef(param);
+}
+
+/**
+ * Tests that every job submitted to the thread pool is executed exactly once.
+ */
+void test_pool(void)
+{
+	SDL_atomic_t count;
+	int submitted = 0;
+
+	SDL_AtomicSet(&count, 0);
+	lequal(pool_init(4), 0);
+
+	for(unsigned i = 0; i < 600; i++)
+	{
+		if(pool_submit(test_pool_job, &count, i % POOL_PRIO_MAX) == 0)
+			submitted++;
+	}
+
+	pool_exit();
+	lequal(SDL_AtomicGet(&count), submitted);
+
+	/* Submitting to a stopped pool must fail without executing the job. */
+	lok(pool_submit(test_pool_job, &count, POOL_PRIO_HIGH) != 0);
+	lequal(SDL_AtomicGet(&count), submitted);
+}
+
+/**
+ * Tests that the core only sees input sampled by the input poll, so that the
+ * state of each port is consistent throughout a frame.
+ */
+void test_input_snapshot(void)
+{
+	struct input_ctx_s inp;
+	SDL_Event ev;
+
+	input_init(&inp);
+
+	SDL_zero(ev);
+	ev.type = SDL_KEYDOWN;
+	ev.key.keysym.scancode = SDL_SCANCODE_Z;
+	input_handle_event(&inp, &ev);
+	ev.key.keysym.scancode = SDL_SCANCODE_BACKSLASH;
+	input_handle_event(&inp, &ev);
+
+	/* Nothing is pressed until the input is polled. */
+	lequal(input_get(&inp, 0, RETRO_DEVICE_JOYPAD, 0,
+			 RETRO_DEVICE_ID_JOYPAD_B), 0);
+
+	input_poll(&inp);
+	lequal(input_get(&inp, 0, RETRO_DEVICE_JOYPAD, 0,
+			 RETRO_DEVICE_ID_JOYPAD_B), 1);
+	lequal(input_get(&inp, 0, RETRO_DEVICE_JOYPAD, 0,
+			 RETRO_DEVICE_ID_JOYPAD_A), 0);
+	lequal(input_get(&inp, 0, RETRO_DEVICE_JOYPAD, 0,
+			 RETRO_DEVICE_ID_JOYPAD_MASK),
+	       1 << RETRO_DEVICE_ID_JOYPAD_B);
+	lequal(input_get(&inp, 0, RETRO_DEVICE_ANALOG,
+			 RETRO_DEVICE_INDEX_ANALOG_LEFT,
+			 RETRO_DEVICE_ID_ANALOG_X), SDL_MAX_SINT16);
+	lequal(input_get(&inp, 0, RETRO_DEVICE_ANALOG,
+			 RETRO_DEVICE_INDEX_ANALOG_BUTTON,
+			 RETRO_DEVICE_ID_JOYPAD_B), SDL_MAX_SINT16);
+
+	/* Out of range requests are not pressed. */
+	lequal(input_get(&inp, MAX_PLAYERS, RETRO_DEVICE_JOYPAD, 0,
+			 RETRO_DEVICE_ID_JOYPAD_B), 0);
+	lequal(input_get(&inp, 0, RETRO_DEVICE_JOYPAD, 0, 16), 0);
+	lequal(input_get(&inp, 0, RETRO_DEVICE_ANALOG,
+			 RETRO_DEVICE_INDEX_ANALOG_LEFT, 2), 0);
+
+	/* A release is seen on the next poll. */
+	ev.type = SDL_KEYUP;
+	ev.key.keysym.scancode = SDL_SCANCODE_Z;
+	input_handle_event(&inp, &ev);
+	lequal(input_get(&inp, 0, RETRO_DEVICE_JOYPAD, 0,
+			 RETRO_DEVICE_ID_JOYPAD_B), 1);
+
+	input_poll(&inp);
+	lequal(input_get(&inp, 0, RETRO_DEVICE_JOYPAD, 0,
+			 RETRO_DEVICE_ID_JOYPAD_B), 0);
+	lequal(input_get(&inp, 0, RETRO_DEVICE_JOYPAD, 0,
+			 RETRO_DEVICE_ID_JOYPAD_MASK), 0);
+}
+
+/**
+ * Tests that input recorded by tool assisted input is played back exactly,
+ * including when spanning multiple blocks.
+ */
+void test_tai(void)
+{
+	const unsigned frames = 2500;
+	const size_t buf_len = 1024 * 1024;
+	struct input_ctx_s rec, play;
+	Uint8 *buf;
+	SDL_RWops *f;
+	tai *t;
+	Sint64 len;
+	unsigned frame;
+
+	buf = SDL_malloc(buf_len);
+	lok(buf != NULL);
+	if(buf == NULL)
+		return;
+
+	SDL_zero(rec);
+	f = SDL_RWFromMem(buf, (int)buf_len);
+	t = tai_init(f, SDL_TRUE);
+	lok(t != NULL);
+	if(t == NULL)
+		goto out;
+
+	for(frame = 0; frame < frames; frame++)
+	{
+		/* Buttons held for a few frames at a time, with analogue
+		 * input that changes every frame. */
+		rec.snap[0].btns = (Uint16)(1 << ((frame / 7) % 16));
+		rec.snap[0].stick[0][0] = (Sint16)(frame * 13);
+		rec.snap[1].stick[1][1] = (Sint16)-(int)frame;
+		rec.snap[3].btn_analog[INPUT_JOYPAD_R2] = (Sint16)(frame / 3);
+		lequal(tai_record_frame(t, &rec), 0);
+	}
+
+	/* The first two blocks have been written. Uncompressed, their input
+	 * alone would be 2048 * 56 bytes. */
+	len = SDL_RWtell(f);
+	lok(len > 0 && len < 16 * 1024);
+	lok(tai_exit(t) == 0);
+
+	SDL_zero(play);
+	t = tai_init(SDL_RWFromConstMem(buf, (int)buf_len), SDL_FALSE);
+	lok(t != NULL);
+	if(t == NULL)
+		goto out;
+
+	for(frame = 0; frame < frames; frame++)
+	{
+		if(tai_play_frame(t, &play) != 0)
+			break;
+
+		lok(play.held == SDL_TRUE);
+		lequal(play.snap[0].btns, (Uint16)(1 << ((frame / 7) % 16)));
+		lequal(play.snap[0].stick[0][0], (Sint16)(frame * 13));
+		lequal(play.snap[1].stick[1][1], (Sint16)-(int)frame);
+		lequal(play.snap[3].btn_analog[INPUT_JOYPAD_R2],
+		       (Sint16)(frame / 3));
+	}
+
+	lequal(frame, frames);
+	lequal(tai_process_event(t, NULL), 1);
+	lequal(tai_play_frame(t, &play), 1);
+	lok(play.held == SDL_FALSE);
+	lok(tai_tell(t) == (Sint64)frames);
+	lok(tai_length(t) == (Sint64)frames);
+
+	/* Seeking back into an earlier block resumes playback. */
+	lok(tai_seek(t, frames + 1) != 0);
+	lequal(tai_seek(t, 5), 0);
+	lequal(tai_play_frame(t, &play), 0);
+	lok(play.held == SDL_TRUE);
+	lequal(play.snap[0].stick[0][0], (Sint16)(5 * 13));
+	lok(tai_tell(t) == 6);
+	tai_exit(t);
+
+out:
+	SDL_free(buf);
+}
+
+/**
+ * Writes a version 1 tool assisted input keyboard command.
+ */
+static void test_tai_v1_key(SDL_RWops *f, Uint64 frame, Uint8 state)
+{
+	const Uint8 cmd = 2;
+	const Uint8 pad[2] = { state, 0 };
+	const Uint16 keymod = KMOD_NONE;
+	const Uint32 sc = SDL_SCANCODE_Z;
+	const Uint32 sym = SDLK_z;
+
+	SDL_RWwrite(f, &frame, sizeof(frame), 1);
+	SDL_RWwrite(f, &cmd, 1, 1);
+	SDL_RWwrite(f, pad, 1, sizeof(pad));
+	SDL_RWwrite(f, &keymod, sizeof(keymod), 1);
+	SDL_RWwrite(f, &sc, sizeof(sc), 1);
+	SDL_RWwrite(f, &sym, sizeof(sym), 1);
+}
+
+/**
+ * Tests that keyboard commands in version 1 files are applied to the input
+ * state on the frame that they were recorded on.
+ */
+void test_tai_v1(void)
+{
+	const Uint8 magic[] = {
+		0xAB, 'h', 't', 'a', 'i', 0xBB, 0x0D, 0x0A, 0x1A, 0x0A, 1
+	};
+	const Uint64 end_frame = 6;
+	const Uint8 end = 0;
+	Uint8 buf[512] = { 0 };
+	struct input_ctx_s inp;
+	SDL_RWops *f;
+	tai *t;
+
+	SDL_memcpy(buf, magic, sizeof(magic));
+	f = SDL_RWFromMem(buf, sizeof(buf));
+	SDL_RWseek(f, 168, RW_SEEK_SET);
+	test_tai_v1_key(f, 2, SDL_PRESSED);
+	test_tai_v1_key(f, 5, SDL_RELEASED);
+	SDL_RWwrite(f, &end_frame, sizeof(end_frame), 1);
+	SDL_RWwrite(f, &end, 1, 1);
+	SDL_RWclose(f);
+
+	input_init(&inp);
+	t = tai_init(SDL_RWFromConstMem(buf, sizeof(buf)), SDL_FALSE);
+	lok(t != NULL);
+	if(t == NULL)
+		return;
+
+	for(Uint64 frame = 1; frame <= 8; frame++)
+	{
+		tai_next_frame(t);
+		lequal(tai_play_frame(t, &inp), frame >= end_frame);
+		input_poll(&inp);
+		lequal(input_get(&inp, 0, RETRO_DEVICE_JOYPAD, 0,
+				 RETRO_DEVICE_ID_JOYPAD_B),
+		       frame >= 2 && frame < 5);
+	}
+
+	lequal(tai_process_event(t, NULL), 1);
+	tai_exit(t);
+}
+
+/**
+ * Tests that a replay is compared against a golden trace, and that the first
+ * frame that differs is found.
+ */
+void test_verify(void)
+{
+	const char *golden = "test_verify_golden.txt";
+	const char *trace = "test_verify_trace.txt";
+	struct verify_hash_s hash;
+	char *golden_txt, *trace_txt;
+	verify_ctx *v;
+
+	/* Record a golden trace. */
+	v = verify_init(golden, NULL);
+	lok(v != NULL);
+	if(v == NULL)
+		return;
+
+	for(Uint32 f = 1; f <= 100; f++)
+	{
+		hash.video = f * 3;
+		hash.audio = ~f;
+		hash.state = f;
+		hash.has_state = SDL_TRUE;
+		lequal(verify_frame(v, f, &hash), 0);
+	}
+
+	lequal(verify_report(v), 0);
+	verify_exit(v);
+
+	/* An identical replay matches, and writes an identical trace. */
+	v = verify_init(trace, golden);
+	lok(v != NULL);
+	if(v == NULL)
+		goto out;
+
+	for(Uint32 f = 1; f <= 100; f++)
+	{
+		hash.video = f * 3;
+		hash.audio = ~f;
+		hash.state = f;
+		lequal(verify_frame(v, f, &hash), 0);
+	}
+
+	lequal(verify_report(v), 0);
+	verify_exit(v);
+
+	golden_txt = SDL_LoadFile(golden, NULL);
+	trace_txt = SDL_LoadFile(trace, NULL);
+	lok(golden_txt != NULL && trace_txt != NULL &&
+	    SDL_strcmp(golden_txt, trace_txt) == 0);
+	SDL_free(golden_txt);
+	SDL_free(trace_txt);
+
+	/* Frames from the first divergence do not match. */
+	v = verify_init(NULL, golden);
+	for(Uint32 f = 1; f <= 100; f++)
+	{
+		hash.video = f * 3;
+		hash.audio = f == 50 ? 0 : ~f;
+		hash.state = f;
+		lequal(verify_frame(v, f, &hash), f >= 50);
+	}
+
+	lok(verify_report(v) != 0);
+	verify_exit(v);
+
+	/* States are only compared if both traces have them. */
+	v = verify_init(NULL, golden);
+	for(Uint32 f = 1; f <= 100; f++)
+	{
+		hash.video = f * 3;
+		hash.audio = ~f;
+		hash.has_state = SDL_FALSE;
+		lequal(verify_frame(v, f, &hash), 0);
+	}
+
+	lequal(verify_report(v), 0);
+	verify_exit(v);
+
+	/* A replay that ends early does not match. */
+	v = verify_init(NULL, golden);
+	hash.video = 3;
+	hash.audio = ~1U;
+	lequal(verify_frame(v, 1, &hash), 0);
+	lok(verify_report(v) != 0);
+	verify_exit(v);
+
+out:
+	remove(golden);
+	remove(trace);
+}
+
+/**
+ * Tests that the latency test injects a key press in each trial, and measures
+ * the time until the screen changes in response.
+ */
+void test_latency(void)
+{
+	const unsigned trials = 8;
+	struct latency_stats_s st;
+	latency_ctx *lat;
+	Uint32 hash = 0;
+	SDL_bool done = SDL_FALSE;
+
+	lok(latency_init(0, 60.0) == NULL);
+
+	lat = latency_init(trials, 200.0);
+	lok(lat != NULL);
+	if(lat == NULL)
+		return;
+
+	for(unsigned frame = 0; frame < 1000 && done == SDL_FALSE; frame++)
+	{
+		SDL_Event ev;
+
+		/* Each frame is 5 ms, and the screen is inverted on each key
+		 * press. */
+		SDL_Delay(5);
+		while(SDL_PollEvent(&ev) != 0)
+		{
+			if(ev.type == SDL_KEYDOWN &&
+			   ev.key.keysym.scancode == LATENCY_KEY)
+				hash = ~hash;
+		}
+
+		done = latency_presented(lat, hash);
+	}
+
+	lok(done == SDL_TRUE);
+	lequal(latency_get_stats(lat, &st), 0);
+	lequal(st.measured, trials);
+	lequal(st.missed, 0);
+	lok(st.min_us <= st.p50_us);
+	lok(st.p50_us <= st.max_us);
+
+	latency_exit(lat);
+}
+
+/**
+ * Tests that the latency of the latency test core is measured from the hashes
+ * of the frames that it gives, and that its screen only changes in response to
+ * the injected key presses.
+ */
+void test_latency_core(void)
+{
+	static struct core_ctx_s ctx;
+	const unsigned trials = 8;
+	struct latency_stats_s st;
+	SDL_Surface *surf;
+	SDL_Renderer *rend;
+	latency_ctx *lat;
+	Uint32 prev_hash;
+	unsigned changes = 0;
+	SDL_bool done = SDL_FALSE;
+
+	if(load_libretro_core("./libretro_latency/libretro-latency.so", &ctx))
+	{
+		SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION, "%s",
+			SDL_GetError());
+		abort();
+	}
+
+	play_init_cb(&ctx);
+	lequal(load_libretro_file(&ctx), 0);
+
+	surf = SDL_CreateRGBSurfaceWithFormat(0, 320, 240, 32,
+			SDL_PIXELFORMAT_ARGB8888);
+	rend = SDL_CreateSoftwareRenderer(surf);
+	lequal(play_init_av(&ctx, rend), 0);
+	input_init(&ctx.inp);
+	ctx.env.status.bits.hash_frames = 1;
+
+	lat = latency_init(trials, 200.0);
+	lok(lat != NULL);
+	if(lat == NULL)
+		goto out;
+
+	play_frame(&ctx);
+	prev_hash = ctx.env.frame_hash;
+
+	for(unsigned frame = 0; frame < 1000 && done == SDL_FALSE; frame++)
+	{
+		SDL_Event ev;
+
+		/* Each frame is 5 ms. */
+		SDL_Delay(5);
+		while(SDL_PollEvent(&ev) != 0)
+		{
+			if(INPUT_EVENT_CHK(ev.type))
+				input_handle_event(&ctx.inp, &ev);
+		}
+
+		play_frame(&ctx);
+		if(ctx.env.frame_hash != prev_hash)
+			changes++;
+
+		prev_hash = ctx.env.frame_hash;
+		done = latency_presented(lat, ctx.env.frame_hash);
+	}
+
+	lok(done == SDL_TRUE);
+	lequal(changes, trials);
+	lequal(latency_get_stats(lat, &st), 0);
+	lequal(st.measured, trials);
+	lequal(st.missed, 0);
+	lok(st.min_us <= st.p50_us);
+	lok(st.p50_us <= st.max_us);
+
+	latency_exit(lat);
+out:
+	unload_libretro_file(&ctx);
+	unload_libretro_core(&ctx);
+	play_deinit_cb(&ctx);
+	SDL_DestroyRenderer(rend);
+	SDL_FreeSurface(surf);
+}
+
+/**
+ * Tests that each font batching method draws the same pixels to the software
+ * renderer, and prints the time taken to draw a status line with each method.
+ */
+void test_font_batching(void)
+{
+	const char *const names[] = { "None", "Cache", "Geometry" };
+	const char txt[] = "REC 12 MB | 60.00 FPS | Frame 0123456789";
+	const SDL_Rect scale = { 4, 4, 2, 2 };
+	/* Enough draws for the string to be rendered to the cache. */
+	const unsigned draws = 16;
+	const unsigned iterations = 2000;
+	SDL_Surface *surf = SDL_CreateRGBSurfaceWithFormat(0, 640, 480, 32,
+			SDL_PIXELFORMAT_ARGB8888);
+	SDL_Renderer *rend = SDL_CreateSoftwareRenderer(surf);
+	size_t len = (size_t)surf->pitch * surf->h;
+	Uint8 *ref = SDL_malloc(len);
+	Uint8 *pix = SDL_malloc(len);
+	font_ctx *font = FontStartup(rend);
+
+	lok(font != NULL);
+	lok(ref != NULL && pix != NULL);
+	if(font == NULL || ref == NULL || pix == NULL)
+		goto out;
+
+	for(font_batch_e b = FONT_BATCH_NONE; b <= FONT_BATCH_GEOMETRY; b++)
+	{
+		Uint64 beg, end;
+		int ret = 0;
+
+		if(FontSetBatching(font, b) != 0)
+		{
+			printf("\t%-8s unsupported: %s\n", names[b],
+					SDL_GetError());
+			continue;
+		}
+
+		SDL_SetRenderDrawColor(rend, 0x00, 0x00, 0x00, SDL_ALPHA_OPAQUE);
+		SDL_RenderClear(rend);
+		SDL_SetRenderDrawColor(rend, 0xFF, 0xFF, 0x00, SDL_ALPHA_OPAQUE);
+
+		for(unsigned i = 0; i < draws; i++)
+			ret |= FontPrintToRenderer(font, txt, &scale);
+
+		lequal(ret, 0);
+		lequal(SDL_RenderReadPixels(rend, NULL, SDL_PIXELFORMAT_ARGB8888,
+					b == FONT_BATCH_NONE ? ref : pix,
+					surf->pitch), 0);
+
+		if(b != FONT_BATCH_NONE)
+			lok(SDL_memcmp(ref, pix, len) == 0);
+
+		beg = SDL_GetPerformanceCounter();
+		for(unsigned i = 0; i < iterations; i++)
+			ret |= FontPrintToRenderer(font, txt, NULL);
+
+		end = SDL_GetPerformanceCounter();
+		lequal(ret, 0);
+
+		printf("\t%-8s %8.2f us per string\n", names[b],
+				(double)(end - beg) * 1000000.0 /
+				(double)SDL_GetPerformanceFrequency() /
+				iterations);
+	}
+
+	FontExit(font);
+out:
+	SDL_free(ref);
+	SDL_free(pix);
+	SDL_DestroyRenderer(rend);
+	SDL_FreeSurface(surf);
+}
+
+/**
+ * Tests that checkpoints are found and restored exactly, both when compressed
+ * on the calling thread and on the thread pool, and that the oldest
+ * checkpoints are thinned out once the memory limit is exceeded.
+ */
+void test_ckpt(void)
+{
+	Uint8 state[4096], out[4096];
+	size_t len;
+	Uint64 at;
+	ckpt_ctx *c;
+
+	c = ckpt_init(60, 1024 * 1024);
+	lok(c != NULL);
+	if(c == NULL)
+		return;
+
+	/* There is nothing to seek to before the first checkpoint. */
+	lok(ckpt_find(c, 0, &at) != 0);
+	lok(ckpt_due(c, 0));
+	lok(ckpt_due(c, 59) == SDL_FALSE);
+
+	/* Add a checkpoint of a slowly changing state every interval. */
+	for(Uint64 f = 0; f <= 600; f++)
+	{
+		if(ckpt_due(c, f) == SDL_FALSE)
+			continue;
+
+		for(size_t i = 0; i < sizeof(state); i++)
+			state[i] = (Uint8)(i / 64 + f / 60);
+
+		lequal(ckpt_add(c, f, state, sizeof(state)), 0);
+	}
+
+	/* Checkpoints are never due before the latest one. */
+	lok(ckpt_due(c, 540) == SDL_FALSE);
+	lok(ckpt_due(c, 600) == SDL_FALSE);
+	lok(ckpt_due(c, 660));
+
+	lequal(ckpt_find(c, 0, &at), 0);
+	lequal((int)at, 0);
+	lequal(ckpt_find(c, 299, &at), 0);
+	lequal((int)at, 240);
+	lequal(ckpt_find(c, 9000, &at), 0);
+	lequal((int)at, 600);
+
+	len = sizeof(out);
+	lequal(ckpt_load(c, 421, &at, out, &len), 0);
+	lequal((int)at, 420);
+	lequal((int)len, (int)sizeof(out));
+	for(size_t i = 0; i < sizeof(state); i++)
+		state[i] = (Uint8)(i / 64 + 420 / 60);
+	lok(SDL_memcmp(state, out, sizeof(out)) == 0);
+
+	/* A buffer too small for the state is refused. */
+	len = sizeof(out) / 2;
+	lok(ckpt_load(c, 421, &at, out, &len) != 0);
+	ckpt_exit(c);
+
+	/* Exceeding the memory limit drops every other checkpoint, keeping
+	 * the first. */
+	lequal(pool_init(2), 0);
+	c = ckpt_init(10, 40 * 1024);
+	lok(c != NULL);
+	if(c == NULL)
+		goto out;
+
+	for(Uint64 f = 0; f < 400; f += 10)
+	{
+		for(size_t i = 0; i < sizeof(state); i++)
+			state[i] = (Uint8)((i * 2654435761U) >> 13 ^ f);
+
+		lequal(ckpt_add(c, f, state, sizeof(state)), 0);
+	}
+
+	lequal(ckpt_find(c, 5, &at), 0);
+	lequal((int)at, 0);
+	lequal(ckpt_find(c, 15, &at), 0);
+	lequal((int)at, 0);
+
+	/* The interval is doubled each time the checkpoints are thinned. */
+	lok(ckpt_due(c, 410) == SDL_FALSE);
+
+	len = sizeof(out);
+	lequal(ckpt_load(c, 399, &at, out, &len), 0);
+	lok(at > 0 && at < 400);
+	for(size_t i = 0; i < sizeof(state); i++)
+		state[i] = (Uint8)((i * 2654435761U) >> 13 ^ at);
+	lok(SDL_memcmp(state, out, sizeof(out)) == 0);
+
+	ckpt_exit(c);
+
+out:
+	pool_exit();
+}
+
 int main(void)
 {
+	/* Must be enabled before SDL allocates any memory. */
+	if(alloc_track_init() != 0)
+	{
+		SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
+			"Unable to track allocations: %s", SDL_GetError());
+		return EXIT_FAILURE;
+	}
+
 	if(SDL_Init(SDL_INIT_EVERYTHING) != 0)
 	{
 		SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
@@ -144,7 +1061,21 @@ int main(void)
 	puts("Executing tests:");
 	lrun("Init", test_retro_init);
 	lrun("Frame Timing", test_retro_av);
+	lrun("Timer Wheel", test_timer_wheel);
 	lrun("UI Drawing", test_ui_drawing);
+	lrun("Font Batching", test_font_batching);
+	lrun("Thread Pool", test_pool);
+	lrun("Flight Recorder", test_perf_flight);
+	lrun("Steady State Allocations", test_steady_state_alloc);
+	lrun("Adaptive Frameskip", test_fskip);
+	lrun("Frame Delay", test_frame_delay);
+	lrun("Input Snapshot", test_input_snapshot);
+	lrun("Input Latency", test_latency);
+	lrun("Input Latency Core", test_latency_core);
+	lrun("Tool Assisted Input", test_tai);
+	lrun("Tool Assisted Input v1", test_tai_v1);
+	lrun("Replay Verification", test_verify);
+	lrun("Checkpoint Cache", test_ckpt);
 	SDL_Quit();
 	lresults();
 	return lfails != 0;